@@ -0,0 +1,132 @@
+/*
+ * Time the slab cache against the cache it replaced, which
+ * realloc()ed one array as it grew and patched up the pointer
+ * each owner had to its object.
+ *
+ *	make bench && ./bench/cache_bench [objects] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../cache.h"
+#include "../types.h"
+#include "cache_old.h"
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((double)ts.tv_sec * 1000.0) + ((double)ts.tv_nsec / 1000000.0);
+}
+
+/*
+ * Fill the cache the way the extractors do, then give back
+ * every other object and take as many again, as something
+ * that holds on to its objects for a while would.
+ */
+static size_t
+run_slab(int nr, void **owners)
+{
+	wiki_cache_t *cachep;
+	void *obj = NULL;
+	size_t n = 0;
+	int i;
+
+	if (!(cachep = wiki_cache_create("bench", sizeof(content_t), 0, NULL, NULL)))
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < nr; ++i)
+		owners[i] = wiki_cache_alloc(cachep);
+
+	for (i = 0; i < nr; i += 2)
+		wiki_cache_dealloc(cachep, owners[i]);
+
+	for (i = 0; i < nr; i += 2)
+		owners[i] = wiki_cache_alloc(cachep);
+
+	while ((obj = wiki_cache_next_used(cachep, obj)))
+		++n;
+
+	wiki_cache_destroy(cachep);
+
+	return n;
+}
+
+static size_t
+run_old(int nr, void **owners)
+{
+	old_cache_t *cachep;
+	size_t n = 0;
+	int i;
+
+	if (!(cachep = old_cache_create("bench", sizeof(content_t), 0, NULL, NULL)))
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < nr; ++i)
+		owners[i] = old_cache_alloc(cachep, &owners[i]);
+
+	for (i = 0; i < nr; i += 2)
+		old_cache_dealloc(cachep, owners[i], &owners[i]);
+
+	for (i = 0; i < nr; i += 2)
+		owners[i] = old_cache_alloc(cachep, &owners[i]);
+
+	for (i = 0; i < cachep->capacity; ++i)
+	{
+		if (old_cache_obj_used(cachep, (char *)cachep->cache + (i * cachep->objsize)))
+			++n;
+	}
+
+	old_cache_destroy(cachep);
+
+	return n;
+}
+
+static void
+time_run(const char *label, size_t (*fn)(int, void **), int nr, int rounds)
+{
+	void **owners;
+	double t;
+	size_t n = 0;
+	int i;
+
+	if (!(owners = calloc(nr, sizeof(void *))))
+		exit(EXIT_FAILURE);
+
+	t = now_ms();
+
+	for (i = 0; i < rounds; ++i)
+		n = fn(nr, owners);
+
+	printf("  %-34s %9.3f ms/round  (%lu in use)\n", label, (now_ms() - t) / rounds, n);
+
+	free(owners);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nr = (argc > 1 ? atoi(argv[1]) : 10000);
+	int rounds = (argc > 2 ? atoi(argv[2]) : 10);
+	int sizes[] = { 100, 1000, 0 };
+	int i;
+
+	printf("alloc, free every other, alloc again, count (%d rounds)\n", rounds);
+
+	for (i = 0; sizes[i] && sizes[i] < nr; ++i)
+	{
+		printf("\n%d objects\n", sizes[i]);
+		time_run("realloc()ed array", run_old, sizes[i], rounds);
+		time_run("slabs", run_slab, sizes[i], rounds);
+	}
+
+	printf("\n%d objects\n", nr);
+	time_run("realloc()ed array", run_old, nr, rounds);
+	time_run("slabs", run_slab, nr, rounds);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,54 @@
+#ifndef OLD_CACHE_H
+#define OLD_CACHE_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * 31 ..... 16 15 ..... 0
+ *   cache nr     obj nr
+ */
+#define OLD_CACHE_SIZE 4096
+#define OLD_CACHE_MAX_NAME 32
+
+#define OLD_CACHE_DEC_FREE(c) --((c)->nr_free)
+#define OLD_CACHE_INC_FREE(c) ++((c)->nr_free)
+
+typedef int (*old_cache_ctor_t)(void *);
+typedef void (*old_cache_dtor_t)(void *);
+
+struct active_ptr_ctx
+{
+	void *ptr_addr;
+	int in_cache;
+	void *obj_addr;
+	off_t obj_offset;
+	off_t ptr_offset;
+};
+
+typedef struct old_cache_t
+{
+	void *cache;
+	int capacity;
+	int nr_free;
+	unsigned char *free_bitmap;
+	uint16_t bitmap_size;
+	struct active_ptr_ctx *active_ptrs;
+	int nr_active_ptrs;
+	size_t objsize;
+	size_t cache_size;
+	char *name;
+	old_cache_ctor_t ctor;
+	old_cache_dtor_t dtor;
+} old_cache_t;
+
+old_cache_t *old_cache_create(char *, size_t, int, old_cache_ctor_t, old_cache_dtor_t);
+void old_cache_destroy(old_cache_t *) __nonnull((1));
+void *old_cache_alloc(old_cache_t *, void *) __wur;
+void old_cache_dealloc(old_cache_t *, void *, void *);
+int old_cache_obj_used(old_cache_t *, void *) __nonnull((1,2)) __wur;
+int old_cache_nr_used(old_cache_t *) __nonnull((1)) __wur;
+int old_cache_capacity(old_cache_t *) __nonnull((1)) __wur;
+void old_cache_clear_all(old_cache_t *) __nonnull((1));
+
+#endif /* OLD_CACHE_H */
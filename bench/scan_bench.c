@@ -0,0 +1,324 @@
+/*
+ * Time the scan.c kernels against the memchr()/strstr() loops
+ * they replaced, and the one-pass remove_excess_sp/nl() against
+ * the versions that cut out each match with buf_collapse().
+ *
+ *	make bench && ./bench/scan_bench [size in KiB] [rounds]
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../buffer.h"
+#include "../scan.h"
+#include "../utils.h"
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((double)ts.tv_sec * 1000.0) + ((double)ts.tv_nsec / 1000000.0);
+}
+
+/*
+ * Something like the text of an article after the
+ * wanted elements have been taken out of the page.
+ */
+static void
+make_text(char *p, size_t len)
+{
+	static const char *const words[] =
+	{
+		"the", "of", "and", "in", "was", "<a href=\"/wiki/X\">link</a>",
+		"<b>bold</b>", "&amp;", "&quot;", "&#91;1&#93;", "  ", "\n",
+		"\n\n\n", "history", "between", "<sup>2</sup>", "city", "&nbsp;"
+	};
+	size_t nr = (sizeof(words) / sizeof(words[0]));
+	size_t off = 0;
+	size_t wlen;
+	const char *w;
+
+	srand(1);
+
+	while (off < len)
+	{
+		w = words[rand() % nr];
+		wlen = strlen(w);
+
+		if ((off + wlen + 1) > len)
+			break;
+
+		memcpy(p + off, w, wlen);
+		off += wlen;
+		p[off++] = ' ';
+	}
+
+	memset(p + off, 'x', (len - off));
+	p[len] = 0;
+}
+
+/*
+ * The loops as they were.
+ */
+static void
+old_remove_excess_sp(buf_t *buf)
+{
+	char *p;
+	char *savep;
+	char *tail = buf->buf_tail;
+	size_t range;
+
+	savep = buf->buf_head;
+
+	while (1)
+	{
+		p = memchr(savep, ' ', (tail - savep));
+
+		if (!p || p >= tail)
+			break;
+
+		++p;
+
+		savep = p;
+		while (isspace(*p))
+			++p;
+
+		range = (p - savep);
+
+		if (range)
+		{
+			buf_collapse(buf, (off_t)(savep - buf->buf_head), range);
+			p = savep;
+			tail = buf->buf_tail;
+		}
+	}
+}
+
+static void
+old_remove_excess_nl(buf_t *buf)
+{
+	char *p;
+	char *savep;
+	char *tail = buf->buf_tail;
+	size_t range;
+
+	savep = buf->buf_head;
+
+	while (1)
+	{
+		p = memchr(savep, 0x0a, (tail - savep));
+
+		if (!p)
+			break;
+
+		savep = p;
+
+		while (*p == 0x0a && p < tail)
+			++p;
+
+		range = (p - savep);
+
+		if (range > 2)
+		{
+			savep += 2;
+			range = (p - savep);
+			buf_collapse(buf, (off_t)(savep - buf->buf_head), range);
+			p = savep;
+			tail = buf->buf_tail;
+		}
+
+		savep = p;
+	}
+}
+
+static size_t
+count_memchr(const char *p, const char *end, int c)
+{
+	size_t n = 0;
+
+	while ((p = memchr(p, c, (end - p))))
+	{
+		++n;
+		++p;
+	}
+
+	return n;
+}
+
+static size_t
+count_strstr(const char *p, const char *needle)
+{
+	size_t n = 0;
+
+	while ((p = strstr(p, needle)))
+	{
+		++n;
+		++p;
+	}
+
+	return n;
+}
+
+static size_t
+count_scan(const char *p, const char *end, const struct scan_set *set)
+{
+	size_t n = 0;
+
+	while ((p = scan_find(p, end, set)))
+	{
+		++n;
+		++p;
+	}
+
+	return n;
+}
+
+/*
+ * The '&' of each "&#", found with the scanner.
+ */
+static size_t
+count_scan_pair(const char *p, const char *end)
+{
+	size_t n = 0;
+
+	while ((p = scan_find_byte(p, end, '&')))
+	{
+		if ((p + 1) < end && p[1] == '#')
+			++n;
+
+		++p;
+	}
+
+	return n;
+}
+
+/*
+ * Every '<', '&', ' ' and '\n' in one go, a block at a
+ * time, as a combined cleanup pass would look for them.
+ */
+static size_t
+count_blocks(const char *p, const char *end, const struct scan_set *set)
+{
+	size_t n = 0;
+
+	while ((end - p) >= SCAN_BLOCK)
+	{
+		n += __builtin_popcountll(scan_block(p, set));
+		p += SCAN_BLOCK;
+	}
+
+	return n;
+}
+
+#define TIME(label, rounds, expr) \
+do {\
+	double __t = now_ms();\
+	size_t __r = 0;\
+	int __i;\
+	for (__i = 0; __i < (rounds); ++__i)\
+		__r += (size_t)(expr);\
+	printf("  %-34s %9.3f ms/round  (%lu)\n", (label), (now_ms() - __t) / (rounds), __r / (rounds));\
+} while (0)
+
+static void
+time_cleanup(const char *label, void (*fn)(buf_t *), const char *text, size_t len, int rounds)
+{
+	buf_t buf;
+	double total = 0.0;
+	double t;
+	size_t out = 0;
+	int i;
+
+	if (buf_init(&buf, len + 1) < 0)
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < rounds; ++i)
+	{
+		buf_clear(&buf);
+		buf_append_ex(&buf, (char *)text, len);
+
+		t = now_ms();
+		fn(&buf);
+		total += (now_ms() - t);
+		out = buf.data_len;
+	}
+
+	printf("  %-34s %9.3f ms/round  (%lu bytes left)\n", label, total / rounds, out);
+
+	buf_destroy(&buf);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t len = (argc > 1 ? strtoul(argv[1], NULL, 0) : 128) * 1024;
+	int rounds = (argc > 2 ? atoi(argv[2]) : 10);
+	static const char *const impls[] = { "scalar", "sse2", "avx2" };
+	struct scan_set lt;
+	struct scan_set all;
+	char *text;
+	char *end;
+	int i;
+
+	if (!(text = malloc(len + SCAN_BLOCK + 1)))
+		return EXIT_FAILURE;
+
+	make_text(text, len);
+	end = (text + len);
+
+	scan_set_init(&lt, "<");
+	scan_set_init(&all, "<& \n");
+
+	printf("%lu bytes, %d rounds (default scanner: %s)\n\n", len, rounds, scan_impl_name());
+
+	printf("find every '<'\n");
+	TIME("memchr", rounds, count_memchr(text, end, '<'));
+
+	for (i = SCAN_SCALAR; i <= SCAN_AVX2; ++i)
+	{
+		if (scan_use(i) < 0)
+			continue;
+
+		TIME(impls[i], rounds, count_scan(text, end, &lt));
+	}
+
+	printf("\nfind every \"&#\"\n");
+	TIME("strstr", rounds, count_strstr(text, "&#"));
+
+	for (i = SCAN_SCALAR; i <= SCAN_AVX2; ++i)
+	{
+		if (scan_use(i) < 0)
+			continue;
+
+		TIME(impls[i], rounds, count_scan_pair(text, end));
+	}
+
+	printf("\nclassify '<', '&', ' ', '\\n' per 64-byte block\n");
+
+	for (i = SCAN_SCALAR; i <= SCAN_AVX2; ++i)
+	{
+		if (scan_use(i) < 0)
+			continue;
+
+		TIME(impls[i], rounds, count_blocks(text, end, &all));
+	}
+
+	if (scan_use(SCAN_AVX2) < 0 && scan_use(SCAN_SSE2) < 0)
+		(void)scan_use(SCAN_SCALAR);
+
+	printf("\nremove_excess_sp\n");
+	time_cleanup("buf_collapse() per match", old_remove_excess_sp, text, len, rounds);
+	time_cleanup("one pass", remove_excess_sp, text, len, rounds);
+
+	printf("\nremove_excess_nl\n");
+	time_cleanup("buf_collapse() per match", old_remove_excess_nl, text, len, rounds);
+	time_cleanup("one pass", remove_excess_nl, text, len, rounds);
+
+	free(text);
+
+	return EXIT_SUCCESS;
+}
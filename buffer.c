@@ -13,6 +13,8 @@
 #include "buffer.h"
 #include "wikigrab.h"
 
+static struct buf_stats buf_counters;
+
 static inline void
 __buf_reset_head(buf_t *buf)
 {
@@ -109,10 +111,9 @@ buf_shift(buf_t *buf, off_t offset, size_t range)
 
 	char *from;
 	char *to;
-	size_t slack = buf_slack(buf);
 
-	if (range >= slack)
-		buf_extend(buf, BUF_ALIGN_SIZE((range - slack)));
+	if (buf_reserve(buf, range) < 0)
+		return;
 
 /*
  * Do this AFTER extending since memory might be
@@ -153,9 +154,45 @@ buf_extend(buf_t *buf, size_t by)
 	buf->buf_tail = (buf->data + tail_off);
 	buf->buf_size = new_size;
 
+	__sync_fetch_and_add(&buf_counters.reallocs, 1);
+
 	return 0;
 }
 
+/**
+ * buf_reserve - make sure there is room for BYTES more at the tail
+ * @buf: the buffer
+ * @bytes: the number of bytes about to be added
+ *
+ * Leaves room for a terminating null byte as well. Does nothing
+ * if there is already enough; otherwise the buffer grows by its
+ * own size (at most BUF_GROW_MAX) or by as much as is needed,
+ * whichever is more.
+ */
+int
+buf_reserve(buf_t *buf, size_t bytes)
+{
+	assert(buf);
+
+	size_t room = (buf->buf_end - buf->buf_tail);
+	size_t need;
+	size_t grow;
+
+	if (bytes < room)
+		return 0;
+
+	need = ((bytes - room) + 1);
+	grow = buf->buf_size;
+
+	if (grow > BUF_GROW_MAX)
+		grow = BUF_GROW_MAX;
+
+	if (grow < need)
+		grow = need;
+
+	return buf_extend(buf, BUF_ALIGN_SIZE(grow));
+}
+
 void
 buf_clear(buf_t *buf)
 {
@@ -168,12 +205,9 @@ void
 buf_append(buf_t *buf, char *str)
 {
 	size_t len = strlen(str);
-	size_t slack = buf_slack(buf);
 
-	if (len >= slack)
-	{
-		buf_extend(buf, BUF_ALIGN_SIZE((len - slack)));
-	}
+	if (buf_reserve(buf, len) < 0)
+		return;
 
 	strcat(buf->buf_tail, str);
 	
@@ -185,17 +219,18 @@ buf_append(buf_t *buf, char *str)
 void
 buf_append_ex(buf_t *buf, char *str, size_t bytes)
 {
-	if (strlen(str) < bytes)
+/*
+ * Binary-safe: this is also used to append message
+ * bodies, which need not be NUL-free, so copy exactly
+ * BYTES rather than stopping at the first zero byte.
+ */
+	if (buf_reserve(buf, bytes) < 0)
 		return;
 
-	size_t slack = buf_slack(buf);
-
-	if (bytes >= slack)
-		buf_extend(buf, BUF_ALIGN_SIZE((bytes - slack)));
-
-	strncpy(buf->buf_tail, str, bytes);
+	memcpy(buf->buf_tail, str, bytes);
 
 	__buf_pull_tail(buf, bytes);
+	BUF_NULL_TERMINATE(buf);
 
 	return;
 }
@@ -226,6 +261,8 @@ buf_init(buf_t *buf, size_t bufsize)
 	buf->buf_head = buf->buf_tail = buf->data;
 	buf->magic = BUFFER_MAGIC;
 
+	__sync_fetch_and_add(&buf_counters.allocs, 1);
+
 	return 0;
 }
 
@@ -255,13 +292,12 @@ buf_read_fd(int fd, buf_t *buf, size_t bytes)
 	size_t toread = bytes;
 	ssize_t n = 0;
 	ssize_t total_read = 0;
-	size_t slack = buf_slack(buf);
 
 	if (bytes <= 0)
 		return 0;
 
-	if (bytes >= slack)
-		buf_extend(buf, BUF_ALIGN_SIZE((bytes - slack)));
+	if (buf_reserve(buf, bytes) < 0)
+		goto fail;
 
 	while (toread > 0)
 	{
@@ -294,24 +330,29 @@ buf_read_socket(int sock, buf_t *buf, size_t toread)
 	ssize_t n = 0;
 	ssize_t total = 0;
 	size_t slack;
-	int sock_flags;
 
-	if (!SOCK_SET_FLAG_ONCE)
-	{
-		sock_flags = fcntl(sock, F_GETFL);
-		if (!(sock_flags & O_NONBLOCK))
-			fcntl(sock, F_SETFL, sock_flags | O_NONBLOCK);
-
-		SOCK_SET_FLAG_ONCE = 1;
-	}
-
-	slack = buf_slack(buf);
+	if (buf_reserve(buf, toread) < 0)
+		goto fail;
 
-	if (toread >= slack)
-		buf_extend(buf, BUF_ALIGN_SIZE((toread - slack)));
+	slack = ((buf->buf_end - buf->buf_tail) - 1);
 
 	while (1)
 	{
+		if (!slack)
+		{
+		/*
+		 * We have what we were asked for; the rest can wait
+		 * for the next call rather than grow the buffer.
+		 */
+			if (toread && (size_t)total >= toread)
+				break;
+
+			if (buf_reserve(buf, 1) < 0)
+				goto fail;
+
+			slack = ((buf->buf_end - buf->buf_tail) - 1);
+		}
+
 		n = recv(sock, buf->buf_tail, slack, 0);
 
 		if (!n)
@@ -341,12 +382,6 @@ buf_read_socket(int sock, buf_t *buf, size_t toread)
 
 			slack -= n;
 			total += n;
-
-			if (!slack)
-			{
-				slack += buf->buf_size;
-				buf_extend(buf, buf->buf_size);
-			}
 		}
 	}
 
@@ -367,30 +402,25 @@ buf_read_tls(SSL *ssl, buf_t *buf, size_t toread)
 	int n;
 	ssize_t total = 0;
 	int ssl_error = 0;
-	int read_socket = 0;
-	int slept_for = 0;
-	struct timeval timeout = {0};
-	fd_set rdfds;
-	int sock_flags;
 
-	read_socket = SSL_get_rfd(ssl);
+	if (buf_reserve(buf, toread) < 0)
+		goto fail;
 
-	if (!SOCK_SSL_SET_FLAG_ONCE)
-	{
-		sock_flags = fcntl(read_socket, F_GETFL);
-		if (!(sock_flags & O_NONBLOCK))
-			fcntl(read_socket, F_SETFL, sock_flags | O_NONBLOCK);
+	slack = ((buf->buf_end - buf->buf_tail) - 1);
 
-		SOCK_SSL_SET_FLAG_ONCE = 1;
-	}
+	while (1)
+	{
+		if (!slack)
+		{
+			if (toread && (size_t)total >= toread)
+				break;
 
-	slack = buf_slack(buf);
+			if (buf_reserve(buf, 1) < 0)
+				goto fail;
 
-	if (toread >= slack)
-		buf_extend(buf, BUF_ALIGN_SIZE((toread - slack)));
+			slack = ((buf->buf_end - buf->buf_tail) - 1);
+		}
 
-	while (1)
-	{
 		n = SSL_read(ssl, buf->buf_tail, slack);
 
 		if (!n)
@@ -413,21 +443,11 @@ buf_read_tls(SSL *ssl, buf_t *buf, size_t toread)
 					case SSL_ERROR_NONE:
 						continue;
 					case SSL_ERROR_WANT_READ:
-						FD_ZERO(&rdfds);
-						FD_SET(read_socket, &rdfds);
-						timeout.tv_sec = 1;
-						slept_for = select(read_socket+1, &rdfds, NULL, NULL, &timeout);
-
-						if (slept_for < 0)
-						{
-							fprintf(stderr, "buf_read_tls: select error (%s)\n", strerror(errno));
-							goto fail;
-						}
-						else
-						if (!slept_for)
-							goto out;
-						else
-							continue;
+					/*
+					 * Nothing more to decrypt right now; waiting
+					 * for the socket is the caller's business.
+					 */
+						goto out;
 					default:
 						goto fail;
 				}
@@ -439,12 +459,6 @@ buf_read_tls(SSL *ssl, buf_t *buf, size_t toread)
 
 			slack -= n;
 			total += n;
-
-			if (!slack)
-			{
-				slack += buf->buf_size;
-				buf_extend(buf, buf->buf_size);
-			}
 		}
 	} /* while (1) */
 
@@ -635,7 +649,7 @@ buf_replace(buf_t *buf, char *pattern, char *with)
 	char *p;
 	off_t poff;
 
-	if (!with || with[0] == 0)
+	if (with[0] == 0)
 		replace_len = (size_t)0;
 	else
 		replace_len = strlen(with);
@@ -685,10 +699,8 @@ buf_pull_tail(buf_t *buf, size_t by)
 {
 	assert(buf);
 
-	if ((buf->buf_tail + by) > buf->buf_end)
-	{
-		buf_extend(buf, BUF_ALIGN_SIZE((by - (buf->buf_end - buf->buf_tail))));
-	}
+	if (buf_reserve(buf, by) < 0)
+		return;
 
 	__buf_pull_tail(buf, by);
 	return;
@@ -723,3 +735,18 @@ buf_pull_head(buf_t *buf, size_t by)
 	__buf_pull_head(buf, by);
 	return;
 }
+
+/**
+ * buf_get_stats - get the number of buffers set up and reallocs done
+ * @stats: filled in with the counters
+ */
+void
+buf_get_stats(struct buf_stats *stats)
+{
+	assert(stats);
+
+	stats->allocs = __sync_fetch_and_add(&buf_counters.allocs, 0);
+	stats->reallocs = __sync_fetch_and_add(&buf_counters.reallocs, 0);
+
+	return;
+}
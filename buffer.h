@@ -7,6 +7,14 @@
 #define DEFAULT_BUFSIZE 16384
 #define BUFFER_MAGIC 0x12344321
 
+/*
+ * A buffer that needs more room doubles in size, but never
+ * grows by more than BUF_GROW_MAX at a time, so a long run
+ * of small appends costs a logarithmic number of reallocs
+ * without a large buffer overshooting by as much again.
+ */
+#define BUF_GROW_MAX (8 * 1024 * 1024)
+
 typedef struct buf_t
 {
 	char			*data;
@@ -24,11 +32,18 @@ typedef struct buf_t
 #define BUF_NULL_TERMINATE(b)	*((b)->buf_tail) = 0
 #define BUF_ALIGN_SIZE(s) (((s) + 0xf) & ~(0xf))
 
+struct buf_stats
+{
+	unsigned long allocs; /* buf_init() */
+	unsigned long reallocs; /* buf_extend() */
+};
+
 int buf_init(buf_t *, size_t) __nonnull((1));
 void buf_destroy(buf_t *) __nonnull((1));
 void buf_collapse(buf_t *, off_t, size_t) __nonnull((1));
 void buf_shift(buf_t *, off_t, size_t) __nonnull((1));
 int buf_extend(buf_t *, size_t) __nonnull((1));
+int buf_reserve(buf_t *, size_t) __nonnull((1)) __wur;
 void buf_append(buf_t *, char *) __nonnull((1,2));
 void buf_append_ex(buf_t *, char *, size_t) __nonnull((1,2));
 void buf_replace(buf_t *, char *, char *) __nonnull((1,2,3));
@@ -44,10 +59,15 @@ buf_t *buf_dup(buf_t *) __nonnull((1)) __wur;
 void buf_copy(buf_t *, buf_t *) __nonnull((1,2));
 int buf_integrity(buf_t *) __nonnull((1)) __wur;
 ssize_t buf_read_fd(int, buf_t *, size_t) __nonnull((2));
+/*
+ * The socket (or the read fd of the SSL object) must already be
+ * non-blocking; the owner of the connection sets that up once.
+ */
 ssize_t buf_read_socket(int, buf_t *, size_t) __nonnull((2));
 ssize_t buf_read_tls(SSL *, buf_t *, size_t) __nonnull((1,2));
 ssize_t buf_write_fd(int, buf_t *) __nonnull((2));
 ssize_t buf_write_socket(int, buf_t *) __nonnull((2));
 ssize_t buf_write_tls(SSL *, buf_t *) __nonnull((1,2));
+void buf_get_stats(struct buf_stats *) __nonnull((1));
 
 #endif /* !defined BUFFER_H */
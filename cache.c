@@ -2,152 +2,78 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "cache.h"
-#include "http.h"
 #include "wikigrab.h"
 
-#define BITS_PER_CHAR (sizeof(char) * 8)
+#define WIKI_CACHE_SLAB_HDR __ALIGN(sizeof(struct wiki_cache_slab))
+#define WIKI_CACHE_SLAB_ALL_FREE (~(uint64_t)0)
 
-static inline void *
-__wiki_cache_object(wiki_cache_t *cachep, int index)
-{
-	return (void *)((char *)cachep->cache + (index * cachep->objsize));
-}
-
-static inline off_t
-__wiki_cache_object_offset(wiki_cache_t *cachep, void *object)
+static inline struct wiki_cache_slab *
+__wiki_cache_slab(wiki_cache_t *cachep, void *obj)
 {
-	return (off_t)((char *)object - (char *)cachep->cache);
+	return (struct wiki_cache_slab *)((uintptr_t)obj & ~((uintptr_t)cachep->slab_size - 1));
 }
 
-static inline int
-__wiki_cache_object_index(wiki_cache_t *cachep, void *object)
+static inline void *
+__wiki_cache_object(wiki_cache_t *cachep, struct wiki_cache_slab *slab, int index)
 {
-	return (int)(__wiki_cache_object_offset(cachep, object) / cachep->objsize);
+	return (void *)(slab->objects + (index * cachep->objsize));
 }
 
 static inline int
-__addr_in_cache(wiki_cache_t *cachep, void *addr)
+__wiki_cache_object_index(wiki_cache_t *cachep, struct wiki_cache_slab *slab, void *obj)
 {
-	int __in_cache = ((unsigned long)addr >= (unsigned long)cachep->cache && (unsigned long)addr < (unsigned long)((char *)cachep->cache + (cachep->capacity * cachep->objsize)));
-
-	return __in_cache;
+	return (int)(((char *)obj - slab->objects) / cachep->objsize);
 }
 
-#define WIKI_CACHE_SAVE_ACTIVE_PTR(c, o, p)\
-do {\
-	int ___i_c = __addr_in_cache((c), (p));\
-	int __nr_active = (c)->nr_active_ptrs;\
-	assert(__nr_active < (c)->capacity);\
-	struct active_ptr_ctx *__ap_ctx;\
-	__ap_ctx = &((c)->active_ptrs[__nr_active]);\
-	__ap_ctx->obj_offset = __wiki_cache_object_offset((c), (o));\
-	__ap_ctx->obj_addr = (void *)(o);\
-	if (___i_c)\
-		__ap_ctx->ptr_offset = (off_t)((char *)(p) - (char *)cachep->cache);\
-	__ap_ctx->ptr_addr = (p);\
-	++((c)->nr_active_ptrs);\
-} while (0)
-
-#define WIKI_CACHE_REMOVE_ACTIVE_PTR(c, o, p)\
-do {\
-	int __nr_active = (c)->nr_active_ptrs;\
-	int __i;\
-	int __k;\
-	struct active_ptr_ctx *__ap_ctx;\
-	assert(__nr_active < (c)->capacity);\
-	__ap_ctx = &((c)->active_ptrs[0]);\
-	for (__i = 0; __i < __nr_active; ++__i)\
-	{\
-		if (__ap_ctx->ptr_addr == (p)\
-		&& *((unsigned long *)__ap_ctx->ptr_addr) == (unsigned long)(o))\
-		{\
-			for (__k = __i; __k < (__nr_active - 1); ++__k)\
-			{\
-				memcpy(&(c)->active_ptrs[__k], &(c)->active_ptrs[__k+1], sizeof(struct active_ptr_ctx));\
-			}\
-			memset(&(c)->active_ptrs[__k], 0, sizeof(struct active_ptr_ctx));\
-			--((c)->nr_active_ptrs);\
-		}\
-		++__ap_ctx;\
-	}\
-} while (0)
-
-#define WIKI_CACHE_ADJUST_ACTIVE_PTRS(c)\
-do {\
-	int __nr_active = (c)->nr_active_ptrs;\
-	int __i;\
-	struct active_ptr_ctx *__ap_ctx;\
-	assert(__nr_active < (c)->capacity);\
-	__ap_ctx = &((c)->active_ptrs[0]);\
-	for (__i = 0; __i < __nr_active; ++__i)\
-	{\
-		if (__ap_ctx->in_cache)\
-			__ap_ctx->ptr_addr = (void *)((char *)(c)->cache + __ap_ctx->ptr_offset);\
-		*((unsigned long *)__ap_ctx->ptr_addr) = (unsigned long)((char *)(c)->cache + __ap_ctx->obj_offset);\
-		++__ap_ctx;\
-	}\
-} while (0)
-
 /**
- * __wiki_cache_next_free_idx - get index of next free object
+ * __wiki_cache_grow - chain another slab onto a cache
  * @cachep: pointer to the metadata cache structure
+ *
+ * The new slab goes on the end of the list of slabs (so that
+ * objects are handed out in address order within a slab and
+ * in slab order across them until something is freed) and at
+ * the head of the list of slabs with free objects.
  */
-static inline int __wiki_cache_next_free_idx(wiki_cache_t *cachep)
+static struct wiki_cache_slab *
+__wiki_cache_grow(wiki_cache_t *cachep)
 {
-	unsigned char *bm = cachep->free_bitmap;
-	unsigned char bit = 1;
-	int idx = 0;
-	int capacity = cachep->capacity;
+	struct wiki_cache_slab *slab;
+	int i;
 
-	while (1)
+	if (!(slab = aligned_alloc(cachep->slab_size, cachep->slab_size)))
 	{
-		while (*bm & bit)
-		{
-			bit <<= 1;
-			++idx;
-		}
+		fprintf(stderr, "__wiki_cache_grow: failed to allocate slab for \"%s\" (%s)\n", cachep->name, strerror(errno));
+		return NULL;
+	}
 
-		if (idx >= capacity)
-			return -1;
+	memset(slab, 0, cachep->slab_size);
 
-		if (!bit)
-		{
-			bit = 1;
-			++bm;
-		}
-		else
-		if (!(*bm & bit))
-		{
-			assert(idx < capacity);
-			return idx;
-		}
+	slab->objects = ((char *)slab + WIKI_CACHE_SLAB_HDR);
+	slab->free = WIKI_CACHE_SLAB_ALL_FREE;
+
+	if (cachep->ctor)
+	{
+		for (i = 0; i < WIKI_CACHE_SLAB_OBJS; ++i)
+			cachep->ctor(__wiki_cache_object(cachep, slab, i));
 	}
 
-	return -1;
-}
+	if (cachep->last_slab)
+		cachep->last_slab->next = slab;
+	else
+		cachep->slabs = slab;
 
-/**
- * __wiki_cache_mark_used - mark an object as used
- * @c: pointer to the metadata cache structure
- * @i: the index of the object in the cache
- */
-#define __wiki_cache_mark_used(c, i)	\
-do {\
-	unsigned char *bm = ((c)->free_bitmap + ((i) >> 3));	\
-	(*bm |= (unsigned char)(1 << ((i) & 7)));							\
-} while(0)
+	cachep->last_slab = slab;
 
-/**
- * __wiki_cache_mark_unused - mark an object as unused
- * @c: pointer to the metadata cache structure
- * @i: the index of the object in the cache
- */
-#define __wiki_cache_mark_unused(c, i)	\
-do {\
-	unsigned char *bm = ((c)->free_bitmap + ((i) >> 3));	\
-	(*bm &= (unsigned char) ~(1 << ((i) & 7)));						\
-} while(0)
+	slab->next_free = cachep->free_slabs;
+	cachep->free_slabs = slab;
+
+	cachep->capacity += WIKI_CACHE_SLAB_OBJS;
+	cachep->nr_free += WIKI_CACHE_SLAB_OBJS;
+
+	return slab;
+}
 
 /**
  * wiki_cache_nr_used - return the number of objects used
@@ -175,17 +101,12 @@ inline int wiki_cache_capacity(wiki_cache_t *cachep)
 inline int
 wiki_cache_obj_used(wiki_cache_t *cachep, void *obj)
 {
-	int idx;
-	int capacity;
-	unsigned char *bm = cachep->free_bitmap;
-
-	capacity = cachep->capacity;
-	idx = __wiki_cache_object_index(cachep, obj);
-	assert(idx < capacity);
+	struct wiki_cache_slab *slab = __wiki_cache_slab(cachep, obj);
+	int idx = __wiki_cache_object_index(cachep, slab, obj);
 
-	bm += (idx >> 3);
+	assert(idx < WIKI_CACHE_SLAB_OBJS);
 
-	return (*bm & (1 << (idx & 7))) ? 1 : 0;
+	return (slab->free & ((uint64_t)1 << idx)) ? 0 : 1;
 }
 
 /**
@@ -194,7 +115,9 @@ wiki_cache_obj_used(wiki_cache_t *cachep, void *obj)
  * @size: size of the type of object that will be stored in the cache
  * @alignment: minimum alignment of the cache objects
  * @ctor: pointer to a constructor function called on each object
- * @dtor: pointer to a destructor function called on each dealloc()
+ * @dtor: pointer to a destructor function called on each object on destroy()
+ *
+ * No slab is allocated until the first object is.
  */
 wiki_cache_t *
 wiki_cache_create(char *name,
@@ -204,19 +127,16 @@ wiki_cache_create(char *name,
 		wiki_cache_dtor_t dtor)
 {
 	wiki_cache_t	*cachep = malloc(sizeof(wiki_cache_t));
-	int capacity = (WIKI_CACHE_SIZE / size);
-	int	i;
-	uint16_t bitmap_size;
+	size_t need = (WIKI_CACHE_SLAB_HDR + (WIKI_CACHE_SLAB_OBJS * size));
 
 	assert(cachep);
 
 	clear_struct(cachep);
 
 	cachep->objsize = size;
-	bitmap_size = (uint16_t)(capacity / BITS_PER_CHAR);
 
-	if (capacity & (BITS_PER_CHAR - 1))
-		++bitmap_size;
+	for (cachep->slab_size = 1; cachep->slab_size < need; cachep->slab_size <<= 1)
+		;
 
 	if (!(cachep->name = calloc(WIKI_CACHE_MAX_NAME, 1)))
 		goto fail_release_mem;
@@ -224,35 +144,6 @@ wiki_cache_create(char *name,
 	assert(strlen(name) < WIKI_CACHE_MAX_NAME);
 	strcpy(cachep->name, name);
 
-	if (!(cachep->cache = calloc(WIKI_CACHE_SIZE, 1)))
-		goto fail_release_mem;
-
-	assert(cachep->cache);
-
-	if (!(cachep->free_bitmap = calloc(bitmap_size, 1)))
-		goto fail_release_mem;
-
-	assert(cachep->free_bitmap);
-
-	for (i = 0; (uint16_t)i < bitmap_size; ++i)
-		cachep->free_bitmap[i] = 0;
-
-	if (!(cachep->active_ptrs = calloc(capacity, sizeof(struct active_ptr_ctx))))
-		goto fail_release_mem;
-
-	assert(cachep->active_ptrs);
-
-	if (ctor)
-	{
-		for (i = 0; i < capacity; ++i)
-			ctor(__wiki_cache_object(cachep, i));
-	}
-
-	cachep->capacity = capacity;
-	cachep->nr_free = capacity;
-	cachep->nr_active_ptrs = 0;
-	cachep->cache_size = WIKI_CACHE_SIZE;
-	cachep->bitmap_size = bitmap_size;
 	cachep->ctor = ctor;
 	cachep->dtor = dtor;
 
@@ -260,16 +151,13 @@ wiki_cache_create(char *name,
 	fprintf(stderr,
 			"Created cache \"%s\"\n"
 			"Size of each object=%lu bytes\n"
-			"Capacity of cache=%d objects\n"
-			"Bitmap size=%hu bytes\n"
-			"Bitmap can represent %hu objects\n"
+			"Size of each slab=%lu bytes (%d objects)\n"
 			"%s\n"
 			"%s\n",
 			name,
 			size,
-			capacity,
-			bitmap_size,
-			bitmap_size * 8,
+			cachep->slab_size,
+			WIKI_CACHE_SLAB_OBJS,
 			ctor ? "constructor provided" : "constructor not provided",
 			dtor ? "destructor provided" : "destructor not provided");
 #endif
@@ -278,23 +166,7 @@ wiki_cache_create(char *name,
 
 	fail_release_mem:
 
-	if (cachep)
-	{
-		if (cachep->name)
-			free(cachep->name);
-
-		if (cachep->cache)
-			free(cachep->cache);
-
-		if (cachep->free_bitmap)
-			free(cachep->free_bitmap);
-
-		if (cachep->active_ptrs)
-			free(cachep->active_ptrs);
-
-		free(cachep);
-		cachep = NULL;
-	}
+	free(cachep);
 
 	return NULL;
 }
@@ -308,19 +180,23 @@ wiki_cache_destroy(wiki_cache_t *cachep)
 {
 	assert(cachep);
 
+	struct wiki_cache_slab *slab;
+	struct wiki_cache_slab *next;
 	int	i;
-	int capacity = wiki_cache_capacity(cachep);
 
-	if (cachep->dtor)
+	for (slab = cachep->slabs; slab; slab = next)
 	{
-		wiki_cache_dtor_t dtor = cachep->dtor;
-		for (i = 0; i < capacity; ++i)
-			dtor(__wiki_cache_object(cachep, i));
+		next = slab->next;
+
+		if (cachep->dtor)
+		{
+			for (i = 0; i < WIKI_CACHE_SLAB_OBJS; ++i)
+				cachep->dtor(__wiki_cache_object(cachep, slab, i));
+		}
+
+		free(slab);
 	}
 
-	free(cachep->cache);
-	free(cachep->free_bitmap);
-	free(cachep->active_ptrs);
 	free(cachep->name);
 	free(cachep);
 
@@ -330,124 +206,33 @@ wiki_cache_destroy(wiki_cache_t *cachep)
 /**
  * wiki_cache_alloc - allocate an object from a cache
  * @cachep: pointer to the metadata cache structure
+ *
+ * Objects never move once allocated, so whoever holds a
+ * pointer to one can keep it for as long as it is used.
  */
 void *
-wiki_cache_alloc(wiki_cache_t *cachep, void *ptr_addr)
+wiki_cache_alloc(wiki_cache_t *cachep)
 {
 	assert(cachep);
 
-	void *slot = NULL;
-	int idx = __wiki_cache_next_free_idx(cachep);
-	uint16_t old_bitmap_size = cachep->bitmap_size;
-	uint16_t new_bitmap_size;
-	int old_capacity = cachep->capacity;
-	int new_capacity = 0;
-	int i;
-	void *old_cache;
-	void *owner_addr = ptr_addr;
-	off_t owner_off;
-	int in_cache;
-	unsigned char *byteptr;
+	struct wiki_cache_slab *slab;
+	int idx;
 
-	if (idx != -1 && idx < old_capacity && wiki_cache_nr_used(cachep) < old_capacity)
+	if (!(slab = cachep->free_slabs))
 	{
-		slot = __wiki_cache_object(cachep, idx);
-
-		__wiki_cache_mark_used(cachep, idx);
-		WIKI_CACHE_DEC_FREE(cachep);
-		WIKI_CACHE_SAVE_ACTIVE_PTR(cachep, slot, owner_addr);
-
-		return slot;
+		if (!(slab = __wiki_cache_grow(cachep)))
+			return NULL;
 	}
-	else
-	{
-		new_capacity = (old_capacity * 2);
-		new_bitmap_size = (old_bitmap_size * 2);
-
-		old_cache = cachep->cache;
-
-		in_cache = __addr_in_cache(cachep, owner_addr);
-
-		if (in_cache)
-			owner_off = (off_t)((char *)owner_addr - (char *)cachep->cache);
-
-		if (!(cachep->cache = realloc(cachep->cache, (new_capacity * cachep->objsize))))
-		{
-			fprintf(stderr, "wiki_cache_alloc: failed to reallocate memory for cache objects\n");
-			goto fail_release_mem;
-		}
-
-		cachep->capacity = new_capacity;
-		cachep->nr_free += (new_capacity - old_capacity);
-		cachep->cache_size = (new_capacity * cachep->objsize);
-
-		if (old_cache != cachep->cache)
-		{
-			if (in_cache)
-			{
-				owner_addr = (void *)((char *)cachep->cache + owner_off);
-			}
-
-			WIKI_CACHE_ADJUST_ACTIVE_PTRS(cachep);
-		}
-
-		if (!(cachep->free_bitmap = realloc(cachep->free_bitmap, new_bitmap_size)))
-		{
-			fprintf(stderr, "wiki_cache_alloc: failed to reallocate memory for cache objects bitmap\n");
-			goto fail_release_mem;
-		}
-
-		cachep->bitmap_size = new_bitmap_size;
-
-		byteptr = cachep->free_bitmap;
-		for (i = old_bitmap_size; i < new_bitmap_size; ++i)
-			byteptr[i] = 0;
-
-		if (cachep->ctor)
-		{
-			wiki_cache_ctor_t ctor = cachep->ctor;
-			for (i = old_capacity; i < new_capacity; ++i)
-			{
-				ctor(__wiki_cache_object(cachep, i));
-			}
-		}
-
-		if (!(cachep->active_ptrs = realloc(cachep->active_ptrs, (new_capacity * sizeof(struct active_ptr_ctx)))))
-		{
-			fprintf(stderr, "wiki_cache_alloc: failed to reallocate memory for list of cache object owners\n");
-			goto fail_release_mem;
-		}
-
-		idx = __wiki_cache_next_free_idx(cachep);
-		assert(idx >= old_capacity);
-		assert(idx < new_capacity);
-
-		slot = __wiki_cache_object(cachep, idx);
-		__wiki_cache_mark_used(cachep, idx);
-		WIKI_CACHE_DEC_FREE(cachep);
-		WIKI_CACHE_SAVE_ACTIVE_PTR(cachep, slot, owner_addr);
-
-		return slot;
-	}
-
-	fail_release_mem:
 
-	if (cachep)
-	{
-		if (cachep->cache)
-			free(cachep->cache);
-
-		if (cachep->free_bitmap)
-			free(cachep->free_bitmap);
+	idx = __builtin_ctzll(slab->free);
+	slab->free &= ~((uint64_t)1 << idx);
 
-		if (cachep->active_ptrs)
-			free(cachep->active_ptrs);
+	if (!slab->free)
+		cachep->free_slabs = slab->next_free;
 
-		free(cachep);
-		cachep = NULL;
-	}
+	--(cachep->nr_free);
 
-	return NULL;
+	return __wiki_cache_object(cachep, slab, idx);
 }
 
 /**
@@ -456,51 +241,90 @@ wiki_cache_alloc(wiki_cache_t *cachep, void *ptr_addr)
  * @slot: the object to be returned
  */
 void
-wiki_cache_dealloc(wiki_cache_t *cachep, void *slot, void *ptr_addr)
+wiki_cache_dealloc(wiki_cache_t *cachep, void *slot)
 {
 	assert(cachep);
 	assert(slot);
 
-	__wiki_cache_mark_unused(cachep, __wiki_cache_object_index(cachep, slot));
+	struct wiki_cache_slab *slab = __wiki_cache_slab(cachep, slot);
+	uint64_t bit = ((uint64_t)1 << __wiki_cache_object_index(cachep, slab, slot));
 
-	if (ptr_addr)
-		WIKI_CACHE_REMOVE_ACTIVE_PTR(cachep, slot, ptr_addr);
+	if (slab->free & bit)
+		return;
+
+/*
+ * It was full, so it is not on the list.
+ */
+	if (!slab->free)
+	{
+		slab->next_free = cachep->free_slabs;
+		cachep->free_slabs = slab;
+	}
 
-	WIKI_CACHE_INC_FREE(cachep);
+	slab->free |= bit;
+	++(cachep->nr_free);
 
 	return;
 }
 
-static void *
-__wiki_cache_get_object_owner(wiki_cache_t *cachep, void *obj)
+/**
+ * wiki_cache_next_used - go through the objects in use
+ * @cachep: pointer to the metadata cache structure
+ * @obj: the last object returned, or NULL to start
+ *
+ * Returns NULL after the last one.
+ */
+void *
+wiki_cache_next_used(wiki_cache_t *cachep, void *obj)
 {
-	int i;
-	int nr_active = cachep->nr_active_ptrs;
-	struct active_ptr_ctx *ap_ctx;
+	assert(cachep);
+
+	struct wiki_cache_slab *slab;
+	uint64_t used;
+	int from = 0;
 
-	ap_ctx = &(cachep->active_ptrs[0]);
-	for (i = 0; i < nr_active; ++i)
+	if (obj)
 	{
-		if (*((unsigned long *)ap_ctx->ptr_addr) == (unsigned long)obj)
-			return (void *)ap_ctx->ptr_addr;
+		slab = __wiki_cache_slab(cachep, obj);
+		from = (__wiki_cache_object_index(cachep, slab, obj) + 1);
+	}
+	else
+	{
+		slab = cachep->slabs;
+	}
+
+	while (slab)
+	{
+		used = (from < WIKI_CACHE_SLAB_OBJS ? (~slab->free & (WIKI_CACHE_SLAB_ALL_FREE << from)) : 0);
+
+		if (used)
+			return __wiki_cache_object(cachep, slab, __builtin_ctzll(used));
+
+		slab = slab->next;
+		from = 0;
 	}
 
 	return NULL;
 }
 
+/**
+ * wiki_cache_clear_all - return every object to the cache
+ * @cachep: pointer to the metadata cache structure
+ */
 void
 wiki_cache_clear_all(wiki_cache_t *cachep)
 {
-	void *obj = NULL;
-	int i;
-	int capacity = cachep->capacity;
+	struct wiki_cache_slab *slab;
+
+	cachep->free_slabs = cachep->slabs;
 
-	for (i = 0; i < capacity; ++i)
+	for (slab = cachep->slabs; slab; slab = slab->next)
 	{
-		obj = __wiki_cache_object(cachep, i);
-		if (wiki_cache_obj_used(cachep, obj))
-			wiki_cache_dealloc(cachep, obj, __wiki_cache_get_object_owner(cachep, obj));
+		slab->free = WIKI_CACHE_SLAB_ALL_FREE;
+		slab->next_free = slab->next;
 	}
 
+	cachep->nr_free = cachep->capacity;
+
 	return;
 }
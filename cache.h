@@ -5,38 +5,36 @@
 #include <sys/types.h>
 
 /*
- * 31 ..... 16 15 ..... 0
- *   cache nr     obj nr
+ * Objects live in slabs of WIKI_CACHE_SLAB_OBJS that never move;
+ * when every slab is full another one is chained on. Each slab
+ * is aligned to its own (power of two) size so that the slab an
+ * object is in can be found from its address, and keeps a bitmap
+ * of its free objects in one word. Slabs with a free object are
+ * kept on a list of their own, so alloc and dealloc are O(1).
  */
-#define WIKI_CACHE_SIZE 4096
+#define WIKI_CACHE_SLAB_OBJS 64
 #define WIKI_CACHE_MAX_NAME 32
 
-#define WIKI_CACHE_DEC_FREE(c) --((c)->nr_free)
-#define WIKI_CACHE_INC_FREE(c) ++((c)->nr_free)
-
 typedef int (*wiki_cache_ctor_t)(void *);
 typedef void (*wiki_cache_dtor_t)(void *);
 
-struct active_ptr_ctx
+struct wiki_cache_slab
 {
-	void *ptr_addr;
-	int in_cache;
-	void *obj_addr;
-	off_t obj_offset;
-	off_t ptr_offset;
+	struct wiki_cache_slab *next; /* Next slab of the cache */
+	struct wiki_cache_slab *next_free; /* Next slab with a free object */
+	uint64_t free; /* Bit N set if object N is free */
+	char *objects;
 };
 
 typedef struct wiki_cache_t
 {
-	void *cache;
+	struct wiki_cache_slab *slabs;
+	struct wiki_cache_slab *last_slab;
+	struct wiki_cache_slab *free_slabs; /* Slabs with a free object */
 	int capacity;
 	int nr_free;
-	unsigned char *free_bitmap;
-	uint16_t bitmap_size;
-	struct active_ptr_ctx *active_ptrs;
-	int nr_active_ptrs;
 	size_t objsize;
-	size_t cache_size;
+	size_t slab_size;
 	char *name;
 	wiki_cache_ctor_t ctor;
 	wiki_cache_dtor_t dtor;
@@ -44,8 +42,9 @@ typedef struct wiki_cache_t
 
 wiki_cache_t *wiki_cache_create(char *, size_t, int, wiki_cache_ctor_t, wiki_cache_dtor_t);
 void wiki_cache_destroy(wiki_cache_t *) __nonnull((1));
-void *wiki_cache_alloc(wiki_cache_t *, void *) __nonnull((1,2)) __wur;
-void wiki_cache_dealloc(wiki_cache_t *, void *, void *) __nonnull((1,2,3));
+void *wiki_cache_alloc(wiki_cache_t *) __nonnull((1)) __wur;
+void wiki_cache_dealloc(wiki_cache_t *, void *) __nonnull((1,2));
+void *wiki_cache_next_used(wiki_cache_t *, void *) __nonnull((1)) __wur;
 int wiki_cache_obj_used(wiki_cache_t *, void *) __nonnull((1,2)) __wur;
 int wiki_cache_nr_used(wiki_cache_t *) __nonnull((1)) __wur;
 int wiki_cache_capacity(wiki_cache_t *) __nonnull((1)) __wur;
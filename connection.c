@@ -1,50 +1,23 @@
-#include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
-#include <netdb.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <openssl/conf.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
-#include <setjmp.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include "buffer.h"
 #include "cache.h"
 #include "connection.h"
+#include "dial.h"
 #include "http.h"
+#include "tls.h"
 #include "wikigrab.h"
 
-static sigjmp_buf __timeout_env;
-static struct sigaction oact;
-static struct sigaction nact;
-
-static void
-handle_timeout(int signo)
-{
-	siglongjmp(__timeout_env, 1);
-}
-
-#define SET_TIMEOUT(s)\
-do {\
-	clear_struct(&oact);\
-	clear_struct(&nact);\
-	nact.sa_flags = 0;\
-	nact.sa_handler = handle_timeout;\
-	sigemptyset(&nact.sa_mask);\
-	sigaction(SIGALRM, &nact, &oact);\
-	alarm((s));\
-} while (0)
-
-#define RESET_TIMEOUT()\
-do {\
-	alarm(0);\
-	sigaction(SIGALRM, &oact, NULL);\
-} while(0)
-
 void
 conn_init(connection_t *conn)
 {
@@ -86,19 +59,6 @@ inline int conn_using_tls(connection_t *conn)
 }
 #endif
 
-/**
- * __init_openssl - initialise the openssl library
- */
-static inline void
-__init_openssl(void)
-{
-	SSL_library_init();
-	SSL_load_error_strings();
-	OpenSSL_add_all_algorithms();
-	OPENSSL_config(NULL);
-	ERR_load_crypto_strings();
-}
-
 /**
  * open_connection - set up a connection with the target site
  * @conn: &connection_t that is initialised in this function
@@ -108,9 +68,9 @@ open_connection(connection_t *conn)
 {
 	assert(conn);
 
-	struct sockaddr_in sock4;
-	struct addrinfo *ainf = NULL;
-	struct addrinfo *aip = NULL;
+	char addr[INET6_ADDRSTRLEN];
+
+	conn->ssl = NULL;
 
 	if (buf_init(&conn->read_buf, HTTP_DEFAULT_READ_BUF_SIZE) < 0)
 		goto fail;
@@ -118,95 +78,49 @@ open_connection(connection_t *conn)
 	if (buf_init(&conn->write_buf, HTTP_DEFAULT_WRITE_BUF_SIZE) < 0)
 		goto fail_release_bufs;
 
-	clear_struct(&sock4);
-
-#ifdef DEBUG
-	printf("Getting address of host \"%s\"\n", conn->host);
-#endif
-
-	if (getaddrinfo(conn->host, NULL, NULL, &ainf) < 0)
-	{
-		fprintf(stderr, "open_connection: getaddrinfo error (%s)\n", gai_strerror(errno));
-		goto fail;
-	}
-
-	for (aip = ainf; aip; aip = aip->ai_next)
-	{
-		if (aip->ai_family == AF_INET && aip->ai_socktype == SOCK_STREAM)
-		{
-			memcpy(&sock4, aip->ai_addr, aip->ai_addrlen);
-			break;
-		}
-	}
-
-	if (!aip)
-	{
-		fprintf(stderr, "open_connection: error obtaining remote host address\n");
-		goto fail_release_ainf;
-	}
-
-	sock4.sin_port = htons(HTTPS_PORT_NR);
+	fprintf(stdout, "Connecting to %s⇢  %s%s\n", COL_ORANGE, COL_END, conn->host);
 
-	if ((conn->sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	if ((conn->sock = dial(conn->host, HTTPS_PORT, addr, sizeof(addr))) < 0)
 	{
 		fprintf(stderr, "open_connection: connect error (%s)\n", strerror(errno));
-		goto fail_release_ainf;
+		goto fail_release_bufs;
 	}
 
 	assert(conn->sock > 2);
 
-	fprintf(stdout, "Connecting to %s⇢  %s%s\n", COL_ORANGE, COL_END, inet_ntoa(sock4.sin_addr));
-
-
-	SET_TIMEOUT(4);
-	if (sigsetjmp(__timeout_env, 1) != 0)
-	{
-		fprintf(stderr, "Operation timed out\n");
-		shutdown(conn->sock, SHUT_RDWR);
-	}
-
-	if (connect(conn->sock, (struct sockaddr *)&sock4, (socklen_t)sizeof(sock4)) != 0)
-	{
-		fprintf(stderr, "open_connection: connect error (%s)\n", strerror(errno));
-		goto fail_release_ainf;
-	}
-
-	__init_openssl();
+/*
+ * Everything here reads and writes as if blocking.
+ */
+	fcntl(conn->sock, F_SETFL, fcntl(conn->sock, F_GETFL) & ~O_NONBLOCK);
 
-	if (!(conn->ssl_ctx = SSL_CTX_new(TLSv1_2_client_method())))
+	if (!(conn->ssl = tls_new(conn->sock, conn->host)))
 	{
-		fprintf(stderr, "open_connection: SSL_CTX_new error\n");
-		goto fail_release_ainf;
+		fprintf(stderr, "open_connection: SSL_new error\n");
+		goto fail_close_sock;
 	}
 
-	if (!(conn->ssl = SSL_new(conn->ssl_ctx)))
+	if (tls_handshake(conn->ssl) < 0)
 	{
-		fprintf(stderr, "open_connection: SSL_new error\n");
-		goto fail_free_ssl_ctx;
+		fprintf(stderr, "open_connection: TLS handshake error\n");
+		goto fail_free_ssl;
 	}
 
-	SSL_set_fd(conn->ssl, conn->sock); /* Set the socket for reading/writing */
-	SSL_set_connect_state(conn->ssl); /* Set as client */
+	fprintf(stdout, "Connected %s✓%s (%s)\n", COL_GREEN, COL_END, addr);
 
+	return 0;
 
-	RESET_TIMEOUT();
-
-	fprintf(stdout, "Connected %s✓%s\n", COL_GREEN, COL_END);
+	fail_free_ssl:
+	tls_close(conn->ssl);
+	conn->ssl = NULL;
 
-	freeaddrinfo(ainf);
-	return 0;
+	fail_close_sock:
+	close(conn->sock);
+	conn->sock = -1;
 
 	fail_release_bufs:
 	buf_destroy(&conn->read_buf);
 	buf_destroy(&conn->write_buf);
 
-	fail_free_ssl_ctx:
-	SSL_CTX_free(conn->ssl_ctx);
-	conn->ssl_ctx = NULL;
-
-	fail_release_ainf:
-	freeaddrinfo(ainf);
-
 	fail:
 	return -1;
 }
@@ -216,15 +130,13 @@ close_connection(connection_t *conn)
 {
 	assert(conn);
 
+	tls_close(conn->ssl);
+	conn->ssl = NULL;
+
 	shutdown(conn->sock, SHUT_RDWR);
 	close(conn->sock);
 	conn->sock = -1;
 
-	SSL_CTX_free(conn->ssl_ctx);
-	conn->ssl_ctx = NULL;
-	SSL_free(conn->ssl);
-	conn->ssl = NULL;
-
 	buf_destroy(&conn->read_buf);
 	buf_destroy(&conn->write_buf);
 
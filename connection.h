@@ -12,7 +12,6 @@ typedef struct connection_t
 	buf_t write_buf;
 	char *host;
 	char *page;
-	SSL_CTX *ssl_ctx;
 } connection_t;
 
 void conn_init(connection_t *) __nonnull((1));
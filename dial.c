@@ -0,0 +1,300 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "dial.h"
+#include "resolve.h"
+
+struct dial_attempt
+{
+	int sock;
+	long deadline;
+	struct resolve_addr *ra;
+};
+
+static long
+__dial_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * __dial_order - put the addresses in the order we will try them
+ * @res: the host's addresses
+ * @port: the port to set in each of them
+ * @addrs: filled in with up to DIAL_MAX_ADDRS addresses
+ *
+ * getaddrinfo() has already sorted them by preference (RFC 6724);
+ * keep that order within each family but alternate the families,
+ * starting with whichever came first (RFC 8305 section 4).
+ */
+static int
+__dial_order(struct resolve_result *res, int port, struct resolve_addr **addrs)
+{
+	struct resolve_addr *first[DIAL_MAX_ADDRS];
+	struct resolve_addr *other[DIAL_MAX_ADDRS];
+	struct resolve_addr *ra;
+	int nr_first = 0;
+	int nr_other = 0;
+	int family = 0;
+	int nr = 0;
+	int i;
+
+	for (i = 0; i < res->nr_addrs; ++i)
+	{
+		ra = &res->addrs[i];
+
+		if (ra->family == AF_INET6)
+			((struct sockaddr_in6 *)&ra->addr)->sin6_port = htons(port);
+		else
+			((struct sockaddr_in *)&ra->addr)->sin_port = htons(port);
+
+		if (!family)
+			family = ra->family;
+
+		if (ra->family == family)
+		{
+			if (nr_first < DIAL_MAX_ADDRS)
+				first[nr_first++] = ra;
+		}
+		else
+		{
+			if (nr_other < DIAL_MAX_ADDRS)
+				other[nr_other++] = ra;
+		}
+	}
+
+	for (i = 0; nr < DIAL_MAX_ADDRS && (i < nr_first || i < nr_other); ++i)
+	{
+		if (i < nr_first)
+			addrs[nr++] = first[i];
+
+		if (i < nr_other && nr < DIAL_MAX_ADDRS)
+			addrs[nr++] = other[i];
+	}
+
+	return nr;
+}
+
+/**
+ * __dial_start - start a non-blocking connect to one address
+ * @ra: the address
+ * @sock: set to the socket if it connected at once
+ *
+ * Returns 1 if connected, 0 if in progress, or -1.
+ */
+static int
+__dial_start(struct resolve_addr *ra, int *sock)
+{
+	int s;
+
+	if ((s = socket(ra->family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+
+	*sock = s;
+
+	if (connect(s, (struct sockaddr *)&ra->addr, ra->len) == 0)
+		return 1;
+
+	if (errno == EINPROGRESS)
+		return 0;
+
+	close(s);
+	*sock = -1;
+
+	return -1;
+}
+
+/**
+ * dial - connect to a host, racing its addresses
+ * @host: the remote host name
+ * @port: the port number
+ * @addr: filled in with the address we connected to (may be NULL)
+ * @addr_len: size of @addr (INET6_ADDRSTRLEN is always enough)
+ *
+ * Returns a connected, non-blocking socket, or -1 with errno set
+ * (ETIMEDOUT if nothing answered in time).
+ */
+int
+dial(char *host, int port, char *addr, size_t addr_len)
+{
+	assert(host);
+
+	struct resolve_result res;
+	struct resolve_addr *addrs[DIAL_MAX_ADDRS];
+	struct dial_attempt attempts[DIAL_MAX_ADDRS];
+	struct pollfd pfds[DIAL_MAX_ADDRS];
+	struct dial_attempt *winner = NULL;
+	struct dial_attempt connected;
+	long deadline;
+	long next_start;
+	long now;
+	long wait;
+	int nr_addrs;
+	int nr_pending = 0;
+	int next = 0;
+	int error = ETIMEDOUT;
+	int err;
+	int i;
+	int j;
+	socklen_t len;
+
+	if (resolve_host(host, &res) < 0)
+		return -1;
+
+	if (!(nr_addrs = __dial_order(&res, port, addrs)))
+	{
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+
+	now = __dial_now_ms();
+	deadline = now + DIAL_TIMEOUT_MS;
+	next_start = now;
+
+	while (!winner && (nr_pending || next < nr_addrs))
+	{
+		now = __dial_now_ms();
+
+		if (now >= deadline)
+			break;
+
+	/*
+	 * Start the next address when the last attempt has had
+	 * its head start, or at once if nothing is pending.
+	 */
+		while (next < nr_addrs && (!nr_pending || now >= next_start))
+		{
+			struct dial_attempt *a = &attempts[nr_pending];
+
+			a->ra = addrs[next++];
+			a->deadline = now + DIAL_ATTEMPT_TIMEOUT_MS;
+
+			switch(__dial_start(a->ra, &a->sock))
+			{
+				case 1:
+					connected = *a;
+					winner = &connected;
+					break;
+				case 0:
+					++nr_pending;
+					next_start = now + DIAL_ATTEMPT_DELAY_MS;
+					break;
+				default:
+					error = errno;
+			}
+
+			if (winner || nr_pending)
+				break;
+		}
+
+		if (winner || !nr_pending)
+			continue;
+
+		wait = deadline - now;
+
+		if (next < nr_addrs && next_start - now < wait)
+			wait = next_start - now;
+
+		for (i = 0; i < nr_pending; ++i)
+		{
+			if (attempts[i].deadline - now < wait)
+				wait = attempts[i].deadline - now;
+
+			pfds[i].fd = attempts[i].sock;
+			pfds[i].events = POLLOUT;
+			pfds[i].revents = 0;
+		}
+
+		if (wait < 0)
+			wait = 0;
+
+		if (poll(pfds, nr_pending, (int)wait) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			error = errno;
+			break;
+		}
+
+		now = __dial_now_ms();
+
+		for (i = 0, j = 0; i < nr_pending; ++i)
+		{
+			err = 0;
+
+			if (pfds[i].revents)
+			{
+				len = sizeof(err);
+
+				if (getsockopt(attempts[i].sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+					err = errno;
+
+				if (!err && !winner)
+				{
+					connected = attempts[i];
+					winner = &connected;
+					continue;
+				}
+			}
+			else
+			if (now >= attempts[i].deadline)
+			{
+				err = ETIMEDOUT;
+			}
+
+			if (err)
+			{
+				error = err;
+				close(attempts[i].sock);
+
+			/*
+			 * Nothing to wait for on this one; do not make
+			 * the next address sit out the rest of the delay.
+			 */
+				next_start = now;
+				continue;
+			}
+
+			pfds[j] = pfds[i];
+			attempts[j++] = attempts[i];
+		}
+
+		nr_pending = j;
+	}
+
+	for (i = 0; i < nr_pending; ++i)
+		close(attempts[i].sock);
+
+	if (!winner)
+	{
+		errno = error;
+		return -1;
+	}
+
+	if (addr)
+	{
+		void *in;
+
+		if (winner->ra->family == AF_INET6)
+			in = &((struct sockaddr_in6 *)&winner->ra->addr)->sin6_addr;
+		else
+			in = &((struct sockaddr_in *)&winner->ra->addr)->sin_addr;
+
+		inet_ntop(winner->ra->family, in, addr, addr_len);
+	}
+
+	return winner->sock;
+}
@@ -0,0 +1,24 @@
+#ifndef DIAL_H
+#define DIAL_H 1
+
+#include <stddef.h>
+#include <sys/cdefs.h>
+
+/*
+ * Non-blocking connect with "happy eyeballs" (RFC 8305).
+ *
+ * All the addresses of the host (from resolve.c) are tried, alternating
+ * between IPv6 and IPv4, starting a new attempt every
+ * DIAL_ATTEMPT_DELAY_MS while the earlier ones are still
+ * pending; the first to connect wins and the rest are
+ * closed. Nothing here uses signals, so any number of
+ * threads may dial at once.
+ */
+#define DIAL_ATTEMPT_DELAY_MS 250 /* RFC 8305 "Connection Attempt Delay" */
+#define DIAL_ATTEMPT_TIMEOUT_MS 4000 /* Longest we wait on any one address */
+#define DIAL_TIMEOUT_MS 10000 /* Longest we wait on the host */
+#define DIAL_MAX_ADDRS 16
+
+int dial(char *, int, char *, size_t) __nonnull((1)) __wur;
+
+#endif /* !defined DIAL_H */
@@ -0,0 +1,254 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+#include "gapbuf.h"
+
+/*
+ * Put the gap at OFF in the text.
+ */
+static void
+__gap_move(gap_buf_t *gap, size_t off)
+{
+	size_t before = gap_before(gap);
+	size_t range;
+
+	if (off < before)
+	{
+		range = (before - off);
+		gap->gap_start -= range;
+		gap->gap_end -= range;
+		memmove(gap->gap_end, gap->gap_start, range);
+	}
+	else
+	if (off > before)
+	{
+		range = (off - before);
+		memmove(gap->gap_start, gap->gap_end, range);
+		gap->gap_start += range;
+		gap->gap_end += range;
+	}
+
+	return;
+}
+
+/*
+ * Make sure the gap has room for BYTES. Like buf_reserve(),
+ * the buffer grows by its own size (at most BUF_GROW_MAX)
+ * or by as much as is needed, whichever is more.
+ */
+static int
+__gap_reserve(gap_buf_t *gap, size_t bytes)
+{
+	size_t room = (gap->gap_end - gap->gap_start);
+	size_t before;
+	size_t after;
+	size_t after_off;
+	size_t grow;
+	size_t new_size;
+	char *data;
+
+	if (bytes <= room)
+		return 0;
+
+	grow = gap->buf_size;
+
+	if (grow > BUF_GROW_MAX)
+		grow = BUF_GROW_MAX;
+
+	if (grow < (bytes - room))
+		grow = (bytes - room);
+
+	new_size = BUF_ALIGN_SIZE((gap->buf_size + grow));
+
+/*
+ * Only offsets survive the realloc(); the pointers
+ * into the old memory must not be read after it.
+ */
+	before = gap_before(gap);
+	after = gap_after(gap);
+	after_off = (before + room);
+
+	if (!(data = realloc(gap->data, new_size)))
+	{
+		fprintf(stderr, "__gap_reserve: realloc error (%s)\n", strerror(errno));
+		return -1;
+	}
+
+/*
+ * The text after the gap (and its null byte) goes
+ * to the end of the new memory.
+ */
+	memmove(data + (new_size - (after + 1)), data + after_off, (after + 1));
+
+	gap->data = data;
+	gap->buf_size = new_size;
+	gap->gap_start = (data + before);
+	gap->buf_end = (data + (new_size - 1));
+	gap->gap_end = (gap->buf_end - after);
+
+	return 0;
+}
+
+/**
+ * gap_init - set up a gap buffer holding a copy of some text
+ * @gap: the gap buffer
+ * @text: the text
+ * @len: its length
+ *
+ * The gap starts out at the start of the text.
+ */
+int
+gap_init(gap_buf_t *gap, char *text, size_t len)
+{
+	assert(gap);
+	assert(text);
+
+	size_t size = BUF_ALIGN_SIZE((len + GAP_DEFAULT_SIZE + 1));
+
+	memset(gap, 0, sizeof(*gap));
+
+	if (!(gap->data = malloc(size)))
+	{
+		perror("gap_init: malloc error");
+		return -1;
+	}
+
+	gap->buf_size = size;
+	gap->buf_end = (gap->data + (size - 1));
+	gap->gap_start = gap->data;
+	gap->gap_end = (gap->buf_end - len);
+
+	memcpy(gap->gap_end, text, len);
+	*(gap->buf_end) = 0;
+
+	return 0;
+}
+
+/**
+ * gap_destroy - free the memory of a gap buffer
+ * @gap: the gap buffer
+ */
+void
+gap_destroy(gap_buf_t *gap)
+{
+	assert(gap);
+
+	free(gap->data);
+	memset(gap, 0, sizeof(*gap));
+
+	return;
+}
+
+/**
+ * gap_seek - get the text from OFF onwards in one piece
+ * @gap: the gap buffer
+ * @off: offset in the text
+ *
+ * Moves the gap to OFF and returns a pointer to the text after
+ * it, which is null-terminated and stays where it is until the
+ * next edit.
+ */
+char *
+gap_seek(gap_buf_t *gap, off_t off)
+{
+	assert(gap);
+	assert((size_t)off <= gap_len(gap));
+
+	__gap_move(gap, (size_t)off);
+
+	return gap->gap_end;
+}
+
+/**
+ * gap_collapse - remove RANGE bytes at OFF
+ * @gap: the gap buffer
+ * @off: offset in the text
+ * @range: the number of bytes
+ */
+void
+gap_collapse(gap_buf_t *gap, off_t off, size_t range)
+{
+	assert(gap);
+
+	if ((size_t)off >= gap_len(gap))
+		return;
+
+	__gap_move(gap, (size_t)off);
+
+	if (range > gap_after(gap))
+		range = gap_after(gap);
+
+	gap->gap_end += range;
+
+	return;
+}
+
+/**
+ * gap_insert - insert bytes at OFF
+ * @gap: the gap buffer
+ * @off: offset in the text
+ * @data: the bytes
+ * @len: the number of bytes
+ */
+int
+gap_insert(gap_buf_t *gap, off_t off, char *data, size_t len)
+{
+	assert(gap);
+	assert(data);
+
+	if (__gap_reserve(gap, len) < 0)
+		return -1;
+
+	__gap_move(gap, (size_t)off);
+
+	memcpy(gap->gap_start, data, len);
+	gap->gap_start += len;
+
+	return 0;
+}
+
+/**
+ * gap_replace - replace RANGE bytes at OFF with other bytes
+ * @gap: the gap buffer
+ * @off: offset in the text
+ * @range: the number of bytes replaced
+ * @data: what they are replaced with
+ * @len: the number of bytes in DATA
+ */
+int
+gap_replace(gap_buf_t *gap, off_t off, size_t range, char *data, size_t len)
+{
+	assert(gap);
+	assert(data);
+
+	gap_collapse(gap, off, range);
+
+	return gap_insert(gap, off, data, len);
+}
+
+/**
+ * gap_to_buf - put the text of a gap buffer into a buf_t
+ * @gap: the gap buffer
+ * @buf: what it was in before (or any other buffer)
+ *
+ * Whatever was in BUF is replaced.
+ */
+int
+gap_to_buf(gap_buf_t *gap, buf_t *buf)
+{
+	assert(gap);
+	assert(buf);
+
+	buf_snip(buf, buf_used(buf));
+
+	if (buf_reserve(buf, gap_len(gap)) < 0)
+		return -1;
+
+	buf_append_ex(buf, gap->data, gap_before(gap));
+	buf_append_ex(buf, gap->gap_end, gap_after(gap));
+
+	return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef GAPBUF_H
+#define GAPBUF_H 1
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include "buffer.h"
+
+/*
+ * Text with a gap in it where the last edit was. Moving the gap
+ * costs as much as the distance it moves, and an edit where the
+ * gap already is costs only the bytes inserted, so a pass that
+ * edits its way from the start of the text to the end moves each
+ * byte once rather than once for every edit after it.
+ *
+ * The text after the gap is always contiguous and followed by
+ * a null byte, so it can be searched with the string functions.
+ */
+#define GAP_DEFAULT_SIZE 4096
+
+typedef struct gap_buf_t
+{
+	char			*data;
+	char			*gap_start; /* The text before the gap ends here... */
+	char			*gap_end; /* ...and the text after it starts here */
+	char			*buf_end; /* End of the text (where the null byte is) */
+	size_t		buf_size;
+} gap_buf_t;
+
+#define gap_before(g) ((size_t)((g)->gap_start - (g)->data))
+#define gap_after(g) ((size_t)((g)->buf_end - (g)->gap_end))
+#define gap_len(g) (gap_before(g) + gap_after(g))
+
+int gap_init(gap_buf_t *, char *, size_t) __nonnull((1,2)) __wur;
+void gap_destroy(gap_buf_t *) __nonnull((1));
+char *gap_seek(gap_buf_t *, off_t) __nonnull((1));
+void gap_collapse(gap_buf_t *, off_t, size_t) __nonnull((1));
+int gap_insert(gap_buf_t *, off_t, char *, size_t) __nonnull((1,3)) __wur;
+int gap_replace(gap_buf_t *, off_t, size_t, char *, size_t) __nonnull((1,4)) __wur;
+int gap_to_buf(gap_buf_t *, buf_t *) __nonnull((1,2)) __wur;
+
+#endif /* !defined GAPBUF_H */
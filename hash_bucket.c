@@ -307,7 +307,7 @@ BUCKET_put_data(bucket_obj_t *bucket_obj, char *key, void *data, size_t data_len
 		++bucket_obj->nr_buckets_used;
 	}
 
-	bucket->key = calloc(ALIGN_SIZE(key_len), 1);
+	bucket->key = calloc(ALIGN_SIZE(key_len + 1), 1);
 
 	if (!bucket->key)
 		goto fail;
@@ -324,7 +324,10 @@ BUCKET_put_data(bucket_obj_t *bucket_obj, char *key, void *data, size_t data_len
 	}
 	else
 	{
-		bucket->data = calloc(ALIGN_SIZE(data_len), 1);
+	/*
+	 * Values are read as strings, so leave room for a null byte.
+	 */
+		bucket->data = calloc(ALIGN_SIZE(data_len + 1), 1);
 		if (!bucket->data)
 			goto fail;
 		memcpy(bucket->data, data, data_len);
@@ -0,0 +1,920 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+#include "hpack.h"
+
+/*
+ * RFC 7541 Appendix A.
+ */
+static const struct hpack_static_entry hpack_static_table[HPACK_STATIC_TABLE_SIZE] =
+{
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" }
+};
+
+/*
+ * RFC 7541 Appendix B.
+ */
+static const struct hpack_huffman_code hpack_huffman_codes[HPACK_HUFFMAN_NR_SYMS] =
+{
+	{ 0x00001ff8, 13 }, /*   0 */
+	{ 0x007fffd8, 23 }, /*   1 */
+	{ 0x0fffffe2, 28 }, /*   2 */
+	{ 0x0fffffe3, 28 }, /*   3 */
+	{ 0x0fffffe4, 28 }, /*   4 */
+	{ 0x0fffffe5, 28 }, /*   5 */
+	{ 0x0fffffe6, 28 }, /*   6 */
+	{ 0x0fffffe7, 28 }, /*   7 */
+	{ 0x0fffffe8, 28 }, /*   8 */
+	{ 0x00ffffea, 24 }, /*   9 */
+	{ 0x3ffffffc, 30 }, /*  10 */
+	{ 0x0fffffe9, 28 }, /*  11 */
+	{ 0x0fffffea, 28 }, /*  12 */
+	{ 0x3ffffffd, 30 }, /*  13 */
+	{ 0x0fffffeb, 28 }, /*  14 */
+	{ 0x0fffffec, 28 }, /*  15 */
+	{ 0x0fffffed, 28 }, /*  16 */
+	{ 0x0fffffee, 28 }, /*  17 */
+	{ 0x0fffffef, 28 }, /*  18 */
+	{ 0x0ffffff0, 28 }, /*  19 */
+	{ 0x0ffffff1, 28 }, /*  20 */
+	{ 0x0ffffff2, 28 }, /*  21 */
+	{ 0x3ffffffe, 30 }, /*  22 */
+	{ 0x0ffffff3, 28 }, /*  23 */
+	{ 0x0ffffff4, 28 }, /*  24 */
+	{ 0x0ffffff5, 28 }, /*  25 */
+	{ 0x0ffffff6, 28 }, /*  26 */
+	{ 0x0ffffff7, 28 }, /*  27 */
+	{ 0x0ffffff8, 28 }, /*  28 */
+	{ 0x0ffffff9, 28 }, /*  29 */
+	{ 0x0ffffffa, 28 }, /*  30 */
+	{ 0x0ffffffb, 28 }, /*  31 */
+	{ 0x00000014,  6 }, /*  32 */
+	{ 0x000003f8, 10 }, /* '!' */
+	{ 0x000003f9, 10 }, /* '"' */
+	{ 0x00000ffa, 12 }, /* '#' */
+	{ 0x00001ff9, 13 }, /* '$' */
+	{ 0x00000015,  6 }, /* '%' */
+	{ 0x000000f8,  8 }, /* '&' */
+	{ 0x000007fa, 11 }, /*  39 */
+	{ 0x000003fa, 10 }, /* '(' */
+	{ 0x000003fb, 10 }, /* ')' */
+	{ 0x000000f9,  8 }, /*  42 */
+	{ 0x000007fb, 11 }, /* '+' */
+	{ 0x000000fa,  8 }, /* ',' */
+	{ 0x00000016,  6 }, /* '-' */
+	{ 0x00000017,  6 }, /* '.' */
+	{ 0x00000018,  6 }, /*  47 */
+	{ 0x00000000,  5 }, /* '0' */
+	{ 0x00000001,  5 }, /* '1' */
+	{ 0x00000002,  5 }, /* '2' */
+	{ 0x00000019,  6 }, /* '3' */
+	{ 0x0000001a,  6 }, /* '4' */
+	{ 0x0000001b,  6 }, /* '5' */
+	{ 0x0000001c,  6 }, /* '6' */
+	{ 0x0000001d,  6 }, /* '7' */
+	{ 0x0000001e,  6 }, /* '8' */
+	{ 0x0000001f,  6 }, /* '9' */
+	{ 0x0000005c,  7 }, /* ':' */
+	{ 0x000000fb,  8 }, /* ';' */
+	{ 0x00007ffc, 15 }, /* '<' */
+	{ 0x00000020,  6 }, /* '=' */
+	{ 0x00000ffb, 12 }, /* '>' */
+	{ 0x000003fc, 10 }, /* '?' */
+	{ 0x00001ffa, 13 }, /* '@' */
+	{ 0x00000021,  6 }, /* 'A' */
+	{ 0x0000005d,  7 }, /* 'B' */
+	{ 0x0000005e,  7 }, /* 'C' */
+	{ 0x0000005f,  7 }, /* 'D' */
+	{ 0x00000060,  7 }, /* 'E' */
+	{ 0x00000061,  7 }, /* 'F' */
+	{ 0x00000062,  7 }, /* 'G' */
+	{ 0x00000063,  7 }, /* 'H' */
+	{ 0x00000064,  7 }, /* 'I' */
+	{ 0x00000065,  7 }, /* 'J' */
+	{ 0x00000066,  7 }, /* 'K' */
+	{ 0x00000067,  7 }, /* 'L' */
+	{ 0x00000068,  7 }, /* 'M' */
+	{ 0x00000069,  7 }, /* 'N' */
+	{ 0x0000006a,  7 }, /* 'O' */
+	{ 0x0000006b,  7 }, /* 'P' */
+	{ 0x0000006c,  7 }, /* 'Q' */
+	{ 0x0000006d,  7 }, /* 'R' */
+	{ 0x0000006e,  7 }, /* 'S' */
+	{ 0x0000006f,  7 }, /* 'T' */
+	{ 0x00000070,  7 }, /* 'U' */
+	{ 0x00000071,  7 }, /* 'V' */
+	{ 0x00000072,  7 }, /* 'W' */
+	{ 0x000000fc,  8 }, /* 'X' */
+	{ 0x00000073,  7 }, /* 'Y' */
+	{ 0x000000fd,  8 }, /* 'Z' */
+	{ 0x00001ffb, 13 }, /* '[' */
+	{ 0x0007fff0, 19 }, /*  92 */
+	{ 0x00001ffc, 13 }, /* ']' */
+	{ 0x00003ffc, 14 }, /* '^' */
+	{ 0x00000022,  6 }, /* '_' */
+	{ 0x00007ffd, 15 }, /* '`' */
+	{ 0x00000003,  5 }, /* 'a' */
+	{ 0x00000023,  6 }, /* 'b' */
+	{ 0x00000004,  5 }, /* 'c' */
+	{ 0x00000024,  6 }, /* 'd' */
+	{ 0x00000005,  5 }, /* 'e' */
+	{ 0x00000025,  6 }, /* 'f' */
+	{ 0x00000026,  6 }, /* 'g' */
+	{ 0x00000027,  6 }, /* 'h' */
+	{ 0x00000006,  5 }, /* 'i' */
+	{ 0x00000074,  7 }, /* 'j' */
+	{ 0x00000075,  7 }, /* 'k' */
+	{ 0x00000028,  6 }, /* 'l' */
+	{ 0x00000029,  6 }, /* 'm' */
+	{ 0x0000002a,  6 }, /* 'n' */
+	{ 0x00000007,  5 }, /* 'o' */
+	{ 0x0000002b,  6 }, /* 'p' */
+	{ 0x00000076,  7 }, /* 'q' */
+	{ 0x0000002c,  6 }, /* 'r' */
+	{ 0x00000008,  5 }, /* 's' */
+	{ 0x00000009,  5 }, /* 't' */
+	{ 0x0000002d,  6 }, /* 'u' */
+	{ 0x00000077,  7 }, /* 'v' */
+	{ 0x00000078,  7 }, /* 'w' */
+	{ 0x00000079,  7 }, /* 'x' */
+	{ 0x0000007a,  7 }, /* 'y' */
+	{ 0x0000007b,  7 }, /* 'z' */
+	{ 0x00007ffe, 15 }, /* '{' */
+	{ 0x000007fc, 11 }, /* '|' */
+	{ 0x00003ffd, 14 }, /* '}' */
+	{ 0x00001ffd, 13 }, /* '~' */
+	{ 0x0ffffffc, 28 }, /* 127 */
+	{ 0x000fffe6, 20 }, /* 128 */
+	{ 0x003fffd2, 22 }, /* 129 */
+	{ 0x000fffe7, 20 }, /* 130 */
+	{ 0x000fffe8, 20 }, /* 131 */
+	{ 0x003fffd3, 22 }, /* 132 */
+	{ 0x003fffd4, 22 }, /* 133 */
+	{ 0x003fffd5, 22 }, /* 134 */
+	{ 0x007fffd9, 23 }, /* 135 */
+	{ 0x003fffd6, 22 }, /* 136 */
+	{ 0x007fffda, 23 }, /* 137 */
+	{ 0x007fffdb, 23 }, /* 138 */
+	{ 0x007fffdc, 23 }, /* 139 */
+	{ 0x007fffdd, 23 }, /* 140 */
+	{ 0x007fffde, 23 }, /* 141 */
+	{ 0x00ffffeb, 24 }, /* 142 */
+	{ 0x007fffdf, 23 }, /* 143 */
+	{ 0x00ffffec, 24 }, /* 144 */
+	{ 0x00ffffed, 24 }, /* 145 */
+	{ 0x003fffd7, 22 }, /* 146 */
+	{ 0x007fffe0, 23 }, /* 147 */
+	{ 0x00ffffee, 24 }, /* 148 */
+	{ 0x007fffe1, 23 }, /* 149 */
+	{ 0x007fffe2, 23 }, /* 150 */
+	{ 0x007fffe3, 23 }, /* 151 */
+	{ 0x007fffe4, 23 }, /* 152 */
+	{ 0x001fffdc, 21 }, /* 153 */
+	{ 0x003fffd8, 22 }, /* 154 */
+	{ 0x007fffe5, 23 }, /* 155 */
+	{ 0x003fffd9, 22 }, /* 156 */
+	{ 0x007fffe6, 23 }, /* 157 */
+	{ 0x007fffe7, 23 }, /* 158 */
+	{ 0x00ffffef, 24 }, /* 159 */
+	{ 0x003fffda, 22 }, /* 160 */
+	{ 0x001fffdd, 21 }, /* 161 */
+	{ 0x000fffe9, 20 }, /* 162 */
+	{ 0x003fffdb, 22 }, /* 163 */
+	{ 0x003fffdc, 22 }, /* 164 */
+	{ 0x007fffe8, 23 }, /* 165 */
+	{ 0x007fffe9, 23 }, /* 166 */
+	{ 0x001fffde, 21 }, /* 167 */
+	{ 0x007fffea, 23 }, /* 168 */
+	{ 0x003fffdd, 22 }, /* 169 */
+	{ 0x003fffde, 22 }, /* 170 */
+	{ 0x00fffff0, 24 }, /* 171 */
+	{ 0x001fffdf, 21 }, /* 172 */
+	{ 0x003fffdf, 22 }, /* 173 */
+	{ 0x007fffeb, 23 }, /* 174 */
+	{ 0x007fffec, 23 }, /* 175 */
+	{ 0x001fffe0, 21 }, /* 176 */
+	{ 0x001fffe1, 21 }, /* 177 */
+	{ 0x003fffe0, 22 }, /* 178 */
+	{ 0x001fffe2, 21 }, /* 179 */
+	{ 0x007fffed, 23 }, /* 180 */
+	{ 0x003fffe1, 22 }, /* 181 */
+	{ 0x007fffee, 23 }, /* 182 */
+	{ 0x007fffef, 23 }, /* 183 */
+	{ 0x000fffea, 20 }, /* 184 */
+	{ 0x003fffe2, 22 }, /* 185 */
+	{ 0x003fffe3, 22 }, /* 186 */
+	{ 0x003fffe4, 22 }, /* 187 */
+	{ 0x007ffff0, 23 }, /* 188 */
+	{ 0x003fffe5, 22 }, /* 189 */
+	{ 0x003fffe6, 22 }, /* 190 */
+	{ 0x007ffff1, 23 }, /* 191 */
+	{ 0x03ffffe0, 26 }, /* 192 */
+	{ 0x03ffffe1, 26 }, /* 193 */
+	{ 0x000fffeb, 20 }, /* 194 */
+	{ 0x0007fff1, 19 }, /* 195 */
+	{ 0x003fffe7, 22 }, /* 196 */
+	{ 0x007ffff2, 23 }, /* 197 */
+	{ 0x003fffe8, 22 }, /* 198 */
+	{ 0x01ffffec, 25 }, /* 199 */
+	{ 0x03ffffe2, 26 }, /* 200 */
+	{ 0x03ffffe3, 26 }, /* 201 */
+	{ 0x03ffffe4, 26 }, /* 202 */
+	{ 0x07ffffde, 27 }, /* 203 */
+	{ 0x07ffffdf, 27 }, /* 204 */
+	{ 0x03ffffe5, 26 }, /* 205 */
+	{ 0x00fffff1, 24 }, /* 206 */
+	{ 0x01ffffed, 25 }, /* 207 */
+	{ 0x0007fff2, 19 }, /* 208 */
+	{ 0x001fffe3, 21 }, /* 209 */
+	{ 0x03ffffe6, 26 }, /* 210 */
+	{ 0x07ffffe0, 27 }, /* 211 */
+	{ 0x07ffffe1, 27 }, /* 212 */
+	{ 0x03ffffe7, 26 }, /* 213 */
+	{ 0x07ffffe2, 27 }, /* 214 */
+	{ 0x00fffff2, 24 }, /* 215 */
+	{ 0x001fffe4, 21 }, /* 216 */
+	{ 0x001fffe5, 21 }, /* 217 */
+	{ 0x03ffffe8, 26 }, /* 218 */
+	{ 0x03ffffe9, 26 }, /* 219 */
+	{ 0x0ffffffd, 28 }, /* 220 */
+	{ 0x07ffffe3, 27 }, /* 221 */
+	{ 0x07ffffe4, 27 }, /* 222 */
+	{ 0x07ffffe5, 27 }, /* 223 */
+	{ 0x000fffec, 20 }, /* 224 */
+	{ 0x00fffff3, 24 }, /* 225 */
+	{ 0x000fffed, 20 }, /* 226 */
+	{ 0x001fffe6, 21 }, /* 227 */
+	{ 0x003fffe9, 22 }, /* 228 */
+	{ 0x001fffe7, 21 }, /* 229 */
+	{ 0x001fffe8, 21 }, /* 230 */
+	{ 0x007ffff3, 23 }, /* 231 */
+	{ 0x003fffea, 22 }, /* 232 */
+	{ 0x003fffeb, 22 }, /* 233 */
+	{ 0x01ffffee, 25 }, /* 234 */
+	{ 0x01ffffef, 25 }, /* 235 */
+	{ 0x00fffff4, 24 }, /* 236 */
+	{ 0x00fffff5, 24 }, /* 237 */
+	{ 0x03ffffea, 26 }, /* 238 */
+	{ 0x007ffff4, 23 }, /* 239 */
+	{ 0x03ffffeb, 26 }, /* 240 */
+	{ 0x07ffffe6, 27 }, /* 241 */
+	{ 0x03ffffec, 26 }, /* 242 */
+	{ 0x03ffffed, 26 }, /* 243 */
+	{ 0x07ffffe7, 27 }, /* 244 */
+	{ 0x07ffffe8, 27 }, /* 245 */
+	{ 0x07ffffe9, 27 }, /* 246 */
+	{ 0x07ffffea, 27 }, /* 247 */
+	{ 0x07ffffeb, 27 }, /* 248 */
+	{ 0x0ffffffe, 28 }, /* 249 */
+	{ 0x07ffffec, 27 }, /* 250 */
+	{ 0x07ffffed, 27 }, /* 251 */
+	{ 0x07ffffee, 27 }, /* 252 */
+	{ 0x07ffffef, 27 }, /* 253 */
+	{ 0x07fffff0, 27 }, /* 254 */
+	{ 0x03ffffee, 26 }, /* 255 */
+	{ 0x3fffffff, 30 } /* EOS */
+};
+
+/*
+ * Decoding tree built from the code table the first time we
+ * need it. A positive child is the index of another node; a
+ * negative child -(N + 1) is the leaf for symbol N.
+ */
+static int16_t hpack_tree[HPACK_HUFFMAN_NR_SYMS][2];
+static pthread_once_t hpack_tree_once = PTHREAD_ONCE_INIT;
+
+static void
+__hpack_build_tree(void)
+{
+	uint32_t code;
+	int nr_nodes = 1;
+	int node;
+	int sym;
+	int bit;
+	int b;
+
+	for (sym = 0; sym < HPACK_HUFFMAN_NR_SYMS; ++sym)
+	{
+		code = hpack_huffman_codes[sym].code;
+		node = 0;
+
+		for (bit = hpack_huffman_codes[sym].len - 1; bit > 0; --bit)
+		{
+			b = (code >> bit) & 1;
+
+			if (!hpack_tree[node][b])
+				hpack_tree[node][b] = nr_nodes++;
+
+			node = hpack_tree[node][b];
+		}
+
+		hpack_tree[node][code & 1] = -(sym + 1);
+	}
+
+	assert(nr_nodes == (HPACK_HUFFMAN_NR_SYMS - 1));
+
+	return;
+}
+
+/**
+ * hpack_huffman_decode - decode a Huffman-coded string
+ * @in: the coded octets
+ * @len: number of coded octets
+ * @out: the decoded string is written here
+ * @size: size of OUT
+ *
+ * Returns the length of the decoded string, or -1 if it is
+ * not validly coded (RFC 7541 5.2) or does not fit in OUT.
+ */
+ssize_t
+hpack_huffman_decode(unsigned char *in, size_t len, char *out, size_t size)
+{
+	size_t i;
+	size_t n = 0;
+	int node = 0;
+	int nr_bits = 0; /* Bits seen since the last complete symbol */
+	int all_ones = 1;
+	int next;
+	int bit;
+	int b;
+
+	pthread_once(&hpack_tree_once, __hpack_build_tree);
+
+	for (i = 0; i < len; ++i)
+	{
+		for (bit = 7; bit >= 0; --bit)
+		{
+			b = (in[i] >> bit) & 1;
+			next = hpack_tree[node][b];
+
+			++nr_bits;
+
+			if (!b)
+				all_ones = 0;
+
+			if (next > 0)
+			{
+				node = next;
+				continue;
+			}
+
+		/*
+		 * EOS must never appear in the string itself.
+		 */
+			if (!next || next == -HPACK_HUFFMAN_NR_SYMS)
+				return -1;
+
+			if (n >= size)
+				return -1;
+
+			out[n++] = (char)(-next - 1);
+
+			node = 0;
+			nr_bits = 0;
+			all_ones = 1;
+		}
+	}
+
+/*
+ * Padding is the most significant bits of EOS
+ * and is never longer than seven bits.
+ */
+	if (nr_bits > 7 || !all_ones)
+		return -1;
+
+	return (ssize_t)n;
+}
+
+/**
+ * __hpack_int - decode a prefixed integer (RFC 7541 5.1)
+ * @pp: current position; advanced past the integer
+ * @end: end of the header block
+ * @prefix: number of bits of the first octet used by the integer
+ * @value: the integer is returned here
+ */
+static int
+__hpack_int(unsigned char **pp, unsigned char *end, int prefix, uint32_t *value)
+{
+	unsigned char *p = *pp;
+	uint32_t max = ((1u << prefix) - 1);
+	uint64_t v;
+	int shift = 0;
+
+	if (p >= end)
+		return -1;
+
+	v = (*p++ & max);
+
+	if (v == max)
+	{
+		while (1)
+		{
+			if (p >= end || shift > 28)
+				return -1;
+
+			v += (uint64_t)(*p & 0x7f) << shift;
+			shift += 7;
+
+			if (!(*p++ & 0x80))
+				break;
+		}
+
+		if (v > UINT32_MAX)
+			return -1;
+	}
+
+	*pp = p;
+	*value = (uint32_t)v;
+
+	return 0;
+}
+
+/**
+ * __hpack_string - decode a string literal (RFC 7541 5.2)
+ * @pp: current position; advanced past the string
+ * @end: end of the header block
+ * @scratch: decoded strings are written here
+ * @str: pointed to the decoded string on return
+ * @str_len: length of the decoded string
+ */
+static int
+__hpack_string(unsigned char **pp, unsigned char *end, buf_t *scratch, char **str, size_t *str_len)
+{
+	unsigned char *p = *pp;
+	uint32_t len;
+	int huffman;
+	ssize_t n;
+
+	if (p >= end)
+		return -1;
+
+	huffman = (*p & 0x80);
+
+	if (__hpack_int(&p, end, 7, &len) < 0)
+		return -1;
+
+	if (len > (size_t)(end - p))
+		return -1;
+
+	*str = scratch->buf_tail;
+
+	if (huffman)
+	{
+		n = hpack_huffman_decode(p, len, scratch->buf_tail, buf_slack(scratch));
+
+		if (n < 0)
+			return -1;
+	}
+	else
+	{
+		if (len > buf_slack(scratch))
+			return -1;
+
+		memcpy(scratch->buf_tail, p, len);
+		n = len;
+	}
+
+	buf_pull_tail(scratch, (size_t)n);
+
+	*str_len = (size_t)n;
+	*pp = (p + len);
+
+	return 0;
+}
+
+#define __hpack_entry_size(e) ((e)->name_len + (e)->value_len + HPACK_ENTRY_OVERHEAD)
+
+/**
+ * __hpack_evict - drop the oldest entries until the table is small enough
+ * @table: the dynamic table
+ * @limit: the size the table must not exceed
+ */
+static void
+__hpack_evict(struct hpack_table *table, size_t limit)
+{
+	struct hpack_entry *e;
+
+	while (table->size > limit && table->nr_entries)
+	{
+		e = &table->entries[(table->head + table->nr_entries - 1) % table->nr_alloc];
+
+		table->size -= __hpack_entry_size(e);
+		free(e->name);
+		e->name = e->value = NULL;
+
+		--(table->nr_entries);
+	}
+
+	return;
+}
+
+/**
+ * __hpack_insert - add a field to the front of the dynamic table
+ * @table: the dynamic table
+ * @name: field name
+ * @name_len: length of NAME
+ * @value: field value
+ * @value_len: length of VALUE
+ *
+ * NAME may point into an entry that gets evicted, so
+ * the copy is made before making room for it.
+ */
+static int
+__hpack_insert(struct hpack_table *table, char *name, size_t name_len, char *value, size_t value_len)
+{
+	struct hpack_entry *entries;
+	struct hpack_entry *e;
+	size_t size = (name_len + value_len + HPACK_ENTRY_OVERHEAD);
+	char *copy;
+	int nr_alloc;
+	int i;
+
+/*
+ * Not an error; the table just ends up empty (RFC 7541 4.4).
+ */
+	if (size > table->max_size)
+	{
+		__hpack_evict(table, 0);
+		return 0;
+	}
+
+	if (!(copy = malloc(name_len + value_len + 1)))
+		return -1;
+
+	memcpy(copy, name, name_len);
+	memcpy(copy + name_len, value, value_len);
+	copy[name_len + value_len] = 0;
+
+	__hpack_evict(table, (table->max_size - size));
+
+	if (table->nr_entries == table->nr_alloc)
+	{
+		nr_alloc = table->nr_alloc ? (table->nr_alloc * 2) : 16;
+
+		if (!(entries = calloc(nr_alloc, sizeof(struct hpack_entry))))
+		{
+			free(copy);
+			return -1;
+		}
+
+		for (i = 0; i < table->nr_entries; ++i)
+			entries[i] = table->entries[(table->head + i) % table->nr_alloc];
+
+		free(table->entries);
+
+		table->entries = entries;
+		table->nr_alloc = nr_alloc;
+		table->head = 0;
+	}
+
+	table->head = ((table->head + table->nr_alloc - 1) % table->nr_alloc);
+
+	e = &table->entries[table->head];
+	e->name = copy;
+	e->name_len = name_len;
+	e->value = (copy + name_len);
+	e->value_len = value_len;
+
+	table->size += size;
+	++(table->nr_entries);
+
+	return 0;
+}
+
+/**
+ * __hpack_lookup - get the field at an index of the combined tables
+ * @table: the dynamic table
+ * @index: 1 to 61 for the static table; 62 onwards for the dynamic table
+ * @tmp: filled in and returned for static table entries
+ */
+static struct hpack_entry *
+__hpack_lookup(struct hpack_table *table, uint32_t index, struct hpack_entry *tmp)
+{
+	if (!index)
+		return NULL;
+
+	if (index <= HPACK_STATIC_TABLE_SIZE)
+	{
+		tmp->name = (char *)hpack_static_table[index - 1].name;
+		tmp->value = (char *)hpack_static_table[index - 1].value;
+		tmp->name_len = strlen(tmp->name);
+		tmp->value_len = strlen(tmp->value);
+
+		return tmp;
+	}
+
+	index -= (HPACK_STATIC_TABLE_SIZE + 1);
+
+	if (index >= (uint32_t)table->nr_entries)
+		return NULL;
+
+	return &table->entries[(table->head + index) % table->nr_alloc];
+}
+
+/**
+ * hpack_table_init - set up an empty dynamic table
+ * @table: the dynamic table
+ * @size: our SETTINGS_HEADER_TABLE_SIZE (0 for the default)
+ */
+int
+hpack_table_init(struct hpack_table *table, size_t size)
+{
+	assert(table);
+
+	memset(table, 0, sizeof(*table));
+
+	table->max_size = table->settings_size = size ? size : HPACK_DEFAULT_TABLE_SIZE;
+
+	return 0;
+}
+
+/**
+ * hpack_table_destroy - free the entries of a dynamic table
+ * @table: the dynamic table
+ */
+void
+hpack_table_destroy(struct hpack_table *table)
+{
+	assert(table);
+
+	__hpack_evict(table, 0);
+	free(table->entries);
+
+	memset(table, 0, sizeof(*table));
+
+	return;
+}
+
+/**
+ * hpack_decode - decode a complete header block
+ * @table: the connection's dynamic table
+ * @block: the header block (the fragments of HEADERS and CONTINUATION frames joined)
+ * @len: length of BLOCK
+ * @cb: called for each header field in the order they appear
+ * @arg: passed through to CB
+ *
+ * Returns 0, or -1 on a decoding error, which is a connection
+ * error of type COMPRESSION_ERROR since the table can no longer
+ * be trusted.
+ */
+int
+hpack_decode(struct hpack_table *table, unsigned char *block, size_t len, hpack_header_cb_t cb, void *arg)
+{
+	assert(table);
+	assert(block);
+	assert(cb);
+
+	unsigned char *p = block;
+	unsigned char *end = (block + len);
+	struct hpack_entry tmp;
+	struct hpack_entry *e;
+	buf_t scratch;
+	char *name;
+	char *value;
+	size_t name_len;
+	size_t value_len;
+	uint32_t index;
+	int indexing;
+
+/*
+ * The shortest Huffman code is five bits, so no string
+ * decodes to more than 8/5 of its coded length; all the
+ * strings of the block fit in SCRATCH together.
+ */
+	if (buf_init(&scratch, (len * 2) + 16) < 0)
+		return -1;
+
+	while (p < end)
+	{
+		if (*p & 0x80)
+		{
+		/*
+		 * Indexed header field.
+		 */
+			if (__hpack_int(&p, end, 7, &index) < 0)
+				goto fail;
+
+			if (!(e = __hpack_lookup(table, index, &tmp)))
+				goto fail;
+
+			if (cb(arg, e->name, e->name_len, e->value, e->value_len) < 0)
+				goto fail;
+
+			continue;
+		}
+
+		if ((*p & 0xe0) == 0x20)
+		{
+		/*
+		 * Dynamic table size update.
+		 */
+			if (__hpack_int(&p, end, 5, &index) < 0)
+				goto fail;
+
+			if (index > table->settings_size)
+				goto fail;
+
+			table->max_size = index;
+			__hpack_evict(table, table->max_size);
+
+			continue;
+		}
+
+	/*
+	 * Literal header field with incremental indexing (01xxxxxx),
+	 * without indexing (0000xxxx) or never indexed (0001xxxx).
+	 */
+		indexing = ((*p & 0xc0) == 0x40);
+
+		if (__hpack_int(&p, end, indexing ? 6 : 4, &index) < 0)
+			goto fail;
+
+		if (index)
+		{
+			if (!(e = __hpack_lookup(table, index, &tmp)))
+				goto fail;
+
+			name = e->name;
+			name_len = e->name_len;
+		}
+		else
+		{
+			if (__hpack_string(&p, end, &scratch, &name, &name_len) < 0)
+				goto fail;
+		}
+
+		if (__hpack_string(&p, end, &scratch, &value, &value_len) < 0)
+			goto fail;
+
+		if (cb(arg, name, name_len, value, value_len) < 0)
+			goto fail;
+
+		if (indexing && __hpack_insert(table, name, name_len, value, value_len) < 0)
+			goto fail;
+	}
+
+	buf_destroy(&scratch);
+
+	return 0;
+
+fail:
+	buf_destroy(&scratch);
+	return -1;
+}
+
+/**
+ * __hpack_put_int - encode a prefixed integer
+ * @buf: the buffer to append to
+ * @first: the flag bits of the first octet
+ * @prefix: number of bits of the first octet used by the integer
+ * @value: the integer
+ */
+static void
+__hpack_put_int(buf_t *buf, unsigned char first, int prefix, size_t value)
+{
+	unsigned char octets[16];
+	size_t max = ((1u << prefix) - 1);
+	int n = 0;
+
+	if (value < max)
+	{
+		octets[n++] = (first | value);
+	}
+	else
+	{
+		octets[n++] = (first | max);
+		value -= max;
+
+		while (value >= 0x80)
+		{
+			octets[n++] = ((value & 0x7f) | 0x80);
+			value >>= 7;
+		}
+
+		octets[n++] = value;
+	}
+
+	buf_append_ex(buf, (char *)octets, n);
+
+	return;
+}
+
+static void
+__hpack_put_string(buf_t *buf, char *str)
+{
+	size_t len = strlen(str);
+
+	__hpack_put_int(buf, 0x00, 7, len);
+	buf_append_ex(buf, str, len);
+
+	return;
+}
+
+/**
+ * hpack_encode_header - append one request header field to a header block
+ * @buf: the header block being built
+ * @name: the field name (lower case)
+ * @value: the field value
+ *
+ * Fields in the static table are sent as a single index;
+ * everything else is a literal that is not indexed, using
+ * the static table for the name where possible.
+ */
+void
+hpack_encode_header(buf_t *buf, char *name, char *value)
+{
+	assert(buf);
+	assert(name);
+	assert(value);
+
+	uint32_t name_index = 0;
+	int i;
+
+	for (i = 0; i < HPACK_STATIC_TABLE_SIZE; ++i)
+	{
+		if (strcmp(hpack_static_table[i].name, name))
+			continue;
+
+		if (!strcmp(hpack_static_table[i].value, value))
+		{
+			__hpack_put_int(buf, 0x80, 7, (i + 1));
+			return;
+		}
+
+		if (!name_index)
+			name_index = (i + 1);
+	}
+
+	__hpack_put_int(buf, 0x00, 4, name_index);
+
+	if (!name_index)
+		__hpack_put_string(buf, name);
+
+	__hpack_put_string(buf, value);
+
+	return;
+}
@@ -0,0 +1,70 @@
+#ifndef HPACK_H
+#define HPACK_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "buffer.h"
+
+/*
+ * HPACK header compression for HTTP/2 (RFC 7541).
+ *
+ * We decode everything the server may send (indexed fields,
+ * literals with and without indexing, Huffman-coded strings
+ * and dynamic table size updates). Requests are encoded with
+ * the static table and literals that are never added to the
+ * server's dynamic table, so we never need an encoder table.
+ */
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+#define HPACK_ENTRY_OVERHEAD 32 /* Added to each entry's size (RFC 7541 4.1) */
+#define HPACK_STATIC_TABLE_SIZE 61
+#define HPACK_HUFFMAN_NR_SYMS 257 /* Including EOS */
+
+struct hpack_static_entry
+{
+	const char *name;
+	const char *value;
+};
+
+struct hpack_huffman_code
+{
+	uint32_t code;
+	uint8_t len;
+};
+
+struct hpack_entry
+{
+	char *name;
+	char *value;
+	size_t name_len;
+	size_t value_len;
+};
+
+/*
+ * The dynamic table is a ring; the newest entry is at HEAD
+ * and has index HPACK_STATIC_TABLE_SIZE + 1.
+ */
+struct hpack_table
+{
+	struct hpack_entry *entries;
+	int nr_entries;
+	int nr_alloc;
+	int head;
+	size_t size; /* Sum of the entries' sizes */
+	size_t max_size; /* Current limit set by the encoder */
+	size_t settings_size; /* Upper bound from our SETTINGS_HEADER_TABLE_SIZE */
+};
+
+/*
+ * Called for each decoded header field; the strings are not
+ * NUL-terminated and are only valid until the callback returns.
+ */
+typedef int (*hpack_header_cb_t)(void *, char *, size_t, char *, size_t);
+
+int hpack_table_init(struct hpack_table *, size_t) __nonnull((1)) __wur;
+void hpack_table_destroy(struct hpack_table *) __nonnull((1));
+int hpack_decode(struct hpack_table *, unsigned char *, size_t, hpack_header_cb_t, void *) __nonnull((1,2,4)) __wur;
+void hpack_encode_header(buf_t *, char *, char *) __nonnull((1,2,3));
+ssize_t hpack_huffman_decode(unsigned char *, size_t, char *, size_t) __nonnull((1,3)) __wur;
+
+#endif /* !defined HPACK_H */
@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,7 +11,7 @@
 #include "utils.h"
 #include "wikigrab.h"
 
-static content_t *content = NULL;
+static __thread content_t *content = NULL;
 
 #define mark_start(p) ((*p) = 0x01)
 #define mark_end(p) ((*(p-1)) = 0x02)
@@ -104,7 +106,7 @@ html_get_all(wiki_cache_t *cachep, buf_t *buf, const char *open_pattern, const c
 			if (end > buf->buf_tail)
 				end = buf->buf_tail;
 
-			content = wiki_cache_alloc(cachep, &content);
+			content = wiki_cache_alloc(cachep);
 
 			if (!content)
 			{
@@ -115,23 +117,10 @@ html_get_all(wiki_cache_t *cachep, buf_t *buf, const char *open_pattern, const c
 			len = (end - start);
 
 			assert(len < buf->data_len);
-			assert(len >= 0);
 
-			if (len >= content->alloc_len)
-			{
-				size_t new_len = __ALIGN(len+1);
-				content->data = realloc(content->data, new_len);
-				if (!content->data)
-					goto fail;
-				content->alloc_len = new_len;
-			}
-
-			assert(len < content->alloc_len);
-			assert(len < buf->data_len);
-			memcpy((void *)content->data, (void *)start, len);
-			content->data[len] = 0;
-			content->data_len = len;
 			content->off = (off_t)(start - buf->buf_head);
+			content->len = len;
+			content->el = -1;
 			assert(content->off < buf->data_len);
 			++cnt;
 
@@ -296,31 +285,19 @@ html_get_all_class(wiki_cache_t *cachep, buf_t *buf, const char *classname)
 			if (end > buf->buf_tail)
 				end = buf->buf_tail;
 
-			content = wiki_cache_alloc(cachep, &content);
+			content = wiki_cache_alloc(cachep);
 
 			if (!content)
 				goto fail_release_bufs;
 
 			len = (end - left_angle);
-			if (len >= content->alloc_len)
-			{
-				size_t new_len = __ALIGN(len+1);
-				content->data = realloc(content->data, new_len);
-				if (!content->data)
-					goto fail_release_bufs;
-
-				content->alloc_len = new_len;
-			}
 
-			assert(len < content->alloc_len);
-			memcpy((void *)content->data, (void *)left_angle, len);
-			content->data[len] = 0;
-			content->data_len = len;
 			content->off = (off_t)(left_angle - buf->buf_head);
+			content->len = len;
+			content->el = -1;
 
 			assert(content->off < buf->data_len);
-			assert(content->data_len < buf->data_len);
-			assert(content->data_len < content->alloc_len);
+			assert(content->len < buf->data_len);
 			++cnt;
 
 			savep = ++end;
@@ -470,34 +447,19 @@ html_get_all_id(wiki_cache_t *cachep, buf_t *buf, const char *id)
 			if (end > buf->buf_tail)
 				end = buf->buf_tail;
 
-			content = wiki_cache_alloc(cachep, &content);
+			content = wiki_cache_alloc(cachep);
 
 			if (!content)
 				goto fail_release_bufs;
 
 			len = (end - left_angle);
-			if (len >= content->alloc_len)
-			{
-				size_t new_len = __ALIGN(len+1);
-				content->data = realloc(content->data, new_len);
-				if (!content->data)
-				{
-					fprintf(stderr, "html_get_all_id: failed to allocate cache object\n");
-					goto fail_release_bufs;
-				}
-
-				content->alloc_len = new_len;
-			}
 
-			assert(len < content->alloc_len);
-			memcpy((void *)content->data, (void *)left_angle, len);
-			content->data[len] = 0;
-			content->data_len = len;
 			content->off = (off_t)(left_angle - buf->buf_head);
+			content->len = len;
+			content->el = -1;
 
 			assert(content->off < buf->data_len);
-			assert(content->data_len < buf->data_len);
-			assert(content->data_len < content->alloc_len);
+			assert(content->len < buf->data_len);
 			++cnt;
 
 			savep = ++end;
@@ -648,34 +610,19 @@ html_get_all_attribute(wiki_cache_t *cachep, buf_t *buf, const char *attribute,
 			if (end > buf->buf_tail)
 				end = buf->buf_tail;
 
-			content = wiki_cache_alloc(cachep, &content);
+			content = wiki_cache_alloc(cachep);
 
 			if (!content)
 				goto fail_release_bufs;
 
 			len = (end - left_angle);
-			if (len >= content->alloc_len)
-			{
-				size_t new_len = __ALIGN(len+1);
-				content->data = realloc(content->data, new_len);
-				if (!content->data)
-				{
-					fprintf(stderr, "html_get_all_id: failed to allocate cache object\n");
-					goto fail_release_bufs;
-				}
-
-				content->alloc_len = new_len;
-			}
 
-			assert(len < content->alloc_len);
-			memcpy((void *)content->data, (void *)left_angle, len);
-			content->data[len] = 0;
-			content->data_len = len;
 			content->off = (off_t)(left_angle - buf->buf_head);
+			content->len = len;
+			content->el = -1;
 
 			assert(content->off < buf->data_len);
-			assert(content->data_len < buf->data_len);
-			assert(content->data_len < content->alloc_len);
+			assert(content->len < buf->data_len);
 			++cnt;
 
 			savep = ++end;
@@ -697,7 +644,7 @@ html_get_all_attribute(wiki_cache_t *cachep, buf_t *buf, const char *attribute,
 	return -1;
 }
 
-static char tag_content[8192];
+static __thread char tag_content[8192];
 
 char *
 html_get_tag_field(buf_t *buf, const char *tag, const char *field)
@@ -885,450 +832,801 @@ html_remove_elements_class(buf_t *buf, const char *classname)
 	assert(buf);
 	assert(classname);
 
-	char *p;
-	char *savep;
-	char *left_angle;
-	char *right_angle;
-	char *content_end;
-	char *search_from;
-	char *sp;
-	char *q;
-	size_t clen = strlen("class=\"");
-	size_t range;
-	size_t cnamelen = strlen(classname);
-	buf_t open_tag;
-	buf_t close_tag;
-	int depth = 0;
-
-	if (buf_init(&open_tag, 64) < 0)
-		goto fail;
-
-	if (buf_init(&close_tag, 64) < 0)
-		goto fail_release_bufs;
+	struct html_selector sel = { NULL, "class", classname, 0 };
 
-	savep = buf->buf_head;
+	return html_remove_elements(buf, &sel, 1);
+}
 
-	while (1)
-	{
-		while (1)
-		{
-			p = strstr(savep, classname);
+int
+html_remove_elements_attribute(buf_t *buf, const char *attribute, const char *value)
+{
+	assert(buf);
+	assert(attribute);
+	assert(value);
 
-			if (!p || p >= buf->buf_tail)
-				goto out_release_bufs;
+	struct html_selector sel = { NULL, attribute, value, 0 };
 
-			if (memcmp((p - clen), "class=\"", clen))
-			{
-				savep = ++p;
-				continue;
-			}
+	return html_remove_elements(buf, &sel, 1);
+}
 
-			q = (p + cnamelen);
-			if (*q != ' ' && *q != '"')
-			{
-				savep = ++p;
-				continue;
-			}
+/**
+ * html_remove_elements_id - remove HTML content with particular id
+ * @buf: the buffer with the HTML data
+ * @id: the id to search for
+ */
+int
+html_remove_elements_id(buf_t *buf, const char *id)
+{
+	assert(buf);
+	assert(id);
 
-			left_angle = p;
-			while (*left_angle != '<' && left_angle > (buf->buf_head + 1))
-				--left_angle;
+	struct html_selector sel = { NULL, "id", id, 0 };
 
-			if (*left_angle != '<')
-			{
-				savep = ++p;
-				continue;
-			}
+	return html_remove_elements(buf, &sel, 1);
+}
 
-			sp = memchr(left_angle, ' ', (p - left_angle));
+/*
+ * A single pass over the document that records where every
+ * element starts and ends. Queries then look at the elements
+ * instead of searching the text again for each pattern.
+ */
 
-			if (!sp)
-			{
-				savep = ++p;
-				continue;
-			}
+#define HTML_TOK_DEFAULT_NR 1024
 
-			buf_append_ex(&open_tag, left_angle, (sp - left_angle));
-			*(open_tag.buf_tail) = 0;
-			buf_append(&close_tag, "</");
-			buf_append_ex(&close_tag, (left_angle + 1), ((sp - left_angle) - 1));
-			*(close_tag.buf_tail) = 0;
+static const char *const html_void_elements[] =
+{
+	"area", "base", "br", "col", "embed", "hr", "img", "input",
+	"link", "meta", "param", "source", "track", "wbr",
+	NULL
+};
 
-			content_end = strstr(p, close_tag.buf_head);
+static int
+__html_name_is(char *name, int name_len, const char *what)
+{
+	return ((int)strlen(what) == name_len && !strncasecmp(name, what, name_len));
+}
 
-			if (!content_end || content_end >= buf->buf_tail)
-				goto out_release_bufs;
+static int
+__html_is_void(char *name, int name_len)
+{
+	int i;
 
-			search_from = savep = p;
+	for (i = 0; html_void_elements[i] != NULL; ++i)
+	{
+		if (__html_name_is(name, name_len, html_void_elements[i]))
+			return 1;
+	}
 
-			while (1)
-			{
-				depth = 0;
-				while (1)
-				{
-					p = strstr(savep, open_tag.buf_head);
+	return 0;
+}
 
-					if (!p || p >= content_end)
-						break;
+/*
+ * Find the '>' that ends the tag at P, skipping
+ * over quoted attribute values.
+ */
+static char *
+__html_tag_end(char *p, char *tail)
+{
+	char quote = 0;
 
-					++depth;
-					savep = ++p;
-				}
+	while (p < tail)
+	{
+		if (quote)
+		{
+			if (*p == quote)
+				quote = 0;
+		}
+		else
+		if (*p == 0x22 || *p == 0x27)
+		{
+			quote = *p;
+		}
+		else
+		if (*p == 0x3e)
+		{
+			return p;
+		}
 
-				if (!depth)
-					break;
+		++p;
+	}
 
-				search_from = savep = (content_end + 1);
+	return NULL;
+}
 
-				while (depth)
-				{
-					p = strstr(savep, close_tag.buf_head);
+static int
+__html_tok_new_element(struct html_doc *doc)
+{
+	struct html_element *elements;
+	int nr_alloc;
 
-					if (!p || p >= buf->buf_tail)
-						break;
+	if (doc->nr_elements >= doc->nr_alloc)
+	{
+		nr_alloc = (doc->nr_alloc ? (doc->nr_alloc * 2) : HTML_TOK_DEFAULT_NR);
 
-					--depth;
-					content_end = p;
-					savep = ++p;
-				}
+		if (!(elements = realloc(doc->elements, nr_alloc * sizeof(struct html_element))))
+			return -1;
 
-				savep = search_from;
-			}
+		doc->elements = elements;
+		doc->nr_alloc = nr_alloc;
+	}
 
-			right_angle = memchr(content_end, '>', (buf->buf_tail - content_end));
+	return doc->nr_elements++;
+}
 
-			if (right_angle)
-				content_end = (right_angle + 1);
-			else
-				content_end += close_tag.data_len;
+static int
+__html_tok_push(struct html_doc *doc, int depth, int idx)
+{
+	int *stack;
+	int stack_alloc;
 
-			if (content_end > buf->buf_tail)
-				content_end = buf->buf_tail;
+	if (depth >= doc->stack_alloc)
+	{
+		stack_alloc = (doc->stack_alloc ? (doc->stack_alloc * 2) : 64);
 
-			range = (content_end - left_angle);
-			buf_collapse(buf, (off_t)(left_angle - buf->buf_head), range);
-			content_end = savep = left_angle;
+		if (!(stack = realloc(doc->stack, stack_alloc * sizeof(int))))
+			return -1;
 
-			buf_clear(&open_tag);
-			buf_clear(&close_tag);
-		}
+		doc->stack = stack;
+		doc->stack_alloc = stack_alloc;
 	}
 
-	out_release_bufs:
-	buf_destroy(&open_tag);
-	buf_destroy(&close_tag);
+	doc->stack[depth] = idx;
 
 	return 0;
-
-	fail_release_bufs:
-	buf_destroy(&open_tag);
-	buf_destroy(&close_tag);
-
-	fail:
-	return -1;
 }
 
+/**
+ * html_tokenize - find the elements of an HTML document in one pass
+ * @buf: the document
+ * @doc: the elements are recorded here; release it with html_tok_release()
+ *
+ * End tags close the nearest open element of the same name,
+ * and anything opened inside it that is still open. End tags
+ * that match nothing open are ignored, and elements still open
+ * at the end of the document end there. Comments and the text
+ * of <script> and <style> are skipped.
+ */
 int
-html_remove_elements_attribute(buf_t *buf, const char *attribute, const char *value)
+html_tokenize(buf_t *buf, struct html_doc *doc)
 {
 	assert(buf);
-	assert(attribute);
-	assert(value);
+	assert(doc);
 
-	char *p;
-	char *savep;
-	char *left_angle;
-	char *right_angle;
-	char *content_end;
-	char *search_from;
-	char *sp;
-	char *q;
-	size_t alen = strlen(attribute) + 2;
-	size_t range;
-	size_t vlen = strlen(value);
-	buf_t open_tag;
-	buf_t close_tag;
+	char *head = buf->buf_head;
+	char *tail = buf->buf_tail;
+	char *p = head;
+	char *lt;
+	char *gt;
+	char *name;
+	int name_len;
 	int depth = 0;
+	int idx;
+	int i;
+	struct html_element *el;
 
-	if (buf_init(&open_tag, 64) < 0)
-		goto fail;
+	memset(doc, 0, sizeof(*doc));
+	doc->buf = buf;
 
-	if (buf_init(&close_tag, 64) < 0)
-		goto fail_release_bufs;
+	while (p < tail)
+	{
+		if (!(lt = memchr(p, 0x3c, (tail - p))))
+			break;
 
-	savep = buf->buf_head;
+		if ((tail - lt) >= 4 && !strncmp(lt, "<!--", 4))
+		{
+			gt = strstr(lt + 4, "-->");
+			p = (gt ? (gt + 3) : tail);
+			continue;
+		}
 
-	while (1)
-	{
-		while (1)
+		if (lt[1] == '/')
 		{
-			p = strstr(savep, value);
+			name = (lt + 2);
 
-			if (!p || p >= buf->buf_tail)
-				goto out_release_bufs;
+			for (name_len = 0; (name + name_len) < tail && isalnum(name[name_len]); ++name_len)
+				;
 
-			if (memcmp((p - alen), attribute, (alen - 2)))
+			if (!(gt = memchr(lt, 0x3e, (tail - lt))))
+				break;
+
+			for (i = (depth - 1); i >= 0; --i)
 			{
-				savep = ++p;
-				continue;
+				el = &doc->elements[doc->stack[i]];
+
+				if (el->name_len == name_len && !strncasecmp(head + el->name, name, name_len))
+					break;
 			}
 
-			q = (p + vlen);
-			if (*q != ' ' && *q != '"')
+			if (i >= 0)
 			{
-				savep = ++p;
-				continue;
+				while (depth > (i + 1))
+				{
+					el = &doc->elements[doc->stack[--depth]];
+					el->end = (off_t)(lt - head);
+					el->next = doc->nr_elements;
+				}
+
+				el = &doc->elements[doc->stack[--depth]];
+				el->end = (off_t)((gt + 1) - head);
+				el->next = doc->nr_elements;
 			}
 
-			left_angle = p;
-			while (*left_angle != '<' && left_angle > (buf->buf_head + 1))
-				--left_angle;
+			p = (gt + 1);
+			continue;
+		}
 
-			if (*left_angle != '<')
+		if (!isalpha(lt[1]))
+		{
+		/*
+		 * <!DOCTYPE ...>, <?xml ...?>, or just a '<' in the text.
+		 */
+			if (lt[1] == '!' || lt[1] == '?')
 			{
-				savep = ++p;
-				continue;
+				gt = memchr(lt, 0x3e, (tail - lt));
+				p = (gt ? (gt + 1) : tail);
 			}
-
-			sp = memchr(left_angle, ' ', (p - left_angle));
-
-			if (!sp)
+			else
 			{
-				savep = ++p;
-				continue;
+				p = (lt + 1);
 			}
 
-			buf_append_ex(&open_tag, left_angle, (sp - left_angle));
-			*(open_tag.buf_tail) = 0;
-			buf_append(&close_tag, "</");
-			buf_append_ex(&close_tag, (left_angle + 1), ((sp - left_angle) - 1));
-			*(close_tag.buf_tail) = 0;
+			continue;
+		}
 
-			content_end = strstr(p, close_tag.buf_head);
+		if (!(gt = __html_tag_end(lt, tail)))
+			break;
 
-			if (!content_end || content_end >= buf->buf_tail)
-				goto out_release_bufs;
+		name = (lt + 1);
 
-			search_from = savep = p;
+		for (name_len = 0; isalnum(name[name_len]) || name[name_len] == '-'; ++name_len)
+			;
 
-			while (1)
-			{
-				depth = 0;
-				while (1)
-				{
-					p = strstr(savep, open_tag.buf_head);
+		if ((idx = __html_tok_new_element(doc)) < 0)
+			goto fail;
 
-					if (!p || p >= content_end)
-						break;
+		el = &doc->elements[idx];
+		el->start = (off_t)(lt - head);
+		el->open_end = (off_t)((gt + 1) - head);
+		el->end = el->open_end;
+		el->name = (off_t)(name - head);
+		el->name_len = name_len;
+		el->depth = depth;
+		el->parent = (depth ? doc->stack[depth - 1] : -1);
+		el->next = (idx + 1);
+		el->flags = 0;
 
-					++depth;
-					savep = ++p;
-				}
+		p = (gt + 1);
 
-				if (!depth)
-					break;
+		if (*(gt - 1) == '/' || __html_is_void(name, name_len))
+			continue;
 
-				search_from = savep = (content_end + 1);
+	/*
+	 * Their contents are not markup.
+	 */
+		if (__html_name_is(name, name_len, "script") || __html_name_is(name, name_len, "style"))
+		{
+			char *close = (__html_name_is(name, name_len, "style") ? "</style" : "</script");
 
-				while (depth)
-				{
-					p = strstr(savep, close_tag.buf_head);
+			if (!(lt = strstr(p, close)) || !(gt = memchr(lt, 0x3e, (tail - lt))))
+			{
+				el->end = (off_t)(tail - head);
+				break;
+			}
 
-					if (!p || p >= buf->buf_tail)
-						break;
+			el->end = (off_t)((gt + 1) - head);
+			p = (gt + 1);
+			continue;
+		}
 
-					--depth;
-					content_end = p;
-					savep = ++p;
-				}
+		if (__html_tok_push(doc, depth, idx) < 0)
+			goto fail;
 
-				savep = search_from;
-			}
+		++depth;
+	}
 
-			right_angle = memchr(content_end, '>', (buf->buf_tail - content_end));
+	while (depth > 0)
+	{
+		el = &doc->elements[doc->stack[--depth]];
+		el->end = (off_t)(tail - head);
+		el->next = doc->nr_elements;
+	}
 
-			if (right_angle)
-				content_end = (right_angle + 1);
-			else
-				content_end += close_tag.data_len;
+	return doc->nr_elements;
 
-			if (content_end > buf->buf_tail)
-				content_end = buf->buf_tail;
+	fail:
+	fprintf(stderr, "html_tokenize: failed to allocate memory (%s)\n", strerror(errno));
+	html_tok_release(doc);
+	return -1;
+}
 
-			range = (content_end - left_angle);
-			buf_collapse(buf, (off_t)(left_angle - buf->buf_head), range);
+/**
+ * html_tok_release - free what html_tokenize() allocated
+ * @doc: the tokenized document
+ */
+void
+html_tok_release(struct html_doc *doc)
+{
+	assert(doc);
 
-			savep = ++content_end;
-			buf_clear(&open_tag);
-			buf_clear(&close_tag);
+	free(doc->elements);
+	free(doc->stack);
+	memset(doc, 0, sizeof(*doc));
+
+	return;
+}
+
+/*
+ * Does the start tag of EL have attribute ATTR
+ * with the word VALUE in its (quoted) value?
+ */
+static int
+__html_attr_has(char *head, struct html_element *el, const char *attr, const char *value)
+{
+	char *p = (head + el->name + el->name_len);
+	char *tail = (head + el->open_end);
+	char *v;
+	char *v_end;
+	size_t alen = strlen(attr);
+	size_t vlen = strlen(value);
+
+	while (p < tail)
+	{
+		while (p < tail && !isalpha(*p))
+		{
+			if (*p == 0x22 || *p == 0x27)
+			{
+				if (!(p = memchr(p + 1, *p, (tail - (p + 1)))))
+					return 0;
+			}
+
+			++p;
 		}
-	}
 
-	out_release_bufs:
-	buf_destroy(&open_tag);
-	buf_destroy(&close_tag);
+		if ((size_t)(tail - p) <= alen)
+			return 0;
+
+		if (!strncasecmp(p, attr, alen) && p[alen] == '=' && (p[alen + 1] == 0x22 || p[alen + 1] == 0x27))
+		{
+			v = (p + alen + 2);
+
+			if (!(v_end = memchr(v, p[alen + 1], (tail - v))))
+				return 0;
+
+			while (v < v_end)
+			{
+				while (v < v_end && *v == 0x20)
+					++v;
+
+				if ((size_t)(v_end - v) >= vlen
+				&& !memcmp(v, value, vlen)
+				&& (v + vlen == v_end || v[vlen] == 0x20))
+					return 1;
+
+				while (v < v_end && *v != 0x20)
+					++v;
+			}
+
+			return 0;
+		}
+
+		while (p < tail && (isalnum(*p) || *p == '-' || *p == '_' || *p == ':'))
+			++p;
+	}
 
 	return 0;
+}
 
-	fail_release_bufs:
-	buf_destroy(&open_tag);
-	buf_destroy(&close_tag);
+static int
+__html_tok_match(char *head, struct html_element *el, const struct html_selector *sel)
+{
+	if (sel->tag && !__html_name_is(head + el->name, el->name_len, sel->tag))
+		return 0;
 
-	fail:
-	return -1;
+	if (sel->bare && (el->name + el->name_len + 1) != el->open_end)
+		return 0;
+
+	if (sel->attr && !__html_attr_has(head, el, sel->attr, sel->value))
+		return 0;
+
+	return 1;
 }
 
 /**
- * html_remove_elements_id - remove HTML content with particular id
- * @buf: the buffer with the HTML data
- * @id: the id to search for
+ * html_tok_append - append the text of an element to a buffer
+ * @doc: the tokenized document
+ * @idx: index of the element
+ * @buf: what it is appended to (not the buffer of DOC)
+ *
+ * Removed elements inside it are left out.
  */
 int
-html_remove_elements_id(buf_t *buf, const char *id)
+html_tok_append(struct html_doc *doc, int idx, buf_t *buf)
 {
+	assert(doc);
 	assert(buf);
-	assert(id);
+	assert(buf != doc->buf);
 
-	char *p;
-	char *savep;
-	char *left_angle;
-	char *right_angle;
-	char *content_end;
-	char *search_from;
-	char *sp;
-	char *q;
-	size_t ilen = strlen("id=\"");
-	size_t range;
-	size_t idlen = strlen(id);
-	buf_t open_tag;
-	buf_t close_tag;
-	int depth = 0;
+	char *head = doc->buf->buf_head;
+	struct html_element *el = &doc->elements[idx];
+	struct html_element *inner;
+	off_t from = el->start;
+	int i;
 
-	if (buf_init(&open_tag, 64) < 0)
-		goto fail;
+	if (buf_reserve(buf, (size_t)(el->end - el->start)) < 0)
+		return -1;
 
-	if (buf_init(&close_tag, 64) < 0)
-		goto fail_release_bufs;
+	for (i = (idx + 1); i < el->next; ++i)
+	{
+		inner = &doc->elements[i];
 
-	savep = buf->buf_head;
+		if (!(inner->flags & HTML_EL_REMOVED))
+			continue;
 
-	while (1)
+		buf_append_ex(buf, head + from, (inner->start - from));
+		from = inner->end;
+		i = (inner->next - 1);
+	}
+
+	buf_append_ex(buf, head + from, (el->end - from));
+
+	return 0;
+}
+
+/**
+ * html_tok_get_all - find the elements that match any of the selectors
+ * @cachep: a content_t is allocated from here for each element
+ * @doc: the tokenized document
+ * @sel: the selectors
+ * @nr_sel: number of selectors
+ *
+ * Nothing is copied: each content_t is the offset and length of
+ * an element in the document's buffer and its index, for
+ * html_tok_append(). As with html_get_all(), an element inside
+ * another that matched the same selector is not taken again on
+ * its own. Returns the number of elements taken.
+ */
+int
+html_tok_get_all(wiki_cache_t *cachep, struct html_doc *doc, const struct html_selector *sel, int nr_sel)
+{
+	assert(cachep);
+	assert(doc);
+	assert(sel);
+
+	char *head = doc->buf->buf_head;
+	struct html_element *el;
+	off_t taken_end[nr_sel];
+	int cnt = 0;
+	int i;
+	int j;
+
+	for (j = 0; j < nr_sel; ++j)
+		taken_end[j] = 0;
+
+	for (i = 0; i < doc->nr_elements; ++i)
 	{
-		while (1)
-		{
-			p = strstr(savep, id);
+		el = &doc->elements[i];
 
-			if (!p || p >= buf->buf_tail)
-				goto out_release_bufs;
+		if (el->flags & HTML_EL_REMOVED)
+		{
+			i = (el->next - 1);
+			continue;
+		}
 
-			if (memcmp((p - ilen), "id=\"", ilen))
-			{
-				savep = ++p;
+		for (j = 0; j < nr_sel; ++j)
+		{
+			if (el->start < taken_end[j] || !__html_tok_match(head, el, &sel[j]))
 				continue;
-			}
 
-			q = (p + idlen);
-			if (*q != ' ' && *q != '"')
-			{
-				savep = ++p;
-				continue;
-			}
+			taken_end[j] = el->end;
 
-			left_angle = p;
-			while (*left_angle != '<' && left_angle > (buf->buf_head + 1))
-				--left_angle;
+			content = wiki_cache_alloc(cachep);
 
-			if (*left_angle != '<')
+			if (!content)
 			{
-				savep = ++p;
-				continue;
+				fprintf(stderr, "html_tok_get_all: failed to allocate new cache object\n");
+				goto fail;
 			}
 
-			sp = memchr(left_angle, ' ', (p - left_angle));
+			content->off = el->start;
+			content->len = (size_t)(el->end - el->start);
+			content->el = i;
+			++cnt;
+		}
+	}
 
-			if (!sp)
-			{
-				savep = ++p;
-				continue;
-			}
+	return cnt;
 
-			buf_append_ex(&open_tag, left_angle, (sp - left_angle));
-			*(open_tag.buf_tail) = 0;
-			buf_append(&close_tag, "</");
-			buf_append_ex(&close_tag, (left_angle + 1), ((sp - left_angle) - 1));
-			*(close_tag.buf_tail) = 0;
+	fail:
+	return -1;
+}
 
-			content_end = strstr(p, close_tag.buf_head);
+/*
+ * Selectors of the form { NULL, attr, word } are looked up in a
+ * hash table keyed on the word, so each start tag has its
+ * attributes parsed once whatever the number of selectors.
+ * Anything else is tried against every element as it is.
+ */
+struct html_matcher
+{
+	const struct html_selector *sel;
+	int *slots; /* Index into SEL, or -1 */
+	unsigned int mask;
+	int *others; /* Selectors not in the table */
+	int nr_others;
+};
+
+static unsigned int
+__html_hash(const char *p, size_t len)
+{
+	unsigned int h = 2166136261u;
 
-			if (!content_end || content_end >= buf->buf_tail)
-				goto out_release_bufs;
+	while (len--)
+	{
+		h ^= (unsigned char)*p++;
+		h *= 16777619u;
+	}
 
-			search_from = savep = p;
+	return h;
+}
 
-			while (1)
-			{
-				depth = 0;
-				while (1)
-				{
-					p = strstr(savep, open_tag.buf_head);
+static int
+__html_matcher_init(struct html_matcher *m, const struct html_selector *sel, int nr_sel)
+{
+	unsigned int nr_slots = 16;
+	unsigned int h;
+	int i;
 
-					if (!p || p >= content_end)
-						break;
+	while (nr_slots < (unsigned int)(nr_sel * 2))
+		nr_slots <<= 1;
 
-					++depth;
-					savep = ++p;
-				}
+	m->sel = sel;
+	m->mask = (nr_slots - 1);
+	m->nr_others = 0;
 
-				if (!depth)
-					break;
+	if (!(m->slots = malloc(nr_slots * sizeof(int))))
+		return -1;
 
-				search_from = savep = (content_end + 1);
+	if (!(m->others = malloc((nr_sel + 1) * sizeof(int))))
+	{
+		free(m->slots);
+		return -1;
+	}
 
-				while (depth)
-				{
-					p = strstr(savep, close_tag.buf_head);
+	memset(m->slots, 0xff, nr_slots * sizeof(int));
 
-					if (!p || p >= buf->buf_tail)
-						break;
+	for (i = 0; i < nr_sel; ++i)
+	{
+		if (sel[i].tag || sel[i].bare || !sel[i].attr)
+		{
+			m->others[m->nr_others++] = i;
+			continue;
+		}
 
-					--depth;
-					content_end = p;
-					savep = ++p;
-				}
+		h = (__html_hash(sel[i].value, strlen(sel[i].value)) & m->mask);
 
-				savep = search_from;
-			}
+		while (m->slots[h] != -1)
+			h = ((h + 1) & m->mask);
 
-			right_angle = memchr(content_end, '>', (buf->buf_tail - content_end));
+		m->slots[h] = i;
+	}
 
-			if (right_angle)
-				content_end = (right_angle + 1);
-			else
-				content_end += close_tag.data_len;
+	return 0;
+}
 
-			if (content_end > buf->buf_tail)
-				content_end = buf->buf_tail;
+static void
+__html_matcher_release(struct html_matcher *m)
+{
+	free(m->slots);
+	free(m->others);
 
-			range = (content_end - left_angle);
-			buf_collapse(buf, (off_t)(left_angle - buf->buf_head), range);
+	return;
+}
 
-			savep = ++content_end;
-			buf_clear(&open_tag);
-			buf_clear(&close_tag);
+/*
+ * Is the word W (of length WLEN) in the value of
+ * attribute NAME one that a selector is after?
+ */
+static int
+__html_matcher_lookup(struct html_matcher *m, char *name, size_t name_len, char *w, size_t wlen)
+{
+	const struct html_selector *sel;
+	unsigned int h = (__html_hash(w, wlen) & m->mask);
+
+	while (m->slots[h] != -1)
+	{
+		sel = &m->sel[m->slots[h]];
+
+		if (strlen(sel->value) == wlen
+		&& !memcmp(sel->value, w, wlen)
+		&& strlen(sel->attr) == name_len
+		&& !strncasecmp(sel->attr, name, name_len))
+			return 1;
+
+		h = ((h + 1) & m->mask);
+	}
+
+	return 0;
+}
+
+static int
+__html_matcher_match(struct html_matcher *m, char *head, struct html_element *el)
+{
+	char *p = (head + el->name + el->name_len);
+	char *tail = (head + el->open_end);
+	char *name;
+	char *v;
+	char *v_end;
+	char *w;
+	size_t name_len;
+	int i;
+
+	for (i = 0; i < m->nr_others; ++i)
+	{
+		if (__html_tok_match(head, el, &m->sel[m->others[i]]))
+			return 1;
+	}
+
+	while (p < tail)
+	{
+		while (p < tail && !isalpha(*p))
+			++p;
+
+		name = p;
+
+		while (p < tail && (isalnum(*p) || *p == '-' || *p == '_' || *p == ':'))
+			++p;
+
+		name_len = (p - name);
+
+		if (p >= tail || *p != '=')
+			continue;
+
+		++p;
+
+		if (*p != 0x22 && *p != 0x27)
+		{
+			while (p < tail && !isspace(*p) && *p != 0x3e)
+				++p;
+
+			continue;
+		}
+
+		v = (p + 1);
+
+		if (!(v_end = memchr(v, *p, (tail - v))))
+			return 0;
+
+		p = (v_end + 1);
+
+		while (v < v_end)
+		{
+			while (v < v_end && *v == 0x20)
+				++v;
+
+			w = v;
+
+			while (v < v_end && *v != 0x20)
+				++v;
+
+			if (v > w && __html_matcher_lookup(m, name, name_len, w, (v - w)))
+				return 1;
 		}
 	}
 
-	out_release_bufs:
-	buf_destroy(&open_tag);
-	buf_destroy(&close_tag);
+	return 0;
+}
+
+/**
+ * html_dom_remove - remove the elements that match any of the selectors
+ * @doc: the tokenized document
+ * @sel: the selectors
+ * @nr_sel: number of selectors
+ *
+ * Nothing is cut from the text; the elements are flagged
+ * and html_tok_get_all() leaves them (and what is inside
+ * them) out. Returns the number of elements removed.
+ */
+int
+html_dom_remove(struct html_doc *doc, const struct html_selector *sel, int nr_sel)
+{
+	assert(doc);
+	assert(sel);
+
+	char *head = doc->buf->buf_head;
+	struct html_matcher m;
+	struct html_element *el;
+	int cnt = 0;
+	int i;
+
+	if (__html_matcher_init(&m, sel, nr_sel) < 0)
+	{
+		fprintf(stderr, "html_dom_remove: failed to allocate memory (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < doc->nr_elements; ++i)
+	{
+		el = &doc->elements[i];
+
+		if (!__html_matcher_match(&m, head, el))
+			continue;
+
+		el->flags |= HTML_EL_REMOVED;
+		++cnt;
+
+	/*
+	 * What is inside is gone with it.
+	 */
+		i = (el->next - 1);
+	}
+
+	__html_matcher_release(&m);
+
+	return cnt;
+}
+
+/**
+ * html_remove_elements - remove all the elements that match any of the selectors
+ * @buf: the buffer holding the HTML data
+ * @sel: the selectors
+ * @nr_sel: number of selectors
+ *
+ * The document is tokenized once, the elements to go are
+ * flagged, and then the text that is left is moved down
+ * over them in a single pass.
+ */
+int
+html_remove_elements(buf_t *buf, const struct html_selector *sel, int nr_sel)
+{
+	assert(buf);
+	assert(sel);
+
+	struct html_doc doc;
+	struct html_element *el;
+	char *head = buf->buf_head;
+	off_t from = 0;
+	off_t to = 0;
+	size_t len;
+	int i;
+
+	if (html_tokenize(buf, &doc) < 0)
+		goto fail;
+
+	if (html_dom_remove(&doc, sel, nr_sel) < 0)
+		goto fail_release_doc;
+
+	for (i = 0; i < doc.nr_elements; ++i)
+	{
+		el = &doc.elements[i];
+
+		if (!(el->flags & HTML_EL_REMOVED))
+			continue;
+
+		len = (size_t)(el->start - from);
+
+		if (to != from)
+			memmove(head + to, head + from, len);
+
+		to += len;
+		from = el->end;
+		i = (el->next - 1);
+	}
+
+	len = (size_t)(buf_used(buf) - from);
+
+	if (to != from)
+	{
+		memmove(head + to, head + from, len);
+		buf_snip(buf, (size_t)(from - to));
+	}
+
+	html_tok_release(&doc);
 
 	return 0;
 
-	fail_release_bufs:
-	buf_destroy(&open_tag);
-	buf_destroy(&close_tag);
+	fail_release_doc:
+	html_tok_release(&doc);
 
 	fail:
 	return -1;
-	
 }
@@ -1,9 +1,76 @@
 #ifndef HTML_H
 #define HTML_H 1
 
+#include <sys/types.h>
 #include "buffer.h"
 #include "cache.h"
 
+/*
+ * An element found by html_tokenize(). Offsets are
+ * from the start of the buffer that was tokenized.
+ */
+struct html_element
+{
+	off_t start; /* '<' of the start tag */
+	off_t open_end; /* Just past the '>' of the start tag */
+	off_t end; /* Just past the end tag (or where the element was closed) */
+	off_t name; /* Tag name, just after the '<' */
+	int name_len;
+	int depth; /* Number of open elements around this one */
+	int parent; /* Index of the enclosing element, or -1 */
+	int next; /* Index of the first element after this one's subtree */
+	int flags;
+};
+
+#define HTML_EL_REMOVED 0x1 /* Left out, along with everything inside it */
+
+/*
+ * The elements of a document in the order their start
+ * tags appear, so nested elements follow their parent
+ * and a subtree is the run of elements up to NEXT. They
+ * are kept in one array and refer to the text by offset.
+ */
+struct html_doc
+{
+	buf_t *buf;
+	struct html_element *elements;
+	int nr_elements;
+	int nr_alloc;
+	int *stack; /* Open elements while tokenizing */
+	int stack_alloc;
+};
+
+/*
+ * What html_tok_get_all() looks for. An element matches
+ * if its tag is TAG (any tag if NULL), it has no attributes
+ * if BARE is set, and, if ATTR is not NULL, the value of
+ * ATTR has the word VALUE in it (e.g. one of its classes).
+ */
+struct html_selector
+{
+	const char *tag;
+	const char *attr;
+	const char *value;
+	int bare;
+};
+
+int html_tokenize(buf_t *, struct html_doc *) __nonnull((1,2)) __wur;
+void html_tok_release(struct html_doc *) __nonnull((1));
+int html_tok_get_all(wiki_cache_t *, struct html_doc *, const struct html_selector *, int) __nonnull((1,2,3)) __wur;
+int html_tok_append(struct html_doc *, int, buf_t *) __nonnull((1,3)) __wur;
+
+/*
+ * Used as a DOM (--dom): elements are removed by flagging
+ * them rather than cutting them out of the text, and
+ * html_tok_get_all() leaves out what was removed.
+ */
+int html_dom_remove(struct html_doc *, const struct html_selector *, int) __nonnull((1,2));
+
+/*
+ * Cut out everything matching any of the selectors in one go.
+ */
+int html_remove_elements(buf_t *, const struct html_selector *, int) __nonnull((1,2)) __wur;
+
 int html_get_all(wiki_cache_t *, buf_t *, const char *, const char *) __nonnull((1,2,3,4)) __wur;
 int html_get_all_class(wiki_cache_t *, buf_t *, const char *) __nonnull((1,2,3)) __wur;
 int html_get_all_id(wiki_cache_t *, buf_t *, const char *) __nonnull((1,2,3)) __wur;
@@ -13,21 +13,31 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+# include <brotli/decode.h>
+#endif
 #include "buffer.h"
 #include "cache.h"
+#include "dial.h"
+#include "hpack.h"
 #include "http.h"
+#include "http2.h"
 #include "malloc.h"
+#include "redirect.h"
 #include "string_utils.h"
+#include "tls.h"
+#include "wikigrab.h"
 
 /*
  * TODO
  *
  * Gracefully handle 3xx/4xx/5xx codes.
  *
- * Upgrade to handle HTTP 2.0
- *
  * Decouple this file and the netwasabi header
  * because we want the internals of this module
  * to be opaque and therefore reusable elsewhere.
@@ -43,31 +53,6 @@ typedef struct HTTP_Cookie
 	char *for_domain;
 } cookie_t;
 
-#define HTTP_VERSION_1_0 0x10000000u
-#define HTTP_VERSION_1_1 0x10100000u
-#define HTTP_VERSION_2_0 0x20000000u
-#define HTTP_DEFAULT_VERSION HTTP_VERSION_1_1
-
-/*
- * Definitions related to HTTP 2.0
- *
- * This MUST be followed by a SETTINGS frame,
- * which MAY be empty (RFC 7540)
- */
-#define HTTP_2_0_CONNECTION_PREFACE_START_SEQUENCE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
-#define HTTP_2_0_SETTINGS_MAX_FRAME_SIZE 1048576u // 2^20
-
-#define HTTP_UPGRADE_HEADER_FIELD_CLEAR	"Upgrade: h2c"
-#define HTTP_UPGRADE_HEADER_FIELD_TLS	"Upgrade: h2"
-
-struct HTTP_frame
-{
-	uint32_t len:24;
-	uint32_t type:8;
-	uint8_t flags;
-	uint32_t streamId;
-} __attribute__((packed));
-
 #define HTTP_SKIP_HOST_PART(PTR, URL)\
 do {\
 	char *____s_p = NULL;\
@@ -98,6 +83,9 @@ do {\
 #define CREATION_FLAGS O_RDWR|O_CREAT|O_TRUNC
 #define CREATION_MODE S_IRUSR|S_IWUSR
 
+size_t httplen;
+size_t httpslen;
+
 /*
 static enum Error_Code
 {
@@ -106,6 +94,29 @@ static enum Error_Code
 */
 
 
+enum content_coding
+{
+	CODING_IDENTITY = 0,
+	CODING_GZIP,
+	CODING_DEFLATE,
+	CODING_BROTLI
+};
+
+/*
+ * Decompression state for the body of the current response.
+ */
+struct content_decoder
+{
+	enum content_coding coding;
+	int active;
+	int finished;
+	int raw_deflate; /* Server sent deflate without the zlib wrapper */
+	z_stream zs;
+#ifdef HAVE_BROTLI
+	BrotliDecoderState *br;
+#endif
+};
+
 /*
  * User gets struct http_t which does not
  * include the caches.
@@ -116,7 +127,10 @@ struct HTTP_private
 
 	bucket_obj_t *headers;
 	cache_t *cookies;
-	bucket_obj_t *redirects;
+	struct content_decoder decoder;
+	uint32_t h2_stream; /* Stream of our last request over HTTP/2 */
+	int streaming; /* Body of this response goes to http->body_sink */
+	size_t body_off; /* Start of the body in the read buffer */
 };
 
 void http_check_host(struct http_t *) __nonnull((1));
@@ -133,7 +147,10 @@ static const char *code_as_string(struct http_t *);
 
 static void append_cookies_1_1(struct http_t *);
 
-static int http_status_code_int(buf_t *) __nonnull((1));
+static int send_request_2_0(struct http_t *);
+static int recv_response_2_0(struct http_t *);
+static int build_request_header_2_0(struct http_t *);
+static int append_header_2_0(struct http_t *, char *, char *);
 
 struct HTTP_methods Methods_v1_1 = {
 	.send_request = send_request_1_1,
@@ -147,30 +164,24 @@ struct HTTP_methods Methods_v1_1 = {
 	.code_as_string = code_as_string
 };
 
-struct HTTP_methods *Default_Version_Methods = &Methods_v1_1;
-
-//struct HTTP_methods Methods_v2_0;
-
 /*
- * Cache redirected URLs so that we can obtain
- * their current URL if we stumble upon another
- * URL on the site that would elicit a redirect.
- *
- * XXX
- *
- *	After a session, we should save these
- *	mappings in a compressed file in the
- *	event that we crawl the same site
- *	at a future date, sparing bandwidth
- *	wastage.
+ * Used once the server has chosen "h2" with ALPN; the
+ * response header fields end up in the same place as
+ * with 1.1, so only sending and receiving differ.
  */
-struct HTTP_redirected
-{
-	char *fromURL; // The URL that elicits an HTTP redirect
-	char *toURL; // The URL found in the Location header field
-	time_t when; // When we first encountered the original URL
+struct HTTP_methods Methods_v2_0 = {
+	.send_request = send_request_2_0,
+	.recv_response = recv_response_2_0,
+	.build_header = build_request_header_2_0,
+	.append_header = append_header_2_0,
+	.fetch_header = fetch_header_1_1,
+	.URL_parse_host = URL_parse_host,
+	.URL_parse_page = URL_parse_page,
+	.code_as_string = code_as_string
 };
 
+struct HTTP_methods *Default_Version_Methods = &Methods_v1_1;
+
 #ifdef DEBUG
 # define PATH_MAX_GUESS 1024
 static char *LOG_FILE = NULL;
@@ -438,120 +449,249 @@ parse_cookies(struct http_t *http)
 	return;
 }
 
+/*
+ * The response header is parsed as it arrives. The parser
+ * keeps offsets rather than pointers since the read buffer
+ * may be moved by a realloc() between reads, and it resumes
+ * from where it stopped, so each byte of the header is only
+ * looked at once however many reads it takes to get it all.
+ */
+enum header_state
+{
+	HEADER_STATUS_LINE = 0,
+	HEADER_LINE_START,
+	HEADER_NAME,
+	HEADER_VALUE_WS,
+	HEADER_VALUE,
+	HEADER_DONE
+};
+
+struct header_parser
+{
+	enum header_state state;
+	size_t scan; /* Offset from BUF_HEAD of the next byte to look at */
+	size_t sol; /* Offset of the start of the current line */
+	size_t colon; /* Offset of the ':' after the field name */
+	size_t value; /* Offset of the start of the field value */
+	int code;
+};
+
+#define HTTP_MAX_HEADER_LEN 65536
+
 /**
- * Parse the response header fields into a hash bucket.
+ * __header_status_line - get the status code from "HTTP/1.1 200 OK"
+ * @line: start of the status line
+ * @len: length of the line without the line terminator
  */
 static int
-parse_response_header_1_1(struct http_t *http)
+__header_status_line(char *line, size_t len)
 {
-	assert(http);
+	char *p;
+	char *e = (line + len);
+	int code = 0;
+	int i;
 
-	buf_t *buf = &http->conn.read_buf;
-	char *sol = NULL; // start of line
-	char *eol = NULL; // end of line
-	char *eoh = NULL; // end of header
-	char *p = NULL;
-	char *q = NULL;
-	char field_name[1024];
-	char field_value[2048];
-	struct HTTP_private *private = (struct HTTP_private *)http;
+	if (len < 12 || strncmp("HTTP/", line, 5))
+		return -1;
+
+	if (!(p = memchr(line, ' ', len)))
+		return -1;
 
-	_log("\nBEGIN FIRST 10 BYTES OF HEADER:\n%*.*s\nEND FIRST 10 BYTES OF HEADER\n", 10, 10, buf->buf_head);
-	eoh = HTTP_EOH(buf);
-	eoh -= 2;
+	++p;
 
-	size_t hlen = (eoh - buf->buf_head);
+	if ((e - p) < 3)
+		return -1;
 
-	if (2048 < hlen)
+	for (i = 0; i < 3; ++i)
 	{
-		//_drain_socket(http); TODO
-		return -1;
+		if (!isdigit(p[i]))
+			return -1;
+
+		code = (code * 10) + (p[i] - '0');
 	}
 
-	sol = buf->buf_head;
+	return code;
+}
 
-	BUCKET_reset_buckets(private->headers, 0);
-	assert(0 == private->headers->nr_buckets_used);
+/**
+ * __header_emit - put a completed header field into the headers bucket
+ * @http: our HTTP object
+ * @name: start of the field name
+ * @name_len: length of the field name
+ * @value: start of the field value
+ * @value_len: length of the field value
+ */
+static void
+__header_emit(struct http_t *http, char *name, size_t name_len, char *value, size_t value_len)
+{
+	struct HTTP_private *private = (struct HTTP_private *)http;
+	char field_name[1024];
+	size_t i;
 
-/*
- * Skip the initial line showing the status of the request (200 OK...)
+	if (!name_len || name_len >= sizeof(field_name))
+		return;
+
+	for (i = 0; i < name_len; ++i)
+		field_name[i] = tolower(name[i]);
+
+	field_name[name_len] = 0;
+
+	while (value_len && isspace(value[value_len - 1]))
+		--value_len;
+
+	_log("Putting header field \"%s\" (%.*s) into hash table\n", field_name, (int)value_len, value);
+
+	BUCKET_put_data(private->headers, field_name, (void *)value, value_len, 0);
+
+	return;
+}
+
+/**
+ * http_parse_header - parse whatever more of the response header has arrived
+ * @http: our HTTP object
+ * @hp: the parser state carried between reads
+ *
+ * Returns 1 once the blank line ending the header has been seen
+ * (HP->scan is then the offset of the body), 0 if we need more
+ * bytes, or -1 if this is not a valid HTTP response header.
  */
-	eol = memchr(sol, '\r', (eol - sol));
-	if (!eol)
-		return -1;
+static int
+http_parse_header(struct http_t *http, struct header_parser *hp)
+{
+	assert(http);
+	assert(hp);
 
-	sol = eol + 2;
+	buf_t *buf = &http->conn.read_buf;
+	char *head = buf->buf_head;
+	char *p = (head + hp->scan);
+	char *end = buf->buf_tail;
+	char *eol;
+	size_t len;
 
-	while (sol < eoh)
+	while (p < end)
 	{
-		eol = memchr(sol, '\r', (eoh - sol));
+		switch(hp->state)
+		{
+			case HEADER_STATUS_LINE:
 
-		if (!eol)
-			break;
+			/*
+			 * Some servers send a stray CRLF left over
+			 * from a previous response; skip it.
+			 */
+				if (p == (head + hp->sol) && (*p == 0x0d || *p == 0x0a))
+				{
+					++(hp->sol);
+					++p;
+					break;
+				}
+
+				if (!(eol = memchr(p, 0x0a, (end - p))))
+				{
+					p = end;
+					break;
+				}
 
-		p = sol;
-		q = memchr(p, ':', (eol - p));
+				len = (eol - (head + hp->sol));
 
-		if (!q)
-			break;
+				if (len && *(eol - 1) == 0x0d)
+					--len;
 
-		memcpy((void *)field_name, (void *)p, (q - p));
-		field_name[q - p] = 0;
-		to_lower_case(field_name);
+				if ((hp->code = __header_status_line((head + hp->sol), len)) < 0)
+					return -1;
 
-		p = ++q;
+				p = (eol + 1);
+				hp->sol = (p - head);
+				hp->state = HEADER_LINE_START;
+				break;
 
-	/*
-	 * XXX	Determine rule regarding more than one
-	 *	bit of WS between the ':' after the
-	 *	field name and the following field value.
-	 */
-		while (*p == ' ' && p < eol)
-			++p;
+			case HEADER_LINE_START:
 
-		if (p == eol)
-		{
-			break;
-		}
+				if (*p == 0x0d)
+				{
+					++p;
+					break;
+				}
+
+				if (*p == 0x0a)
+				{
+					++p;
+					hp->state = HEADER_DONE;
+					goto done;
+				}
 
-		size_t value_len = (eol - p);
-		memcpy((void *)field_value, (void *)p, value_len);
-		field_value[value_len] = 0;
+				hp->sol = (p - head);
+				hp->state = HEADER_NAME;
+				/* fall through */
 
-		_log("Putting header field \"%s\" (%s) into hash table\n", field_name, field_value);
+			case HEADER_NAME:
 
-		/*
-		 * BUCKET_put_data(bucket_obj_t *bObj, char *key, void *data, size_t len, int flags);
-		 * Flags available:
-		 *
-		 * BUCKET_FL_NO_FREE
-		 *	If we allocated memory on the heap and copied the data from DATA,
-		 *	then we would pass this flag when freeing buckets.
-		 *
-		 * BUCKET_FL_NO_COPY
-		 *	If we use this flag, the data pointed to by DATA will not be copied.
-		 *	The value of the pointer in DATA itself will just be stored.
-		 *
-		 */
-		BUCKET_put_data(private->headers, field_name, (void *)field_value, value_len, 0);
+				while (p < end && *p != ':' && *p != 0x0a)
+					++p;
 
-		sol = eol + 2;
+				if (p == end)
+					break;
 
-#ifdef DEBUG
-		bucket_t *bucket = BUCKET_get_bucket(private->headers, field_name);
-		assert(bucket);
+			/*
+			 * Not a field; ignore the line.
+			 */
+				if (*p == 0x0a)
+				{
+					++p;
+					hp->state = HEADER_LINE_START;
+					break;
+				}
 
-		value_len = strlen(field_value);
-		char *k = BUCKET_get_key_for_value(bucket, (void *)field_value, value_len);
-		bucket_t *b = BUCKET_get_list_bucket_for_value(bucket, (void *)field_value, value_len);
+				hp->colon = (p - head);
+				++p;
+				hp->state = HEADER_VALUE_WS;
+				/* fall through */
 
-		assert(!memcmp((void *)k, (void *)field_name, strlen(field_name)));
-		assert(!memcmp((void *)field_value, b->data, value_len));
-#endif
+			case HEADER_VALUE_WS:
+
+				while (p < end && (*p == ' ' || *p == '\t'))
+					++p;
+
+				if (p == end)
+					break;
+
+				hp->value = (p - head);
+				hp->state = HEADER_VALUE;
+				/* fall through */
+
+			case HEADER_VALUE:
+
+				if (!(eol = memchr(p, 0x0a, (end - p))))
+				{
+					p = end;
+					break;
+				}
+
+				__header_emit(http,
+					(head + hp->sol), (hp->colon - hp->sol),
+					(head + hp->value), (eol - (head + hp->value)));
+
+				p = (eol + 1);
+				hp->state = HEADER_LINE_START;
+				break;
+
+			default:
+				goto done;
+		}
+	}
+
+	hp->scan = (p - head);
+
+	if (hp->scan > HTTP_MAX_HEADER_LEN)
+	{
+		_log("%s: response header too large\n", __func__);
+		return -1;
 	}
 
-	parse_cookies(http);
 	return 0;
+
+done:
+	hp->scan = (p - head);
+	return 1;
 }
 
 #define HTTP_HEADER_BUFSIZE 8192
@@ -569,6 +709,7 @@ build_request_header_1_1(struct http_t *http)
 
 	buf_t *buf = &http->conn.write_buf;
 	buf_t tmp;
+	int len;
 	/*
 	 * Cannot use static memory since we
 	 * need to be thread-safe.
@@ -628,17 +769,28 @@ build_request_header_1_1(struct http_t *http)
 		if (*(tmp.buf_tail - 1) == '/')
 			buf_snip(&tmp, 1);
 
-		sprintf(header_buf,
+		len = sprintf(header_buf,
 			"GET %s HTTP/1.1\r\n"
 			"User-Agent: %s\r\n"
 			"Accept: %s\r\n"
-			"Host: %s\r\n"
-			"Connection: keep-alive%s",
+			"Accept-Encoding: %s\r\n"
+			"Host: %s\r\n",
 			http->URL,
 			HTTP_USER_AGENT,
 			HTTP_ACCEPT,
-			tmp.buf_head,
-			HTTP_EOH_SENTINEL);
+			HTTP_ACCEPT_ENCODING,
+			tmp.buf_head);
+
+	/*
+	 * Revalidate an article we already have.
+	 */
+		if (http->if_none_match[0])
+			len += sprintf(header_buf + len, "If-None-Match: %s\r\n", http->if_none_match);
+
+		if (http->if_modified_since[0])
+			len += sprintf(header_buf + len, "If-Modified-Since: %s\r\n", http->if_modified_since);
+
+		sprintf(header_buf + len, "Connection: keep-alive%s", HTTP_EOH_SENTINEL);
 	}
 
 	buf_append(buf, header_buf);
@@ -696,6 +848,46 @@ check_target_URL(struct http_t *http, int wantSecure)
 	return;
 }
 
+/**
+ * use_cached_redirect - rewrite the URL if we know it redirects
+ * @http: our HTTP object
+ *
+ * Check if this URL has a redirect URL that we cached
+ * (this run, or a permanent one saved by an earlier run).
+ *
+ * If the redirect we received was the exact same URL
+ * as the redirected one, we put the empty string ""
+ * in as the new location. Check for zero length
+ * and return -1 if we find it.
+ *
+ * We can only rewrite the URL if it stays on the host
+ * we are connected to; otherwise let the server send
+ * us the redirect again.
+ */
+static int
+use_cached_redirect(struct http_t *http)
+{
+	char newURL[HTTP_URL_MAX];
+	char newHost[HTTP_HOST_MAX+1];
+
+	if (redirect_map_lookup(http->URL, newURL, HTTP_URL_MAX))
+	{
+		if (!*newURL)
+			return -1;
+
+		http->ops->URL_parse_host(newURL, newHost);
+
+		if (!strcmp(newHost, http->host))
+		{
+			_log("Rewriting %s to %s from redirect cache\n", http->URL, newURL);
+			strcpy(http->URL, newURL);
+			http->ops->URL_parse_page(http->URL, http->page);
+		}
+	}
+
+	return 0;
+}
+
 int
 send_request_1_1(struct http_t *http)
 {
@@ -708,23 +900,9 @@ send_request_1_1(struct http_t *http)
 
 	check_target_URL(http, http->usingSecure);
 
-/*
- * Check if this URL has a redirect URL that we cached.
- *
- * If the redirect we received was the exact same URL
- * as the redirected one, we put the empty string ""
- * in as the data for the key. Check for zero length
- * and return -1 if we find it.
- */
-	struct HTTP_private *private = (struct HTTP_private *)http;
-	bucket_t *bucket = BUCKET_get_bucket(private->redirects, http->URL);
-	if (bucket)
-	{
-		if (0 < strlen((char *)bucket->data))
-			memcpy(http->URL, bucket->data, bucket->data_len);
-		else
-			return -1;
-	}
+	if (use_cached_redirect(http) < 0)
+		return -1;
+
 	//set_verb(http, GET);
 	build_request_header_1_1(http);
 
@@ -756,84 +934,423 @@ fail:
 	return -1;
 }
 
-#define CYCLES_MAX 100000000
-
-static int
-read_until_eoh(struct http_t *http, char **p)
+/**
+ * HTTP 2.0
+ * Build the HPACK header block of a request in the write buffer
+ *
+ * @http HTTP object.
+ */
+int
+build_request_header_2_0(struct http_t *http)
 {
 	assert(http);
 
-	ssize_t n;
-	int is_http = 0;
-	int bytes = 0;
-	buf_t *buf = &http->conn.read_buf;
-	register int cycles = 0;
+	buf_t *buf = &http->conn.write_buf;
 
-	_log("In read_until_eoh\n");
+	hpack_encode_header(buf, ":method", HEAD == http->verb ? "HEAD" : "GET");
+	hpack_encode_header(buf, ":scheme", http->usingSecure ? "https" : "http");
+	hpack_encode_header(buf, ":authority", http->host);
+	hpack_encode_header(buf, ":path", *http->page ? http->page : "/");
+	hpack_encode_header(buf, "user-agent", HTTP_USER_AGENT);
+	hpack_encode_header(buf, "accept", HTTP_ACCEPT);
+	hpack_encode_header(buf, "accept-encoding", HTTP_ACCEPT_ENCODING);
 
-	while (!(*p))
+	if (GET == http->verb)
 	{
-		++cycles;
+		if (http->if_none_match[0])
+			hpack_encode_header(buf, "if-none-match", http->if_none_match);
 
-		if (cycles >= CYCLES_MAX)
-		{
-			return HTTP_OPERATION_TIMEOUT;
-		}
+		if (http->if_modified_since[0])
+			hpack_encode_header(buf, "if-modified-since", http->if_modified_since);
+	}
 
-		if (http->usingSecure)
-			n = buf_read_tls(http_tls(http), buf, HTTP_SMALL_READ_BLOCK);
-		else
-			n = buf_read_socket(http_socket(http), buf, HTTP_SMALL_READ_BLOCK);
+	return 0;
+}
 
-		if (n == -1)
-		{
-			_log("buf_read_%s returned -1...\n", http->usingSecure ? "tls" : "socket");
-			return -1;
-		}
+/**
+ * Add a header field to the request header block.
+ * Field names are lower case in HTTP/2.
+ *
+ * @http Our HTTP object.
+ * @field_name The name of the header field.
+ * @field_value Its value.
+ */
+int
+append_header_2_0(struct http_t *http, char *field_name, char *field_value)
+{
+	assert(http);
+	assert(field_name);
+	assert(field_value);
 
-		switch(n)
-		{
-			case 0:
+	char name[HTTP_HNAME_MAX];
+	size_t i;
 
-				//_log("Read 0 bytes: continuing\n");
-				continue;
-				break;
+	for (i = 0; field_name[i] && i < (HTTP_HNAME_MAX - 1); ++i)
+		name[i] = tolower(field_name[i]);
 
-			default:
+	name[i] = 0;
 
-				_log("read %d bytes\n", n);
+	hpack_encode_header(&http->conn.write_buf, name, field_value);
 
-				bytes += (int)n;
+	return 0;
+}
 
-				if (!strstr(buf->buf_head, "HTTP/") && strncmp("\r\n", buf->buf_head, 2))
-					goto out;
+/**
+ * send_request_2_0 - open a new stream with a request for http->URL
+ * @http: our HTTP object
+ */
+int
+send_request_2_0(struct http_t *http)
+{
+	assert(http);
 
-				*p = strstr(buf->buf_head, HTTP_EOH_SENTINEL);
+	struct HTTP_private *private = HTTP_private(http);
+	buf_t *buf = &http->conn.write_buf;
 
-				if (*p)
-				{
-					is_http = 1;
-					goto out;
-				}
-		}
-	}
+	buf_clear(buf);
 
-out:
+	check_target_URL(http, http->usingSecure);
+
+	if (use_cached_redirect(http) < 0)
+		return -1;
+
+	build_request_header_2_0(http);
 
-	if (is_http)
+	if (!(private->h2_stream = http2_submit(http, buf)))
 	{
-		assert(!strncmp(HTTP_EOH_SENTINEL, *p, strlen(HTTP_EOH_SENTINEL)));
-		*p += strlen(HTTP_EOH_SENTINEL);
+		_log("Failed to open a stream for %s\n", http->URL);
+		goto fail;
 	}
 
-	_log("Returning %d bytes\n", bytes);
-	return bytes;
-}
+	_log("Sent request for %s on stream %u\n", http->URL, private->h2_stream);
 
-#ifdef DEBUG
-static void
-__dump_buf(buf_t *buf)
-{
+	buf_clear(buf);
+
+	return 0;
+
+fail:
+	buf_clear(buf);
+	return -1;
+}
+
+/*
+ * ================================================================================================
+ *
+ * Readiness-driven receive engine.
+ *
+ * The sockets are non-blocking; rather than spinning on reads
+ * that return nothing, sleep in epoll_wait() until the kernel
+ * says there is something to read or our deadline passes.
+ *
+ * ================================================================================================
+ */
+
+#define HTTP_READ_TIMEOUT_MS (HTTP_MAX_WAIT_TIME * 1000)
+#define HTTP_HANDSHAKE_TIMEOUT_MS (HTTP_MAX_WAIT_TIME * 1000)
+#define HTTP_DRAIN_TIMEOUT_MS 250
+
+#define HTTP_WAIT_READABLE 0x1
+#define HTTP_WAIT_CLOSED 0x2
+
+long
+http_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((long)ts.tv_sec * 1000L) + (ts.tv_nsec / 1000000L);
+}
+
+/**
+ * http_watch_socket - register the connection's socket with its epoll instance
+ * @http: our HTTP object
+ */
+static int
+http_watch_socket(struct http_t *http)
+{
+	assert(http);
+
+	struct epoll_event ev;
+
+	if (http->conn.epfd < 0)
+	{
+		if ((http->conn.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		{
+			_log("epoll_create1 error (%s)\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	clear_struct(&ev);
+	ev.events = EPOLLIN|EPOLLRDHUP;
+	ev.data.fd = http_socket(http);
+
+	if (epoll_ctl(http->conn.epfd, EPOLL_CTL_ADD, http_socket(http), &ev) < 0)
+	{
+		_log("epoll_ctl error (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * http_unwatch_socket - release the connection's epoll instance
+ * @http: our HTTP object
+ */
+static void
+http_unwatch_socket(struct http_t *http)
+{
+	assert(http);
+
+	if (http->conn.epfd >= 0)
+	{
+		close(http->conn.epfd);
+		http->conn.epfd = -1;
+	}
+
+	return;
+}
+
+/**
+ * http_wait_readable - sleep until the socket has data or the deadline passes
+ * @http: our HTTP object
+ * @deadline: absolute CLOCK_MONOTONIC time in milliseconds
+ *
+ * Returns a mask of HTTP_WAIT_* flags, 0 on timeout or -1 on error.
+ */
+static int
+http_wait_readable(struct http_t *http, long deadline)
+{
+	assert(http);
+
+	struct epoll_event ev;
+	long timeout;
+	int nr_events;
+	int mask = 0;
+
+/*
+ * OpenSSL may already hold decrypted bytes from a
+ * previous record; the kernel knows nothing of those.
+ */
+	if (http->usingSecure && http_tls(http) && SSL_pending(http_tls(http)) > 0)
+		return HTTP_WAIT_READABLE;
+
+	while (1)
+	{
+		timeout = (deadline - http_now_ms());
+
+		if (timeout <= 0)
+			return 0;
+
+		nr_events = epoll_wait(http->conn.epfd, &ev, 1, (int)timeout);
+
+		if (nr_events < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			_log("epoll_wait error (%s)\n", strerror(errno));
+			return -1;
+		}
+
+		if (!nr_events)
+			return 0;
+
+		break;
+	}
+
+	if (ev.events & EPOLLIN)
+		mask |= HTTP_WAIT_READABLE;
+
+	if (ev.events & (EPOLLRDHUP|EPOLLHUP|EPOLLERR))
+		mask |= (HTTP_WAIT_CLOSED|HTTP_WAIT_READABLE);
+
+	return mask;
+}
+
+/**
+ * http_wait_writable - sleep until the socket can be written to or the deadline passes
+ * @http: our HTTP object
+ * @deadline: absolute CLOCK_MONOTONIC time in milliseconds
+ *
+ * The socket is watched for writing only while we wait. Returns
+ * 1 if it is writable (or the peer hung up), 0 on timeout or -1.
+ */
+static int
+http_wait_writable(struct http_t *http, long deadline)
+{
+	assert(http);
+
+	struct epoll_event ev;
+	long timeout;
+	int nr_events = 0;
+
+	clear_struct(&ev);
+	ev.events = EPOLLOUT|EPOLLRDHUP;
+	ev.data.fd = http_socket(http);
+
+	if (epoll_ctl(http->conn.epfd, EPOLL_CTL_MOD, http_socket(http), &ev) < 0)
+	{
+		_log("epoll_ctl error (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	while (1)
+	{
+		timeout = (deadline - http_now_ms());
+
+		if (timeout <= 0)
+			break;
+
+		nr_events = epoll_wait(http->conn.epfd, &ev, 1, (int)timeout);
+
+		if (nr_events < 0 && errno == EINTR)
+			continue;
+
+		break;
+	}
+
+	if (nr_events < 0)
+		_log("epoll_wait error (%s)\n", strerror(errno));
+
+	ev.events = EPOLLIN|EPOLLRDHUP;
+	ev.data.fd = http_socket(http);
+
+	if (epoll_ctl(http->conn.epfd, EPOLL_CTL_MOD, http_socket(http), &ev) < 0)
+	{
+		_log("epoll_ctl error (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	if (nr_events < 0)
+		return -1;
+
+	return (nr_events > 0);
+}
+
+/**
+ * http_recv - read whatever is available on the connection, waiting if need be
+ * @http: our HTTP object
+ * @buf: the buffer to append to
+ * @toread: size hint for the read
+ * @deadline: absolute CLOCK_MONOTONIC time in milliseconds
+ *
+ * Returns the number of bytes read, 0 if the peer closed the
+ * connection, HTTP_OPERATION_TIMEOUT or -1 on error.
+ */
+ssize_t
+http_recv(struct http_t *http, buf_t *buf, size_t toread, long deadline)
+{
+	assert(http);
+	assert(buf);
+
+	ssize_t n;
+	int closed = 0;
+	int mask;
+
+	while (1)
+	{
+		if (http->usingSecure)
+			n = buf_read_tls(http_tls(http), buf, toread);
+		else
+			n = buf_read_socket(http_socket(http), buf, toread);
+
+		if (n != 0)
+			return n;
+
+	/*
+	 * Nothing read after the kernel told us the peer
+	 * hung up: there is nothing more coming.
+	 */
+		if (closed)
+			return 0;
+
+		mask = http_wait_readable(http, deadline);
+
+		if (mask < 0)
+			return -1;
+
+		if (!mask)
+			return HTTP_OPERATION_TIMEOUT;
+
+		if (mask & HTTP_WAIT_CLOSED)
+			closed = 1;
+	}
+
+	return -1;
+}
+
+/**
+ * read_until_eoh - read and parse the response header
+ * @http: our HTTP object
+ * @hp: header parser state (zeroed by the caller)
+ * @p: pointed to the start of the body on return
+ *
+ * Header fields are put into the headers bucket as
+ * each line completes.
+ */
+static int
+read_until_eoh(struct http_t *http, struct header_parser *hp, char **p)
+{
+	assert(http);
+	assert(hp);
+
+	ssize_t n;
+	int bytes = 0;
+	int rv;
+	buf_t *buf = &http->conn.read_buf;
+	struct HTTP_private *private = (struct HTTP_private *)http;
+	long deadline = (http_now_ms() + HTTP_READ_TIMEOUT_MS);
+
+	_log("In read_until_eoh\n");
+
+	BUCKET_reset_buckets(private->headers, 0);
+	assert(0 == private->headers->nr_buckets_used);
+
+	while (1)
+	{
+		n = http_recv(http, buf, HTTP_SMALL_READ_BLOCK, deadline);
+
+		if (HTTP_OPERATION_TIMEOUT == n)
+		{
+			_log("Timed out waiting for response header\n");
+			return HTTP_OPERATION_TIMEOUT;
+		}
+
+		if (n <= 0)
+		{
+			_log("http_recv returned %ld...\n", (long)n);
+			return -1;
+		}
+
+		_log("read %d bytes\n", n);
+
+		bytes += (int)n;
+
+		rv = http_parse_header(http, hp);
+
+		if (rv < 0)
+		{
+			_log("Not a valid HTTP response header\n");
+			return -1;
+		}
+
+		if (rv)
+			break;
+	}
+
+	*p = (buf->buf_head + hp->scan);
+
+	_log("Returning %d bytes\n", bytes);
+	return bytes;
+}
+
+#ifdef DEBUG
+static void
+__dump_buf(buf_t *buf)
+{
 	assert(buf);
 
 	int fd = -1;
@@ -852,8 +1369,14 @@ __dump_buf(buf_t *buf)
 }
 #endif
 
+/**
+ * read_bytes_timeout - read at least TOREAD bytes unless the peer closes or time runs out
+ * @http: our HTTP object
+ * @toread: the number of bytes we want
+ * @timeout_ms: how long we are prepared to wait in total
+ */
 static ssize_t
-read_bytes(struct http_t *http, size_t toread)
+read_bytes_timeout(struct http_t *http, size_t toread, int timeout_ms)
 {
 	assert(http);
 	assert(toread > 0);
@@ -861,42 +1384,38 @@ read_bytes(struct http_t *http, size_t toread)
 	ssize_t n;
 	size_t read = 0;
 	size_t r = toread;
-	buf_t *buf = &http->conn.read_buf;
-	register int cycles = 0;
+	long deadline = (http_now_ms() + timeout_ms);
 
-/*
- * XXX
- *
- * CYCLES_MAX is our crude way of
- * deciding we have timed out.
- */
 	while (r)
 	{
-		++cycles;
-		if (cycles > CYCLES_MAX)
+		n = http_recv(http, &http->conn.read_buf, r, deadline);
+
+		if (n == -1)
+			return -1;
+
+		if (n <= 0)
 			break;
 
-		if (http->usingSecure)
-			n = buf_read_tls(http_tls(http), buf, r);
-		else
-			n = buf_read_socket(http_socket(http), buf, r);
+		read += n;
 
-		if (n < 0)
-			return -1;
-		else
-		if (!n)
-			continue;
+		if ((size_t)n >= r)
+			r = 0;
 		else
-		{
 			r -= n;
-			read += n;
-		}
 	}
 
 	return read;
 }
 
-#define HTTP_MAX_CHUNK_STR 10
+static ssize_t
+read_bytes(struct http_t *http, size_t toread)
+{
+	return read_bytes_timeout(http, toread, HTTP_READ_TIMEOUT_MS);
+}
+
+#define HTTP_CHUNK_READ_BLOCK 16384
+#define HTTP_STREAM_READ_BLOCK 16384
+#define HTTP_MAX_CHUNK_DIGITS 16
 
 /*
  * In chunked transfer encoding, the data is sent in chunks
@@ -905,105 +1424,525 @@ read_bytes(struct http_t *http, size_t toread)
  * dynamically and therefore the HTTP server cannot send
  * a Content-Length header.
  *
- * The data is encoding thus:
+ * The data is encoded thus:
  *
- * \r\n[CHUNKSIZE]\r\n...DATA...\r\n[CHUNKSIZE]\r\n...DATA...\r\n0\r\n
+ * [CHUNKSIZE][;ext]\r\n...DATA...\r\n[CHUNKSIZE]\r\n...DATA...\r\n0\r\n[trailers]\r\n
  *
+ * Rather than collapsing the buffer around each chunk header,
+ * we feed whatever the socket gives us through a small state
+ * machine and append only the payload bytes to the body, so
+ * each byte is copied once however many chunks there are.
  */
-static void
-read_until_next_chunk_size(struct http_t *http, buf_t *buf, char **cur_pos)
+enum chunk_state
 {
-	assert(http);
-	assert(buf);
-	assert(cur_pos);
-	assert(buf_integrity(buf));
+	CHUNK_SIZE = 0,	/* Hex digits of the chunk size */
+	CHUNK_EXT,	/* Chunk extensions up to the end of the size line */
+	CHUNK_DATA,	/* Payload bytes of the current chunk */
+	CHUNK_DATA_END,	/* The \r\n after the payload */
+	CHUNK_TRAILER,	/* Start of a trailer line (or the final \r\n) */
+	CHUNK_TRAILER_LINE,	/* Inside a trailer field we ignore */
+	CHUNK_TRAILER_END,	/* The \n of the final empty line */
+	CHUNK_DONE
+};
 
-	off_t cur_pos_off = (*cur_pos - buf->buf_head);
-	char *q;
-	char *tail = buf->buf_tail;
+struct chunk_decoder
+{
+	enum chunk_state state;
+	size_t remaining; /* Payload bytes left in the current chunk */
+	int nr_digits;
+};
 
 /*
- * We want to produce the following state:
- *
- *        \r\n[CHUNKSIZE]\r\n
- *        ^
- *     CUR_POS
- *
- * We may already have this in our buffer
- * and therefore simply need to point
- * CUR_POS accordingly.
- *
- * Otherwise, do small reads until
- * we have the metadata.
+ * Content-Encoding. The body is inflated on its way into the
+ * read buffer, so the read buffer only ever holds plain HTML
+ * and nothing after the receive path needs to know the
+ * transfer was compressed.
  */
+#define HTTP_INFLATE_MIN_SLACK 4096
 
-	if (*cur_pos < tail)
-	{
-		if (**cur_pos == 0x0d)
-		{
-			while ((**cur_pos == 0x0d || **cur_pos == 0x0a) && *cur_pos < tail)
-				++(*cur_pos);
+static int
+__coding_is(bucket_t *bucket, const char *name)
+{
+	size_t len = strlen(name);
 
-			if (*cur_pos != tail)
-			{
-				q = *cur_pos;
+	return (bucket->data_len == len && !strncasecmp((char *)bucket->data, name, len));
+}
 
-				while (*q != 0x0d && q < tail)
-					++q;
+/**
+ * http_decoder_end - release the content decoder of the current response
+ * @http: our HTTP object
+ */
+static void
+http_decoder_end(struct http_t *http)
+{
+	assert(http);
 
-			/*
-			 * Then we don't need to do
-			 * anymore reads. We have already
-			 * got \r\n[CHUNKSIZE]\r\n in the
-			 * buffer.
-			 *
-			 * Adjust CUR_POS to point to the
-			 * carriage return immediately after
-			 * the final byte of the previous
-			 * chunk.
-			 */
-				if (q != tail)
-				{
-					*cur_pos -= 2;
-					return;
-				}
-			}
-		}
+	struct content_decoder *dec = &(HTTP_private(http))->decoder;
+
+	if (!dec->active)
+		return;
+
+	switch(dec->coding)
+	{
+		case CODING_GZIP:
+		case CODING_DEFLATE:
+			inflateEnd(&dec->zs);
+			break;
+#ifdef HAVE_BROTLI
+		case CODING_BROTLI:
+			BrotliDecoderDestroyInstance(dec->br);
+			break;
+#endif
+		default:
+			break;
 	}
 
-/*
- * We enter this function having pointed CUR_POS
- * to START_OF_PREVIOUS_CHUNK + PREVIOUS_CHUNK_SIZE.
- * We need at least two bytes here to get the \r\n
- * at the start of the metadata.
+	if (!dec->finished)
+		_log("%s: compressed body ended before the end of the stream\n", __func__);
+
+	clear_struct(dec);
+
+	return;
+}
+
+/**
+ * http_decoder_start - set up a content decoder from the Content-Encoding header
+ * @http: our HTTP object
  *
- * NB - everytime we do a read, the location of
- * our buffer on the heap may change due to a
- * transparent realloc(). So we need to re-point
- * TAIL and *CUR_POS afterwards.
+ * Returns -1 if the server used a coding we did not ask for.
  */
-	read_bytes(http, 2);
-	*cur_pos = (buf->buf_head + cur_pos_off);
-	tail = buf->buf_tail;
-	*cur_pos += 2;
-	cur_pos_off += 2;
+static int
+http_decoder_start(struct http_t *http)
+{
+	assert(http);
 
-	while (1)
+	struct HTTP_private *private = HTTP_private(http);
+	struct content_decoder *dec = &private->decoder;
+	bucket_t *bucket;
+	int window_bits;
+
+	http_decoder_end(http);
+
+	bucket = BUCKET_get_bucket(private->headers, "content-encoding");
+
+	if (!bucket || __coding_is(bucket, "identity"))
+		return 0;
+
+	if (__coding_is(bucket, "gzip") || __coding_is(bucket, "x-gzip"))
+	{
+		dec->coding = CODING_GZIP;
+		window_bits = (MAX_WBITS + 16);
+	}
+	else
+	if (__coding_is(bucket, "deflate"))
+	{
+		dec->coding = CODING_DEFLATE;
+		window_bits = MAX_WBITS;
+	}
+#ifdef HAVE_BROTLI
+	else
+	if (__coding_is(bucket, "br"))
+	{
+		dec->coding = CODING_BROTLI;
+
+		if (!(dec->br = BrotliDecoderCreateInstance(NULL, NULL, NULL)))
+			goto fail;
+
+		dec->active = 1;
+		return 0;
+	}
+#endif
+	else
+	{
+		_log("%s: unsupported content coding \"%.*s\"\n",
+			__func__, (int)bucket->data_len, (char *)bucket->data);
+		goto fail;
+	}
+
+	if (inflateInit2(&dec->zs, window_bits) != Z_OK)
+		goto fail;
+
+	dec->active = 1;
+	return 0;
+
+fail:
+	clear_struct(dec);
+	return -1;
+}
+
+/*
+ * Make sure there is room to decompress into at the tail
+ * of BUF; buf_reserve() grows it geometrically, so a large
+ * article costs a logarithmic number of reallocs.
+ */
+static int
+__decoder_out_space(buf_t *buf)
+{
+	return buf_reserve(buf, HTTP_INFLATE_MIN_SLACK);
+}
+
+/**
+ * http_decoder_write - decompress body bytes into the read buffer
+ * @http: our HTTP object
+ * @data: compressed bytes
+ * @len: number of bytes
+ */
+static int
+http_decoder_write(struct http_t *http, char *data, size_t len)
+{
+	assert(http);
+
+	struct content_decoder *dec = &(HTTP_private(http))->decoder;
+	buf_t *buf = &http->conn.read_buf;
+	size_t slack;
+	size_t produced;
+
+	if (dec->finished)
+		return 0;
+
+#ifdef HAVE_BROTLI
+	if (CODING_BROTLI == dec->coding)
+	{
+		const uint8_t *next_in = (const uint8_t *)data;
+		size_t avail_in = len;
+		uint8_t *next_out;
+		size_t avail_out;
+		BrotliDecoderResult res;
+
+		while (1)
+		{
+			if (__decoder_out_space(buf) < 0)
+				return -1;
+
+			slack = (buf->buf_end - buf->buf_tail) - 1;
+			next_out = (uint8_t *)buf->buf_tail;
+			avail_out = slack;
+
+			res = BrotliDecoderDecompressStream(dec->br,
+					&avail_in, &next_in, &avail_out, &next_out, NULL);
+
+			buf_pull_tail(buf, (slack - avail_out));
+
+			if (BROTLI_DECODER_RESULT_SUCCESS == res)
+			{
+				dec->finished = 1;
+				break;
+			}
+
+			if (BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT == res)
+				continue;
+
+			if (BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT == res)
+				break;
+
+			_log("%s: brotli error (%s)\n", __func__,
+				BrotliDecoderErrorString(BrotliDecoderGetErrorCode(dec->br)));
+			return -1;
+		}
+
+		BUF_NULL_TERMINATE(buf);
+		return 0;
+	}
+#endif
+
+	z_stream *zs = &dec->zs;
+	int first = (0 == zs->total_in);
+	int rv;
+
+	zs->next_in = (Bytef *)data;
+	zs->avail_in = (uInt)len;
+
+	while (zs->avail_in)
 	{
-		read_bytes(http, 1);
-		tail = buf->buf_tail;
-		*cur_pos = (buf->buf_head + cur_pos_off);
-		q = memchr(*cur_pos, 0x0a, (tail - *cur_pos));
-		if (q)
+		if (__decoder_out_space(buf) < 0)
+			return -1;
+
+		slack = (buf->buf_end - buf->buf_tail) - 1;
+		zs->next_out = (Bytef *)buf->buf_tail;
+		zs->avail_out = (uInt)slack;
+
+		rv = inflate(zs, Z_NO_FLUSH);
+
+		produced = (slack - zs->avail_out);
+		buf_pull_tail(buf, produced);
+
+		if (Z_STREAM_END == rv)
 		{
-			*cur_pos -= 2;
+			dec->finished = 1;
 			break;
 		}
+
+	/*
+	 * "deflate" is meant to be zlib-wrapped but some
+	 * servers send a raw deflate stream; if the very
+	 * first bytes do not parse, start again raw.
+	 */
+		if (Z_DATA_ERROR == rv
+		&& CODING_DEFLATE == dec->coding
+		&& first && !dec->raw_deflate)
+		{
+			if (inflateReset2(zs, -MAX_WBITS) != Z_OK)
+				return -1;
+
+			dec->raw_deflate = 1;
+			zs->next_in = (Bytef *)data;
+			zs->avail_in = (uInt)len;
+			continue;
+		}
+
+		if (Z_OK != rv && !(Z_BUF_ERROR == rv && !produced && zs->avail_in))
+		{
+			_log("%s: inflate error (%s)\n", __func__, zs->msg ? zs->msg : "unknown");
+			return -1;
+		}
+	}
+
+	BUF_NULL_TERMINATE(buf);
+	return 0;
+}
+
+/**
+ * http_body_flush - hand the body received so far to the body sink
+ * @http: our HTTP object
+ *
+ * When streaming, the body bytes after the header are given
+ * to the sink and dropped, so the read buffer only ever holds
+ * the header and the last block we read.
+ */
+static int
+http_body_flush(struct http_t *http)
+{
+	assert(http);
+
+	struct HTTP_private *private = HTTP_private(http);
+	buf_t *buf = &http->conn.read_buf;
+	char *body = (buf->buf_head + private->body_off);
+	size_t len;
+
+	if (!private->streaming || body >= buf->buf_tail)
+		return 0;
+
+	len = (buf->buf_tail - body);
+
+	if (http->body_sink(http->body_sink_arg, body, len) < 0)
+	{
+		_log("%s: body sink failed\n", __func__);
+		return -1;
 	}
 
+	buf_snip(buf, len);
+
+	return 0;
+}
+
+/**
+ * http_body_start - note where the body starts and whether to stream it
+ * @http: our HTTP object
+ * @body: start of the body in the read buffer
+ * @stream: non-zero if this body is the one the caller asked for
+ */
+static void
+http_body_start(struct http_t *http, char *body, int stream)
+{
+	struct HTTP_private *private = HTTP_private(http);
+
+	private->streaming = (stream && http->body_sink);
+	private->body_off = (body - http->conn.read_buf.buf_head);
+
 	return;
 }
 
+/**
+ * http_body_append - append decoded body bytes to the response buffer
+ * @http: our HTTP object
+ * @data: the bytes to append
+ * @len: number of bytes
+ *
+ * Every body byte of a chunked or compressed response goes
+ * through here.
+ */
+static int
+http_body_append(struct http_t *http, char *data, size_t len)
+{
+	assert(http);
+
+	buf_t *buf = &http->conn.read_buf;
+	size_t used = buf_used(buf);
+
+	if (!len)
+		return 0;
+
+	if ((HTTP_private(http))->decoder.active)
+	{
+		if (http_decoder_write(http, data, len) < 0)
+			return -1;
+
+		return http_body_flush(http);
+	}
+
+	buf_append_ex(buf, data, len);
+
+	if ((size_t)buf_used(buf) != (used + len))
+		return -1;
+
+	return http_body_flush(http);
+}
+
+static int
+__chunk_hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+
+	c = tolower(c);
+
+	if (c >= 'a' && c <= 'f')
+		return (c - 'a') + 10;
+
+	return -1;
+}
+
+/**
+ * http_chunk_decode - run received bytes through the chunk decoder
+ * @http: our HTTP object
+ * @dec: the decoder state carried between reads
+ * @data: the raw bytes from the connection
+ * @len: number of raw bytes
+ *
+ * Returns the number of payload bytes appended to the body,
+ * or -1 if the encoding is malformed.
+ */
+static ssize_t
+http_chunk_decode(struct http_t *http, struct chunk_decoder *dec, char *data, size_t len)
+{
+	assert(http);
+	assert(dec);
+
+	char *p = data;
+	char *end = (data + len);
+	size_t run;
+	ssize_t appended = 0;
+	int v;
+
+	while (p < end && dec->state != CHUNK_DONE)
+	{
+		switch(dec->state)
+		{
+			case CHUNK_SIZE:
+
+				if ((v = __chunk_hex_value(*p)) >= 0)
+				{
+					if (++(dec->nr_digits) > HTTP_MAX_CHUNK_DIGITS)
+						goto fail;
+
+					dec->remaining = ((dec->remaining << 4) | (size_t)v);
+					++p;
+					break;
+				}
+
+				if (!dec->nr_digits)
+					goto fail;
+
+				dec->state = CHUNK_EXT;
+				/* fall through */
+
+			case CHUNK_EXT:
+
+				if (*p++ != 0x0a)
+					break;
+
+				dec->nr_digits = 0;
+
+				if (dec->remaining)
+					dec->state = CHUNK_DATA;
+				else
+					dec->state = CHUNK_TRAILER;
+
+				break;
+
+			case CHUNK_DATA:
+
+				run = (size_t)(end - p);
+
+				if (run > dec->remaining)
+					run = dec->remaining;
+
+				if (http_body_append(http, p, run) < 0)
+					goto fail;
+
+				p += run;
+				appended += run;
+				dec->remaining -= run;
+
+				if (!dec->remaining)
+					dec->state = CHUNK_DATA_END;
+
+				break;
+
+			case CHUNK_DATA_END:
+
+				if (*p == 0x0d)
+				{
+					++p;
+					break;
+				}
+
+				if (*p++ != 0x0a)
+					goto fail;
+
+				dec->state = CHUNK_SIZE;
+				break;
+
+			case CHUNK_TRAILER:
+
+				if (*p == 0x0d)
+				{
+					++p;
+					dec->state = CHUNK_TRAILER_END;
+					break;
+				}
+
+				if (*p++ == 0x0a)
+				{
+					dec->state = CHUNK_DONE;
+					break;
+				}
+
+				dec->state = CHUNK_TRAILER_LINE;
+				break;
+
+			case CHUNK_TRAILER_LINE:
+
+				if (!(p = memchr(p, 0x0a, (end - p))))
+				{
+					p = end;
+					break;
+				}
+
+				++p;
+				dec->state = CHUNK_TRAILER;
+				break;
+
+			case CHUNK_TRAILER_END:
+
+				if (*p++ != 0x0a)
+					goto fail;
+
+				dec->state = CHUNK_DONE;
+				break;
+
+			default:
+				goto fail;
+		}
+	}
+
+	return appended;
+
+fail:
+	_log("%s: malformed chunked encoding (state %d)\n", __func__, (int)dec->state);
+	return -1;
+}
+
 /**
  * Obsolete from HTTP 2.0
  *
@@ -1014,205 +1953,191 @@ read_until_next_chunk_size(struct http_t *http, buf_t *buf, char **cur_pos)
  * use a script in a CGI bin and so the length
  * of the output data is variable.
  *
- * Data is sent in chunks, with each chunk
- * preceded by metadata indicating the size
- * of the chunk of data to receive.
- *
- * Ends with sequence \r\n0\r\n
+ * Whatever followed the header (from P) in our read buffer
+ * is moved to the raw buffer and decoded; the read
+ * buffer is cut back to the end of the header and
+ * the decoded body is appended after it. After that
+ * we read in large blocks straight into the raw
+ * buffer until the decoder sees the last chunk.
+ */
+static ssize_t
+do_chunked_recv(struct http_t *http, char *p)
+{
+	assert(http);
+	assert(p);
+	buf_t *buf = &http->conn.read_buf;
+	buf_t *raw = &http->conn.raw_buf;
+	struct chunk_decoder dec;
+	size_t overread;
+	ssize_t n;
+	ssize_t total_bytes = 0;
+
+	clear_struct(&dec);
+	buf_clear(raw);
+
+	overread = (buf->buf_tail - p);
+
+	if (overread)
+	{
+		buf_append_ex(raw, p, overread);
+		buf_snip(buf, overread);
+	}
+
+	while (1)
+	{
+		if (buf_used(raw))
+		{
+			n = http_chunk_decode(http, &dec, raw->buf_head, buf_used(raw));
+
+#ifdef DEBUG
+			if (n < 0)
+				__dump_buf(raw);
+#endif
+
+			if (n < 0)
+				return -1;
+
+			total_bytes += n;
+			buf_snip(raw, buf_used(raw));
+		}
+
+		if (CHUNK_DONE == dec.state)
+			break;
+
+		n = http_recv(http, raw, HTTP_CHUNK_READ_BLOCK, (http_now_ms() + HTTP_READ_TIMEOUT_MS));
+
+		if (HTTP_OPERATION_TIMEOUT == n)
+		{
+			_log("%s: timed out in the middle of a chunked body\n", __func__);
+			return -1;
+		}
+
+		if (n <= 0)
+		{
+			_log("%s: connection closed in the middle of a chunked body\n", __func__);
+			return -1;
+		}
+	}
+
+	_log("Returning %ld from %s\n", (long)total_bytes, __func__);
+	return total_bytes;
+}
+
+/**
+ * do_decoded_recv - receive a Content-Length body that needs decoding
+ * @http: our HTTP object
+ * @p: start of the body in the read buffer
+ * @clen: length of the encoded body
  *
+ * Like the chunked path, the encoded bytes are gathered in the
+ * raw buffer and the decoded body is appended after the header.
  */
-static size_t
-do_chunked_recv(struct http_t *http)
+static ssize_t
+do_decoded_recv(struct http_t *http, char *p, size_t clen)
 {
 	assert(http);
+	assert(p);
 
-	char *p;
-	char *e;
-	off_t chunk_offset;
 	buf_t *buf = &http->conn.read_buf;
-	size_t chunk_size;
-	size_t save_size;
-	size_t overread;
-	size_t total_bytes = 0;
-	static char tmp[HTTP_MAX_CHUNK_STR];
-	char *t;
-	size_t range;
-#if 0
-#ifndef DEBUG
-	char *t;
-	size_t range;
-#else
-	int chunk_nr = 0;
-#endif
-#endif
+	buf_t *raw = &http->conn.raw_buf;
+	size_t received = (buf->buf_tail - p);
+	ssize_t n;
 
-	p = HTTP_EOH(buf);
+	buf_snip(raw, buf_used(raw));
 
-	while (!p)
+	if (received)
 	{
-		total_bytes += read_bytes(http, 1);
-		p = HTTP_EOH(buf);
-	}
+		buf_append_ex(raw, p, (received < clen ? received : clen));
+		buf_snip(buf, received);
 
-	if (!p)
-	{
-		fprintf(stderr, "do_chunked_recv: failed to find end of header sentinel\n");
-		return -1;
+		if (received > clen)
+			received = clen;
 	}
 
-	read_until_next_chunk_size(http, buf, &p);
-
 	while (1)
 	{
-/*
- * Skip the first \r\n in "\r\nchunk_size\r\n"
- * and collapse the buffer so we now have
- * "chunk_size\r\n"
- */
-		t = p;
-		SKIP_CRNL(p);
-
-		range = (p - t);
-		if (range)
+		if (received > clen)
 		{
-			buf_collapse(buf, (off_t)(t - buf->buf_head), range);
-			p = t;
+			buf_snip(raw, (received - clen));
+			received = clen;
 		}
-#if 0
-		++chunk_nr;
-		_log("Chunk #%d\n", chunk_nr);
-		SKIP_CRNL(p);
-#endif
-
-		e = memchr(p, 0x0d, HTTP_MAX_CHUNK_STR);
 
-		if (!e)
+		if (buf_used(raw))
 		{
-			_log("%s: failed to find next carriage return\n", __func__);
-
-#ifdef DEBUG
-			int i;
-
-			__dump_buf(buf);
-
-			p -= 32;
+			if (http_body_append(http, raw->buf_head, buf_used(raw)) < 0)
+				return -1;
 
-			for (i = 0; i < 64; ++i)
-				_log("%02hhx ", p[i]);
-
-			_log("\n");
+			buf_snip(raw, buf_used(raw));
+		}
 
-			_log("%.*s\n", (int)64, p);
+		if (received >= clen)
+			break;
 
-			_log(
-					"BUF_SIZE=%lu bytes\n"
-					"END - DATA = %lu bytes\n"
-					"TAIL - HEAD = %lu bytes\n"
-					"HEAD @ %p\n"
-					"TAIL @ %p\n"
-					"END @ %p\n",
-					buf->buf_size,
-					(buf->buf_end - buf->data),
-					(buf->buf_tail - buf->buf_head),
-					buf->buf_head,
-					buf->buf_tail,
-					buf->buf_end);
-#endif
+		n = http_recv(http, raw, (clen - received), (http_now_ms() + HTTP_READ_TIMEOUT_MS));
 
+		if (n <= 0 || HTTP_OPERATION_TIMEOUT == n)
+		{
+			_log("%s: connection closed or timed out with %lu bytes of body outstanding\n",
+				__func__, (clen - received));
 			return -1;
 		}
 
-/*
- * Now we have chunk_size\r\n
- *             ^         ^
- *             p         e
- */
-		strncpy(tmp, p, (e - p));
-		tmp[e - p] = 0;
-
-		chunk_size = strtoul(tmp, NULL, 16);
+		received += n;
+	}
 
-#ifdef DEBUG
-		_log("%sCHUNK SIZE=%lu BYTES%s\n", COL_ORANGE, chunk_size, COL_END);
-#endif
+	return (ssize_t)clen;
+}
 
-		if (!chunk_size)
-		{
-/*
- * Then we just dealt with the last chunk and there are no more to come.
- * Collapse the buffer to get rid of the final "0\r\n" sequence.
+/**
+ * do_streamed_recv - receive a plain Content-Length body into the body sink
+ * @http: our HTTP object
+ * @overread: body bytes that came in with the header
+ * @clen: length of the body
+ *
+ * Read a block at a time and pass each one on, rather
+ * than reading the whole body into the buffer first.
  */
-			--p;
-			buf_collapse(buf, (off_t)(p - buf->buf_head), (buf->buf_tail - p));
-			break;
-		}
+static ssize_t
+do_streamed_recv(struct http_t *http, size_t overread, size_t clen)
+{
+	assert(http);
 
-/*
- * Save the chunk size here because below we may find we already received
- * some of the chunk data, so we will do chunk_size - overread, but we
- * later need to calculate the position BUFFER START + CHUNK OFFSET +
- * CHUNK SIZE, so we need to save this.
- */
-		save_size = chunk_size;
-		total_bytes += save_size;
+	size_t received = overread;
+	size_t want;
+	ssize_t n;
 
-/*
- * Do not use SKIP_CRNL() here, because the first few bytes of data
- * after the \r\nCHUNK_SIZE\r\n could well be one or more \r / \n
- * chars. This would result in jumping too far when we go forward
- * CHUNK_SIZE bytes from start of the chunk data.
- */
-		e += 2;
+	if (received > clen)
+	{
+		buf_snip(&http->conn.read_buf, (received - clen));
+		received = clen;
+	}
 
-		buf_collapse(buf, (off_t)(p - buf->buf_head), (e - p));
-		e = p;
+	if (http_body_flush(http) < 0)
+		return -1;
 
-/*
- * Save the offset from the start of the buffer of the chunk data,
- * since reading more data into the buffer can result in a
- * realloc(), which may move our buffer data elsewhere on the heap.
- * So use this to make sure our pointer is pointing in the right
- * place on the heap by doing start of buffer + offset later.
- */
-		chunk_offset = (e - buf->buf_head);
-		overread = (buf->buf_tail - e);
+	while (received < clen)
+	{
+		want = (clen - received);
 
-/*
- * Check if we already received some of the chunk data.
- */
-		if (overread >= chunk_size)
-		{
-			p = (e + save_size);
-			read_until_next_chunk_size(http, buf, &p);
-		}
-		else
+		if (want > HTTP_STREAM_READ_BLOCK)
+			want = HTTP_STREAM_READ_BLOCK;
+
+		n = read_bytes(http, want);
+
+		if (n <= 0)
 		{
-			chunk_size -= overread;
+			_log("%s: connection closed or timed out with %lu bytes of body outstanding\n",
+				__func__, (clen - received));
+			return -1;
 		}
 
-		read_bytes(http, chunk_size);
-
-#if 0
-/*
- * Every now and again, we get stuck trying to read more bytes
- * (somehow) even though we already actually have gotten all
- * the data (we have </html>[\r\n]). So just break if we have
- * the closing html tag.
- */
-		if (strstr(buf->buf_head, "</html>"))
-			break;
-#endif
+		received += n;
 
-/*
- * After this, P should be pointing to where the initial
- * \r is/will be in the "\r\nchunk_size\r\n" sequence.
- */
-		p = (buf->buf_head + chunk_offset + save_size);
-		read_until_next_chunk_size(http, buf, &p);
+		if (http_body_flush(http) < 0)
+			return -1;
 	}
 
-	_log("Returning %lu from %s\n", total_bytes, __func__);
-	return total_bytes;
+	return (ssize_t)clen;
 }
 
 /**
@@ -1319,7 +2244,7 @@ _drain_socket(struct http_t *http)
 	_log("Draining socket\n");
 	while (1)
 	{
-		ret = read_bytes(http, block);
+		ret = read_bytes_timeout(http, block, HTTP_DRAIN_TIMEOUT_MS);
 		if (ret < block || 0 == ret)
 			break;
 		_log("Drained %ld bytes from socket\n", ret);
@@ -1341,7 +2266,6 @@ recv_response_1_1(struct http_t *http)
 	size_t clen;
 	size_t overread;
 	ssize_t bytes;
-	int retVal = -1;
 	int code = 0;
 	int total_bytes = 0;
 	int needResend = 0;
@@ -1350,6 +2274,7 @@ recv_response_1_1(struct http_t *http)
 	//http_header_t *transfer_enc = NULL;
 	buf_t *buf = &http->conn.read_buf;
 	struct HTTP_private *private = HTTP_private(http);
+	struct header_parser hp;
 
 /*
  * Set the (ssl) socket to non-blocking.
@@ -1375,8 +2300,10 @@ rp_receive:
  * entered.
  */
 	p = NULL;
+	clear_struct(&hp);
+	private->streaming = 0;
 
-	bytes = read_until_eoh(http, &p);
+	bytes = read_until_eoh(http, &hp, &p);
 
 	_log(http->conn.read_buf.buf_head);
 
@@ -1388,14 +2315,12 @@ rp_receive:
 
 	total_bytes += bytes;
 
-	code = http_status_code_int(buf);
+	code = hp.code;
 	_log("got status code %d\n", code);
 
 	http->code = code;
 
-	int _rv = parse_response_header_1_1(http);
-	if (0 > _rv)
-		return -1;
+	parse_cookies(http);
 
 /*
  * With HEAD, always send back the code
@@ -1406,6 +2331,14 @@ rp_receive:
 	if (HEAD == http->verb)
 		goto out;
 
+/*
+ * No body follows these (RFC 7230 3.3.3).
+ */
+	if ((code >= 100 && code < 200)
+	|| HTTP_NO_CONTENT == code
+	|| HTTP_NOT_MODIFIED == code)
+		goto out;
+
 /*
  * Check for a URL redirect status code.
  * Regardless of the status code, we
@@ -1424,160 +2357,349 @@ rp_receive:
 
 			if (!http->followRedirects)
 				break;
-/*
- * Cache the URL that caused the redirect.
- */
-			memcpy((void *)tmpURL, (void *)http->URL, strlen(http->URL));
-			tmpURL[strlen(http->URL)] = 0;
+/*
+ * Cache the URL that caused the redirect.
+ */
+			memcpy((void *)tmpURL, (void *)http->URL, strlen(http->URL));
+			tmpURL[strlen(http->URL)] = 0;
+
+			if (set_new_location(http) < 0)
+			{
+				_log("set_new_location() returned < 0\n");
+				goto fail;
+			}
+
+			_log("Old location: %s - New location: %s\n", tmpURL, http->URL);
+
+			buf_clear(&http->conn.write_buf);
+			assert(http_wbuf(http).data_len == 0);
+
+		/*
+		 * Still need to receive the body of the HTML page
+		 * that comes with the redirect header.
+		 */
+			if (!strcmp(tmpURL, http->URL))
+			{
+			/*
+			 * Only for this run: a page that redirects to
+			 * itself may well be fixed by the next.
+			 */
+				redirect_map_add(tmpURL, "", 0);
+				needResend = 0;
+			}
+			else
+			{
+				redirect_map_add(tmpURL, http->URL, (HTTP_MOVED_PERMANENTLY == code));
+				needResend = 1;
+			}
+
+			break;
+	}
+
+	if (http_decoder_start(http) < 0)
+		goto fail;
+
+	http_body_start(http, p, (HTTP_OK == code && !needResend));
+
+	bucket_t *bucket = NULL;
+	bucket = BUCKET_get_bucket(private->headers, "transfer-encoding");
+
+	if (bucket && !strcasecmp((char *)bucket->data, "chunked"))
+	{
+		if (do_chunked_recv(http, p) == -1)
+		{
+			_log("do_chunked_recv() returned -1\n");
+			goto fail;
+		}
+
+		goto done_reading;
+	}
+
+	bucket = BUCKET_get_bucket(private->headers, "content-length");
+
+	if (bucket)
+	{
+		clen = strtoul((char *)bucket->data, NULL, 0);
+
+		overread = (buf->buf_tail - p);
+
+		if (private->decoder.active)
+		{
+			if (do_decoded_recv(http, p, clen) == -1)
+			{
+				_log("do_decoded_recv() returned -1\n");
+				goto fail;
+			}
+		}
+		else
+		if (private->streaming)
+		{
+			if (do_streamed_recv(http, overread, clen) == -1)
+			{
+				_log("do_streamed_recv() returned -1\n");
+				goto fail;
+			}
+		}
+		else
+		if (overread < clen)
+		{
+			clen -= overread;
+
+		/*
+		 * Make room for the whole body now, so that the
+		 * download costs at most the one realloc.
+		 */
+			if (buf_reserve(buf, clen) < 0)
+				goto fail;
+
+			bytes = read_bytes(http, clen);
+
+			if (bytes < 0)
+			{
+				_log("read_bytes() returned %ld\n", (long)bytes);
+				goto fail;
+			}
+
+			total_bytes += (int)bytes;
+
+			if ((size_t)bytes < clen)
+			{
+				_log("Connection closed or timed out with %lu bytes of body outstanding\n", clen - bytes);
+				goto fail;
+			}
+		}
+	}
+	else
+	{
+		_log("No Content-Length or chunked transfer encoding header fields");
+		total_bytes = 0;
+		goto fail;
+	}
+
+done_reading:
+
+	http_decoder_end(http);
+
+	if (needResend)
+	{
+		_log("Resending request to web server\n");
+		http->ops->send_request(http);
+		needResend = 0;
+		_log("Sent request. Jumping to retry\n");
+		goto rp_receive;
+	}
+
+out:
+	return total_bytes;
+
+fail:
+	http_decoder_end(http);
+	_drain_socket(http);
+	return -1;
+}
+
+/**
+ * recv_response_2_0 - receive the response on the stream of our last request
+ * @http: our HTTP object
+ *
+ * The header fields and the (decoded) body are put where
+ * recv_response_1_1() would put them, so nothing after us
+ * needs to know which version we spoke.
+ */
+int
+recv_response_2_0(struct http_t *http)
+{
+	assert(http);
+
+	struct HTTP_private *private = HTTP_private(http);
+	struct http2_stream *s;
+	struct header_parser hp;
+	buf_t *buf = &http->conn.read_buf;
+	char status_line[32];
+	char tmpURL[HTTP_URL_MAX];
+	char oldHost[HTTP_HOST_MAX+1];
+	int code;
+	int needResend;
+
+rp_receive:
+
+	needResend = 0;
+	private->streaming = 0;
+
+	if (!(s = http2_wait(http, private->h2_stream)))
+	{
+		_log("Connection failed waiting for stream %u\n", private->h2_stream);
+		goto fail;
+	}
+
+	if (HTTP2_STREAM_RESET == s->state || !s->got_header)
+	{
+		_log("Stream %u reset by server (error %u)\n", s->id, s->error);
+		goto fail_release;
+	}
+
+/*
+ * Give the header fields to the 1.1 parser
+ * behind a made-up status line.
+ */
+	buf_clear(buf);
+	BUCKET_reset_buckets(private->headers, 0);
+
+	snprintf(status_line, sizeof(status_line), "HTTP/2.0 %03d\r\n", s->code);
+	buf_append(buf, status_line);
+	buf_append_ex(buf, s->header.buf_head, s->header.data_len);
+	buf_append(buf, HTTP_EOL);
+
+	clear_struct(&hp);
+
+	if (http_parse_header(http, &hp) != 1)
+	{
+		_log("Bad header block on stream %u\n", s->id);
+		goto fail_release;
+	}
+
+	code = hp.code;
+	http->code = code;
+
+	parse_cookies(http);
+
+	if (HEAD == http->verb
+	|| (code >= 100 && code < 200)
+	|| HTTP_NO_CONTENT == code
+	|| HTTP_NOT_MODIFIED == code)
+		goto out;
+
+	if (http_decoder_start(http) < 0)
+		goto fail_release;
+
+/*
+ * The stream's body is already complete; a sink
+ * gets it in one go.
+ */
+	http_body_start(http, buf->buf_tail, (HTTP_OK == code));
+
+	if (http_body_append(http, s->body.buf_head, s->body.data_len) < 0)
+	{
+		_log("Failed to decode body of stream %u\n", s->id);
+		goto fail_release;
+	}
+
+	http_decoder_end(http);
+
+	switch((unsigned int)code)
+	{
+		default:
+			break;
+
+		case HTTP_FOUND:
+		case HTTP_MOVED_PERMANENTLY:
+		case HTTP_SEE_OTHER:
+
+			if (!http->followRedirects)
+				break;
+
+			strcpy(tmpURL, http->URL);
+			strcpy(oldHost, http->host);
 
 			if (set_new_location(http) < 0)
 			{
 				_log("set_new_location() returned < 0\n");
-				goto fail;
+				goto fail_release;
 			}
 
 			_log("Old location: %s - New location: %s\n", tmpURL, http->URL);
 
-			buf_clear(&http->conn.write_buf);
-			assert(http_wbuf(http).data_len == 0);
+			if (!strcmp(tmpURL, http->URL))
+			{
+				redirect_map_add(tmpURL, "", 0); /* Only for this run */
+				break;
+			}
+
+			redirect_map_add(tmpURL, http->URL, (HTTP_MOVED_PERMANENTLY == code));
 
 		/*
-		 * Still need to receive the body of the HTML page
-		 * that comes with the redirect header.
+		 * The connection is only good for the host we
+		 * connected to; leave redirects elsewhere to
+		 * the caller.
 		 */
-			if (!memcmp(tmpURL, http->URL, strlen(http->URL)))
-			{
-				BUCKET_put_data(private->redirects, (void *)tmpURL, (void *)"", strlen(http->URL), 0);
-				needResend = 0;
-			}
-			else
-			{
-				BUCKET_put_data(private->redirects, (void *)tmpURL, (void *)http->URL, strlen(http->URL), 0);
+			if (!strcmp(oldHost, http->host))
 				needResend = 1;
-			}
 
 			break;
 	}
 
-	bucket_t *bucket = NULL;
-	bucket = BUCKET_get_bucket(private->headers, "transfer-encoding");
-
-	if (bucket && !strcasecmp((char *)bucket->data, "chunked"))
-	{
-		if (do_chunked_recv(http) == -1)
-		{
-			_log("do_chunked_recv() returned -1\n");
-			goto fail;
-		}
-
-		goto done_reading;
-	}
-
-	bucket = BUCKET_get_bucket(private->headers, "content-length");
-
-	if (bucket)
-	{
-		clen = strtoul((char *)bucket->data, NULL, 0);
-
-		overread = (buf->buf_tail - p);
-
-		if (overread < clen)
-		{
-			clen -= overread;
-
-			while (clen)
-			{
-				if (http->usingSecure)
-					bytes = buf_read_tls(http_tls(http), buf, clen);
-				else
-					bytes = buf_read_socket(http_socket(http), buf, clen);
-
-				if (bytes < 0)
-				{
-					_log("buf_read_[tls/socket]() returned %d\n", retVal);
-					goto fail;
-				}
-				else
-				if (!bytes)
-				{
-					continue;	
-				}
-				else
-				{
-					total_bytes += (int)bytes;
-					clen -= bytes;
-				}
-			}
-		}
-	}
-	else
-	{
-		_log("No Content-Length or chunked transfer encoding header fields");
-		total_bytes = 0;
-		goto fail;
-	}
-
-done_reading:
+out:
+	http2_release(http, private->h2_stream);
 
 	if (needResend)
 	{
 		_log("Resending request to web server\n");
-		http->ops->send_request(http);
-		needResend = 0;
-		_log("Sent request. Jumping to retry\n");
+
+		if (send_request_2_0(http) < 0)
+			goto fail;
+
 		goto rp_receive;
 	}
 
-out:
-	return total_bytes;
+	return (int)buf->data_len;
+
+fail_release:
+	http_decoder_end(http);
+	http2_release(http, private->h2_stream);
 
 fail:
-	_drain_socket(http);
 	return -1;
 }
 
 /**
- * Return the HTTP code in the response header (200, 404...)
- *
- * @buf The buffer holding the web server's response.
+ * http_max_in_flight - number of requests we may send before reading responses
+ * @http: our HTTP object
  */
 int
-http_status_code_int(buf_t *buf)
+http_max_in_flight(struct http_t *http)
 {
-	assert(buf);
-
-	char *p = NULL;
-	char *q = NULL;
-	char *eoh = HTTP_EOH(buf);
-	char code_str[16];
+	assert(http);
 
-	if (!eoh)
-		return -1;
+	if (!http_using_h2(http))
+		return 1;
 
-	p = buf->buf_head;
+	return http2_max_streams(http);
+}
 
-	/*
-	 * HTTP/1.1 200 OK\r\n
-	 */
+/**
+ * http_submit_request - send a request for http->URL
+ * @http: our HTTP object
+ *
+ * Returns a handle for http_recv_request(), or -1.
+ */
+int
+http_submit_request(struct http_t *http)
+{
+	assert(http);
 
-	p = memchr(p, ' ', (eoh - p));
-	if (!p)
+	if (http->ops->send_request(http) < 0)
 		return -1;
 
-	++p;
-
-	q = memchr(p, ' ', (eoh - p));
+	if (!http_using_h2(http))
+		return 0;
 
-	if (!q)
-		return -1;
+	return (int)(HTTP_private(http))->h2_stream;
+}
 
-	if ((q - p) > 3)
-		return -1;
+/**
+ * http_recv_request - receive the response to a request sent with http_submit_request()
+ * @http: our HTTP object
+ * @handle: what http_submit_request() returned
+ */
+int
+http_recv_request(struct http_t *http, int handle)
+{
+	assert(http);
 
-	strncpy(code_str, p, (q - p));
-	code_str[q - p] = 0;
+	if (http_using_h2(http))
+		(HTTP_private(http))->h2_stream = (uint32_t)handle;
 
-	return atoi(code_str);
+	return http->ops->recv_response(http);
 }
 
 const char *
@@ -1607,6 +2729,9 @@ code_as_string(struct http_t *http)
 		case HTTP_SEE_OTHER:
 			//sprintf(code_string, "%s%u See Other%s", COL_ORANGE, HTTP_SEE_OTHER, COL_END);
 			break;
+		case HTTP_NOT_MODIFIED:
+			return "304 Not modified";
+			break;
 		case HTTP_BAD_REQUEST:
 			//sprintf(code_string, "%s%u Bad Request%s", COL_RED, HTTP_BAD_REQUEST, COL_END);
 			return "400 Bad request";
@@ -1679,6 +2804,7 @@ URL_parse_host(char *url, char *host)
 	char *p;
 	size_t url_len = strlen(url);
 	char *endp;
+	char *colon;
 
 	host[0] = 0;
 
@@ -1693,29 +2819,28 @@ URL_parse_host(char *url, char *host)
 	while (*p == '/')
 		++p;
 
-	endp = memchr(p, ':', ((url + url_len) - p));
+	endp = memchr(p, '/', ((url + url_len) - p));
+
+	if (!endp)
+		endp = url + url_len;
 
 /*
  * Sometimes, a server may send a 301 with a location header
  * that includes the port (https://website.com:443/page).
- * However, some pages (such as wiki pages), have a colon
- * in the page name (https://wiki.website.com/wiki/page_name:more_name)
- * So actually check to see if there is a port number. If not,
- * use the '/' as the delimitation.
+ * Only look for one before the path, as some pages (such as
+ * wiki pages) have a colon in the page name. The usual ports
+ * are dropped; any other stays with the host, so that the
+ * connection, Host and :authority are for that port.
  */
-
-	if (endp)
+	if ((colon = memchr(p, ':', (endp - p))))
 	{
-		if (strncmp("80", endp+1, 2) && strncmp("443", endp+1, 3))
-			endp = NULL;
+		if ((endp - colon) == 3 && !strncmp(":80", colon, 3))
+			endp = colon;
+		else
+		if ((endp - colon) == 4 && !strncmp(":443", colon, 4))
+			endp = colon;
 	}
 
-	if (!endp)
-		endp = memchr(p, '/', ((url + url_len) - p));
-
-	if (!endp)
-		endp = url + url_len;
-
 	strncpy(host, p, endp - p);
 	host[endp - p] = 0;
 
@@ -1918,6 +3043,14 @@ fetch_header_1_1(struct http_t *http, char *key)
 
 	struct HTTP_private *private = (struct HTTP_private *)http;
 	bucket_t *bucket = BUCKET_get_bucket(private->headers, key);
+
+/*
+ * Other fields that hash to the same bucket are
+ * chained on the same list.
+ */
+	while (bucket && strcmp(bucket->key, key))
+		bucket = bucket->next;
+
 	if (!bucket)
 		return NULL;
 
@@ -2066,6 +3199,8 @@ HTTP_init_object(struct HTTP_private *private, uint32_t id)
 	struct http_t *http;
 	char cache_name[128];
 
+	clear_struct(private);
+
 	http = (struct http_t *)private;
 	http->id = id;
 
@@ -2082,19 +3217,20 @@ HTTP_init_object(struct HTTP_private *private, uint32_t id)
 	if (!private->cookies)
 		goto fail;
 
-	private->redirects = BUCKET_object_new();
-	if (!private->redirects)
-		goto fail;
-
 	http->host = calloc(HTTP_HOST_MAX+1, 1);
-	http->conn.host_ipv4 = calloc(HTTP_ALIGN_SIZE(INET_ADDRSTRLEN+1), 1);
+	http->conn.host_addr = calloc(HTTP_ALIGN_SIZE(INET6_ADDRSTRLEN+1), 1);
 	http->primary_host = calloc(HTTP_HOST_MAX+1, 1);
 	http->page = calloc(HTTP_URL_MAX+1, 1);
 	http->URL = calloc(HTTP_URL_MAX+1, 1);
+	http->if_none_match = calloc(HTTP_VALIDATOR_MAX+1, 1);
+	http->if_modified_since = calloc(HTTP_VALIDATOR_MAX+1, 1);
 
 	http->ops = Default_Version_Methods;
 	http->version = HTTP_DEFAULT_VERSION;
 
+	http->conn.sock = -1;
+	http->conn.epfd = -1;
+
 	if (buf_init(&http->conn.read_buf, HTTP_DEFAULT_READ_BUF_SIZE) < 0)
 	{
 		fprintf(stderr, "HTTP_init_object: failed to initialise read buf\n");
@@ -2107,17 +3243,26 @@ HTTP_init_object(struct HTTP_private *private, uint32_t id)
 		goto fail;
 	}
 
+	if (buf_init(&http->conn.raw_buf, HTTP_DEFAULT_READ_BUF_SIZE) < 0)
+	{
+		fprintf(stderr, "HTTP_init_object: failed to initialise raw buf\n");
+		goto fail;
+	}
+
 	assert(http->host);
-	assert(http->conn.host_ipv4);
+	assert(http->conn.host_addr);
 	assert(http->primary_host);
 	assert(http->page);
 	assert(http->URL);
+	assert(http->if_none_match);
+	assert(http->if_modified_since);
 
 	return 0;
 
 fail:
 
 	buf_destroy(&http->conn.read_buf);
+	buf_destroy(&http->conn.write_buf);
 
 	if (private->headers)
 		BUCKET_object_destroy(private->headers, 0);
@@ -2125,9 +3270,6 @@ fail:
 	if (private->cookies)
 		cache_destroy(private->cookies);
 
-	if (private->redirects)
-		BUCKET_object_destroy(private->redirects, 0);
-
 	return -1;
 }
 
@@ -2170,16 +3312,23 @@ HTTP_delete(struct http_t *http)
 	free(http->host);
 	free(http->page);
 	free(http->primary_host);
-	free(http->conn.host_ipv4);
+	free(http->conn.host_addr);
 	free(http->URL);
+	free(http->if_none_match);
+	free(http->if_modified_since);
 
 	BUCKET_object_destroy(private->headers, 0);
-	BUCKET_object_destroy(private->redirects, 0);
 	cache_clear_all(private->cookies);
 	cache_destroy(private->cookies);
 
 	buf_destroy(&http->conn.read_buf);
 	buf_destroy(&http->conn.write_buf);
+	buf_destroy(&http->conn.raw_buf);
+
+	http_decoder_end(http);
+	http2_end(http);
+
+	free(private);
 
 	_log("Deleted HTTP object\n");
 
@@ -2194,104 +3343,156 @@ HTTP_delete(struct http_t *http)
  * ================================================================================================
  */
 
-/*
- * We need to make sure that OpenSSL
- * initialised once and once only.
- */
-static pthread_once_t __ossl_init_once = PTHREAD_ONCE_INIT;
-
 /**
- * __init_openssl - initialise the openssl library
+ * http_host_port - split the host we are to connect to into its name and port
+ * @http: HTTP object with remote host information
+ * @name: the host name is copied here (HTTP_HOST_MAX+1 bytes)
+ *
+ * Returns the port after the name (see URL_parse_host()),
+ * or the usual one for the scheme if there is none.
  */
-static inline void
-__init_openssl(void)
+static int
+http_host_port(struct http_t *http, char *name)
 {
-	SSL_library_init();
-	SSL_load_error_strings();
-	OpenSSL_add_all_algorithms();
-	//OPENSSL_config(NULL); // this became deprecated 
-	ERR_load_crypto_strings();
+	char *colon;
+	char *e;
+	long port;
+
+	strcpy(name, http->host);
+
+	if ((colon = strrchr(name, ':')))
+	{
+		port = strtol((colon + 1), &e, 10);
+
+		if (e != (colon + 1) && !*e && port > 0 && port <= 65535)
+		{
+			*colon = 0;
+			return (int)port;
+		}
+	}
+
+	return (http->usingSecure ? HTTPS_PORT : HTTP_PORT);
 }
 
 /**
- * http_connect - set up a connection with the target site
+ * http_tls_connect - do the TLS handshake on a connected socket
  * @http: HTTP object with remote host information
+ *
+ * Sends the host name (SNI), resuming our last session with
+ * the host if we have one, and if we want HTTP/2, offers
+ * "h2" and "http/1.1" with ALPN. If the server picks "h2",
+ * the object switches over to the HTTP/2 methods.
+ *
+ * The socket stays non-blocking and we give up on the host if
+ * the handshake is not done in HTTP_HANDSHAKE_TIMEOUT_MS: one
+ * that takes the connection and then says nothing must not
+ * hold up the rest of a batch.
  */
-int
-http_connect(struct http_t *http)
+static int
+http_tls_connect(struct http_t *http)
 {
-	assert(http);
+	const unsigned char *proto = NULL;
+	unsigned int proto_len = 0;
+	char name[HTTP_HOST_MAX+1];
+	long deadline;
+	int ret;
 
-	struct sockaddr_in sock4;
-	struct addrinfo *ainf = NULL;
-	struct addrinfo *aip = NULL;
+	http_host_port(http, name);
 
-	clear_struct(&sock4);
+	if (!(http_tls(http) = tls_new(http_socket(http), name)))
+		goto fail;
 
-	if (getaddrinfo(http->host, NULL, NULL, &ainf) < 0)
+	if (HTTP_VERSION_2_0 == http->version)
 	{
-		_log("error getting address information for remote host\n");
-		goto fail;
+		SSL_set_alpn_protos(http_tls(http),
+			(const unsigned char *)HTTP2_ALPN_PROTOS,
+			sizeof(HTTP2_ALPN_PROTOS) - 1);
 	}
 
-	for (aip = ainf; aip; aip = aip->ai_next)
+/*
+ * Do the handshake now so that we know what we are speaking.
+ */
+	deadline = (http_now_ms() + HTTP_HANDSHAKE_TIMEOUT_MS);
+
+	while ((ret = tls_handshake(http_tls(http))) > 0)
 	{
-		if (aip->ai_family == AF_INET && aip->ai_socktype == SOCK_STREAM)
+		if (TLS_WANT_WRITE == ret)
+			ret = http_wait_writable(http, deadline);
+		else
+			ret = http_wait_readable(http, deadline);
+
+		if (!ret)
 		{
-			memcpy(&sock4, aip->ai_addr, aip->ai_addrlen);
-			break;
+			_log("TLS handshake with %s timed out\n", http->host);
+			errno = ETIMEDOUT;
+			goto fail;
 		}
+
+		if (ret < 0)
+			break;
 	}
 
-	if (!aip)
+	if (ret < 0)
+	{
+		_log("TLS handshake with %s failed\n", http->host);
 		goto fail;
+	}
 
-	assert(http->conn.host_ipv4);
-	sprintf(http->conn.host_ipv4, "%s", inet_ntoa(sock4.sin_addr));
-
-	if (http->usingSecure)
-		sock4.sin_port = htons(HTTPS_PORT);
-	else
-		sock4.sin_port = htons(HTTP_PORT);
+	SSL_get0_alpn_selected(http_tls(http), &proto, &proto_len);
 
-	if ((http_socket(http) = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	if (proto_len == 2 && !memcmp(proto, "h2", 2))
 	{
-		_log("error opening socket\n");
-		goto fail_release_ainf;
+		if (http2_start(http) < 0)
+			goto fail;
+
+		http->ops = &Methods_v2_0;
+		_log("Speaking HTTP/2 with %s\n", http->host);
 	}
 
-	assert(http_socket(http) > 2);
+	return 0;
+
+fail:
+	return -1;
+}
+
+/**
+ * http_connect - set up a connection with the target site
+ * @http: HTTP object with remote host information
+ */
+int
+http_connect(struct http_t *http)
+{
+	assert(http);
+
+	assert(http->conn.host_addr);
+
+	char name[HTTP_HOST_MAX+1];
+	int port = http_host_port(http, name);
 
-	if (connect(http_socket(http), (struct sockaddr *)&sock4, (socklen_t)sizeof(sock4)) != 0)
+	http_socket(http) = dial(name, port, http->conn.host_addr, INET6_ADDRSTRLEN);
+
+	if (http_socket(http) < 0)
 	{
-		_log("error connecting to remote host\n");
-		goto fail_release_ainf;
+		_log("error connecting to %s (%s)\n", http->host, strerror(errno));
+		goto fail;
 	}
 
-	if (http->usingSecure)	
-	{
+	if (http_watch_socket(http) < 0)
+		goto fail;
+
 /*
- * Calling __init_openssl() more than once (multithreaded)
- * has in some instances caused segfaults. Thus, use
- * pthread_once() to do it once only.
+ * dial() leaves the socket non-blocking (and SSL
+ * reads and writes through the same descriptor).
  */
-		pthread_once(&__ossl_init_once, __init_openssl);
-		http->conn.ssl_ctx = SSL_CTX_new(TLSv1_2_client_method());
-		http_tls(http) = SSL_new(http->conn.ssl_ctx);
-
-		SSL_set_fd(http_tls(http), http_socket(http)); /* Set the socket for reading/writing */
-		SSL_set_connect_state(http_tls(http)); /* Set as client */
-	}
+	http->conn.sock_nonblocking = 1;
+	http->conn.ssl_nonblocking = 1;
+	http->ops = Default_Version_Methods;
 
-	http->conn.sock_nonblocking = 0;
-	http->conn.ssl_nonblocking = 0;
+	if (http->usingSecure && http_tls_connect(http) < 0)
+		goto fail;
 
-	freeaddrinfo(ainf);
 	return 0;
 
-fail_release_ainf:
-	freeaddrinfo(ainf);
-
 fail:
 	return -1;
 }
@@ -2301,97 +3502,68 @@ http_disconnect(struct http_t *http)
 {
 	assert(http);
 
-	shutdown(http_socket(http), SHUT_RDWR);
-	close(http_socket(http));
-	http_socket(http) = -1;
+	http2_end(http);
+	http->ops = Default_Version_Methods;
+
+	http_unwatch_socket(http);
 
 	if (http->usingSecure)
 	{
-		SSL_CTX_free(http->conn.ssl_ctx);
-		SSL_free(http_tls(http));
-		http->conn.ssl_ctx = NULL;
+		tls_close(http_tls(http));
 		http_tls(http) = NULL;
 	}
 
+	shutdown(http_socket(http), SHUT_RDWR);
+	close(http_socket(http));
+	http_socket(http) = -1;
+
 	return;
 }
 
 int
 http_reconnect(struct http_t *http)
 {
-	struct sockaddr_in sock4;
-	struct addrinfo *ainf = NULL;
-	struct addrinfo *aip = NULL;
+	char name[HTTP_HOST_MAX+1];
+	int port = http_host_port(http, name);
 
-	shutdown(http_socket(http), SHUT_RDWR);
-	close(http_socket(http));
-	http_socket(http) = -1;
+	http2_end(http);
+	http->ops = Default_Version_Methods;
+
+	http_unwatch_socket(http);
 
 	if (http->usingSecure)
 	{
-		SSL_CTX_free(http->conn.ssl_ctx);
-		SSL_free(http_tls(http));
-		http->conn.ssl_ctx = NULL;
+		tls_close(http_tls(http));
 		http_tls(http) = NULL;
 	}
 
-	clear_struct(&sock4);
+	shutdown(http_socket(http), SHUT_RDWR);
+	close(http_socket(http));
+	http_socket(http) = -1;
 
-	if (getaddrinfo(http->host, NULL, NULL, &ainf) < 0)
-	{
-		_log("failed to get address information for remote host\n");
-		goto fail;
-	}
+	http_socket(http) = dial(name, port, http->conn.host_addr, INET6_ADDRSTRLEN);
 
-	for (aip = ainf; aip; aip = aip->ai_next)
+	if (http_socket(http) < 0)
 	{
-		if (aip->ai_family == AF_INET && aip->ai_socktype == SOCK_STREAM)
-		{
-			memcpy(&sock4, aip->ai_addr, aip->ai_addrlen);
-			break;
-		}
-	}
-
-	if (!aip)
+		_log("error reconnecting to %s (%s)\n", http->host, strerror(errno));
 		goto fail;
-
-	sprintf(http->conn.host_ipv4, "%s", inet_ntoa(sock4.sin_addr));
-
-	if (http->usingSecure)
-		sock4.sin_port = htons(HTTPS_PORT);
-	else
-		sock4.sin_port = htons(HTTP_PORT);
-
-	if ((http_socket(http) = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-	{
-		_log("error opening socket\n");
-		goto fail_release_ainf;
-	}
-
-	if (connect(http_socket(http), (struct sockaddr *)&sock4, (socklen_t)sizeof(sock4)) != 0)
-	{
-		_log("error connecting to remote host\n");
-		goto fail_release_ainf;
 	}
 
-	if (http->usingSecure)
-	{
-		http->conn.ssl_ctx = SSL_CTX_new(TLSv1_2_client_method());
-		http_tls(http) = SSL_new(http->conn.ssl_ctx);
+	if (http_watch_socket(http) < 0)
+		goto fail;
 
-		SSL_set_fd(http_tls(http), http_socket(http)); // Set the socket for reading/writing
-		SSL_set_connect_state(http_tls(http)); // Set as client
-	}
+/*
+ * dial() leaves the socket non-blocking (and SSL
+ * reads and writes through the same descriptor).
+ */
+	http->conn.sock_nonblocking = 1;
+	http->conn.ssl_nonblocking = 1;
 
-	http->conn.sock_nonblocking = 0;
-	http->conn.ssl_nonblocking = 0;
+	if (http->usingSecure && http_tls_connect(http) < 0)
+		goto fail;
 
-	freeaddrinfo(ainf);
 	return 0;
 
-	fail_release_ainf:
-	freeaddrinfo(ainf);
-
 	fail:
 	return -1;
 }
@@ -10,9 +10,11 @@
 
 #define HTTP_SWITCHING_PROTOCOLS 101u // for successful upgrade to HTTP 2.0
 #define HTTP_OK 200u
+#define HTTP_NO_CONTENT 204u
 #define HTTP_MOVED_PERMANENTLY 301u
 #define HTTP_FOUND 302u // the URI is being temporarily redirected
 #define HTTP_SEE_OTHER 303u
+#define HTTP_NOT_MODIFIED 304u
 #define HTTP_BAD_REQUEST 400u // the user agent sent a malformed request
 #define HTTP_UNAUTHORISED 401u
 #define HTTP_PAYMENT_REQUIRED 402u
@@ -35,10 +37,20 @@
 #define HTTP_HNAME_MAX 64 /* Header name */
 #define HTTP_HOST_MAX 256
 #define HTTP_HEADER_FIELD_MAX_LENGTH 2048
+#define HTTP_VALIDATOR_MAX 256 /* ETag / HTTP-date for conditional GETs */
 
 #define HTTP_VERSION		"1.1"
+#define HTTP_VERSION_1_0	0x10000000u
+#define HTTP_VERSION_1_1	0x10100000u
+#define HTTP_VERSION_2_0	0x20000000u /* Offered with ALPN; we fall back to 1.1 */
+#define HTTP_DEFAULT_VERSION	HTTP_VERSION_1_1
 #define HTTP_USER_AGENT		"Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:75.0) Gecko/20100101 Firefox/75.0"
 #define HTTP_ACCEPT		"text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8"
+#ifdef HAVE_BROTLI
+# define HTTP_ACCEPT_ENCODING	"gzip, deflate, br"
+#else
+# define HTTP_ACCEPT_ENCODING	"gzip, deflate"
+#endif
 #define HTTP_EOH_SENTINEL	"\r\n\r\n"
 #define HTTP_EOL		"\r\n"
 
@@ -76,20 +88,25 @@ typedef struct HTTP_Header
 } http_header_t;
 
 #define http_socket(h) ((h)->conn.sock)
+#define http_using_h2(h) ((h)->conn.h2 != NULL)
 #define http_tls(h) ((h)->conn.ssl)
 #define http_rbuf(h) ((h)->conn.read_buf)
 #define http_wbuf(h) ((h)->conn.write_buf)
 
+struct http2_conn;
+
 struct conn
 {
 	int sock;
 	SSL *ssl;
 	buf_t read_buf;
 	buf_t write_buf;
+	buf_t raw_buf; /* Undecoded body bytes of a chunked response */
+	int epfd; /* epoll instance watching SOCK for readability */
 	int sock_nonblocking;
 	int ssl_nonblocking;
-	char *host_ipv4;
-	SSL_CTX *ssl_ctx;
+	char *host_addr; /* Address we connected to, IPv4 or IPv6 */
+	struct http2_conn *h2; /* Set if the server chose "h2" with ALPN */
 };
 
 enum request
@@ -98,6 +115,13 @@ enum request
 	GET = 1
 };
 
+/*
+ * If set, the (decoded) body of a 200 response is handed to
+ * the sink as it arrives instead of being kept after the
+ * header in the read buffer. Returning -1 fails the request.
+ */
+typedef int (*http_body_sink_t)(void *, char *, size_t);
+
 struct http_t
 {
 	uint32_t version;
@@ -114,11 +138,23 @@ struct http_t
 	char *URL;
 	char *primary_host;
 
+/*
+ * Sent as If-None-Match and If-Modified-Since
+ * with GET requests unless they are empty.
+ */
+	char *if_none_match;
+	char *if_modified_since;
+
 	size_t URL_len;
 
+	http_body_sink_t body_sink;
+	void *body_sink_arg;
+
 	struct HTTP_methods *ops;
 };
 
+extern struct HTTP_methods *Default_Version_Methods;
+
 struct HTTP_methods
 {
 	int (*send_request)(struct http_t *);
@@ -131,13 +167,14 @@ struct HTTP_methods
 	const char *(*code_as_string)(struct http_t *);
 };
 
-size_t httplen;
-size_t httpslen;
+extern size_t httplen; /* Defined in http.c */
+extern size_t httpslen;
 
 struct http_t *HTTP_new(uint32_t) __wur;
 void HTTP_delete(struct http_t *) __nonnull((1));
 
 void http_check_host(struct http_t *) __nonnull((1));
+int http_connection_closed(struct http_t *) __nonnull((1)) __wur;
 
 /*
  * Connection-related functions
@@ -147,4 +184,15 @@ void http_disconnect(struct http_t *) __nonnull((1));
 int http_reconnect(struct http_t *) __nonnull((1)) __wur;
 int HTTP_upgrade_to_TLS(struct http_t *) __nonnull((1)) __wur;
 
+/*
+ * Several requests in flight at once (HTTP/2 only; with 1.1
+ * http_max_in_flight() is 1 and these are just send_request
+ * and recv_response). http_submit_request() sends a request
+ * for http->URL and returns a handle to pass to http_recv_request()
+ * to get its response, in any order.
+ */
+int http_max_in_flight(struct http_t *) __nonnull((1)) __wur;
+int http_submit_request(struct http_t *) __nonnull((1)) __wur;
+int http_recv_request(struct http_t *, int) __nonnull((1)) __wur;
+
 #endif /* !defined HTTP_H */
@@ -0,0 +1,907 @@
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/ssl.h>
+#include "buffer.h"
+#include "hpack.h"
+#include "http.h"
+#include "http2.h"
+#include "wikigrab.h"
+
+#define __get16(p) (((uint32_t)(p)[0] << 8) | (uint32_t)(p)[1])
+#define __get24(p) (((uint32_t)(p)[0] << 16) | ((uint32_t)(p)[1] << 8) | (uint32_t)(p)[2])
+#define __get32(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+
+static void
+__put32(unsigned char *p, uint32_t v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+/**
+ * __http2_frame - append a frame header to the output buffer
+ * @h2: the connection state
+ * @len: length of the payload that will follow
+ * @type: frame type
+ * @flags: frame flags
+ * @stream: stream identifier (0 for the connection)
+ */
+static void
+__http2_frame(struct http2_conn *h2, uint32_t len, int type, int flags, uint32_t stream)
+{
+	unsigned char hdr[HTTP2_FRAME_HEADER_LEN];
+
+	hdr[0] = (len >> 16) & 0xff;
+	hdr[1] = (len >> 8) & 0xff;
+	hdr[2] = len & 0xff;
+	hdr[3] = (unsigned char)type;
+	hdr[4] = (unsigned char)flags;
+	__put32(&hdr[5], (stream & HTTP2_MAX_WINDOW));
+
+	buf_append_ex(&h2->out, (char *)hdr, HTTP2_FRAME_HEADER_LEN);
+
+	return;
+}
+
+static void
+__http2_window_update(struct http2_conn *h2, uint32_t stream, uint32_t increment)
+{
+	unsigned char payload[4];
+
+	__put32(payload, increment);
+	__http2_frame(h2, 4, HTTP2_WINDOW_UPDATE, 0, stream);
+	buf_append_ex(&h2->out, (char *)payload, 4);
+
+	return;
+}
+
+/**
+ * __http2_flush - write out the frames we have queued
+ * @http: our HTTP object
+ */
+static int
+__http2_flush(struct http_t *http)
+{
+	struct http2_conn *h2 = http->conn.h2;
+	ssize_t n;
+
+	if (!h2->out.data_len)
+		return 0;
+
+	n = buf_write_tls(http_tls(http), &h2->out);
+	buf_clear(&h2->out);
+
+	if (n < 0)
+	{
+		h2->dead = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * __http2_connection_error - send GOAWAY and give up on the connection
+ * @http: our HTTP object
+ * @error: the error code (RFC 7540 7)
+ */
+static int
+__http2_connection_error(struct http_t *http, uint32_t error)
+{
+	struct http2_conn *h2 = http->conn.h2;
+	unsigned char payload[8];
+
+	if (h2->dead)
+		return -1;
+
+/*
+ * We never accept streams from the server,
+ * so the last one we processed is always 0.
+ */
+	__put32(&payload[0], 0);
+	__put32(&payload[4], error);
+
+	__http2_frame(h2, 8, HTTP2_GOAWAY, 0, 0);
+	buf_append_ex(&h2->out, (char *)payload, 8);
+
+	__http2_flush(http);
+	h2->dead = 1;
+
+	return -1;
+}
+
+static struct http2_stream *
+__http2_stream(struct http2_conn *h2, uint32_t id)
+{
+	int i;
+
+	if (!id)
+		return NULL;
+
+	for (i = 0; i < h2->nr_streams; ++i)
+	{
+		if (h2->streams[i].id == id)
+			return &h2->streams[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * __http2_stream_finished - note that we have all we will get for a stream
+ * @h2: the connection state
+ * @s: the stream
+ * @state: HTTP2_STREAM_DONE or HTTP2_STREAM_RESET
+ */
+static void
+__http2_stream_finished(struct http2_conn *h2, struct http2_stream *s, enum http2_stream_state state)
+{
+	if (HTTP2_STREAM_WAITING != s->state)
+		return;
+
+	s->state = state;
+	--(h2->nr_active);
+
+	return;
+}
+
+static int __http2_process(struct http_t *);
+
+/**
+ * http2_start - begin HTTP/2 on a connection that negotiated "h2"
+ * @http: our HTTP object, with the TLS handshake done
+ *
+ * Sends the connection preface with our settings: no server
+ * push, and a large receive window so that the server does
+ * not stall waiting for WINDOW_UPDATEs on big articles.
+ */
+int
+http2_start(struct http_t *http)
+{
+	assert(http);
+
+	struct http2_conn *h2;
+	unsigned char settings[12];
+
+	if (!(h2 = calloc(1, sizeof(struct http2_conn))))
+		return -1;
+
+	http->conn.h2 = h2;
+
+	if (hpack_table_init(&h2->decoder, 0) < 0
+	|| buf_init(&h2->in, HTTP2_READ_BLOCK * 2) < 0
+	|| buf_init(&h2->out, HTTP_DEFAULT_WRITE_BUF_SIZE) < 0
+	|| buf_init(&h2->block, HTTP_DEFAULT_WRITE_BUF_SIZE) < 0)
+		goto fail;
+
+	h2->next_stream_id = 1;
+	h2->max_concurrent = HTTP2_MAX_STREAMS;
+	h2->max_frame_size = HTTP2_DEFAULT_FRAME_SIZE;
+	h2->send_window = HTTP2_DEFAULT_WINDOW;
+
+	settings[0] = 0;
+	settings[1] = HTTP2_SETTINGS_ENABLE_PUSH;
+	__put32(&settings[2], 0);
+	settings[6] = 0;
+	settings[7] = HTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+	__put32(&settings[8], HTTP2_LOCAL_WINDOW);
+
+	buf_append(&h2->out, HTTP2_PREFACE);
+	__http2_frame(h2, sizeof(settings), HTTP2_SETTINGS, 0, 0);
+	buf_append_ex(&h2->out, (char *)settings, sizeof(settings));
+
+/*
+ * SETTINGS only covers the stream windows;
+ * the connection window starts at 65535.
+ */
+	__http2_window_update(h2, 0, (HTTP2_LOCAL_WINDOW - HTTP2_DEFAULT_WINDOW));
+
+	if (__http2_flush(http) < 0)
+		goto fail;
+
+/*
+ * The server's preface is its SETTINGS, sent as soon as
+ * the handshake is done. Wait for it so that we know how
+ * many streams we may open before we open any.
+ */
+	while (!h2->got_settings)
+	{
+		if (http_recv(http, &h2->in, HTTP2_READ_BLOCK, (http_now_ms() + HTTP2_READ_TIMEOUT_MS)) <= 0)
+			goto fail;
+
+		if (__http2_process(http) < 0)
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	http2_end(http);
+	return -1;
+}
+
+/**
+ * http2_end - free the HTTP/2 state of a connection
+ * @http: our HTTP object
+ */
+void
+http2_end(struct http_t *http)
+{
+	assert(http);
+
+	struct http2_conn *h2 = http->conn.h2;
+	int i;
+
+	if (!h2)
+		return;
+
+/*
+ * The connection is going away; do not try
+ * to reset the streams still in flight.
+ */
+	h2->dead = 1;
+
+	for (i = 0; i < h2->nr_streams; ++i)
+	{
+		if (h2->streams[i].id)
+			http2_release(http, h2->streams[i].id);
+	}
+
+	free(h2->streams);
+	hpack_table_destroy(&h2->decoder);
+
+	buf_destroy(&h2->in);
+	buf_destroy(&h2->out);
+	buf_destroy(&h2->block);
+
+	free(h2);
+	http->conn.h2 = NULL;
+
+	return;
+}
+
+/**
+ * http2_max_streams - number of requests we may have in flight
+ * @http: our HTTP object
+ */
+int
+http2_max_streams(struct http_t *http)
+{
+	assert(http);
+
+	struct http2_conn *h2 = http->conn.h2;
+
+	if (!h2 || h2->dead || h2->goaway)
+		return 0;
+
+	if (h2->max_concurrent < HTTP2_MAX_STREAMS)
+		return (int)h2->max_concurrent;
+
+	return HTTP2_MAX_STREAMS;
+}
+
+/**
+ * http2_submit - open a stream with a request that has no body
+ * @http: our HTTP object
+ * @block: the HPACK-encoded request header block
+ *
+ * Returns the new stream's identifier, or 0 if no more streams
+ * can be opened on this connection or writing failed.
+ */
+uint32_t
+http2_submit(struct http_t *http, buf_t *block)
+{
+	assert(http);
+	assert(block);
+
+	struct http2_conn *h2 = http->conn.h2;
+	struct http2_stream *s = NULL;
+	struct http2_stream *streams;
+	uint32_t id;
+	int i;
+
+	if (!h2 || h2->dead || h2->goaway)
+		return 0;
+
+	if (h2->nr_active >= http2_max_streams(http) || h2->next_stream_id > HTTP2_MAX_WINDOW)
+		return 0;
+
+/*
+ * Our requests are a few hundred bytes; the peer must
+ * accept frames of at least 16384 bytes, so we never
+ * need CONTINUATION.
+ */
+	if (block->data_len > h2->max_frame_size)
+		return 0;
+
+	for (i = 0; i < h2->nr_streams; ++i)
+	{
+		if (!h2->streams[i].id)
+		{
+			s = &h2->streams[i];
+			break;
+		}
+	}
+
+	if (!s)
+	{
+		if (!(streams = realloc(h2->streams, (h2->nr_streams + 1) * sizeof(struct http2_stream))))
+			return 0;
+
+		h2->streams = streams;
+		s = &h2->streams[h2->nr_streams++];
+	}
+
+	clear_struct(s);
+
+	if (buf_init(&s->header, HTTP_HEADER_FIELD_MAX_LENGTH) < 0)
+		return 0;
+
+	if (buf_init(&s->body, HTTP_DEFAULT_READ_BUF_SIZE) < 0)
+	{
+		buf_destroy(&s->header);
+		return 0;
+	}
+
+	id = h2->next_stream_id;
+	h2->next_stream_id += 2;
+
+	s->id = id;
+	s->state = HTTP2_STREAM_WAITING;
+	++(h2->nr_active);
+
+	__http2_frame(h2, block->data_len, HTTP2_HEADERS, (HTTP2_FLAG_END_HEADERS|HTTP2_FLAG_END_STREAM), id);
+	buf_append_ex(&h2->out, block->buf_head, block->data_len);
+
+	if (__http2_flush(http) < 0)
+	{
+		http2_release(http, id);
+		return 0;
+	}
+
+	return id;
+}
+
+/**
+ * http2_release - forget a stream once its response has been dealt with
+ * @http: our HTTP object
+ * @id: the stream identifier
+ */
+void
+http2_release(struct http_t *http, uint32_t id)
+{
+	assert(http);
+
+	struct http2_conn *h2 = http->conn.h2;
+	struct http2_stream *s;
+
+	if (!h2 || !(s = __http2_stream(h2, id)))
+		return;
+
+/*
+ * Nobody is waiting for the rest of it; have
+ * the server stop sending.
+ */
+	if (HTTP2_STREAM_WAITING == s->state && !h2->dead)
+	{
+		unsigned char payload[4];
+
+		__put32(payload, HTTP2_CANCEL);
+		__http2_frame(h2, 4, HTTP2_RST_STREAM, 0, id);
+		buf_append_ex(&h2->out, (char *)payload, 4);
+
+		__http2_flush(http);
+		__http2_stream_finished(h2, s, HTTP2_STREAM_RESET);
+	}
+
+	buf_destroy(&s->header);
+	buf_destroy(&s->body);
+	clear_struct(s);
+
+	return;
+}
+
+/**
+ * __http2_header_field - HPACK callback for each field of a response header block
+ * @arg: the stream, or NULL if the stream is no longer wanted
+ * @name: field name
+ * @name_len: length of NAME
+ * @value: field value
+ * @value_len: length of VALUE
+ */
+static int
+__http2_header_field(void *arg, char *name, size_t name_len, char *value, size_t value_len)
+{
+	struct http2_stream *s = (struct http2_stream *)arg;
+	size_t i;
+
+	if (!s || s->got_header)
+		return 0;
+
+	if (name_len && *name == ':')
+	{
+		if (name_len == 7 && !memcmp(name, ":status", 7))
+		{
+			if (value_len != 3)
+				return -1;
+
+			s->code = 0;
+
+			for (i = 0; i < 3; ++i)
+			{
+				if (!isdigit(value[i]))
+					return -1;
+
+				s->code = (s->code * 10) + (value[i] - '0');
+			}
+		}
+
+		return 0;
+	}
+
+	buf_append_ex(&s->header, name, name_len);
+	buf_append_ex(&s->header, ": ", 2);
+	buf_append_ex(&s->header, value, value_len);
+	buf_append_ex(&s->header, HTTP_EOL, 2);
+
+	return 0;
+}
+
+/**
+ * __http2_header_block - decode a complete header block for a stream
+ * @http: our HTTP object
+ * @id: the stream identifier
+ * @block: the header block
+ * @len: length of BLOCK
+ * @end_stream: the frame had END_STREAM set
+ *
+ * Blocks for streams we have released are still decoded
+ * since they may change the dynamic table.
+ */
+static int
+__http2_header_block(struct http_t *http, uint32_t id, unsigned char *block, size_t len, int end_stream)
+{
+	struct http2_conn *h2 = http->conn.h2;
+	struct http2_stream *s = __http2_stream(h2, id);
+
+	if (s && HTTP2_STREAM_WAITING != s->state)
+		s = NULL;
+
+	if (s && !s->got_header)
+	{
+		s->code = 0;
+		buf_clear(&s->header);
+	}
+
+	if (hpack_decode(&h2->decoder, block, len, __http2_header_field, (void *)s) < 0)
+		return __http2_connection_error(http, HTTP2_COMPRESSION_ERROR);
+
+	if (!s)
+		return 0;
+
+/*
+ * Interim (1xx) responses are followed by the real one.
+ */
+	if (!s->got_header && s->code >= 200)
+		s->got_header = 1;
+
+	if (end_stream)
+		__http2_stream_finished(h2, s, HTTP2_STREAM_DONE);
+
+	return 0;
+}
+
+/**
+ * __http2_data - deal with the payload of a DATA frame
+ * @http: our HTTP object
+ * @id: the stream identifier
+ * @flags: frame flags
+ * @len: length of the payload, including any padding
+ * @data: start of the data proper
+ * @data_len: length of the data proper
+ */
+static int
+__http2_data(struct http_t *http, uint32_t id, int flags, size_t len, unsigned char *data, size_t data_len)
+{
+	struct http2_conn *h2 = http->conn.h2;
+	struct http2_stream *s = __http2_stream(h2, id);
+
+/*
+ * The whole frame counts against the windows,
+ * padding and all, even for a stream we have
+ * already given up on.
+ */
+	h2->unacked += len;
+
+	if (h2->unacked >= (HTTP2_LOCAL_WINDOW / 2))
+	{
+		__http2_window_update(h2, 0, (uint32_t)h2->unacked);
+		h2->unacked = 0;
+	}
+
+	if (!s || HTTP2_STREAM_WAITING != s->state)
+		return 0;
+
+	if (data_len)
+		buf_append_ex(&s->body, (char *)data, data_len);
+
+	if (flags & HTTP2_FLAG_END_STREAM)
+	{
+		__http2_stream_finished(h2, s, HTTP2_STREAM_DONE);
+		return 0;
+	}
+
+	s->unacked += len;
+
+	if (s->unacked >= (HTTP2_LOCAL_WINDOW / 2))
+	{
+		__http2_window_update(h2, id, (uint32_t)s->unacked);
+		s->unacked = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * __http2_settings - apply the server's SETTINGS
+ * @http: our HTTP object
+ * @p: the frame payload
+ * @len: length of the payload
+ */
+static int
+__http2_settings(struct http_t *http, unsigned char *p, size_t len)
+{
+	struct http2_conn *h2 = http->conn.h2;
+	uint32_t value;
+	int id;
+
+	if (len % 6)
+		return __http2_connection_error(http, HTTP2_FRAME_SIZE_ERROR);
+
+	for (; len; p += 6, len -= 6)
+	{
+		id = (int)__get16(p);
+		value = __get32(p + 2);
+
+		switch(id)
+		{
+			case HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS:
+
+				h2->max_concurrent = value;
+				break;
+
+			case HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
+
+				if (value > HTTP2_MAX_WINDOW)
+					return __http2_connection_error(http, HTTP2_FLOW_CONTROL_ERROR);
+
+				break;
+
+			case HTTP2_SETTINGS_MAX_FRAME_SIZE:
+
+				if (value < HTTP2_DEFAULT_FRAME_SIZE || value > 0xffffffu)
+					return __http2_connection_error(http, HTTP2_PROTOCOL_ERROR);
+
+				h2->max_frame_size = value;
+				break;
+
+		/*
+		 * HEADER_TABLE_SIZE is the server's decoder table;
+		 * we never index anything in it so it is of no
+		 * consequence to us.
+		 */
+			default:
+				break;
+		}
+	}
+
+	__http2_frame(h2, 0, HTTP2_SETTINGS, HTTP2_FLAG_ACK, 0);
+	h2->got_settings = 1;
+
+	return 0;
+}
+
+/**
+ * __http2_goaway - the server will not process any more new streams
+ * @http: our HTTP object
+ * @p: the frame payload
+ *
+ * Streams after the last one the server says it will
+ * process are refused and can be retried elsewhere.
+ */
+static void
+__http2_goaway(struct http_t *http, unsigned char *p)
+{
+	struct http2_conn *h2 = http->conn.h2;
+	int i;
+
+	h2->goaway = 1;
+	h2->last_stream_id = (__get32(p) & HTTP2_MAX_WINDOW);
+
+	for (i = 0; i < h2->nr_streams; ++i)
+	{
+		if (h2->streams[i].id > h2->last_stream_id)
+			__http2_stream_finished(h2, &h2->streams[i], HTTP2_STREAM_RESET);
+	}
+
+	return;
+}
+
+/**
+ * __http2_process_frame - deal with one complete frame
+ * @http: our HTTP object
+ * @frame: the frame, starting with its header
+ */
+static int
+__http2_process_frame(struct http_t *http, unsigned char *frame)
+{
+	struct http2_conn *h2 = http->conn.h2;
+	struct http2_stream *s;
+	uint32_t len = __get24(frame);
+	int type = frame[3];
+	int flags = frame[4];
+	uint32_t id = (__get32(&frame[5]) & HTTP2_MAX_WINDOW);
+	unsigned char *p = (frame + HTTP2_FRAME_HEADER_LEN);
+	unsigned char *data = p;
+	size_t data_len = len;
+	uint32_t increment;
+
+/*
+ * Nothing may come between the frames of a header block.
+ */
+	if (h2->block_stream && (HTTP2_CONTINUATION != type || id != h2->block_stream))
+		return __http2_connection_error(http, HTTP2_PROTOCOL_ERROR);
+
+/*
+ * Strip the padding and priority fields.
+ */
+	if ((HTTP2_DATA == type || HTTP2_HEADERS == type) && (flags & HTTP2_FLAG_PADDED))
+	{
+		if (!data_len || *data >= data_len)
+			return __http2_connection_error(http, HTTP2_PROTOCOL_ERROR);
+
+		data_len -= (1 + *data);
+		++data;
+	}
+
+	if (HTTP2_HEADERS == type && (flags & HTTP2_FLAG_PRIORITY))
+	{
+		if (data_len < 5)
+			return __http2_connection_error(http, HTTP2_PROTOCOL_ERROR);
+
+		data += 5;
+		data_len -= 5;
+	}
+
+	switch(type)
+	{
+		case HTTP2_DATA:
+
+			if (!id)
+				return __http2_connection_error(http, HTTP2_PROTOCOL_ERROR);
+
+			return __http2_data(http, id, flags, len, data, data_len);
+
+		case HTTP2_HEADERS:
+
+			if (!id)
+				return __http2_connection_error(http, HTTP2_PROTOCOL_ERROR);
+
+			if (flags & HTTP2_FLAG_END_HEADERS)
+				return __http2_header_block(http, id, data, data_len, (flags & HTTP2_FLAG_END_STREAM));
+
+			buf_clear(&h2->block);
+			buf_append_ex(&h2->block, (char *)data, data_len);
+
+			h2->block_stream = id;
+			h2->block_end_stream = (flags & HTTP2_FLAG_END_STREAM);
+			break;
+
+		case HTTP2_CONTINUATION:
+
+			if (!h2->block_stream)
+				return __http2_connection_error(http, HTTP2_PROTOCOL_ERROR);
+
+			buf_append_ex(&h2->block, (char *)p, len);
+
+			if (flags & HTTP2_FLAG_END_HEADERS)
+			{
+				h2->block_stream = 0;
+
+				return __http2_header_block(http, id,
+					(unsigned char *)h2->block.buf_head, h2->block.data_len,
+					h2->block_end_stream);
+			}
+
+			break;
+
+		case HTTP2_PRIORITY:
+
+			if (len != 5)
+				return __http2_connection_error(http, HTTP2_FRAME_SIZE_ERROR);
+
+			break;
+
+		case HTTP2_RST_STREAM:
+
+			if (!id || len != 4)
+				return __http2_connection_error(http, HTTP2_PROTOCOL_ERROR);
+
+			if ((s = __http2_stream(h2, id)))
+			{
+				s->error = __get32(p);
+				__http2_stream_finished(h2, s, HTTP2_STREAM_RESET);
+			}
+
+			break;
+
+		case HTTP2_SETTINGS:
+
+			if (id)
+				return __http2_connection_error(http, HTTP2_PROTOCOL_ERROR);
+
+			if (flags & HTTP2_FLAG_ACK)
+			{
+				if (len)
+					return __http2_connection_error(http, HTTP2_FRAME_SIZE_ERROR);
+
+				break;
+			}
+
+			return __http2_settings(http, p, len);
+
+		case HTTP2_PUSH_PROMISE:
+
+		/*
+		 * We turned push off in our SETTINGS.
+		 */
+			return __http2_connection_error(http, HTTP2_PROTOCOL_ERROR);
+
+		case HTTP2_PING:
+
+			if (id || len != 8)
+				return __http2_connection_error(http, HTTP2_PROTOCOL_ERROR);
+
+			if (!(flags & HTTP2_FLAG_ACK))
+			{
+				__http2_frame(h2, 8, HTTP2_PING, HTTP2_FLAG_ACK, 0);
+				buf_append_ex(&h2->out, (char *)p, 8);
+			}
+
+			break;
+
+		case HTTP2_GOAWAY:
+
+			if (id || len < 8)
+				return __http2_connection_error(http, HTTP2_PROTOCOL_ERROR);
+
+			__http2_goaway(http, p);
+			break;
+
+		case HTTP2_WINDOW_UPDATE:
+
+			if (len != 4)
+				return __http2_connection_error(http, HTTP2_FRAME_SIZE_ERROR);
+
+			increment = (__get32(p) & HTTP2_MAX_WINDOW);
+
+			if (!increment)
+				return __http2_connection_error(http, HTTP2_PROTOCOL_ERROR);
+
+		/*
+		 * We send no DATA, so only keep the
+		 * connection's window honest.
+		 */
+			if (!id)
+			{
+				h2->send_window += increment;
+
+				if (h2->send_window > HTTP2_MAX_WINDOW)
+					return __http2_connection_error(http, HTTP2_FLOW_CONTROL_ERROR);
+			}
+
+			break;
+
+		default:
+
+		/*
+		 * Unknown frame types are ignored (RFC 7540 4.1).
+		 */
+			break;
+	}
+
+	return 0;
+}
+
+/**
+ * __http2_process - deal with all the complete frames we have read
+ * @http: our HTTP object
+ */
+static int
+__http2_process(struct http_t *http)
+{
+	struct http2_conn *h2 = http->conn.h2;
+	unsigned char *p = (unsigned char *)h2->in.buf_head;
+	size_t avail = h2->in.data_len;
+	size_t consumed = 0;
+	uint32_t len;
+
+	while (avail - consumed >= HTTP2_FRAME_HEADER_LEN)
+	{
+		len = __get24(p + consumed);
+
+	/*
+	 * We never raised SETTINGS_MAX_FRAME_SIZE.
+	 */
+		if (len > HTTP2_DEFAULT_FRAME_SIZE)
+			return __http2_connection_error(http, HTTP2_FRAME_SIZE_ERROR);
+
+		if ((avail - consumed) < (HTTP2_FRAME_HEADER_LEN + len))
+			break;
+
+		if (__http2_process_frame(http, p + consumed) < 0)
+			return -1;
+
+		consumed += (HTTP2_FRAME_HEADER_LEN + len);
+	}
+
+	if (consumed)
+		buf_collapse(&h2->in, 0, consumed);
+
+	return __http2_flush(http);
+}
+
+/**
+ * http2_wait - read frames until a stream has its whole response
+ * @http: our HTTP object
+ * @id: the stream identifier
+ *
+ * Frames for the other streams in flight are dealt with as
+ * they arrive. Returns the stream (valid until the next call
+ * to http2_submit() or http2_release()), or NULL if the stream
+ * is unknown or the connection failed.
+ */
+struct http2_stream *
+http2_wait(struct http_t *http, uint32_t id)
+{
+	assert(http);
+
+	struct http2_conn *h2 = http->conn.h2;
+	struct http2_stream *s;
+	ssize_t n;
+
+	if (!h2)
+		return NULL;
+
+	while (1)
+	{
+		if (__http2_process(http) < 0)
+			return NULL;
+
+		if (!(s = __http2_stream(h2, id)))
+			return NULL;
+
+		if (HTTP2_STREAM_WAITING != s->state)
+			return s;
+
+		if (h2->dead)
+			return NULL;
+
+		n = http_recv(http, &h2->in, HTTP2_READ_BLOCK, (http_now_ms() + HTTP2_READ_TIMEOUT_MS));
+
+		if (n <= 0)
+		{
+			h2->dead = 1;
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
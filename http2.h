@@ -0,0 +1,130 @@
+#ifndef HTTP2_H
+#define HTTP2_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "buffer.h"
+#include "hpack.h"
+#include "http.h"
+
+/*
+ * HTTP/2 framing layer (RFC 7540).
+ *
+ * This deals with frames, streams and flow control on a TLS
+ * connection on which the server selected "h2" with ALPN; the
+ * request and response semantics stay in http.c, which hands
+ * us HPACK header blocks and gets back the decoded header
+ * fields and body of each stream.
+ */
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_ALPN_PROTOS "\x02h2\x08http/1.1"
+
+#define HTTP2_FRAME_HEADER_LEN 9
+#define HTTP2_DEFAULT_FRAME_SIZE 16384u
+#define HTTP2_DEFAULT_WINDOW 65535u
+#define HTTP2_MAX_WINDOW 0x7fffffffu
+#define HTTP2_LOCAL_WINDOW (1u << 24) /* Our receive window, per stream and for the connection */
+#define HTTP2_MAX_STREAMS 32 /* Most requests we keep in flight at once */
+#define HTTP2_READ_BLOCK 16384
+#define HTTP2_READ_TIMEOUT_MS 6000 /* Longest we wait without hearing from the server */
+
+enum http2_frame_type
+{
+	HTTP2_DATA = 0x0,
+	HTTP2_HEADERS = 0x1,
+	HTTP2_PRIORITY = 0x2,
+	HTTP2_RST_STREAM = 0x3,
+	HTTP2_SETTINGS = 0x4,
+	HTTP2_PUSH_PROMISE = 0x5,
+	HTTP2_PING = 0x6,
+	HTTP2_GOAWAY = 0x7,
+	HTTP2_WINDOW_UPDATE = 0x8,
+	HTTP2_CONTINUATION = 0x9
+};
+
+#define HTTP2_FLAG_END_STREAM 0x1
+#define HTTP2_FLAG_ACK 0x1
+#define HTTP2_FLAG_END_HEADERS 0x4
+#define HTTP2_FLAG_PADDED 0x8
+#define HTTP2_FLAG_PRIORITY 0x20
+
+enum http2_setting
+{
+	HTTP2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+	HTTP2_SETTINGS_ENABLE_PUSH = 0x2,
+	HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+	HTTP2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+	HTTP2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+	HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+enum http2_error
+{
+	HTTP2_NO_ERROR = 0x0,
+	HTTP2_PROTOCOL_ERROR = 0x1,
+	HTTP2_INTERNAL_ERROR = 0x2,
+	HTTP2_FLOW_CONTROL_ERROR = 0x3,
+	HTTP2_SETTINGS_TIMEOUT = 0x4,
+	HTTP2_STREAM_CLOSED = 0x5,
+	HTTP2_FRAME_SIZE_ERROR = 0x6,
+	HTTP2_REFUSED_STREAM = 0x7,
+	HTTP2_CANCEL = 0x8,
+	HTTP2_COMPRESSION_ERROR = 0x9
+};
+
+enum http2_stream_state
+{
+	HTTP2_STREAM_FREE = 0, /* Slot not in use */
+	HTTP2_STREAM_WAITING, /* Request sent; the response is not complete */
+	HTTP2_STREAM_DONE, /* The server ended the stream */
+	HTTP2_STREAM_RESET /* Reset by the server or refused with GOAWAY */
+};
+
+struct http2_stream
+{
+	uint32_t id;
+	enum http2_stream_state state;
+	int code; /* From the :status pseudo-header */
+	int got_header; /* Any further HEADERS are trailers */
+	uint32_t error; /* Error code of RST_STREAM */
+	size_t unacked; /* Bytes received since our last WINDOW_UPDATE */
+	buf_t header; /* "name: value\r\n" for each regular header field */
+	buf_t body;
+};
+
+struct http2_conn
+{
+	struct http2_stream *streams;
+	int nr_streams;
+	int nr_active;
+	struct hpack_table decoder;
+	buf_t in; /* Bytes read that do not yet make a whole frame */
+	buf_t out;
+	buf_t block; /* Header block split over HEADERS and CONTINUATION */
+	uint32_t block_stream; /* Non-zero while we expect CONTINUATION */
+	int block_end_stream;
+	uint32_t next_stream_id;
+	uint32_t max_concurrent; /* Peer's SETTINGS_MAX_CONCURRENT_STREAMS */
+	uint32_t max_frame_size; /* Peer's SETTINGS_MAX_FRAME_SIZE */
+	int64_t send_window;
+	size_t unacked;
+	uint32_t last_stream_id; /* Last stream the server will process after GOAWAY */
+	int got_settings; /* The server's connection preface has arrived */
+	int goaway;
+	int dead; /* Connection error; nothing more can be done with it */
+};
+
+int http2_start(struct http_t *) __nonnull((1)) __wur;
+void http2_end(struct http_t *) __nonnull((1));
+uint32_t http2_submit(struct http_t *, buf_t *) __nonnull((1,2)) __wur;
+struct http2_stream *http2_wait(struct http_t *, uint32_t) __nonnull((1)) __wur;
+void http2_release(struct http_t *, uint32_t) __nonnull((1));
+int http2_max_streams(struct http_t *) __nonnull((1)) __wur;
+
+/*
+ * Provided by http.c
+ */
+long http_now_ms(void);
+ssize_t http_recv(struct http_t *, buf_t *, size_t, long) __nonnull((1,2));
+
+#endif /* !defined HTTP2_H */
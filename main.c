@@ -1,16 +1,24 @@
 #include <assert.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include "buffer.h"
 #include "cache.h"
 #include "connection.h"
 #include "http.h"
 #include "parse.h"
+#include "pool.h"
+#include "redirect.h"
+#include "resolve.h"
+#include "store.h"
+#include "tls.h"
 #include "wikigrab.h"
 
 #define DEFAULT_PROG_NAME_MAX		512
@@ -20,26 +28,38 @@
 #define __dtor __attribute__((destructor))
 
 static char PROG_NAME[DEFAULT_PROG_NAME_MAX];
+static char *batch_file = NULL;
+static char *article_link = NULL;
+static int nr_jobs = 1;
+static int want_http2 = 0;
+
+uint32_t runtime_options;
 
 wiki_cache_t *http_hcache;
 static http_header_t *cookie;
 
-int SOCK_SET_FLAG_ONCE;
-int SOCK_SSL_SET_FLAG_ONCE;
-
 static void
 __noret usage(int status)
 {
 	printf(
-			"%s <link> [options]\n\n"
+			"%s <link> [options]\n"
+			"%s --batch <file|-> [options]\n\n"
+			"--batch         fetch every link listed in FILE (or stdin if \"-\")\n"
+			"--jobs N        with --batch, fetch N articles concurrently\n"
+			"--http2         use HTTP/2 if the server offers it (one connection,\n"
+			"                many articles in flight with --batch)\n"
 			"-Q              show HTTP request header(s)\n"
 			"-S              show HTTP response headers(s)\n"
 			"--open/-O       open article in text editor when done\n"
 			"--txt           format article in plain text file (default)\n"
 			"--xml           format article in XML\n"
+			"--stream        extract the article while it downloads\n"
+			"                (HTTP/1.1; HTTP/2 responses are extracted whole)\n"
+			"--dom           drop unwanted parts of the article from a parsed\n"
+			"                DOM instead of cutting them out of the HTML text\n"
 			"--print/-P      print the parsed article to stdout\n"
 			"--help/-h       display this information\n",
-			PROG_NAME);
+			PROG_NAME, PROG_NAME);
 
 	exit(status);
 }
@@ -76,6 +96,16 @@ get_runtime_options(int argc, char *argv[])
 			unset_option(OPT_FORMAT_XML);
 		}
 		else
+		if (!strcmp("--stream", argv[i]))
+		{
+			set_option(OPT_STREAM);
+		}
+		else
+		if (!strcmp("--dom", argv[i]))
+		{
+			set_option(OPT_DOM);
+		}
+		else
 		if (!strcmp("--open", argv[i])
 		|| !strcmp("-O", argv[i]))
 		{
@@ -98,6 +128,39 @@ get_runtime_options(int argc, char *argv[])
 			set_option(OPT_OUT_TTY);
 		}
 		else
+		if (!strcmp("--batch", argv[i]))
+		{
+			if ((i + 1) >= argc)
+				usage(EXIT_FAILURE);
+
+			batch_file = argv[++i];
+		}
+		else
+		if (!strcmp("--jobs", argv[i])
+		|| !strcmp("-j", argv[i]))
+		{
+			if ((i + 1) >= argc)
+				usage(EXIT_FAILURE);
+
+			nr_jobs = atoi(argv[++i]);
+
+			if (nr_jobs < 1 || nr_jobs > HTTP_POOL_MAX_JOBS)
+			{
+				fprintf(stderr, "--jobs must be between 1 and %d\n", HTTP_POOL_MAX_JOBS);
+				usage(EXIT_FAILURE);
+			}
+		}
+		else
+		if (!strcmp("--http2", argv[i]))
+		{
+			want_http2 = 1;
+		}
+		else
+		if (argv[i][0] != '-' && !article_link)
+		{
+			article_link = argv[i];
+		}
+		else
 		{
 			continue;
 		}
@@ -136,6 +199,601 @@ check_wikigrab_dir(void)
 	return -1;
 }
 
+static void
+save_redirects(void)
+{
+	if (redirect_map_save() < 0)
+		fprintf(stderr, "Failed to save redirect map\n");
+
+	redirect_map_unload();
+}
+
+/**
+ * load_redirects - map the permanent redirects saved by previous runs
+ *
+ * They live in ~/WIKIGRAB_DIR/REDIRECT_MAP_FILE and anything
+ * new is merged back into that file when we exit.
+ */
+static void
+load_redirects(void)
+{
+	char *home;
+	buf_t tmp_buf;
+
+	if (!(home = getenv("HOME")))
+		return;
+
+	if (buf_init(&tmp_buf, pathconf("/", _PC_PATH_MAX)) < 0)
+		return;
+
+	buf_append(&tmp_buf, home);
+	buf_append(&tmp_buf, WIKIGRAB_DIR "/" REDIRECT_MAP_FILE);
+
+	if (redirect_map_load(tmp_buf.buf_head) < 0)
+		fprintf(stderr, "Failed to load redirect map %s (%s)\n", tmp_buf.buf_head, strerror(errno));
+	else
+		atexit(save_redirects);
+
+	buf_destroy(&tmp_buf);
+}
+
+/**
+ * begin_article - set up the request for an article
+ * @http: our HTTP object
+ * @link: the wiki link to fetch
+ * @meta: what we stored for the article last time is loaded here
+ *
+ * If we already have the article, the request is conditional
+ * and nothing is extracted if the server says it has not
+ * changed since.
+ */
+static int
+begin_article(struct http_t *http, char *link, struct article_meta *meta)
+{
+	if (strlen(link) >= HTTP_URL_MAX)
+	{
+		fprintf(stderr, "fetch_article: link too long\n");
+		return -1;
+	}
+
+	strcpy(http->URL, link);
+	http->ops->URL_parse_page(link, http->page);
+
+	http->if_none_match[0] = 0;
+	http->if_modified_since[0] = 0;
+
+	if (!store_load(link, meta) && !access(meta->path, F_OK))
+	{
+		strcpy(http->if_none_match, meta->etag);
+		strcpy(http->if_modified_since, meta->lastmod);
+	}
+
+	return 0;
+}
+
+/**
+ * finish_article - extract an article from the response we received
+ * @http: our HTTP object
+ * @link: the wiki link we fetched
+ * @meta: filled in by begin_article()
+ * @stream: if not NULL, the body was fed to this as it arrived (--stream)
+ */
+static int
+finish_article(struct http_t *http, char *link, struct article_meta *meta, struct article_stream *stream)
+{
+	char *field;
+
+	if (HTTP_NOT_MODIFIED == http->code)
+	{
+		fprintf(stdout, "Not modified \"%s\"\n", meta->path);
+		goto out;
+	}
+
+	if (HTTP_OK != http->code)
+	{
+		fprintf(stderr, "%s: %s\n", link, http->ops->code_as_string(http));
+		goto fail_check_closed;
+	}
+
+	clear_struct(meta);
+
+	if (stream)
+	{
+		if (article_stream_finish(stream, meta->path) < 0)
+		{
+			fprintf(stderr, "fetch_article: article_stream_finish error\n");
+			goto fail_check_closed;
+		}
+	}
+	else
+	if (extract_wiki_article(http, meta->path) < 0)
+	{
+		fprintf(stderr, "fetch_article: extract_wiki_article error\n");
+		goto fail_check_closed;
+	}
+
+	if ((field = http->ops->fetch_header(http, "etag")))
+		strncpy(meta->etag, field, STORE_VALUE_MAX - 1);
+
+	if ((field = http->ops->fetch_header(http, "last-modified")))
+		strncpy(meta->lastmod, field, STORE_VALUE_MAX - 1);
+
+	if (store_save(link, meta) < 0)
+		fprintf(stderr, "fetch_article: failed to save metadata for %s\n", link);
+
+out:
+
+	if (http_connection_closed(http))
+		http_reconnect(http);
+
+	return 0;
+
+fail_check_closed:
+	if (http_connection_closed(http))
+		http_reconnect(http);
+
+	return -1;
+}
+
+/**
+ * fetch_article - request one article over the current connection and parse it
+ * @http: our HTTP object (already connected)
+ * @link: the wiki link to fetch
+ *
+ * If the server closed the keep-alive connection since our last
+ * request, reconnect once and try again.
+ */
+static int
+fetch_article(struct http_t *http, char *link)
+{
+	assert(http);
+	assert(link);
+
+	struct article_meta meta;
+	struct article_stream *stream = NULL;
+	int retried = 0;
+	int ret;
+
+	if (begin_article(http, link, &meta) < 0)
+		return -1;
+
+/*
+ * Reconnects for us if this article lives on another host.
+ */
+	http_check_host(http);
+
+retry:
+	if (option_set(OPT_STREAM) && !http_using_h2(http))
+	{
+		if (!(stream = article_stream_new(http)))
+			return -1;
+
+		http->body_sink = article_stream_feed;
+		http->body_sink_arg = (void *)stream;
+	}
+
+	ret = http->ops->send_request(http);
+
+	if (!ret)
+		ret = http->ops->recv_response(http);
+
+	http->body_sink = NULL;
+	http->body_sink_arg = NULL;
+
+	if (ret < 0)
+	{
+	/*
+	 * Whatever part of the body it got is thrown away
+	 * with it (as is its file, if it had created one).
+	 */
+		if (stream)
+		{
+			article_stream_destroy(stream);
+			stream = NULL;
+		}
+
+		if (retried)
+			return -1;
+
+		retried = 1;
+
+		if (http_reconnect(http) < 0)
+			return -1;
+
+		goto retry;
+	}
+
+	if (stream && HTTP_OK != http->code)
+	{
+		article_stream_destroy(stream);
+		stream = NULL;
+	}
+
+	ret = finish_article(http, link, &meta, stream);
+
+	if (stream)
+		article_stream_destroy(stream);
+
+	return ret;
+}
+
+/*
+ * An article whose request is in flight on an HTTP/2 connection.
+ */
+struct article_request
+{
+	char *link;
+	int handle; /* From http_submit_request(), or -1 to fetch it on its own */
+	struct article_meta meta;
+};
+
+/**
+ * fetch_multiplexed - fetch articles with many requests in flight on one connection
+ * @http: our HTTP object, connected with HTTP/2
+ * @links: the links to fetch
+ * @nr_links: number of links
+ * @nr_ok: incremented for each article fetched
+ * @nr_failed: incremented for each article we failed to fetch
+ *
+ * Requests are sent ahead of the responses we are reading,
+ * up to as many as the server lets us have open, and the
+ * responses dealt with in the order of the links. We stop at
+ * the first link on another host; if the connection fails,
+ * what is still in flight is fetched one at a time instead.
+ *
+ * Returns the number of links dealt with.
+ */
+static int
+fetch_multiplexed(struct http_t *http, char **links, int nr_links, int *nr_ok, int *nr_failed)
+{
+	struct article_request *reqs;
+	struct article_request *r;
+	char host[HTTP_HOST_MAX+1];
+	int window = http_max_in_flight(http);
+	int degraded = 0;
+	int next = 0;
+	int done = 0;
+	int i;
+
+	if (window < 2 || !(reqs = calloc(window, sizeof(struct article_request))))
+		return 0;
+
+	while (1)
+	{
+		while (!degraded && (next - done) < window && next < nr_links)
+		{
+			http->ops->URL_parse_host(links[next], host);
+
+			if (strcmp(host, http->host))
+				break;
+
+			r = &reqs[next % window];
+			r->link = links[next];
+			r->handle = -1;
+
+			if (!begin_article(http, r->link, &r->meta))
+				r->handle = http_submit_request(http);
+
+			++next;
+		}
+
+		if (done == next)
+			break;
+
+		r = &reqs[done % window];
+
+	/*
+	 * Redirects are followed from http->URL, which
+	 * by now is the last link we sent a request for.
+	 */
+		strcpy(http->URL, r->link);
+		http->ops->URL_parse_page(r->link, http->page);
+
+		if (r->handle >= 0 && http_recv_request(http, r->handle) >= 0)
+		{
+			if (finish_article(http, r->link, &r->meta, NULL) < 0)
+				++(*nr_failed);
+			else
+				++(*nr_ok);
+		}
+		else
+		{
+		/*
+		 * Whatever else is in flight went with the
+		 * connection; get the rest one at a time.
+		 */
+			if (!degraded)
+			{
+				degraded = 1;
+
+				for (i = done; i < next; ++i)
+					reqs[i % window].handle = -1;
+			}
+
+			if (fetch_article(http, r->link) < 0)
+				++(*nr_failed);
+			else
+				++(*nr_ok);
+		}
+
+		++done;
+	}
+
+	free(reqs);
+
+	return done;
+}
+
+static int
+fetch_article_job(struct http_t *http, char *link, void *arg)
+{
+	(void)arg;
+
+	return fetch_article(http, link);
+}
+
+/**
+ * read_batch_links - read the wiki links listed in a file
+ * @fp: stream with one link per line ('#' starts a comment)
+ * @links: the array of links is returned here
+ * @nr_skipped: the number of lines that were not wiki links
+ */
+static int
+read_batch_links(FILE *fp, char ***links, int *nr_skipped)
+{
+	assert(fp);
+	assert(links);
+
+	char line[HTTP_URL_MAX];
+	char **list = NULL;
+	char **tmp;
+	char *p;
+	char *e;
+	int nr = 0;
+	int alloc = 0;
+
+	*nr_skipped = 0;
+
+	while (fgets(line, HTTP_URL_MAX, fp))
+	{
+		p = line;
+		while (isspace(*p))
+			++p;
+
+		e = (p + strlen(p));
+		while (e > p && isspace(*(e - 1)))
+			--e;
+
+		*e = 0;
+
+		if (!*p || *p == '#')
+			continue;
+
+		if (!strstr(p, "/wiki/"))
+		{
+			fprintf(stderr, "Not a wiki link: %s\n", p);
+			++(*nr_skipped);
+			continue;
+		}
+
+		if (nr >= alloc)
+		{
+			alloc = alloc ? (alloc * 2) : 64;
+
+			if (!(tmp = realloc(list, alloc * sizeof(char *))))
+				goto fail;
+
+			list = tmp;
+		}
+
+		if (!(list[nr] = strdup(p)))
+			goto fail;
+
+		++nr;
+	}
+
+	*links = list;
+	return nr;
+
+fail:
+	fprintf(stderr, "read_batch_links: out of memory\n");
+
+	while (nr > 0)
+		free(list[--nr]);
+
+	free(list);
+	return -1;
+}
+
+/**
+ * prefetch_hosts - start the DNS lookups for the hosts in a batch
+ * @http: our HTTP object
+ * @links: the article links
+ * @nr_links: number of links
+ *
+ * These run in the resolver's thread while we fetch, so that
+ * moving on to another host later does not wait on DNS.
+ */
+static void
+prefetch_hosts(struct http_t *http, char **links, int nr_links)
+{
+	char host[HTTP_HOST_MAX+1];
+	char last[HTTP_HOST_MAX+1];
+	int nr_hosts = 0;
+	int i;
+
+	last[0] = 0;
+
+	for (i = 0; i < nr_links && nr_hosts < RESOLVE_MAX_HOSTS; ++i)
+	{
+		http->ops->URL_parse_host(links[i], host);
+
+		if (!host[0] || !strcmp(host, last))
+			continue;
+
+		resolve_prefetch(host);
+		strcpy(last, host);
+		++nr_hosts;
+	}
+}
+
+/**
+ * run_batch - fetch every wiki link listed in a file
+ * @http: our HTTP object, used when fetching one article at a time
+ * @fp: stream with one link per line
+ *
+ * With --jobs 1, all articles go over the one keep-alive
+ * connection in HTTP (with many requests in flight at once
+ * if it speaks HTTP/2). Otherwise the links are shared out
+ * between NR_JOBS workers taking connections from a pool
+ * keyed by host.
+ */
+static int
+run_batch(struct http_t *http, FILE *fp)
+{
+	assert(http);
+	assert(fp);
+
+	char **links = NULL;
+	int nr_links;
+	int nr_ok = 0;
+	int nr_failed = 0;
+	int connected = 0;
+	int i;
+	http_pool_t *pool = NULL;
+	struct tls_stats tls;
+	struct resolve_stats dns;
+	struct buf_stats bufs;
+	struct timespec start;
+	struct timespec end;
+	double elapsed;
+
+	if ((nr_links = read_batch_links(fp, &links, &nr_failed)) < 0)
+		return -1;
+
+	prefetch_hosts(http, links, nr_links);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (nr_jobs > 1)
+	{
+		if (!(pool = http_pool_create(nr_jobs)))
+		{
+			fprintf(stderr, "run_batch: failed to create connection pool\n");
+			goto out_free_links;
+		}
+
+		pool->usingSecure = http->usingSecure;
+		pool->followRedirects = http->followRedirects;
+		pool->version = http->version;
+
+		int pool_failed = 0;
+
+		nr_ok = http_pool_run(pool, links, nr_links, nr_jobs, fetch_article_job, NULL, &pool_failed);
+
+		if (nr_ok < 0)
+		{
+			nr_ok = 0;
+			pool_failed = nr_links;
+		}
+
+		nr_failed += pool_failed;
+
+		http_pool_destroy(pool);
+		pool = NULL;
+	}
+	else
+	{
+		for (i = 0; i < nr_links; ++i)
+		{
+		/*
+		 * Connect lazily to the host of the first article;
+		 * after that, fetch_article() only reconnects when
+		 * the host changes or the server closes on us.
+		 */
+			if (!connected)
+			{
+				http->ops->URL_parse_host(links[i], http->host);
+
+				if (http_connect(http) < 0)
+				{
+					fprintf(stderr, "Failed to connect to %s\n", http->host);
+					++nr_failed;
+					continue;
+				}
+
+				connected = 1;
+			}
+
+			if (http_max_in_flight(http) > 1)
+			{
+				int nr_done = fetch_multiplexed(http, &links[i], (nr_links - i), &nr_ok, &nr_failed);
+
+				if (nr_done > 0)
+				{
+					i += (nr_done - 1);
+					continue;
+				}
+			}
+
+			if (fetch_article(http, links[i]) < 0)
+				++nr_failed;
+			else
+				++nr_ok;
+		}
+
+		if (connected)
+			http_disconnect(http);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (double)(end.tv_sec - start.tv_sec)
+		+ ((double)(end.tv_nsec - start.tv_nsec) / 1000000000.0);
+
+	fprintf(stdout,
+		"Fetched %d article%s (%d failed) in %.2f seconds (%.2f articles/s, %d job%s)\n",
+		nr_ok, nr_ok == 1 ? "" : "s",
+		nr_failed,
+		elapsed,
+		elapsed > 0.0 ? (double)nr_ok / elapsed : 0.0,
+		nr_jobs, nr_jobs == 1 ? "" : "s");
+
+	tls_get_stats(&tls);
+
+	if (tls.handshakes)
+	{
+		fprintf(stdout,
+			"TLS: %lu handshake%s, %lu resumed (%.1f%%)\n",
+			tls.handshakes, tls.handshakes == 1 ? "" : "s",
+			tls.resumed,
+			(double)tls.resumed * 100.0 / (double)tls.handshakes);
+	}
+
+	resolve_get_stats(&dns);
+
+	fprintf(stdout,
+		"DNS: %lu lookup%s, %lu cache hit%s\n",
+		dns.lookups, dns.lookups == 1 ? "" : "s",
+		dns.hits, dns.hits == 1 ? "" : "s");
+
+	buf_get_stats(&bufs);
+
+	fprintf(stdout,
+		"Buffers: %lu allocated, %lu realloc%s (%.1f per article)\n",
+		bufs.allocs,
+		bufs.reallocs, bufs.reallocs == 1 ? "" : "s",
+		nr_ok ? (double)bufs.reallocs / (double)nr_ok : 0.0);
+
+out_free_links:
+	for (i = 0; i < nr_links; ++i)
+		free(links[i]);
+
+	free(links);
+
+	return nr_failed ? -1 : 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -145,12 +803,9 @@ main(int argc, char *argv[])
 	if (argc < 2)
 		usage(EXIT_FAILURE);
 
-	SOCK_SET_FLAG_ONCE = 0;
-	SOCK_SSL_SET_FLAG_ONCE = 0;
-
 	get_runtime_options(argc, argv);
 
-	if (!strstr(argv[1], "/wiki/"))
+	if (!batch_file && (!article_link || !strstr(article_link, "/wiki/")))
 	{
 		fprintf(stderr,
 			"Not a wiki link!\n\n");
@@ -168,16 +823,15 @@ main(int argc, char *argv[])
 		WIKIGRAB_BUILD);
 #endif
 
-	if (check_wikigrab_dir() < 0)
-		goto fail;
-
 	struct http_t *http = NULL;
-	off_t off;
-	int code;
+	FILE *batch_fp = NULL;
 	int exit_ret = EXIT_SUCCESS;
-	int host_max;
 
-	host_max = sysconf(_SC_HOST_NAME_MAX);
+	if (check_wikigrab_dir() < 0)
+		goto fail;
+
+	load_redirects();
+	atexit(tls_fini);
 
 	http = HTTP_new(0xdeadbeef);
 	assert(http);
@@ -186,25 +840,44 @@ main(int argc, char *argv[])
 	http->followRedirects = 1; // automatically follow 3xx status codes
 	http->verb = GET;
 
-	http->URL_parse_host(argv[1], http->host);
-	http->URL_parse_page(argv[1], http->page);
+	if (want_http2)
+		http->version = HTTP_VERSION_2_0;
 
-	if (-1 == http_connect(http))
-		goto fail;
+/*
+ * A server closing an idle keep-alive connection must not
+ * kill us when we next write to it (or send it close_notify).
+ */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (batch_file)
+	{
+		if (!strcmp("-", batch_file))
+			batch_fp = stdin;
+		else
+		if (!(batch_fp = fopen(batch_file, "r")))
+		{
+			fprintf(stderr, "Failed to open \"%s\" (%s)\n", batch_file, strerror(errno));
+			goto fail_delete;
+		}
 
-	http->send_request(http);
-	code = http->recv_response(http);
+		if (run_batch(http, batch_fp) < 0)
+			exit_ret = EXIT_FAILURE;
 
-	if (HTTP_OK != code)
-		goto fail_disconnect;
+		if (batch_fp != stdin)
+			fclose(batch_fp);
 
-	exit_ret = extract_wiki_article(http_rbuf(http));
-	if (exit_ret < 0)
-	{
-		printf("main: extract_wiki_article error\n");
-		goto fail_disconnect;
+		HTTP_delete(http);
+		exit(exit_ret);
 	}
 
+	http->ops->URL_parse_host(article_link, http->host);
+
+	if (-1 == http_connect(http))
+		goto fail_delete;
+
+	if (fetch_article(http, article_link) < 0)
+		goto fail_disconnect;
+
 	http_disconnect(http);
 	HTTP_delete(http);
 	exit(EXIT_SUCCESS);
@@ -213,14 +886,10 @@ fail_disconnect:
 
 	fprintf(stderr, "Disconnecting from remote server\n");
 	http_disconnect(http);
+
+fail_delete:
 	HTTP_delete(http);
 
 fail:
-	if (http)
-	{
-		http_disconnect(http);
-		HTTP_delete(http);
-	}
-
 	exit(EXIT_FAILURE);
 }
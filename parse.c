@@ -3,124 +3,85 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include "buffer.h"
+#include "gapbuf.h"
 #include "html.h"
 #include "http.h"
 #include "parse.h"
+#include "resolve.h"
+#include "scan.h"
 #include "tex.h"
 #include "types.h"
 #include "utils.h"
 #include "wikigrab.h"
 
-#define CONTENT_DATA_SIZE		16384UL
-
-const char *const unwanted_class[] =
+/*
+ * Removed (along with everything inside them) before
+ * we take the content: elements with any of these
+ * classes or ids, and <style>, as it can be embedded
+ * within content we do want.
+ */
+static const struct html_selector unwanted[] =
 {
-	"box-Multiple_issues",
-	"mw-references-wrap",
-	"toc",
-	"mw-empty-elt",
-	"mw-editsection",
-	"reference",
-	"infobox",
-	"navbox",
-	"box-Cleanup",
-	"box-Expand_language",
-	"hatnote",
-	"vertical-navbox",
-	"gallery",
-	NULL
+	{ NULL, "class", "box-Multiple_issues", 0 },
+	{ NULL, "class", "mw-references-wrap", 0 },
+	{ NULL, "class", "toc", 0 },
+	{ NULL, "class", "mw-empty-elt", 0 },
+	{ NULL, "class", "mw-editsection", 0 },
+	{ NULL, "class", "reference", 0 },
+	{ NULL, "class", "infobox", 0 },
+	{ NULL, "class", "navbox", 0 },
+	{ NULL, "class", "box-Cleanup", 0 },
+	{ NULL, "class", "box-Expand_language", 0 },
+	{ NULL, "class", "hatnote", 0 },
+	{ NULL, "class", "vertical-navbox", 0 },
+	{ NULL, "class", "gallery", 0 },
+	{ NULL, "id", "cite_note-FOOTNOTE", 0 },
+	{ NULL, "id", "See_also", 0 },
+	{ NULL, "id", "Notes", 0 },
+	{ NULL, "id", "References", 0 },
+	{ NULL, "id", "External_links", 0 },
+	{ NULL, "id", "coordinates", 0 },
+	{ NULL, "id", "Citations", 0 },
+	{ NULL, "id", "Footnotes", 0 },
+	{ "style", NULL, NULL, 0 }
 };
 
-const char *const unwanted_id[] =
-{
-	"cite_note-FOOTNOTE",
-	"See_also",
-	"Notes",
-	"References",
-	"External_links",
-	"coordinates",
-	"Citations",
-	"Footnotes",
-	NULL
-};
+#define NR_UNWANTED (sizeof(unwanted) / sizeof(unwanted[0]))
 
 int
 sort_content_cache(const void *obj1, const void *obj2)
 {
-	content_t *c1 = (content_t *)obj1;
-	content_t *c2 = (content_t *)obj2;
+	content_t *c1 = *(content_t **)obj1;
+	content_t *c2 = *(content_t **)obj2;
 
 	return (c1->off - c2->off);
 }
 
-int
-content_cache_ctor(void *obj)
-{
-	assert(obj);
-
-	content_t *content = (content_t *)obj;
-
-	if (!(content->data = calloc(CONTENT_DATA_SIZE, 1)))
-		return -1;
-
-#ifdef DEBUG
-	fprintf(stderr,
-		"allocated %lu bytes of memory @ %p (content->data)\n",
-		CONTENT_DATA_SIZE, content->data);
-#endif
-
-	content->data_len = 0;
-	content->alloc_len = CONTENT_DATA_SIZE;
-	content->off = 0;
-
-	return 0;
-}
-
-void
-content_cache_dtor(void *obj)
-{
-	assert(obj);
-
-	content_t *content = (content_t *)obj;
-
-#ifdef DEBUG
-	fprintf(stderr,
-		"freeing content_t object:\n"
-		"ptr: %p\n"
-		"data: %s\n"
-		"len: %lu bytes\n"
-		"off: %lu bytes\n",
-		content->data,
-		content->data,
-		content->data_len,
-		content->off);
-#endif
-
-	if (content->data)
-		free(content->data);
-
-	memset(content, 0, sizeof(*content));
-
-	return;
-}
-
+/*
+ * The value of a value object is only allocated once the
+ * object is used, by __value_alloc(), and it is kept when the
+ * object goes back to the cache.
+ */
 int
 value_cache_ctor(void *obj)
 {
 	assert(obj);
 
 	value_t *val = (value_t *)obj;
-	if (!(val->value = calloc(MAX_VALUE_LEN+1, 1)))
-		return -1;
 
+	val->value = NULL;
 	val->vlen = 0;
 
 	return 0;
@@ -141,110 +102,126 @@ value_cache_dtor(void *obj)
 	return;
 }
 
-#define RESET() (p = savep = buf->buf_head)
+/*
+ * Each thread keeps its content and value caches from one
+ * article to the next: objects are given back (and their
+ * memory kept) rather than the caches being destroyed and
+ * created again, so once a thread has done an article or two
+ * the caches do not allocate anything. They are destroyed
+ * when the thread exits.
+ */
+struct parse_caches
+{
+	wiki_cache_t *content;
+	wiki_cache_t *value;
+	content_t **sorted; /* For putting the content in order */
+	int nr_sorted;
+	buf_t text; /* The text is put together here, then swapped in */
+};
+
+static pthread_key_t parse_caches_key;
+static pthread_once_t parse_caches_once = PTHREAD_ONCE_INIT;
+static __thread struct parse_caches *thread_caches = NULL;
 
 static void
-__remove_html_tags(buf_t *buf)
+__parse_caches_destroy(void *arg)
 {
-	char *p;
-	char *savep;
-	char *tail = buf->buf_tail;
-	size_t range;
-	off_t poff;
+	struct parse_caches *caches = (struct parse_caches *)arg;
 
-	savep = buf->buf_head;
+	if (caches->content)
+		wiki_cache_destroy(caches->content);
 
-	while(1)
-	{
-		p = memchr(savep, 0x3c, (tail - savep));
+	if (caches->value)
+		wiki_cache_destroy(caches->value);
 
-		if (!p || p >= tail)
-			break;
+	if (caches->text.data)
+		buf_destroy(&caches->text);
 
-		if (option_set(OPT_FORMAT_XML))
-		{
-			if (!strncmp(p, "<p", 2)
-			|| !strncmp(p, "<ul", 3)
-			|| !strncmp(p, "<li", 3)
-			|| !strncmp(p, "<table", 6)
-			|| !strncmp(p, "<tbody", 6)
-			|| !strncmp(p, "<tr", 3)
-			|| !strncmp(p, "<td", 3)
-			|| !strncmp(p, "<pre", 4))
-			{
-				/*
-				 * We want to keep the tags, but without the classes, styles, etc.
-				 */
-				savep = p;
+	free(caches->sorted);
+	free(caches);
+
+	return;
+}
 
-				while (!isspace(*savep) && *savep != 0x3e)
-					++savep;
+static void
+__parse_caches_key_create(void)
+{
+	if (pthread_key_create(&parse_caches_key, __parse_caches_destroy) != 0)
+		fprintf(stderr, "__parse_caches_key_create: pthread_key_create error\n");
+}
 
-				p = savep;
+/**
+ * __parse_caches - get the calling thread's caches, creating them the first time
+ */
+static struct parse_caches *
+__parse_caches(void)
+{
+	struct parse_caches *caches;
 
-				if (*p != 0x3e)
-				{
-					savep = p;
+	if (thread_caches)
+		return thread_caches;
 
-					p = memchr(savep, 0x3e, (tail - savep));
+	pthread_once(&parse_caches_once, __parse_caches_key_create);
 
-					if (!p)
-						break;
+	if (!(caches = calloc(1, sizeof(*caches))))
+	{
+		fprintf(stderr, "__parse_caches: failed to allocate memory (%s)\n", strerror(errno));
+		return NULL;
+	}
 
-					range = (p - savep);
+	caches->content = wiki_cache_create(
+			"content_cache",
+			sizeof(content_t),
+			0,
+			NULL,
+			NULL);
 
-					buf_collapse(buf, (off_t)(savep - buf->buf_head), range);
-					tail = buf->buf_tail;
-					p = savep;
-				}
+	caches->value = wiki_cache_create(
+			"value_cache",
+			sizeof(value_t),
+			0,
+			value_cache_ctor,
+			value_cache_dtor);
 
-				continue;
-			}
-			else
-			if (!strncmp("</p", p, 3)
-			|| !strncmp("</ul", p, 4)
-			|| !strncmp("</li", p, 4)
-			|| !strncmp("</table", p, 7)
-			|| !strncmp("</tbody", p, 7)
-			|| !strncmp("</tr", p, 4)
-			|| !strncmp("</td", p, 4)
-			|| !strncmp("</pre", p, 5))
-			{
-				savep = ++p;
-				continue;
-			}
-		}
-		else
-		{
-			if (!strncmp("</li", p, 4)
-			|| !strncmp("</tr", p, 4)
-			|| !strncmp("</td", p, 4)
-			|| !strncmp("</ul", p, 4)
-			|| !strncmp("</pre", p, 5))
-			{
-				poff = (off_t)(p - buf->buf_head);
-				buf_shift(buf, (off_t)(p - buf->buf_head), (size_t)1);
-				tail = buf->buf_tail;
-				p = (buf->buf_head + poff);
-				strncpy(p, "\n", 1);
-				++p;
-			}
-		}
+	if (!caches->content || !caches->value)
+	{
+		__parse_caches_destroy(caches);
+		return NULL;
+	}
 
-		savep = p;
+	pthread_setspecific(parse_caches_key, caches);
+	thread_caches = caches;
 
-		p = memchr(savep, 0x3e, (tail - savep));
+	return caches;
+}
 
-		if (!p)
-			break;
+#define RESET() (p = savep = buf->buf_head)
 
-		++p;
+/*
+ * Move the text between R and END down to W.
+ */
+#define COPY_DOWN(w, r, end) \
+do {\
+	size_t __len = ((end) - (r));\
+	if ((w) != (r))\
+		memmove((w), (r), __len);\
+	(w) += __len;\
+	(r) += __len;\
+} while (0)
 
-		range = (p - savep);
+/*
+ * Finish a pass that moved the text down: what
+ * is left from R goes to W and the end is cut.
+ */
+static void
+__compact_end(buf_t *buf, char *w, char *r)
+{
+	size_t len = (buf->buf_tail - r);
 
-		buf_collapse(buf, (off_t)(savep - buf->buf_head), range);
-		p = savep;
-		tail = buf->buf_tail;
+	if (w != r)
+	{
+		memmove(w, r, len);
+		buf_snip(buf, (size_t)(r - w));
 	}
 
 	return;
@@ -291,44 +268,6 @@ __remove_inline_refs(buf_t *buf)
 }
 #endif
 
-static void
-__remove_html_encodings(buf_t *buf)
-{
-	char *p;
-	char *savep;
-	char *tail = buf->buf_tail;
-	size_t range;
-
-	p = savep = buf->buf_head;
-
-	while(1)
-	{
-		p = strstr(savep, "&#");
-
-		if (!p || p >= tail)
-			break;
-
-		*p++ = 0x20;
-
-		savep = p;
-
-		p = memchr(savep, ';', (tail - savep));
-
-		if (!p)
-			p = (savep + 1);
-		else
-			++p;
-
-		range = (p - savep);
-#ifdef DEBUG
-		printf("removing LINE_BEGIN|%.*s|LINE_END\n", (int)range, savep);
-#endif
-		buf_collapse(buf, (off_t)(savep - buf->buf_head), range);
-		tail = buf->buf_tail;
-		p = savep;
-	}
-}
-
 struct html_entity_t
 {
 	char *entity;
@@ -348,9 +287,12 @@ struct html_entity_t HTML_ENTS[6] =
 static void
 __replace_html_entities(buf_t *buf)
 {
-	char *tail = buf->buf_tail;
+	char *tail;
+	char *r;
+	char *w;
 	char *p;
-	char *savep;
+	size_t elen;
+	size_t skip;
 	int i;
 
 	if (option_set(OPT_FORMAT_XML))
@@ -358,736 +300,1848 @@ __replace_html_entities(buf_t *buf)
 
 	for (i = 0; HTML_ENTS[i].entity != NULL; ++i)
 	{
-		p = savep = buf->buf_head;
+		tail = buf->buf_tail;
+		r = w = buf->buf_head;
+		elen = strlen(HTML_ENTS[i].entity);
 
-		while (1)
+		while (r < tail)
 		{
-			p = strstr(savep, HTML_ENTS[i].entity);
-
-			if (!p || p >= tail)
+			if (!(p = scan_find_byte(r, tail, 0x26)))
 				break;
 
-			*p++ = HTML_ENTS[i]._char;
-			savep = p;
-			p = memchr(savep, ';', (tail - savep));
+			if ((size_t)(tail - p) < elen || memcmp(p, HTML_ENTS[i].entity, elen))
+			{
+				COPY_DOWN(w, r, (p + 1));
+				continue;
+			}
 
-			if (!p)
-				break;
+			COPY_DOWN(w, r, p);
+			*w++ = HTML_ENTS[i]._char;
+			r = (p + elen);
 
-			++p;
+		/*
+		 * This has always carried on looking from where the
+		 * entity ended before it was replaced, so the next
+		 * ELEN - 1 bytes are not looked at; keep it that way.
+		 */
+			skip = (elen - 1);
 
-			buf_collapse(buf, (off_t)(savep - buf->buf_head), (p - savep));
-			tail = buf->buf_tail;
-			savep = p;
+			if (skip > (size_t)(tail - r))
+				skip = (tail - r);
+
+			COPY_DOWN(w, r, (r + skip));
 		}
+
+		__compact_end(buf, w, r);
 	}
+
 	return;
 }
 
 /*
- * buf_shift() could require extending the buffer,
- * and this in turn could result in our data
- * being copied to somewhere else in the heap.
- * So save all the offsets and restore them
- * after the shift.
+ * The cleanup after extraction is one pass over the text:
+ * each of the old filters is a stage that pulls bytes from
+ * the one before it, and what comes out of the last stage
+ * is written back over what has already been read.
+ *
+ *	tags -> "&#...;" -> HTML_ENTS[0] -> ... -> HTML_ENTS[4]
+ *	-> runs of new lines -> whitespace after a space
+ *
+ * Each stage does exactly what the filter it stands in for
+ * did over the whole text, so the output is the same as
+ * running them one after another.
  */
-#define BUF_SHIFT_SAFE(by, optr)\
-do {\
-	size_t __lstart_off = 0;\
-	size_t __lend_off = 0;\
-	size_t __nloff = 0;\
-	size_t __rightoff = 0;\
-	size_t __poff = 0;\
-	size_t __spoff = 0;\
-	if (line_start)\
-		__lstart_off = (line_start - buf->buf_head);\
-	if (line_end)\
-		__lend_off = (line_end - buf->buf_head);\
-	if (new_line)\
-		__nloff = (new_line - buf->buf_head);\
-	if (right)\
-		__rightoff = (right - buf->buf_head);\
-	if (p)\
-		__poff = (p - buf->buf_head);\
-	if (savep)\
-		__spoff = (savep - buf->buf_head);\
-	buf_shift(buf, (off_t)((optr) - buf->buf_head), (by));\
-	if (line_start)\
-		line_start = (buf->buf_head + __lstart_off);\
-	if (line_end)\
-		line_end = (buf->buf_head + __lend_off);\
-	if (new_line)\
-		new_line = (buf->buf_head + __nloff);\
-	if (right)\
-		right = (buf->buf_head + __rightoff);\
-	if (p)\
-		p = (buf->buf_head + __poff);\
-	if (savep)\
-		savep = (buf->buf_head + __spoff);\
-} while(0)
 
-static int
-__count_non_ascii(char *data, char *end)
+/*
+ * First stage: the raw text with the tags taken out.
+ */
+struct clean_tags
 {
-	char *p = data;
-	int count = 0;
+	char *r; /* next byte of the raw text */
+	char *tail;
+	char *copy_end; /* the name of a kept tag ends here... */
+	char *resume; /* ...and then carry on from here */
+	int nl; /* a new line goes out before the next byte */
+	int verbatim; /* no '>' to be found; the rest stays as it is */
+};
 
-	while (p < end)
+struct clean_entity
+{
+	struct html_entity_t *ent;
+	size_t len;
+	size_t skip; /* bytes to let through without looking at them */
+	unsigned char back[8]; /* bytes read ahead and put back */
+	int back_head;
+	int nr_back;
+};
+
+#define NR_CLEAN_ENTITIES 5
+
+struct text_clean
+{
+	struct clean_tags tags;
+	int enc_back; /* byte put back by the "&#...;" stage, or -1 */
+	int no_semi; /* no ';' left for an "&#" to run to */
+	struct clean_entity ents[NR_CLEAN_ENTITIES];
+	int nr_ents;
+	int nr_nl;
+	int after_space;
+};
+
+/*
+ * Deal with the '<' at T->R: the tag goes, or the part of
+ * it that stays is set up to be copied out.
+ */
+static void
+__clean_tag(struct clean_tags *t)
+{
+	char *p = t->r;
+	char *q;
+	char *tail = t->tail;
+	int nl;
+
+	if (option_set(OPT_FORMAT_XML))
 	{
-		if (!isascii(*p))
+		if (!strncmp(p, "<p", 2)
+		|| !strncmp(p, "<ul", 3)
+		|| !strncmp(p, "<li", 3)
+		|| !strncmp(p, "<table", 6)
+		|| !strncmp(p, "<tbody", 6)
+		|| !strncmp(p, "<tr", 3)
+		|| !strncmp(p, "<td", 3)
+		|| !strncmp(p, "<pre", 4))
 		{
-			if ((*p >> 4) == 0x0e)
-				count += 2;
-			else
-				++count;
-		}
+			/*
+			 * We want to keep the tags, but without the classes, styles, etc.
+			 */
+			q = p;
 
-		++p;
-	}
+			while (q < tail && !isspace(*q) && *q != 0x3e)
+				++q;
 
-	return count;
-}
+			t->copy_end = q;
+			t->resume = q;
 
-static int
-__do_format_txt(buf_t *buf)
-{
-	assert(buf);
+			if (q < tail && *q != 0x3e)
+			{
+				if ((q = memchr(q, 0x3e, (tail - q))))
+					t->resume = q;
+				else
+					t->verbatim = 1;
+			}
 
-	char *tail = NULL;
-	char *line_start = NULL;
-	char *line_end = NULL;
-	char *p = NULL;
-	char *savep = NULL;
-	char *left = NULL;
-	char *right = NULL;
-	char *new_line = NULL;
-	size_t line_len;
-	size_t delta;
-	int	gaps = 0;
-	int passes;
-	int remainder;
-	int volte_face = 0;
-	int nr_nascii;
-	size_t ulist_start_len = strlen(BEGIN_ULIST_MARK);
-	size_t ulist_end_len = strlen(END_ULIST_MARK);
-	size_t list_start_len = strlen(BEGIN_LIST_MARK);
-	size_t list_end_len = strlen(END_LIST_MARK);
-	size_t range = 0;
+			return;
+		}
+		else
+		if (!strncmp("</p", p, 3)
+		|| !strncmp("</ul", p, 4)
+		|| !strncmp("</li", p, 4)
+		|| !strncmp("</table", p, 7)
+		|| !strncmp("</tbody", p, 7)
+		|| !strncmp("</tr", p, 4)
+		|| !strncmp("</td", p, 4)
+		|| !strncmp("</pre", p, 5))
+		{
+			t->copy_end = t->resume = (p + 1);
+			return;
+		}
 
-	p = buf->buf_head;
-	if (*p == 0x0a)
+		nl = 0;
+	}
+	else
 	{
-		while (*p == 0x0a && p < tail)
-			++p;
-
-		buf_collapse(buf, (off_t)0, (p - buf->buf_head));
-		tail = buf->buf_tail;
+		nl = (!strncmp("</li", p, 4)
+		|| !strncmp("</tr", p, 4)
+		|| !strncmp("</td", p, 4)
+		|| !strncmp("</ul", p, 4)
+		|| !strncmp("</pre", p, 5));
 	}
 
-	tail = buf->buf_tail;
-	savep = buf->buf_head;
+	if (!(q = memchr(p, 0x3e, (tail - p))))
+		t->verbatim = 1;
+	else
+		t->r = (q + 1);
 
-	while(1)
+	t->nl = nl;
+
+	return;
+}
+
+static int
+__clean_tags_get(struct clean_tags *t)
+{
+	while (1)
 	{
-		p = strstr(savep, BEGIN_ULIST_MARK);
-	
-		if (!p || p >= tail)
-			break;
+		if (t->nl)
+		{
+			t->nl = 0;
+			return 0x0a;
+		}
 
-		buf_collapse(buf, (off_t)(p - buf->buf_head), ulist_start_len);
-		tail = buf->buf_tail;
+		if (t->copy_end)
+		{
+			if (t->r < t->copy_end)
+				return (unsigned char)*t->r++;
 
-		savep = p;
+			t->r = t->resume;
+			t->copy_end = NULL;
+		}
 
-		p = strstr(savep, END_ULIST_MARK);
+		if (t->r >= t->tail)
+			return -1;
 
-		if (!p || p >= tail)
-			break;
+		if (*t->r != 0x3c || t->verbatim)
+			return (unsigned char)*t->r++;
 
-		buf_collapse(buf, (off_t)(p - buf->buf_head), ulist_end_len);
-		tail = buf->buf_tail;
-		savep = p;
+		__clean_tag(t);
 	}
+}
 
-	savep = buf->buf_head;
+/*
+ * "&#...;" becomes a space; if there is no ';' after it
+ * only the "&#" goes.
+ */
+static int
+__clean_encodings_get(struct text_clean *c)
+{
+	struct clean_tags look;
+	int ch;
 
-	while(1)
+	if (c->enc_back >= 0)
 	{
-		p = strstr(savep, BEGIN_LIST_MARK);
+		ch = c->enc_back;
+		c->enc_back = -1;
+	}
+	else
+	{
+		ch = __clean_tags_get(&c->tags);
+	}
 
-		if (!p || p >= tail)
-			break;
+	if (ch != 0x26)
+		return ch;
 
-		buf_collapse(buf, (off_t)(p - buf->buf_head), list_start_len);
-		tail = buf->buf_tail;
+	if ((ch = __clean_tags_get(&c->tags)) != '#')
+	{
+		c->enc_back = ch;
+		return 0x26;
+	}
 
-		savep = p;
+	if (!c->no_semi)
+	{
+		look = c->tags;
 
-		p = strstr(savep, END_LIST_MARK);
+		while ((ch = __clean_tags_get(&look)) >= 0 && ch != ';')
+			;
 
-		if (!p || p >= tail)
-			break;
+		if (ch == ';')
+			c->tags = look;
+		else
+			c->no_semi = 1;
+	}
 
-		strncpy(p, "\n\n", 2);
+	return 0x20;
+}
 
-		buf_collapse(buf, (off_t)((p - buf->buf_head) + 2), (list_end_len - 2));
-		tail = buf->buf_tail;
+static int
+__clean_entity_get(struct text_clean *, int);
 
-		savep = p;
+static int
+__clean_entity_in(struct text_clean *c, int i)
+{
+	struct clean_entity *e = &c->ents[i];
 
-		while (*p == 0x0a)
-			++p;
+	if (e->nr_back)
+	{
+		--e->nr_back;
+		return e->back[e->back_head++];
+	}
 
-		range = (p - savep);
+	if (!i)
+		return __clean_encodings_get(c);
 
-		if (range > 2)
-		{
-			savep += 2;
-			range = (p - savep);
-			buf_collapse(buf, (off_t)(savep - buf->buf_head), range);
-			tail = buf->buf_tail;
-			p = savep;
-		}
+	return __clean_entity_get(c, i - 1);
+}
 
-		savep = p;
-	}
+/*
+ * One HTML_ENTS[] entity replaced. As before, the ELEN - 1
+ * bytes after each one that is replaced are let through
+ * without being looked at.
+ */
+static int
+__clean_entity_get(struct text_clean *c, int i)
+{
+	struct clean_entity *e = &c->ents[i];
+	unsigned char ahead[8];
+	int ch;
+	int n;
 
-	tail = buf->buf_tail;
-	line_start = buf->buf_head;
+	if ((ch = __clean_entity_in(c, i)) < 0)
+		return -1;
 
-	while (1)
+	if (e->skip)
 	{
-		outer_loop_begin:
-		line_end = (line_start + WIKI_ARTICLE_LINE_LENGTH);
+		--e->skip;
+		return ch;
+	}
 
-		if (line_end > tail)
-			line_end = tail;
+	if (ch != 0x26)
+		return ch;
 
-		if (line_start >= line_end)
+	for (n = 0; (size_t)n < (e->len - 1); )
+	{
+		if ((ch = __clean_entity_in(c, i)) < 0)
 			break;
 
-		savep = line_start;
+		ahead[n++] = (unsigned char)ch;
 
-		/*
-		 * Remove new lines occuring within our
-		 * new line length.
-		 */
-		while (1)
-		{
-			if (savep >= line_end)
-				break;
+		if (ch != (unsigned char)e->ent->entity[n])
+			break;
+	}
 
-			p = memchr(savep, 0x0a, (line_end - savep));
+	if ((size_t)n == (e->len - 1) && ch == (unsigned char)e->ent->entity[n])
+	{
+		e->skip = (e->len - 1);
+		return (unsigned char)e->ent->_char;
+	}
 
-			if (!p)
-				break;
+	/*
+	 * Not this entity; look at what came after the '&' again.
+	 */
+	if (n)
+	{
+		memmove(e->back + n, e->back + e->back_head, e->nr_back);
+		memcpy(e->back, ahead, n);
+		e->back_head = 0;
+		e->nr_back += n;
+	}
 
-		/*
-		 * Then it's the end of a paragraph.
-		 * Leave it alone and go to 
-		 */
-			if (*(p+1) == 0x0a)
-			{
-				while (*p == 0x0a)
-					++p;
+	return 0x26;
+}
 
-				line_start = savep = p;
-				goto outer_loop_begin;
-			}
+static int
+__clean_get(struct text_clean *c)
+{
+	int ch;
 
-			*p++ = 0x20;
-			savep = p;
-		}
+	while (1)
+	{
+		if (c->nr_ents)
+			ch = __clean_entity_get(c, c->nr_ents - 1);
+		else
+			ch = __clean_encodings_get(c);
 
-		/*
-		 * LINE_START + WIKI_ARTICLE_LINE_LENGTH may
-		 * happen to already be on a new line.
-		 */
-		if (*line_end == 0x0a)
+	/*
+	 * At most two new lines in a row...
+	 */
+		if (ch == 0x0a)
 		{
-			new_line = line_end;
+			if (c->nr_nl >= 2)
+				continue;
 
-			while (*line_end == 0x0a)
-				++line_end;
+			++c->nr_nl;
 		}
 		else
-		if (*line_end == 0x20)
 		{
-			new_line = line_end;
-
-			*line_end++ = 0x0a;
+			c->nr_nl = 0;
 		}
-		else
-		if (line_end < tail)
-		{
-			/*
-			 * Find the nearest space backwards.
-			 */
-			while (*line_end != 0x20 && line_end > (line_start + 1))
-				--line_end;
 
-			if (line_end == line_start)
-			{
-				line_end += WIKI_ARTICLE_LINE_LENGTH;
+	/*
+	 * ...and no whitespace after a space.
+	 */
+		if (c->after_space && ch >= 0 && isspace(ch))
+			continue;
 
-				BUF_SHIFT_SAFE(1, line_end);
-				tail = buf->buf_tail;
+		c->after_space = (ch == 0x20);
 
-				*line_end++ = 0x0a;
+		return ch;
+	}
+}
 
-				while (*line_end == 0x0a)
-					++line_end;
+/*
+ * Nothing is waiting in any of the stages,
+ * so text with nothing for them to do can
+ * be moved down as it is.
+ */
+static int
+__clean_idle(struct text_clean *c)
+{
+	int i;
 
-				line_start = line_end;
+	if (c->tags.nl || c->tags.copy_end || c->enc_back >= 0)
+		return 0;
 
-				continue;
-			}
+	for (i = 0; i < c->nr_ents; ++i)
+	{
+		if (c->ents[i].skip || c->ents[i].nr_back)
+			return 0;
+	}
 
-			new_line = line_end;
+	return 1;
+}
 
-			*line_end++ = 0x0a;
+/**
+ * __clean_text - remove tags, encodings, entities and excess whitespace
+ * @buf: the extracted text
+ *
+ * Does in one pass what __remove_html_tags(), __remove_html_encodings(),
+ * __replace_html_entities(), remove_excess_nl() and remove_excess_sp()
+ * did in turn.
+ */
+static void
+__clean_text(buf_t *buf)
+{
+	assert(buf);
+
+	struct text_clean c;
+	char *w = buf->buf_head;
+	char *tail;
+	char *r;
+	off_t woff;
+	off_t roff;
+	off_t coff = 0;
+	off_t resoff = 0;
+	struct scan_set stop;
+	struct scan_set white;
+	struct scan_set space;
+	uint64_t white_mask = 0;
+	uint64_t space_mask = 0;
+	uint64_t stop_mask = 0;
+	uint64_t mask;
+	char *blk;
+	char *blk_end;
+	int off;
+	int run;
+	int nr_nl;
+	int after_space;
+	int ch;
+	int i;
+
+	memset(&c, 0, sizeof(c));
+	c.tags.r = buf->buf_head;
+	blk = blk_end = buf->buf_head;
+	c.tags.tail = buf->buf_tail;
+	c.enc_back = -1;
+
+	if (!option_set(OPT_FORMAT_XML))
+	{
+		for (i = 0; i < NR_CLEAN_ENTITIES; ++i)
+		{
+			c.ents[i].ent = &HTML_ENTS[i];
+			c.ents[i].len = strlen(HTML_ENTS[i].entity);
 		}
 
-		if (line_end >= tail)
-			line_end = new_line = tail;
+		c.nr_ents = NR_CLEAN_ENTITIES;
+	}
 
-		line_len = (new_line - line_start);
-		nr_nascii = __count_non_ascii(line_start, new_line);
-		if (nr_nascii > 0)
-			line_len -= (nr_nascii >> 1);
+	scan_set_init(&stop, "<&\n");
+	scan_set_init(&white, " \t\n\v\f\r");
+	scan_set_init(&space, " ");
 
-		delta = (WIKI_ARTICLE_LINE_LENGTH - line_len);
+	while (1)
+	{
+		if (__clean_idle(&c))
+		{
+			r = c.tags.r;
+			tail = c.tags.tail;
+			nr_nl = c.nr_nl;
+			after_space = c.after_space;
 
 		/*
-		 * Needs justified.
+		 * With nothing held up in the stages before them,
+		 * the last two see the raw bytes unless there is
+		 * a tag or an entity to deal with.
 		 */
-		if (delta > 0)
-		{
-			p = savep = line_start;
-			gaps = 0;
-
-			while (1)
+			while (r < tail)
 			{
-				p = memchr(savep, 0x20, (new_line - savep));
-
-				if (!p)
-					break;
-
-				++gaps;
+			/*
+			 * Move down what is before the first tag, entity,
+			 * new line or whitespace after a space in the
+			 * next block; none of it is changed.
+			 */
+				if (r < blk_end || (tail - r) >= SCAN_BLOCK)
+				{
+					if (r >= blk_end)
+					{
+						blk = r;
+						blk_end = (r + SCAN_BLOCK);
+						white_mask = scan_block(blk, &white);
+						space_mask = scan_block(blk, &space);
+						stop_mask = scan_block(blk, &stop);
+					}
 
-				while (*p == 0x20)
-					++p;
+					off = (r - blk);
+					mask = (((white_mask & (space_mask << 1)) >> off) & ~(uint64_t)1);
+					mask |= ((white_mask >> off) & (uint64_t)after_space);
+					mask |= (stop_mask >> off);
 
-				if (p >= new_line)
-					break;
+					run = (mask ? __builtin_ctzll(mask) : (SCAN_BLOCK - off));
 
-				savep = p;
-			}
+					if (run)
+					{
+						COPY_DOWN(w, r, (r + run));
+						nr_nl = 0;
+						after_space = (w[-1] == 0x20);
 
-			if (line_len < (WIKI_ARTICLE_LINE_LENGTH / 3))
-			{
-				line_start = line_end;
-				continue;
-			}
+						continue;
+					}
+				}
 
-			if (!gaps)
-			{
-				line_start = line_end;
-				continue;
-			}
+				ch = (unsigned char)*r;
 
-			passes = (delta / gaps);
-			remainder = (delta % gaps);
+				if (ch == 0x3c && !c.tags.verbatim)
+				{
+					c.tags.r = r;
+					__clean_tag(&c.tags);
+					r = c.tags.r;
 
-			p = savep = line_start;
-			while (passes > 0)
-			{
-				p = memchr(savep, 0x20, (new_line - savep));
+					if (c.tags.nl || c.tags.copy_end)
+						break;
 
-				if (!p)
-				{
-					--passes;
-					p = savep = line_start;
 					continue;
 				}
 
-				BUF_SHIFT_SAFE(1, p);
-				tail = buf->buf_tail;
-				++line_end;
-				++new_line;
-
-				*p++ = 0x20;
-
-				while (*p == 0x20)
-					++p;
-
-				if (p >= new_line)
+				if (ch == 0x26)
 					break;
 
-				savep = p;
-			}
+				++r;
 
-			if (remainder)
-			{
-				left = line_start;
-				right = new_line;
-				volte_face = 0;
+				if (ch == 0x0a)
+				{
+					if (nr_nl >= 2)
+						continue;
 
-				while (remainder)
+					++nr_nl;
+				}
+				else
 				{
-					if (!volte_face)
-					{
-						p = memchr(left, 0x20, (right - left));
-
-						if (!p)
-						{
-							left = line_start;
-							right = (new_line - 1);
-							volte_face = 0;
-							continue;
-						}
-					}
-					else
-					{
-						p = right;
-						while (*p != 0x20 && p > left)
-							--p;
-
-						if (p == left)
-						{
-							left = line_start;
-							right = (new_line - 1);
-							volte_face = 0;
-							continue;
-						}
-					}
+					nr_nl = 0;
+				}
 
-					BUF_SHIFT_SAFE(1, p);
-					tail = buf->buf_tail;
+				if (after_space && isspace(ch))
+					continue;
 
-					++line_end;
-					++new_line;
-					++right;
+				after_space = (ch == 0x20);
+				*w++ = (char)ch;
+			}
 
-					*p++ = 0x20;
-					--remainder;
+			c.tags.r = r;
+			c.nr_nl = nr_nl;
+			c.after_space = after_space;
+		}
 
-					if (!volte_face)
-					{
-						while (*p == 0x20)
-							++p;
+		if ((ch = __clean_get(&c)) < 0)
+			break;
 
-						left = p;
+	/*
+	 * Only a closing tag with no '>' after it can
+	 * give back more than it took; make room.
+	 */
+		if (w >= c.tags.r)
+		{
+			woff = (w - buf->buf_head);
+			roff = (c.tags.r - buf->buf_head);
 
-						volte_face = 1;
-					}
-					else
-					{
-						while (*p == 0x20)
-							--p;
+			if (c.tags.copy_end)
+			{
+				coff = (c.tags.copy_end - buf->buf_head);
+				resoff = (c.tags.resume - buf->buf_head);
+			}
 
-						right = p;
+			buf_shift(buf, roff, (size_t)1);
 
-						volte_face = 0;
-					}
-				} /* while(remainder) */
-			} /* if (remainder) */
-		} /* if (delta > 0) */
+			w = (buf->buf_head + woff);
+			c.tags.r = (buf->buf_head + roff + 1);
+			c.tags.tail = buf->buf_tail;
+			blk = blk_end = buf->buf_head;
 
-		line_start = line_end;
+			if (c.tags.copy_end)
+			{
+				c.tags.copy_end = (buf->buf_head + coff + 1);
+				c.tags.resume = (buf->buf_head + resoff + 1);
+			}
+		}
 
-		if (line_end == tail)
-			break;
-	} /* while(1) */
+		*w++ = (char)ch;
+	}
 
-	__replace_html_entities(buf);
+	__compact_end(buf, w, c.tags.tail);
 
-	return 0;
+	return;
 }
 
 static int
-__extract_area(buf_t *sbuf, buf_t *dbuf, char *const open_pattern, char *const close_pattern)
+__count_non_ascii(char *data, char *end)
 {
-	assert(sbuf);
-	assert(dbuf);
-	assert(open_pattern);
-	assert(close_pattern);
+	char *p = data;
+	int count = 0;
 
-	char *p;
-	char *savep;
-	char *tail = sbuf->buf_tail;
-	char *search_from;
-	int depth = 0;
-	buf_t tmp_buf;
-	char *tmp_tail;
-	buf_t first_part;
-	size_t op_len;
-	char *save_start;
-	char *save_close;
+	while (p < end)
+	{
+		if (!isascii(*p))
+		{
+			if ((*p >> 4) == 0x0e)
+				count += 2;
+			else
+				++count;
+		}
 
-/*
- * 1. SEARCH FOR OPEN PATTERN.
- * 2. IF NONE FOUND, GOTO END.
- * 3. SEARCH RANGE [OPENPATTERN+1,TAIL) FOR CLOSE PATTERN.
- * 4. IF NONE FOUND, GOTO FAIL
- * 5. SEARCH RANGE [OPENPATTERN+1, CLOSINGPATTERN) FOR MORE OPEN PATTERNS.
- * 6. IF MORE, SEARCH RANGE [CLOSINGPATTERN+1,TAIL) FOR EQUAL # OF CLOSING PATTERNS, ELSE GOTO END.
- * 7. SEARCH RANGE [CLOSINGPATTERN+1,CLOSINGPATTERN') FOR MORE OPEN PATTERNS.
- * 8. GOTO 6.
- * 9. END.
- * 10. FAIL
- *
- */
+		++p;
+	}
 
-	if (buf_init(&tmp_buf, DEFAULT_TMP_BUF_SIZE) < 0)
-		goto fail;
+	return count;
+}
 
-	if (buf_init(&first_part, 32) < 0)
-		goto fail_release_bufs;
+/*
+ * A line that still needs justified is less than
+ * WIKI_ARTICLE_LINE_LENGTH characters, which is at
+ * most twice that in bytes, and will get fewer than
+ * WIKI_ARTICLE_LINE_LENGTH spaces added to it.
+ */
+#define FORMAT_LINE_MAX (WIKI_ARTICLE_LINE_LENGTH * 4)
 
-	p = open_pattern;
-	op_len = strlen(open_pattern);
-	while (!isspace(*p) && p < (open_pattern + op_len))
-		++p;
+#define LINE_OPEN_GAP(ptr)\
+do {\
+	memmove((ptr) + 1, (ptr), (size_t)((new_line - (ptr)) + 1));\
+	++new_line;\
+} while(0)
 
-/*
- * Open_pattern may be something like "<div id=\"mw-content-text\""
- * So extract the "<div" part so we can search ranges for more div tags.
+/**
+ * __justify_line - add DELTA spaces to the gaps in a line
+ * @line_start: start of the line
+ * @line_tail: pointer to the end of the line; updated
+ * @delta: the number of spaces to add
+ *
+ * A space goes into every gap from left to right for as
+ * many rounds as there are spaces for, and what is left
+ * over goes in alternately from the left and right ends.
+ * There must be room for DELTA more bytes after the line,
+ * and one byte that is not a space either side of it.
  */
-	buf_append_ex(&first_part, open_pattern, (p - open_pattern));
+static void
+__justify_line(char *line_start, char **line_tail, size_t delta)
+{
+	char *new_line = *line_tail;
+	char *p;
+	char *savep;
+	char *left;
+	char *right;
+	int gaps = 0;
+	int passes;
+	int remainder;
+	int volte_face = 0;
+	int reset = 0;
 
-	search_from = sbuf->buf_head;
+	savep = line_start;
 
-	p = strstr(search_from, open_pattern);
+	while (1)
+	{
+		p = memchr(savep, 0x20, (new_line - savep));
 
-	if (!p)
-		goto out;
+		if (!p)
+			break;
 
-	save_start = p;
-	search_from = ++p;
-	p = strstr(search_from, close_pattern);
+		++gaps;
 
-	if (!p || p >= tail)
-	{
-		fprintf(stderr, "__extract_area: failed to find closing tag for \"%s\"\n", open_pattern);
-		goto fail;
+		while (*p == 0x20)
+			++p;
+
+		if (p >= new_line)
+			break;
+
+		savep = p;
 	}
 
-	save_close = p;
+	if (!gaps)
+		return;
 
-	/*
-	 * Copy range [SEARCH_FROM,CLOSINGTAG) into temp buffer
-	 * so we can search for more open patterns.
-	 */
-	buf_append_ex(&tmp_buf, search_from, (save_close - search_from));
-	p = savep = tmp_buf.buf_head;
-	tmp_tail = tmp_buf.buf_tail;
+	passes = (delta / gaps);
+	remainder = (delta % gaps);
 
-	while(1)
+	p = savep = line_start;
+	while (passes > 0)
 	{
-		/*
-		 * Search range in the temp buffer for more open patterns.
-		 */
-		while(1)
+		p = memchr(savep, 0x20, (new_line - savep));
+
+		if (!p)
 		{
-			p = strstr(savep, first_part.buf_head);
+			--passes;
+			p = savep = line_start;
+			continue;
+		}
 
-			if (!p || p >= tmp_tail)
-				break;
+		LINE_OPEN_GAP(p);
 
-			++depth;
+		*p++ = 0x20;
 
-			savep = ++p;
-		}
+		while (*p == 0x20)
+			++p;
 
-		if (!depth) /* done */
+		if (p >= new_line)
 			break;
 
-		search_from = (save_close + 1);
-		savep = search_from;
+		savep = p;
+	}
 
-		while (depth > 0)
-		{
-			p = strstr(savep, close_pattern);
+	left = line_start;
+	right = new_line;
 
-			if (!p || p >= tail)
-				break;
+	while (remainder)
+	{
+		if (!volte_face)
+		{
+			p = (right > left ? memchr(left, 0x20, (right - left)) : NULL);
 
-			--depth;
+			if (!p)
+			{
+			/*
+			 * Starting again from both ends without having
+			 * found anywhere to put a space since last time.
+			 */
+				if (reset)
+					break;
 
-			save_close = p;
-			savep = ++p;
+				left = line_start;
+				right = (new_line - 1);
+				reset = 1;
+				continue;
+			}
 		}
-
-		if (depth) /* error */
+		else
 		{
-			fprintf(stderr, "__extract_area: failed to find matching closing tag for \"%s\"\n", first_part.buf_head);
-			goto fail;
-		}
-
-		buf_clear(&tmp_buf);
-		buf_append_ex(&tmp_buf, search_from, (save_close - search_from));
-		tmp_tail = tmp_buf.buf_tail;
-		savep = tmp_buf.buf_head;
-	}
+			p = right;
+			while (*p != 0x20 && p > left)
+				--p;
 
-	buf_clear(&tmp_buf);
-	buf_append_ex(dbuf, save_start, (save_close - save_start));
+			if (p == left)
+			{
+				if (reset)
+					break;
 
-	out:
-	buf_destroy(&tmp_buf);
-	buf_destroy(&first_part);
-	return 0;
+				left = line_start;
+				right = (new_line - 1);
+				volte_face = 0;
+				reset = 1;
+				continue;
+			}
+		}
 
-	fail_release_bufs:
-	buf_destroy(&tmp_buf);
-	buf_destroy(&first_part);
+		LINE_OPEN_GAP(p);
+		++right;
 
-	fail:
-	return -1;
-}
+		*p++ = 0x20;
+		--remainder;
+		reset = 0;
 
-static void
-__normalise_file_title(buf_t *buf)
-{
-	assert(buf);
+		if (!volte_face)
+		{
+			while (*p == 0x20)
+				++p;
 
-	char *tail = buf->buf_tail;
-	char *p = buf->buf_head;
+			left = p;
 
-	p = buf->buf_head;
-	while (p < tail)
-	{
-		if (*p == 0x20
-		|| (*p != 0x5f && !isalpha(*p) && !isdigit(*p) && isascii(*p)))
+			volte_face = 1;
+		}
+		else
 		{
-			*p++ = 0x5f;
-			if (*(p-2) == 0x5f)
-			{
+			while (*p == 0x20)
 				--p;
-				buf_collapse(buf, (off_t)(p - buf->buf_head), (size_t)1);
-				tail = buf->buf_tail;
-			}
 
-			continue;
-		}
+			right = p;
 
-		++p;
+			volte_face = 0;
+		}
 	}
 
-	p = (buf->buf_tail - 1);
-	while (!isalpha(*p) && !isdigit(*p))
-		--p;
-
-	++p;
-
-	if ((buf->buf_tail - p) > 0)
-		buf_snip(buf, (buf->buf_tail - p));
-
-	if (option_set(OPT_FORMAT_XML))
-		buf_append(buf, ".xml");
-	else
-		buf_append(buf, ".txt");
+	*line_tail = new_line;
 
 	return;
 }
 
+/**
+ * __wrap_lines - wrap the text at WIKI_ARTICLE_LINE_LENGTH and justify it
+ * @buf: the text
+ *
+ * The text is read once and the lines written out to a
+ * new buffer, which then replaces the old one; only the
+ * line being justified is ever moved around, in a buffer
+ * of its own.
+ */
 static int
-parse_maths_expressions(buf_t *buf)
+__wrap_lines(buf_t *buf)
 {
 	assert(buf);
 
-	char *exp_start;
-	char *exp_end;
-	char *savep;
+	buf_t out;
+	char line[FORMAT_LINE_MAX + 2];
 	char *tail = buf->buf_tail;
-	buf_t tmp;
-	size_t elen;
-	size_t tlen;
-	off_t sp_off;
-	off_t off;
-
-	savep = buf->buf_head;
+	char *line_start = buf->buf_head;
+	char *line_end;
+	char *new_line = NULL;
+	char *p;
+	char *savep;
+	size_t line_len;
+	size_t delta;
+	int nr_nascii;
 
-	if (buf_init(&tmp, 1024) < 0)
-		goto fail;
+	if (buf_init(&out, buf->data_len + (buf->data_len >> 1) + 1) < 0)
+		return -1;
 
 	while (1)
 	{
-		exp_start = strstr(savep, "{\\displaystyle");
+		outer_loop_begin:
+		line_end = (line_start + WIKI_ARTICLE_LINE_LENGTH);
+
+		if (line_end > tail)
+			line_end = tail;
 
-		if (!exp_start || exp_start >= tail)
+		if (line_start >= line_end)
 			break;
 
-		exp_end = nested_closing_char(exp_start, buf->buf_tail, '{', '}');
+		savep = line_start;
 
-		if (!exp_end)
-			break;
+		/*
+		 * Remove new lines occuring within our
+		 * new line length.
+		 */
+		while (savep < line_end)
+		{
+			p = memchr(savep, 0x0a, (line_end - savep));
 
-		elen = (exp_end - exp_start);
+			if (!p)
+				break;
 
-		buf_append_ex(&tmp, exp_start+1, ((exp_end - exp_start) - 1));
-		*(tmp.buf_tail) = 0;
+		/*
+		 * Then it's the end of a paragraph; leave the
+		 * rest of the line as it is.
+		 */
+			if (*(p+1) == 0x0a)
+			{
+				while (*p == 0x0a)
+					++p;
 
-		if (tex_replace_symbols(&tmp) < 0)
-		{
-			fprintf(stderr, "parse_maths_expressions: tex_replace_symbols error\n");
-			goto fail;
+				buf_append_ex(&out, line_start, (p - line_start));
+				line_start = p;
+				goto outer_loop_begin;
+			}
+
+			*p++ = 0x20;
+			savep = p;
 		}
 
-		tlen = tmp.data_len;
-		if (elen > tlen)
+		/*
+		 * LINE_START + WIKI_ARTICLE_LINE_LENGTH may
+		 * happen to already be on a new line.
+		 */
+		if (*line_end == 0x0a)
 		{
-			memcpy(exp_start, tmp.buf_head, tlen);
-			exp_start += tlen;
-			buf_collapse(buf, (off_t)(exp_start - buf->buf_head), (elen - tlen));
-			tail = buf->buf_tail;
+			new_line = line_end;
+
+			while (*line_end == 0x0a)
+				++line_end;
 		}
 		else
+		if (*line_end == 0x20)
 		{
-			sp_off = (off_t)(savep - buf->buf_head);
-			off = (off_t)(exp_start - buf->buf_head);
-			buf_shift(buf, off, (tlen - elen));
-			exp_start = (buf->buf_head + off);
-			memcpy(exp_start, tmp.buf_head, tlen);
-			exp_start += tlen;
-			savep = (buf->buf_head + sp_off);
-			tail = buf->buf_tail;
+			new_line = line_end;
+
+			*line_end++ = 0x0a;
 		}
+		else
+		if (line_end < tail)
+		{
+			/*
+			 * Find the nearest space backwards.
+			 */
+			while (*line_end != 0x20 && line_end > (line_start + 1))
+				--line_end;
 
-		savep = exp_start;
-		buf_clear(&tmp);
+			/*
+			 * One word longer than the line; break it at the
+			 * line length, but not inside a UTF-8 sequence.
+			 */
+			if (*line_end != 0x20)
+			{
+				line_end = (line_start + WIKI_ARTICLE_LINE_LENGTH);
+
+				while (((unsigned char)*line_end & 0xc0) == 0x80 && line_end > (line_start + 1))
+					--line_end;
+
+				buf_append_ex(&out, line_start, (line_end - line_start));
+				buf_append_ex(&out, "\n", 1);
+
+				line_start = line_end;
+
+				continue;
+			}
+
+			new_line = line_end;
+
+			*line_end++ = 0x0a;
+		}
+
+		if (line_end >= tail)
+			line_end = new_line = tail;
+
+		line_len = (new_line - line_start);
+		nr_nascii = __count_non_ascii(line_start, new_line);
+		if (nr_nascii > 0)
+			line_len -= (nr_nascii >> 1);
+
+		/*
+		 * If the text ends just after a new line at the
+		 * end of the line, that new line is counted here.
+		 * (DELTA is unsigned; don't let it wrap.)
+		 */
+		if (line_len > WIKI_ARTICLE_LINE_LENGTH)
+			line_len = WIKI_ARTICLE_LINE_LENGTH;
+
+		delta = (WIKI_ARTICLE_LINE_LENGTH - line_len);
+
+		/*
+		 * Needs justified (but not if it's the short
+		 * last line of a paragraph).
+		 */
+		if (delta > 0 && line_len >= (WIKI_ARTICLE_LINE_LENGTH / 3))
+		{
+			char *line_tail = &line[1 + (new_line - line_start)];
+
+			assert(((new_line - line_start) + delta) < FORMAT_LINE_MAX);
+
+			line[0] = 0;
+			memcpy(&line[1], line_start, (new_line - line_start));
+			*line_tail = 0;
+
+			__justify_line(&line[1], &line_tail, delta);
+
+			buf_append_ex(&out, &line[1], (line_tail - &line[1]));
+			buf_append_ex(&out, new_line, (line_end - new_line));
+		}
+		else
+		{
+			buf_append_ex(&out, line_start, (line_end - line_start));
+		}
+
+		line_start = line_end;
+
+		if (line_end == tail)
+			break;
+	}
+
+	buf_destroy(buf);
+	memcpy(buf, &out, sizeof(out));
+
+	return 0;
+}
+
+static int
+__do_format_txt(buf_t *buf)
+{
+	assert(buf);
+
+	char *tail = NULL;
+	char *p = NULL;
+	char *savep = NULL;
+	gap_buf_t text;
+	size_t ulist_start_len = strlen(BEGIN_ULIST_MARK);
+	size_t ulist_end_len = strlen(END_ULIST_MARK);
+	size_t list_start_len = strlen(BEGIN_LIST_MARK);
+	size_t list_end_len = strlen(END_LIST_MARK);
+	size_t range = 0;
+	off_t off;
+
+	p = buf->buf_head;
+	if (*p == 0x0a)
+	{
+		while (*p == 0x0a && p < tail)
+			++p;
+
+		buf_collapse(buf, (off_t)0, (p - buf->buf_head));
+		tail = buf->buf_tail;
+	}
+
+/*
+ * There is a pair of marks around every list and every
+ * item in one; take them out in a gap buffer so that
+ * each one costs as much as the mark rather than the
+ * rest of the text.
+ */
+	if (gap_init(&text, buf->buf_head, buf->data_len) < 0)
+		return -1;
+
+	off = 0;
+
+	while(1)
+	{
+		savep = gap_seek(&text, off);
+		p = strstr(savep, BEGIN_ULIST_MARK);
+	
+		if (!p)
+			break;
+
+		off += (p - savep);
+		gap_collapse(&text, off, ulist_start_len);
+
+		savep = gap_seek(&text, off);
+		p = strstr(savep, END_ULIST_MARK);
+
+		if (!p)
+			break;
+
+		off += (p - savep);
+		gap_collapse(&text, off, ulist_end_len);
+	}
+
+	off = 0;
+
+	while(1)
+	{
+		savep = gap_seek(&text, off);
+		p = strstr(savep, BEGIN_LIST_MARK);
+
+		if (!p)
+			break;
+
+		off += (p - savep);
+		gap_collapse(&text, off, list_start_len);
+
+		savep = gap_seek(&text, off);
+		p = strstr(savep, END_LIST_MARK);
+
+		if (!p)
+			break;
+
+		off += (p - savep);
+
+		if (gap_replace(&text, off, list_end_len, "\n\n", 2) < 0)
+			goto fail_destroy_text;
+
+		p = savep = gap_seek(&text, off);
+
+		while (*p == 0x0a)
+			++p;
+
+		range = (p - savep);
+
+		if (range > 2)
+		{
+			off += 2;
+			gap_collapse(&text, off, (range - 2));
+		}
+		else
+		{
+			off += range;
+		}
+	}
+
+	if (gap_to_buf(&text, buf) < 0)
+		goto fail_destroy_text;
+
+	gap_destroy(&text);
+
+	if (__wrap_lines(buf) < 0)
+		return -1;
+
+	__replace_html_entities(buf);
+
+	return 0;
+
+	fail_destroy_text:
+	gap_destroy(&text);
+
+	return -1;
+}
+
+static int
+__extract_area(buf_t *sbuf, buf_t *dbuf, char *const open_pattern, char *const close_pattern)
+{
+	assert(sbuf);
+	assert(dbuf);
+	assert(open_pattern);
+	assert(close_pattern);
+
+	char *p;
+	char *savep;
+	char *tail = sbuf->buf_tail;
+	char *search_from;
+	int depth = 0;
+	buf_t tmp_buf;
+	char *tmp_tail;
+	buf_t first_part;
+	size_t op_len;
+	char *save_start;
+	char *save_close;
+
+/*
+ * 1. SEARCH FOR OPEN PATTERN.
+ * 2. IF NONE FOUND, GOTO END.
+ * 3. SEARCH RANGE [OPENPATTERN+1,TAIL) FOR CLOSE PATTERN.
+ * 4. IF NONE FOUND, GOTO FAIL
+ * 5. SEARCH RANGE [OPENPATTERN+1, CLOSINGPATTERN) FOR MORE OPEN PATTERNS.
+ * 6. IF MORE, SEARCH RANGE [CLOSINGPATTERN+1,TAIL) FOR EQUAL # OF CLOSING PATTERNS, ELSE GOTO END.
+ * 7. SEARCH RANGE [CLOSINGPATTERN+1,CLOSINGPATTERN') FOR MORE OPEN PATTERNS.
+ * 8. GOTO 6.
+ * 9. END.
+ * 10. FAIL
+ *
+ */
+
+	if (buf_init(&tmp_buf, DEFAULT_TMP_BUF_SIZE) < 0)
+		goto fail;
+
+	if (buf_init(&first_part, 32) < 0)
+		goto fail_release_bufs;
+
+	p = open_pattern;
+	op_len = strlen(open_pattern);
+	while (!isspace(*p) && p < (open_pattern + op_len))
+		++p;
+
+/*
+ * Open_pattern may be something like "<div id=\"mw-content-text\""
+ * So extract the "<div" part so we can search ranges for more div tags.
+ */
+	buf_append_ex(&first_part, open_pattern, (p - open_pattern));
+
+	search_from = sbuf->buf_head;
+
+	p = strstr(search_from, open_pattern);
+
+	if (!p)
+		goto out;
+
+	save_start = p;
+	search_from = ++p;
+	p = strstr(search_from, close_pattern);
+
+	if (!p || p >= tail)
+	{
+		fprintf(stderr, "__extract_area: failed to find closing tag for \"%s\"\n", open_pattern);
+		goto fail;
+	}
+
+	save_close = p;
+
+	/*
+	 * Copy range [SEARCH_FROM,CLOSINGTAG) into temp buffer
+	 * so we can search for more open patterns.
+	 */
+	buf_append_ex(&tmp_buf, search_from, (save_close - search_from));
+	p = savep = tmp_buf.buf_head;
+	tmp_tail = tmp_buf.buf_tail;
+
+	while(1)
+	{
+		/*
+		 * Search range in the temp buffer for more open patterns.
+		 */
+		while(1)
+		{
+			p = strstr(savep, first_part.buf_head);
+
+			if (!p || p >= tmp_tail)
+				break;
+
+			++depth;
+
+			savep = ++p;
+		}
+
+		if (!depth) /* done */
+			break;
+
+		search_from = (save_close + 1);
+		savep = search_from;
+
+		while (depth > 0)
+		{
+			p = strstr(savep, close_pattern);
+
+			if (!p || p >= tail)
+				break;
+
+			--depth;
+
+			save_close = p;
+			savep = ++p;
+		}
+
+		if (depth) /* error */
+		{
+			fprintf(stderr, "__extract_area: failed to find matching closing tag for \"%s\"\n", first_part.buf_head);
+			goto fail;
+		}
+
+		buf_clear(&tmp_buf);
+		buf_append_ex(&tmp_buf, search_from, (save_close - search_from));
+		tmp_tail = tmp_buf.buf_tail;
+		savep = tmp_buf.buf_head;
+	}
+
+	buf_clear(&tmp_buf);
+	buf_append_ex(dbuf, save_start, (save_close - save_start));
+
+	out:
+	buf_destroy(&tmp_buf);
+	buf_destroy(&first_part);
+	return 0;
+
+	fail_release_bufs:
+	buf_destroy(&tmp_buf);
+	buf_destroy(&first_part);
+
+	fail:
+	return -1;
+}
+
+static void
+__normalise_file_title(buf_t *buf)
+{
+	assert(buf);
+
+	char *tail = buf->buf_tail;
+	char *p = buf->buf_head;
+
+	p = buf->buf_head;
+	while (p < tail)
+	{
+		if (*p == 0x20
+		|| (*p != 0x5f && !isalpha(*p) && !isdigit(*p) && isascii(*p)))
+		{
+			*p++ = 0x5f;
+			if (*(p-2) == 0x5f)
+			{
+				--p;
+				buf_collapse(buf, (off_t)(p - buf->buf_head), (size_t)1);
+				tail = buf->buf_tail;
+			}
+
+			continue;
+		}
+
+		++p;
+	}
+
+	p = (buf->buf_tail - 1);
+	while (!isalpha(*p) && !isdigit(*p))
+		--p;
+
+	++p;
+
+	if ((buf->buf_tail - p) > 0)
+		buf_snip(buf, (buf->buf_tail - p));
+
+	if (option_set(OPT_FORMAT_XML))
+		buf_append(buf, ".xml");
+	else
+		buf_append(buf, ".txt");
+
+	return;
+}
+
+/*
+ * A maths-heavy article has thousands of these, so the
+ * text is edited in a gap buffer, where replacing each
+ * one costs about as much as the expression itself.
+ */
+static int
+parse_maths_expressions(buf_t *buf)
+{
+	assert(buf);
+
+	char *exp_start;
+	char *exp_end;
+	char *savep;
+	gap_buf_t text;
+	buf_t tmp;
+	size_t elen;
+	off_t off = 0;
+
+	if (gap_init(&text, buf->buf_head, buf->data_len) < 0)
+		goto fail;
+
+	if (buf_init(&tmp, 1024) < 0)
+		goto fail_destroy_text;
+
+	while (1)
+	{
+		savep = gap_seek(&text, off);
+		exp_start = strstr(savep, "{\\displaystyle");
+
+		if (!exp_start)
+			break;
+
+		exp_end = nested_closing_char(exp_start, text.buf_end, '{', '}');
+
+		if (!exp_end)
+			break;
+
+		elen = (exp_end - exp_start);
+
+		buf_append_ex(&tmp, exp_start+1, ((exp_end - exp_start) - 1));
+		*(tmp.buf_tail) = 0;
+
+		if (tex_replace_symbols(&tmp) < 0)
+		{
+			fprintf(stderr, "parse_maths_expressions: tex_replace_symbols error\n");
+			goto fail_destroy_tmp;
+		}
+
+		off += (exp_start - savep);
+
+		if (gap_replace(&text, off, elen, tmp.buf_head, tmp.data_len) < 0)
+			goto fail_destroy_tmp;
+
+		off += tmp.data_len;
+		buf_clear(&tmp);
+	}
+
+	if (gap_to_buf(&text, buf) < 0)
+		goto fail_destroy_tmp;
+
+	buf_destroy(&tmp);
+	gap_destroy(&text);
+
+	return 0;
+
+	fail_destroy_tmp:
+	buf_destroy(&tmp);
+
+	fail_destroy_text:
+	gap_destroy(&text);
+
+	fail:
+	return -1;
+}
+
+static void
+__set_value(value_t *val, char *str)
+{
+	size_t len = strlen(str);
+
+	if (len >= MAX_VALUE_LEN)
+		len = (MAX_VALUE_LEN - 1);
+
+	memcpy(val->value, str, len);
+	val->value[len] = 0;
+	val->vlen = len;
+
+	return;
+}
+
+/**
+ * __fill_article_header - get the values shown at the top of the article
+ * @http: the HTTP object holding the response
+ * @buf: the page, at least as far as the end of its <head>
+ * @article_header: the values are set here
+ * @file_title: the path of the file to create is appended here
+ */
+static int
+__fill_article_header(struct http_t *http, buf_t *buf, struct article_header *article_header, buf_t *file_title)
+{
+	char *field;
+	char date_string[64];
+	char inet4_string[INET_ADDRSTRLEN];
+	char inet6_string[INET6_ADDRSTRLEN];
+	char *home;
+	char *tag_content_ptr;
+	char *_p;
+	time_t now;
+	struct tm tm;
+	struct sockaddr_in sock4;
+	struct sockaddr_in6 sock6;
+	struct resolve_result res;
+	buf_t tmp_buf;
+	size_t vlen;
+	size_t len;
+	int gotv4 = 0;
+	int gotv6 = 0;
+	int i;
+
+	if (buf_init(&tmp_buf, DEFAULT_TMP_BUF_SIZE) < 0)
+		goto fail;
+
+	home = getenv("HOME");
+	buf_append(file_title, home);
+	buf_append(file_title, WIKIGRAB_DIR);
+	buf_append(file_title, "/");
+
+	if (!(tag_content_ptr = html_get_tag_content(buf, "<title")))
+	{
+		fprintf(stderr, "__fill_article_header: no <title> in page\n");
+		goto fail;
+	}
+
+	if ((_p = strstr(tag_content_ptr, " - Wiki")))
+		*_p = 0;
+
+	buf_append(&tmp_buf, tag_content_ptr);
+	__normalise_file_title(&tmp_buf);
+
+	buf_append(file_title, tmp_buf.buf_head);
+	buf_destroy(&tmp_buf);
+
+	vlen = strlen(tag_content_ptr);
+
+	if (vlen < MAX_VALUE_LEN)
+		len = vlen;
+	else
+		len = (MAX_VALUE_LEN - 1);
+
+	strncpy(article_header->title->value, tag_content_ptr, len);
+	article_header->title->value[len] = 0;
+	article_header->title->vlen = len;
+
+	tag_content_ptr = html_get_tag_field(buf, "<meta name=\"generator\"", "content");
+
+	vlen = strlen(tag_content_ptr);
+
+	if (vlen < MAX_VALUE_LEN)
+		len = vlen;
+	else
+		len = (MAX_VALUE_LEN - 1);
+
+	strncpy(article_header->generator->value, tag_content_ptr, len);
+	article_header->generator->value[len] = 0;
+	article_header->generator->vlen = len;
+
+	__set_value(article_header->server_name, http->host);
+
+	if ((field = http->ops->fetch_header(http, "last-modified")))
+		__set_value(article_header->lastmod, field);
+	else
+		__set_value(article_header->lastmod, "None");
+
+	time(&now);
+	gmtime_r(&now, &tm);
+	strftime(date_string, sizeof(date_string), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	__set_value(article_header->downloaded, date_string);
+
+	if (article_header->server_name->value[0])
+	{
+		clear_struct(&sock4);
+		clear_struct(&sock6);
+
+	/*
+	 * We have just fetched the article from this host,
+	 * so this comes from the resolver cache.
+	 */
+		if (resolve_host(article_header->server_name->value, &res) == 0)
+		{
+			for (i = 0; i < res.nr_addrs; ++i)
+			{
+				if (!gotv4 && res.addrs[i].family == AF_INET)
+				{
+					memcpy(&sock4, &res.addrs[i].addr, sizeof(sock4));
+					gotv4 = 1;
+				}
+				else
+				if (!gotv6 && res.addrs[i].family == AF_INET6)
+				{
+					memcpy(&sock6, &res.addrs[i].addr, sizeof(sock6));
+					gotv6 = 1;
+				}
+			}
+		}
+	}
+
+	if (gotv4)
+		strcpy(article_header->server_ipv4->value, inet_ntop(AF_INET, &sock4.sin_addr, inet4_string, INET_ADDRSTRLEN));
+	else
+		strcpy(article_header->server_ipv4->value, "None");
+
+	if (gotv6)
+		strcpy(article_header->server_ipv6->value, inet_ntop(AF_INET6, sock6.sin6_addr.s6_addr, inet6_string, INET6_ADDRSTRLEN));
+	else
+		strcpy(article_header->server_ipv6->value, "None");
+
+	return 0;
+
+	fail:
+	return -1;
+}
+
+/*
+ * What we take from the article.
+ */
+static const struct html_selector article_selectors[] =
+{
+	/* The article paragraphs */
+	{ "p", NULL, NULL, 0 },
+	/*
+	 * Seems to be used for things like quotations ("<dl>...<i>quotation</i></dl>")
+	 * Do not extract <i></i>, however, because that can be embedded within
+	 * <p></p> tags which can result in <i></i> content being repeated several
+	 * times in the output text.
+	 */
+	{ "dl", NULL, NULL, 1 },
+	/* Content that should retain its formatting (such as source code examples) */
+	{ "pre", NULL, NULL, 0 },
+	/* List items */
+	{ "li", NULL, NULL, 1 },
+	/* The section headlines */
+	{ NULL, "class", "mw-headline", 0 },
+	{ NULL, "class", "quotebox-quote", 0 }
+};
+
+#define NR_ARTICLE_SELECTORS (sizeof(article_selectors) / sizeof(article_selectors[0]))
+
+static const struct html_selector maths_selector =
+{
+	"annotation", "encoding", "application/x-tex", 0
+};
+
+/**
+ * __extract_content - turn the HTML of (part of) the article into text
+ * @caches: the thread's caches; the pieces we keep come from the content cache
+ * @content_buf: the HTML on entry; the text, not yet formatted, on return
+ *
+ * Every piece is given back to the content cache before we return.
+ */
+static int
+__extract_content(struct parse_caches *caches, buf_t *content_buf)
+{
+	wiki_cache_t *content_cache = caches->content;
+	struct html_doc doc;
+	content_t **sorted;
+	buf_t tmp;
+	int i;
+
+	if (option_set(OPT_DOM))
+	{
+	/*
+	 * Flag what we don't want instead of cutting
+	 * it out of the text (and moving the rest).
+	 */
+		if (html_tokenize(content_buf, &doc) < 0)
+			goto fail;
+
+		if (html_dom_remove(&doc, unwanted, NR_UNWANTED) < 0)
+			goto fail_release_doc;
+	}
+	else
+	{
+		if (html_remove_elements(content_buf, unwanted, NR_UNWANTED) < 0)
+			goto fail;
+
+		if (html_tokenize(content_buf, &doc) < 0)
+			goto fail;
+	}
+
+	if (html_tok_get_all(content_cache, &doc, article_selectors, NR_ARTICLE_SELECTORS) < 0)
+		goto fail_release_doc;
+
+/*
+ * Use this instead of taking <math> tags because we can end up with several
+ * duplicate equations sometimes due to one being here and one also being
+ * elsewhere (not bounded in <>)
+ */
+	int nr_maths = 0;
+	if ((nr_maths = html_tok_get_all(content_cache, &doc, &maths_selector, 1)) < 0)
+		goto fail_release_doc;
+
+	//if (html_get_all(content_cache, content_buf, "<table", "</table") < 0)
+		//goto fail;
+
+/*
+ * Now sort the extracted content by offset from start of buffer.
+ * The objects stay where they are in the cache's slabs; it is
+ * pointers to them that are sorted.
+ */
+	int nr_used = wiki_cache_nr_used(content_cache);
+	content_t *cp = NULL;
+	size_t total = 0;
+
+	if (nr_used >= caches->nr_sorted)
+	{
+		if (!(sorted = realloc(caches->sorted, (nr_used + 1) * sizeof(content_t *))))
+			goto fail_release_doc;
+
+		caches->sorted = sorted;
+		caches->nr_sorted = (nr_used + 1);
+	}
+
+	sorted = caches->sorted;
+
+	for (i = 0; i < nr_used; ++i)
+	{
+		sorted[i] = cp = (content_t *)wiki_cache_next_used(content_cache, (void *)cp);
+		total += (cp->len + 2);
+	}
+
+	qsort((void *)sorted,
+				(size_t)nr_used,
+				sizeof(content_t *),
+				sort_content_cache);
+
+/*
+ * The pieces are views of CONTENT_BUF, so the text is put
+ * together in the thread's other buffer, which is then
+ * swapped with it.
+ */
+	if (!caches->text.data)
+	{
+		if (buf_init(&caches->text, DEFAULT_TMP_BUF_SIZE) < 0)
+			goto fail_release_doc;
+	}
+	else
+	{
+		buf_clear(&caches->text);
+	}
+
+	if (buf_reserve(&caches->text, total) < 0)
+		goto fail_release_doc;
+
+	for (i = 0; i < nr_used; ++i)
+	{
+		cp = sorted[i];
+
+		if (cp->el >= 0)
+		{
+			if (html_tok_append(&doc, cp->el, &caches->text) < 0)
+				goto fail_release_doc;
+		}
+		else
+		{
+			buf_append_ex(&caches->text, content_buf->buf_head + cp->off, cp->len);
+		}
+
+		buf_append(&caches->text, "\n\n");
+	}
+
+	html_tok_release(&doc);
+
+	tmp = *content_buf;
+	*content_buf = caches->text;
+	caches->text = tmp;
+
+	wiki_cache_clear_all(content_cache);
+
+	if (nr_maths > 0)
+		parse_maths_expressions(content_buf);
+
+	__clean_text(content_buf);
+
+	return 0;
+
+	fail_release_doc:
+	html_tok_release(&doc);
+
+	fail:
+	wiki_cache_clear_all(content_cache);
+
+	return -1;
+}
+
+/**
+ * __format_article_header - write the header that goes before the article text
+ * @buffer: the header is written here (DEFAULT_TMP_BUF_SIZE bytes)
+ * @article_header: the values to show
+ * @pad: number of spaces to put at the end of the line with the content length
+ */
+static void
+__format_article_header(char *buffer, struct article_header *article_header, int pad)
+{
+	if (option_set(OPT_FORMAT_XML))
+	{
+		sprintf(buffer,
+			"%s\n"
+			"<wiki>\n"
+			"\t<metadata>\n"
+			"\t\t<meta name=\"Title\" content=\"%s\"/>\n"
+			"\t\t<meta name=\"Parser\" content=\"WikiGrab v%s\"/>\n"
+			"\t\t<meta name=\"Server\" content=\"%s\"/>\n"
+			"\t\t<meta name=\"Server-ipv4\" content=\"%s\"/>\n"
+			"\t\t<meta name=\"Server-ipv6\" content=\"%s\"/>\n"
+			"\t\t<meta name=\"Generator\" content=\"%s\"/>\n"
+			"\t\t<meta name=\"Modified\" content=\"%s\"/>\n"
+			"\t\t<meta name=\"Downloaded\" content=\"%s\"/>\n"
+			"\t\t<meta name=\"Length\" content=\"%s\"/>%*s\n"
+			"\t</metadata>\n"
+			"\t<text>\n",
+			XML_START_LINE,
+			article_header->title->value,
+			WIKIGRAB_BUILD,
+			article_header->server_name->value,
+			article_header->server_ipv4->value,
+			article_header->server_ipv6->value,
+			article_header->generator->value,
+			article_header->lastmod->value,
+			article_header->downloaded->value,
+			article_header->content_len->value, pad, "");
+	}
+	else
+	{
+		int title_offset = ((WIKI_ARTICLE_LINE_LENGTH - article_header->title->vlen) / 2);
+		int title_width = (title_offset + (int)article_header->title->vlen);
+		char wgb[64];
+
+		sprintf(wgb, "WikiGrab v%s", WIKIGRAB_BUILD);
+		
+		sprintf(buffer,
+			"\n%*s\n\n"
+			"  {\n"
+			"    \"server\" : \"%s\",\n"
+			"    \"v4-addr\" : \"%s\",\n"
+			"    \"v6-addr\" : \"%s\",\n"
+			"    \"last-modified\" : \"%s\",\n"
+			"    \"generator\" : \"%s\",\n"
+			"    \"content-length\" : \"%s bytes\",%*s\n"
+			"    \"downloaded\" : \"%s\"\n"
+			"  }\n"
+			"\n\n"
+			"%*s\n\n\n",
+			WIKI_ARTICLE_LINE_LENGTH, wgb,
+			article_header->server_name->value,
+			article_header->server_ipv4->value,
+			article_header->server_ipv6->value,
+			article_header->lastmod->value,
+			article_header->generator->value,
+			article_header->content_len->value, pad, "",
+			article_header->downloaded->value,
+			title_width, article_header->title->value);
 	}
 
-	buf_destroy(&tmp);
+	return;
+}
+
+/*
+ * Get a value from the cache with an empty string in it.
+ */
+static value_t *
+__value_alloc(wiki_cache_t *value_cache)
+{
+	value_t *val;
+
+	if (!(val = (value_t *)wiki_cache_alloc(value_cache)))
+		return NULL;
+
+	if (!val->value && !(val->value = malloc(MAX_VALUE_LEN+1)))
+	{
+		wiki_cache_dealloc(value_cache, (void *)val);
+		return NULL;
+	}
+
+	val->value[0] = 0;
+	val->vlen = 0;
+
+	return val;
+}
+
+/**
+ * __article_header_alloc - get the values of an article header from a cache
+ * @value_cache: the cache
+ * @article_header: the header whose values are allocated
+ */
+static int
+__article_header_alloc(wiki_cache_t *value_cache, struct article_header *article_header)
+{
+	if (!(article_header->title = __value_alloc(value_cache)) ||
+	    !(article_header->server_name = __value_alloc(value_cache)) ||
+	    !(article_header->server_ipv4 = __value_alloc(value_cache)) ||
+	    !(article_header->server_ipv6 = __value_alloc(value_cache)) ||
+	    !(article_header->generator = __value_alloc(value_cache)) ||
+	    !(article_header->lastmod = __value_alloc(value_cache)) ||
+	    !(article_header->downloaded = __value_alloc(value_cache)) ||
+	    !(article_header->content_len = __value_alloc(value_cache)))
+		return -1;
+
 	return 0;
+}
 
-	fail:
-	return -1;
+/**
+ * __article_header_free - give the values of an article header back to their cache
+ * @value_cache: the cache
+ * @article_header: the header
+ */
+static void
+__article_header_free(wiki_cache_t *value_cache, struct article_header *article_header)
+{
+	value_t **vals[] =
+	{
+		&article_header->title,
+		&article_header->server_name,
+		&article_header->server_ipv4,
+		&article_header->server_ipv6,
+		&article_header->generator,
+		&article_header->content_len,
+		&article_header->lastmod,
+		&article_header->downloaded
+	};
+	size_t i;
+
+	for (i = 0; i < (sizeof(vals) / sizeof(vals[0])); ++i)
+	{
+		if (*vals[i])
+			wiki_cache_dealloc(value_cache, (void *)*vals[i]);
+
+		*vals[i] = NULL;
+	}
+}
+
+/*
+ * The most pieces of the article we write out in one go.
+ */
+#define ARTICLE_IOV_MAX 4
+
+/**
+ * __write_iov - write out pieces of the article with as few writev() calls as we can
+ * @fd: the article file
+ * @iov: the pieces, as they are in memory; the array is used up
+ * @nr_iov: the number of pieces
+ */
+static int
+__write_iov(int fd, struct iovec *iov, int nr_iov)
+{
+	ssize_t n;
+
+	while (nr_iov)
+	{
+		if ((n = writev(fd, iov, nr_iov)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+	/*
+	 * Short write; carry on from where it stopped.
+	 */
+		while (nr_iov && (size_t)n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			++iov;
+			--nr_iov;
+		}
+
+		if (nr_iov)
+		{
+			iov->iov_base = ((char *)iov->iov_base + n);
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
 }
 
+/**
+ * extract_wiki_article - parse the article in an HTTP response and write it out
+ * @http: the HTTP object holding the response
+ * @path: if not NULL, the path of the file written is copied here (PATH_MAX bytes)
+ */
 int
-extract_wiki_article(buf_t *buf)
+extract_wiki_article(struct http_t *http, char *path)
 {
+	buf_t *buf = &http_rbuf(http);
 	int out_fd = -1;
 	buf_t file_title;
 	buf_t content_buf;
-	static char inet6_string[INET6_ADDRSTRLEN];
 	char *buffer = NULL;
-	char *home;
-	struct sockaddr_in sock4;
-	struct sockaddr_in6 sock6;
-	struct addrinfo *ainf = NULL;
-	struct addrinfo *aip = NULL;
-	int gotv4 = 0;
-	int gotv6 = 0;
-	int i;
-	wiki_cache_t *value_cache = NULL;
-	wiki_cache_t *content_cache = NULL;
+	struct parse_caches *caches;
 	struct article_header article_header;
-	size_t vlen;
-	size_t len;
-	char *tag_content_ptr;
+	struct iovec iov[ARTICLE_IOV_MAX];
+	char *tail;
+	int nr_iov = 0;
 
 	if (!(buffer = calloc(DEFAULT_TMP_BUF_SIZE, 1)))
 	{
@@ -1096,359 +2150,742 @@ extract_wiki_article(buf_t *buf)
 	}
 
 	clear_struct(&article_header);
+	clear_struct(&content_buf);
+	clear_struct(&file_title);
+
+	if (!(caches = __parse_caches()))
+	{
+		free(buffer);
+		goto fail;
+	}
 
 	/*
 	 * Extract data for display
 	 * at top of the article.
 	 */
-	value_cache = wiki_cache_create(
-			"value_cache",
-			sizeof(value_t),
-			0,
-			value_cache_ctor,
-			value_cache_dtor);
+	if (__article_header_alloc(caches->value, &article_header) < 0)
+		goto fail_release_mem;
 
-	content_cache = wiki_cache_create(
-			"content_cache",
-			sizeof(content_t),
-			0,
-			content_cache_ctor,
-			content_cache_dtor);
-
-	article_header.title = (value_t *)wiki_cache_alloc(value_cache, &article_header.title);
-	article_header.server_name = (value_t *)wiki_cache_alloc(value_cache, &article_header.server_name);
-	article_header.server_ipv4 = (value_t *)wiki_cache_alloc(value_cache, &article_header.server_ipv4);
-	article_header.server_ipv6 = (value_t *)wiki_cache_alloc(value_cache, &article_header.server_ipv6);
-	article_header.generator = (value_t *)wiki_cache_alloc(value_cache, &article_header.generator);
-	article_header.lastmod = (value_t *)wiki_cache_alloc(value_cache, &article_header.lastmod);
-	article_header.downloaded = (value_t *)wiki_cache_alloc(value_cache, &article_header.downloaded);
-	article_header.content_len = (value_t *)wiki_cache_alloc(value_cache, &article_header.content_len);
+	if (buf_init(&content_buf, DEFAULT_TMP_BUF_SIZE) < 0)
+		goto fail_release_mem;
+
+	if (buf_init(&file_title, pathconf("/", _PC_PATH_MAX)) < 0)
+		goto fail_release_mem;
+
+	if (__fill_article_header(http, buf, &article_header, &file_title) < 0)
+		goto fail_release_mem;
+
+	if ((out_fd = open(file_title.buf_head, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR)) < 0)
+		goto fail_release_mem;
+
+	if (__extract_area(buf, &content_buf, "<div id=\"mw-content-text\"", "</div") < 0)
+		goto out_destroy_file;
+
+	if (__extract_content(caches, &content_buf) < 0)
+		goto out_destroy_file;
+
+/*
+ * The header, the text and (for XML) the end of the
+ * document are written out together from where they
+ * are rather than being copied into one buffer.
+ */
+	if (option_set(OPT_FORMAT_XML))
+	{
+		sprintf(article_header.content_len->value, "%lu", content_buf.data_len + 16);
+		article_header.content_len->vlen = strlen(article_header.content_len->value);
+	}
+	else
+	{
+		__do_format_txt(&content_buf);
+
+		sprintf(article_header.content_len->value, "%lu", content_buf.data_len);
+		article_header.content_len->vlen = strlen(article_header.content_len->value);
+	}
+
+	__format_article_header(buffer, &article_header, 0);
+
+	iov[nr_iov].iov_base = buffer; /* Our article header */
+	iov[nr_iov++].iov_len = strlen(buffer);
+
+	tail = content_buf.buf_tail;
+
+	if (option_set(OPT_FORMAT_XML))
+	{
+		iov[nr_iov].iov_base = content_buf.buf_head;
+		iov[nr_iov++].iov_len = (tail - content_buf.buf_head);
+		iov[nr_iov].iov_base = "</text>\n</wiki>";
+		iov[nr_iov++].iov_len = 15;
+	}
+	else
+	{
+	/*
+	 * Leave out the new lines at the end of the article.
+	 */
+		while (tail > content_buf.buf_head && *(tail - 1) == 0x0a)
+			--tail;
+
+		iov[nr_iov].iov_base = content_buf.buf_head;
+		iov[nr_iov++].iov_len = (tail - content_buf.buf_head);
+	}
+
+	if (__write_iov(out_fd, iov, nr_iov) < 0)
+	{
+		fprintf(stderr, "extract_wiki_article: failed to write to file (%s)\n", strerror(errno));
+		goto out_destroy_file;
+	}
+
+	close(out_fd);
+	out_fd = -1;
+
+	fprintf(stdout, "Created file \"%s\"\n", file_title.buf_head);
+
+	if (path)
+	{
+		strncpy(path, file_title.buf_head, PATH_MAX - 1);
+		path[PATH_MAX - 1] = 0;
+	}
+
+	__article_header_free(caches->value, &article_header);
+
+	buf_destroy(&content_buf);
+	buf_destroy(&file_title);
+
+	free(buffer);
+	buffer = NULL;
+
+	return 0;
+
+	out_destroy_file:
+
+	if (ftruncate(out_fd, (off_t)0) < 0)
+		;
+	close(out_fd);
+	out_fd = -1;
+	unlink(file_title.buf_head);
+
+	fail_release_mem:
+	buf_destroy(&content_buf);
+	buf_destroy(&file_title);
+
+	free(buffer);
+	buffer = NULL;
+
+	__article_header_free(caches->value, &article_header);
+
+	fail:
+	return -1;
+}
+
+/*
+ * Incremental extraction (--stream).
+ *
+ * The body is handed to article_stream_feed() as it arrives.
+ * Once we have the <head> we write the article header (with
+ * room left for the content length, which we learn last);
+ * inside mw-content-text we follow the nesting of elements
+ * and, each time there are STREAM_SEGMENT_MIN bytes of whole
+ * blocks (paragraphs, lists, tables, ...), run them through
+ * the same extraction as extract_wiki_article() and append
+ * the text to the file. Nothing else of the page is kept.
+ */
+enum stream_state
+{
+	STREAM_HEAD = 0, /* Waiting for the end of <head> */
+	STREAM_BODY, /* Looking for mw-content-text */
+	STREAM_CONTENT, /* Inside mw-content-text */
+	STREAM_DONE /* Past the end of it */
+};
+
+struct article_stream
+{
+	struct http_t *http;
+	enum stream_state state;
+	buf_t in; /* Bytes received that we have not finished with */
+	buf_t work; /* The blocks being extracted */
+	buf_t file_title;
+	wiki_cache_t *value_cache; /* The creating thread's; the stream must stay on it */
+	struct article_header article_header;
+	char *header;
+	int out_fd;
+	size_t header_len; /* Bytes reserved for the header at the start of the file */
+	size_t content_len; /* Bytes of text after the header */
+	int held_nl; /* New lines ending the text so far that are not written yet */
+	int depth; /* Elements open in mw-content-text, counting itself */
+	int base_depth; /* Depth the article's blocks are children of */
+	size_t scan_off; /* How far into IN we have followed the tags */
+	size_t cut_off; /* End of the last whole block in IN */
+};
+
+#define CONTENT_OPEN_PATTERN "<div id=\"mw-content-text\""
+
+static const char *const void_elements[] =
+{
+	"area", "base", "br", "col", "embed", "hr", "img", "input",
+	"link", "meta", "param", "source", "track", "wbr",
+	NULL
+};
+
+static int
+__is_void_element(char *name)
+{
+	size_t len;
+	int i;
+
+	for (i = 0; void_elements[i] != NULL; ++i)
+	{
+		len = strlen(void_elements[i]);
+
+		if (!strncasecmp(name, void_elements[i], len) && !isalnum(name[len]))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Find the '>' that ends the tag at P, skipping quoted
+ * attribute values; NULL if it has not all arrived yet.
+ */
+static char *
+__tag_end(char *p, char *tail)
+{
+	char quote = 0;
+
+	while (p < tail)
+	{
+		if (quote)
+		{
+			if (*p == quote)
+				quote = 0;
+		}
+		else
+		if (*p == 0x22 || *p == 0x27)
+		{
+			quote = *p;
+		}
+		else
+		if (*p == 0x3e)
+		{
+			return p;
+		}
+
+		++p;
+	}
+
+	return NULL;
+}
+
+/*
+ * Does the tag from P to E contain NEEDLE?
+ */
+static int
+__tag_has(char *p, char *e, char *needle)
+{
+	size_t len = strlen(needle);
+
+	while ((size_t)(e - p) >= len)
+	{
+		if (!(p = memchr(p, *needle, (e - p) - len + 1)))
+			return 0;
+
+		if (!memcmp(p, needle, len))
+			return 1;
+
+		++p;
+	}
+
+	return 0;
+}
+
+/**
+ * __stream_write - write to the article file
+ * @s: the stream
+ * @iov: the pieces to write, one after the other; the array is used up
+ * @nr_iov: the number of pieces
+ */
+static int
+__stream_write(struct article_stream *s, struct iovec *iov, int nr_iov)
+{
+	if (__write_iov(s->out_fd, iov, nr_iov) < 0)
+	{
+		fprintf(stderr, "article_stream: failed to write to file (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * __stream_open - create the article file and write its header
+ * @s: the stream, with the page's <head> in IN
+ *
+ * The header is written with a length of zero followed by
+ * STREAM_LENGTH_RESERVE spaces on the same line, outside
+ * the article text, so that the real length fits when we
+ * rewrite it at the end.
+ */
+static int
+__stream_open(struct article_stream *s)
+{
+	struct iovec iov[1];
+
+	if (__fill_article_header(s->http, &s->in, &s->article_header, &s->file_title) < 0)
+		return -1;
+
+	if ((s->out_fd = open(s->file_title.buf_head, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR)) < 0)
+	{
+		fprintf(stderr, "article_stream: failed to create \"%s\" (%s)\n", s->file_title.buf_head, strerror(errno));
+		return -1;
+	}
+
+	__set_value(s->article_header.content_len, "0");
+	__format_article_header(s->header, &s->article_header, STREAM_LENGTH_RESERVE);
+
+	s->header_len = strlen(s->header);
+
+	iov[0].iov_base = s->header;
+	iov[0].iov_len = s->header_len;
 
-	if (buf_init(&content_buf, DEFAULT_TMP_BUF_SIZE) < 0)
-		goto fail_release_mem;
+	return __stream_write(s, iov, 1);
+}
 
-	if (buf_init(&file_title, pathconf("/", _PC_PATH_MAX)) < 0)
-		goto fail_release_mem;
+/**
+ * __stream_extract - extract the text from whole blocks and write it
+ * @s: the stream
+ * @len: number of bytes at the start of IN to take
+ */
+static int
+__stream_extract(struct article_stream *s, size_t len)
+{
+	struct parse_caches *caches;
+	buf_t *work = &s->work;
+	struct iovec iov[2];
+	int nr_iov = 0;
+	char *p;
+	int lead;
+	int trail;
 
-	home = getenv("HOME");
-	buf_append(&file_title, home);
-	buf_append(&file_title, WIKIGRAB_DIR);
-	buf_append(&file_title, "/");
+	if (!len)
+		return 0;
 
-	tag_content_ptr = html_get_tag_content(buf, "<title");
+	buf_clear(work);
+	buf_append_ex(work, s->in.buf_head, len);
+	buf_collapse(&s->in, (off_t)0, len);
 
-	char *_p;
+	if (!(caches = __parse_caches()))
+		return -1;
 
-	if ((_p = strstr(tag_content_ptr, " - Wiki")))
-		*_p = 0;
+	if (__extract_content(caches, work) < 0)
+		return -1;
 
-	buf_append(&content_buf, tag_content_ptr);
-	__normalise_file_title(&content_buf);
+	if (!option_set(OPT_FORMAT_XML))
+		__do_format_txt(work);
 
-	buf_append(&file_title, content_buf.buf_head);
-	buf_clear(&content_buf);
+/*
+ * Had this been extracted along with what came before, runs
+ * of new lines across the join would have been cut to two.
+ */
+	for (p = work->buf_head, lead = 0; p < work->buf_tail && *p == 0x0a; ++p)
+		++lead;
 
-	vlen = strlen(tag_content_ptr);
+	if ((s->held_nl + lead) > 2)
+		buf_collapse(work, (off_t)0, (size_t)((s->held_nl + lead) - 2));
 
-	if (vlen < MAX_VALUE_LEN)
-		len = vlen;
-	else
-		len = (MAX_VALUE_LEN - 1);
+	if (!work->data_len)
+		return 0;
 
-	strncpy(article_header.title->value, tag_content_ptr, len);
-	article_header.title->value[len] = 0;
-	article_header.title->vlen = len;
+	s->content_len += work->data_len;
 
-	tag_content_ptr = html_get_tag_field(buf, "<meta name=\"generator\"", "content");
+/*
+ * Hold back the new lines at the end: the file does
+ * not end with any, and they may join the next ones.
+ */
+	for (p = work->buf_tail, trail = 0; p > work->buf_head && *(p - 1) == 0x0a; --p)
+		++trail;
 
-	vlen = strlen(tag_content_ptr);
+	if (trail == (int)work->data_len)
+	{
+		s->held_nl += trail;
+		return 0;
+	}
 
-	if (vlen < MAX_VALUE_LEN)
-		len = vlen;
-	else
-		len = (MAX_VALUE_LEN - 1);
+	if (s->held_nl)
+	{
+		iov[nr_iov].iov_base = "\n\n";
+		iov[nr_iov++].iov_len = s->held_nl;
+	}
 
-	strncpy(article_header.generator->value, tag_content_ptr, len);
-	article_header.generator->value[len] = 0;
-	article_header.generator->vlen = len;
+	iov[nr_iov].iov_base = work->buf_head;
+	iov[nr_iov++].iov_len = (work->data_len - trail);
 
-	if ((out_fd = open(file_title.buf_head, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR)) < 0)
-		goto fail_release_mem;
+	s->held_nl = trail;
 
+	return __stream_write(s, iov, nr_iov);
+}
+
+/**
+ * __stream_scan - follow the tags in mw-content-text
+ * @s: the stream
+ *
+ * Moves CUT_OFF to the end of each block of the article we
+ * see the whole of. Returns 1 when mw-content-text ends (with
+ * CUT_OFF at its closing tag), or 0 if we need more input.
+ */
+static int
+__stream_scan(struct article_stream *s)
+{
+	char *head = s->in.buf_head;
+	char *tail = s->in.buf_tail;
+	char *p = (head + s->scan_off);
+	char *e;
 
-	if (server->value[0])
+	while (p < tail)
 	{
-		clear_struct(&sock4);
-		clear_struct(&sock6);
+		if (!(p = memchr(p, 0x3c, (tail - p))))
+		{
+			p = tail;
+			break;
+		}
 
-		getaddrinfo(server->value, NULL, NULL, &ainf);
-		if (ainf)
+		if ((tail - p) < 4)
+			break;
+
+		if (!strncmp(p, "<!--", 4))
 		{
-			for (aip = ainf; aip; aip = aip->ai_next)
-			{
-				if (aip->ai_socktype == SOCK_STREAM
-				&& aip->ai_family == AF_INET)
-				{
-					memcpy(&sock4, aip->ai_addr, aip->ai_addrlen);
-					gotv4 = 1;
-					break;
-				}
-			}
+			if (!(e = strstr(p, "-->")))
+				break;
+
+			p = (e + 3);
+			continue;
+		}
 
-			for (aip = ainf; aip; aip = aip->ai_next)
+		if (!(e = __tag_end(p, tail)))
+			break;
+
+		if (p[1] == '/')
+		{
+			if (--s->depth <= 0)
 			{
-				if (aip->ai_family == AF_INET6)
-				{
-					memcpy(&sock6, aip->ai_addr, aip->ai_addrlen);
-					gotv6 = 1;
-					break;
-				}
+				s->cut_off = (p - head);
+				s->scan_off = s->cut_off;
+				return 1;
 			}
+
+			p = (e + 1);
+
+			if (s->depth <= s->base_depth)
+				s->cut_off = (p - head);
+
+			continue;
 		}
-	}
 
-	if (gotv4)
-		strcpy(article_header.server_ipv4->value, inet_ntoa(sock4.sin_addr));
-	else
-		strcpy(article_header.server_ipv4->value, "None");
+		if (!isalpha(p[1]))
+		{
+			p = (e + 1);
+			continue;
+		}
 
-	if (gotv6)
-		strcpy(article_header.server_ipv6->value, inet_ntop(AF_INET6, sock6.sin6_addr.s6_addr, inet6_string, INET6_ADDRSTRLEN));
-	else
-		strcpy(article_header.server_ipv6->value, "None");
+	/*
+	 * Their contents are not markup; skip to the end tag.
+	 */
+		if (!strncasecmp(p, "<style", 6) || !strncasecmp(p, "<script", 7))
+		{
+			char *close = (p[2] == 't' || p[2] == 'T') ? "</style" : "</script";
 
-	if (__extract_area(buf, &content_buf, "<div id=\"mw-content-text\"", "</div") < 0)
-		goto out_destroy_file;
+			if (!(e = strstr(e, close)) || !(e = __tag_end(e, tail)))
+				break;
 
+			p = (e + 1);
 
-	/* Remove HTML content of unwanted classes */
-	for (i = 0; unwanted_class[i] != NULL; ++i)
-	{
-		if (html_remove_elements_class(&content_buf, unwanted_class[i]) < 0)
-			goto out_destroy_file;
-	}
+			if (s->depth <= s->base_depth)
+				s->cut_off = (p - head);
 
-	/* Remove HTML content of unwanted IDs */
-	for (i = 0; unwanted_id[i] != NULL; ++i)
-	{
-		if (html_remove_elements_id(&content_buf, unwanted_id[i]) < 0)
-			goto out_destroy_file;
-	}
+			continue;
+		}
 
-	/* Remove this as it can be embedded within content we do want */
-	html_remove_content(&content_buf, "<style", "</style");
+		if (*(e - 1) == '/' || __is_void_element(p + 1))
+		{
+			p = (e + 1);
 
+			if (s->depth <= s->base_depth)
+				s->cut_off = (p - head);
 
-	/* Get all the article paragraphs */
-	if (html_get_all(content_cache, &content_buf, "<p", "</p") < 0)
-		goto out_destroy_file;
+			continue;
+		}
 
 	/*
-	 * Seems to be used for things like quotations ("<dl>...<i>quotation</i></dl>")
-	 * Do not extract <i></i>, however, because that can be embedded within
-	 * <p></p> tags which can result in <i></i> content being repeated several
-	 * times in the output text.
+	 * The blocks are usually inside a wrapper div; if so,
+	 * they are its children, not mw-content-text's.
 	 */
-	if (html_get_all(content_cache, &content_buf, "<dl>", "</dl>") < 0)
-		goto out_destroy_file;
+		if (s->depth == s->base_depth && __tag_has(p, e, "class=\"mw-parser-output\""))
+			++s->base_depth;
 
-	/* Content that should retain its formatting (such as source code examples) */
-	if (html_get_all(content_cache, &content_buf, "<pre", "</pre") < 0)
-		goto out_destroy_file;
+		++s->depth;
+		p = (e + 1);
+	}
 
-	/* Get all list items */
-	if (html_get_all(content_cache, &content_buf, "<li>", "</li>") < 0)
-		goto out_destroy_file;
+	s->scan_off = (p - head);
 
-/*
- * Use this instead of taking <math> tags because we can end up with several
- * duplicate equations sometimes due to one being here and one also being
- * elsewhere (not bounded in <>)
+	return 0;
+}
+
+/**
+ * article_stream_new - start extracting an article from a response as it arrives
+ * @http: the HTTP object whose body will be fed to us
  */
+struct article_stream *
+article_stream_new(struct http_t *http)
+{
+	assert(http);
 
-	int nr_maths = 0;
-	if ((nr_maths = html_get_all(content_cache, &content_buf, "<annotation encoding=\"application/x-tex\"", "</annotation")) < 0)
-		goto out_destroy_file;
+	struct article_stream *s;
+	struct parse_caches *caches;
 
-	/* Keep the section headlines */
-	if (html_get_all_class(content_cache, &content_buf, "mw-headline") < 0)
-		goto out_destroy_file;
+	if (!(s = calloc(1, sizeof(*s))))
+		return NULL;
 
-	if (html_get_all_class(content_cache, &content_buf, "quotebox-quote") < 0)
-		goto out_destroy_file;
+	s->http = http;
+	s->out_fd = -1;
 
-	//if (html_get_all(content_cache, &content_buf, "<table", "</table") < 0)
-		//goto out_destroy_file;
+	if (!(s->header = calloc(DEFAULT_TMP_BUF_SIZE, 1)))
+		goto fail;
 
-/*
- * Now sort the extracted content by offset from start of buffer.
+	if (buf_init(&s->in, DEFAULT_TMP_BUF_SIZE) < 0)
+		goto fail_free_header;
+
+	if (buf_init(&s->work, DEFAULT_TMP_BUF_SIZE) < 0)
+		goto fail_release_in;
+
+	if (buf_init(&s->file_title, pathconf("/", _PC_PATH_MAX)) < 0)
+		goto fail_release_work;
+
+	if (!(caches = __parse_caches()))
+		goto fail_release_title;
+
+	s->value_cache = caches->value;
+
+	if (__article_header_alloc(s->value_cache, &s->article_header) < 0)
+		goto fail_release_values;
+
+	return s;
+
+	fail_release_values:
+	__article_header_free(s->value_cache, &s->article_header);
+
+	fail_release_title:
+	buf_destroy(&s->file_title);
+
+	fail_release_work:
+	buf_destroy(&s->work);
+
+	fail_release_in:
+	buf_destroy(&s->in);
+
+	fail_free_header:
+	free(s->header);
+
+	fail:
+	free(s);
+	return NULL;
+}
+
+/**
+ * article_stream_feed - take the next part of the body (an http_body_sink_t)
+ * @arg: the stream
+ * @data: body bytes
+ * @len: number of bytes
  */
-	qsort((void *)content_cache->cache,
-				(size_t)wiki_cache_nr_used(content_cache),
-				content_cache->objsize,
-				sort_content_cache);
+int
+article_stream_feed(void *arg, char *data, size_t len)
+{
+	struct article_stream *s = (struct article_stream *)arg;
+	char *p;
+	char *e;
+	size_t keep;
+	int ret;
 
-	int nr_used = wiki_cache_nr_used(content_cache);
-	content_t *cp = (content_t *)content_cache->cache;
-	buf_clear(&content_buf);
+	if (STREAM_DONE == s->state)
+		return 0;
 
-	for (i = 0; i < nr_used; ++i)
+	buf_append_ex(&s->in, data, len);
+
+	if (STREAM_HEAD == s->state)
 	{
-		buf_append_ex(&content_buf, cp->data, cp->data_len);
-		buf_append(&content_buf, "\n\n");
-		++cp;
+		if (!strstr(s->in.buf_head, "</head") && !strstr(s->in.buf_head, "<body"))
+			return 0;
+
+		if (__stream_open(s) < 0)
+			return -1;
+
+		s->state = STREAM_BODY;
 	}
 
-	if (nr_maths > 0)
-		parse_maths_expressions(&content_buf);
+	if (STREAM_BODY == s->state)
+	{
+		if (!(p = strstr(s->in.buf_head, CONTENT_OPEN_PATTERN))
+		|| !(e = __tag_end(p, s->in.buf_tail)))
+		{
+		/*
+		 * Keep enough that the pattern can be
+		 * found if it straddles the next read.
+		 */
+			keep = (sizeof(CONTENT_OPEN_PATTERN) - 1);
 
-	__remove_html_tags(&content_buf);
-	//__remove_inline_refs(&content_buf);
-	__remove_html_encodings(&content_buf);
-	__replace_html_entities(&content_buf);
-	remove_excess_nl(&content_buf);
-	remove_excess_sp(&content_buf);
+			if (p)
+				buf_collapse(&s->in, (off_t)0, (p - s->in.buf_head));
+			else
+			if (s->in.data_len > keep)
+				buf_collapse(&s->in, (off_t)0, (s->in.data_len - keep));
+
+			return 0;
+		}
 
+		buf_collapse(&s->in, (off_t)0, ((e + 1) - s->in.buf_head));
 
-	if (option_set(OPT_FORMAT_XML))
+		s->depth = 1;
+		s->base_depth = 1;
+		s->scan_off = 0;
+		s->cut_off = 0;
+		s->state = STREAM_CONTENT;
+	}
+
+	ret = __stream_scan(s);
+
+	if (ret || s->cut_off >= STREAM_SEGMENT_MIN)
 	{
-		buf_append(&content_buf, "</text>\n</wiki>\n");
-		sprintf(article_header.content_len->value, "%lu", content_buf.data_len);
-		article_header.content_len->vlen = strlen(article_header.content_len->value);
+		if (__stream_extract(s, s->cut_off) < 0)
+			return -1;
 
-		sprintf(buffer,
-			"%s\n"
-			"<wiki>\n"
-			"\t<metadata>\n"
-			"\t\t<meta name=\"Title\" content=\"%s\"/>\n"
-			"\t\t<meta name=\"Parser\" content=\"WikiGrab v%s\"/>\n"
-			"\t\t<meta name=\"Server\" content=\"%s\"/>\n"
-			"\t\t<meta name=\"Server-ipv4\" content=\"%s\"/>\n"
-			"\t\t<meta name=\"Server-ipv6\" content=\"%s\"/>\n"
-			"\t\t<meta name=\"Generator\" content=\"%s\"/>\n"
-			"\t\t<meta name=\"Modified\" content=\"%s\"/>\n"
-			"\t\t<meta name=\"Downloaded\" content=\"%s\"/>\n"
-			"\t\t<meta name=\"Length\" content=\"%s\"/>\n"
-			"\t</metadata>\n"
-			"\t<text>\n",
-			XML_START_LINE,
-			article_header.title->value,
-			WIKIGRAB_BUILD,
-			article_header.server_name->value,
-			article_header.server_ipv4->value,
-			article_header.server_ipv6->value,
-			article_header.generator->value,
-			article_header.lastmod->value,
-			article_header.downloaded->value,
-			article_header.content_len->value);
+		s->scan_off -= s->cut_off;
+		s->cut_off = 0;
 	}
-	else
+
+	if (ret)
 	{
-		__do_format_txt(&content_buf);
+		buf_clear(&s->in);
+		s->state = STREAM_DONE;
+	}
 
-		sprintf(article_header.content_len->value, "%lu", content_buf.data_len);
-		article_header.content_len->vlen = strlen(article_header.content_len->value);
+	return 0;
+}
 
-		int title_offset = ((WIKI_ARTICLE_LINE_LENGTH - article_header.title->vlen) / 2);
-		int title_width = (title_offset + (int)article_header.title->vlen);
-		static char wgb[64];
+/**
+ * article_stream_finish - write what is left and the real content length
+ * @s: the stream
+ * @path: if not NULL, the path of the file written is copied here (PATH_MAX bytes)
+ */
+int
+article_stream_finish(struct article_stream *s, char *path)
+{
+	assert(s);
 
-		sprintf(wgb, "WikiGrab v%s", WIKIGRAB_BUILD);
-		
-		sprintf(buffer,
-			"\n%*s\n\n"
-			"  {\n"
-			"    \"server\" : \"%s\",\n"
-			"    \"v4-addr\" : \"%s\",\n"
-			"    \"v6-addr\" : \"%s\",\n"
-			"    \"last-modified\" : \"%s\",\n"
-			"    \"generator\" : \"%s\",\n"
-			"    \"content-length\" : \"%s bytes\",\n"
-			"    \"downloaded\" : \"%s\"\n"
-			"  }\n"
-			"\n\n"
-			"%*s\n\n\n",
-			WIKI_ARTICLE_LINE_LENGTH, wgb,
-			article_header.server_name->value,
-			article_header.server_ipv4->value,
-			article_header.server_ipv6->value,
-			article_header.lastmod->value,
-			article_header.generator->value,
-			article_header.content_len->value,
-			article_header.downloaded->value,
-			title_width, article_header.title->value);
+	struct iovec iov[2];
+	int nr_iov = 0;
+	size_t len;
+	int pad;
+
+	if (STREAM_HEAD == s->state)
+	{
+		if (__stream_open(s) < 0)
+			goto fail;
+
+		s->state = STREAM_DONE;
 	}
 
 /*
- * Remove trailing new lines at end of article.
+ * The body ended inside mw-content-text; take what we have.
  */
-	if (*(content_buf.buf_tail - 1) == 0x0a)
+	if (STREAM_CONTENT == s->state)
 	{
-		char *t = content_buf.buf_tail - 1;
-		while (*t == 0x0a)
-			--t;
-		++t;
-		buf_snip(&content_buf, (content_buf.buf_tail - t));
+		if (__stream_extract(s, s->in.data_len) < 0)
+			goto fail;
+
+		s->state = STREAM_DONE;
 	}
 
-	size_t buf_len = strlen(buffer);
-	if (write(out_fd, buffer, buf_len) != buf_len) /* Our article header */
+	if (option_set(OPT_FORMAT_XML))
 	{
-		fprintf(stderr, "extract_wiki_article: failed to write to file (%s)\n", strerror(errno));
-		goto out_destroy_file;
-	}
+		if (s->held_nl)
+		{
+			iov[nr_iov].iov_base = "\n\n";
+			iov[nr_iov++].iov_len = s->held_nl;
+		}
 
-	buf_write_fd(out_fd, &content_buf); /* The article */
-	close(out_fd);
-	out_fd = -1;
+		iov[nr_iov].iov_base = "</text>\n</wiki>";
+		iov[nr_iov++].iov_len = 15;
 
-	fprintf(stdout, "Created file \"%s\"\n", file_title.buf_head);
+		if (__stream_write(s, iov, nr_iov) < 0)
+			goto fail;
 
-	wiki_cache_dealloc(value_cache, (void *)article_header.title, &article_header.title);
-	wiki_cache_dealloc(value_cache, (void *)article_header.server_name, &article_header.server_name);
-	wiki_cache_dealloc(value_cache, (void *)article_header.server_ipv4, &article_header.server_ipv4);
-	wiki_cache_dealloc(value_cache, (void *)article_header.server_ipv6, &article_header.server_ipv6);
-	wiki_cache_dealloc(value_cache, (void *)article_header.generator, &article_header.generator);
-	wiki_cache_dealloc(value_cache, (void *)article_header.content_len, &article_header.content_len);
-	wiki_cache_dealloc(value_cache, (void *)article_header.lastmod, &article_header.lastmod);
-	wiki_cache_dealloc(value_cache, (void *)article_header.downloaded, &article_header.downloaded);
+		s->content_len += 16;
+	}
 
-	wiki_cache_destroy(value_cache);
-	wiki_cache_destroy(content_cache);
+	if (s->out_fd < 0)
+		goto fail;
 
-	buf_destroy(&content_buf);
-	buf_destroy(&file_title);
+	sprintf(s->article_header.content_len->value, "%lu", s->content_len);
+	s->article_header.content_len->vlen = strlen(s->article_header.content_len->value);
 
-	free(buffer);
-	buffer = NULL;
+/*
+ * The spaces take up what the digits past the "0" do not.
+ */
+	pad = (STREAM_LENGTH_RESERVE - (int)(s->article_header.content_len->vlen - 1));
 
-	return 0;
+	if (pad < 0)
+		goto fail;
 
-	out_destroy_file:
+	__format_article_header(s->header, &s->article_header, pad);
 
-	if (ftruncate(out_fd, (off_t)0) < 0)
-		;
-	unlink(file_title.buf_head);
+	len = strlen(s->header);
 
-	fail_release_mem:
-	buf_destroy(&content_buf);
-	buf_destroy(&file_title);
+	if (len != s->header_len)
+		goto fail;
 
-	free(buffer);
-	buffer = NULL;
+	if (pwrite(s->out_fd, s->header, s->header_len, (off_t)0) != (ssize_t)s->header_len)
+	{
+		fprintf(stderr, "article_stream_finish: failed to write header (%s)\n", strerror(errno));
+		goto fail;
+	}
+
+	close(s->out_fd);
+	s->out_fd = -1;
 
-	wiki_cache_dealloc(value_cache, (void *)article_header.title, &article_header.title);
-	wiki_cache_dealloc(value_cache, (void *)article_header.server_name, &article_header.server_name);
-	wiki_cache_dealloc(value_cache, (void *)article_header.server_ipv4, &article_header.server_ipv4);
-	wiki_cache_dealloc(value_cache, (void *)article_header.server_ipv6, &article_header.server_ipv6);
-	wiki_cache_dealloc(value_cache, (void *)article_header.generator, &article_header.generator);
-	wiki_cache_dealloc(value_cache, (void *)article_header.content_len, &article_header.content_len);
-	wiki_cache_dealloc(value_cache, (void *)article_header.lastmod, &article_header.lastmod);
-	wiki_cache_dealloc(value_cache, (void *)article_header.downloaded, &article_header.downloaded);
+	fprintf(stdout, "Created file \"%s\"\n", s->file_title.buf_head);
 
-	wiki_cache_destroy(value_cache);
-	wiki_cache_destroy(content_cache);
+	if (path)
+	{
+		strncpy(path, s->file_title.buf_head, PATH_MAX - 1);
+		path[PATH_MAX - 1] = 0;
+	}
+
+	return 0;
 
 	fail:
 	return -1;
 }
+
+/**
+ * article_stream_destroy - free a stream, removing its file if it was not finished
+ * @s: the stream
+ */
+void
+article_stream_destroy(struct article_stream *s)
+{
+	assert(s);
+
+	if (s->out_fd >= 0)
+	{
+		close(s->out_fd);
+		unlink(s->file_title.buf_head);
+	}
+
+	__article_header_free(s->value_cache, &s->article_header);
+
+	buf_destroy(&s->in);
+	buf_destroy(&s->work);
+	buf_destroy(&s->file_title);
+	free(s->header);
+	free(s);
+
+	return;
+}
@@ -3,6 +3,8 @@
 
 #include "buffer.h"
 
+struct http_t;
+
 #define LEFT_ALIGN_WIDTH	20
 #define WIKI_ARTICLE_LINE_LENGTH 92
 #define MAX_VALUE_LEN 1024
@@ -15,6 +17,20 @@
 #define BEGIN_LIST_MARK		"_BEGIN_LIST_"
 #define END_LIST_MARK			"_END_LIST_"
 
-int extract_wiki_article(buf_t *);
+int extract_wiki_article(struct http_t *, char *) __nonnull((1)) __wur;
+
+/*
+ * Extract the article while the body is still arriving
+ * (--stream); article_stream_feed() is an http_body_sink_t.
+ */
+#define STREAM_SEGMENT_MIN 8192 /* Least HTML we extract at a time */
+#define STREAM_LENGTH_RESERVE 20 /* Room in the header for the digits of the length */
+
+struct article_stream;
+
+struct article_stream *article_stream_new(struct http_t *) __nonnull((1)) __wur;
+int article_stream_feed(void *, char *, size_t) __wur;
+int article_stream_finish(struct article_stream *, char *) __nonnull((1)) __wur;
+void article_stream_destroy(struct article_stream *) __nonnull((1));
 
 #endif /* !defined PARSE_H */
@@ -0,0 +1,345 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "http.h"
+#include "pool.h"
+#include "wikigrab.h"
+
+#define HTTP_POOL_DEFAULT_IDLE 4
+
+struct http_pool_ctx
+{
+	http_pool_t *pool;
+	char **links;
+	int nr_links;
+	int next_link;
+	int nr_ok;
+	int nr_failed;
+	http_pool_job_t job;
+	void *arg;
+};
+
+/**
+ * __http_pool_host - find the entry for a host, optionally creating it
+ * @pool: the connection pool (lock held)
+ * @host: the remote host name
+ * @create: add an entry if none exists
+ */
+static struct http_pool_host *
+__http_pool_host(http_pool_t *pool, char *host, int create)
+{
+	struct http_pool_host *ph;
+	int i;
+
+	for (i = 0; i < pool->nr_hosts; ++i)
+	{
+		if (!strcmp(pool->hosts[i].host, host))
+			return &pool->hosts[i];
+	}
+
+	if (!create)
+		return NULL;
+
+	if (!(ph = realloc(pool->hosts, (pool->nr_hosts + 1) * sizeof(struct http_pool_host))))
+		return NULL;
+
+	pool->hosts = ph;
+	ph = &pool->hosts[pool->nr_hosts];
+	clear_struct(ph);
+
+	if (!(ph->host = strdup(host)))
+		return NULL;
+
+	if (!(ph->idle = calloc(pool->max_idle, sizeof(struct http_t *))))
+	{
+		free(ph->host);
+		return NULL;
+	}
+
+	ph->nr_alloc = pool->max_idle;
+	++(pool->nr_hosts);
+
+	return ph;
+}
+
+/**
+ * http_pool_create - create a pool of keep-alive connections keyed by host
+ * @max_idle: number of idle connections to keep per host (0 for default)
+ */
+http_pool_t *
+http_pool_create(int max_idle)
+{
+	http_pool_t *pool = calloc(1, sizeof(http_pool_t));
+
+	if (!pool)
+		return NULL;
+
+	if (pthread_mutex_init(&pool->lock, NULL) != 0)
+	{
+		free(pool);
+		return NULL;
+	}
+
+	pool->max_idle = max_idle > 0 ? max_idle : HTTP_POOL_DEFAULT_IDLE;
+	pool->usingSecure = 1;
+	pool->followRedirects = 1;
+	pool->version = HTTP_DEFAULT_VERSION;
+
+	return pool;
+}
+
+/**
+ * http_pool_destroy - disconnect and free every idle connection
+ * @pool: the connection pool
+ */
+void
+http_pool_destroy(http_pool_t *pool)
+{
+	assert(pool);
+
+	struct http_pool_host *ph;
+	int i;
+	int k;
+
+	for (i = 0; i < pool->nr_hosts; ++i)
+	{
+		ph = &pool->hosts[i];
+
+		for (k = 0; k < ph->nr_idle; ++k)
+		{
+			http_disconnect(ph->idle[k]);
+			HTTP_delete(ph->idle[k]);
+		}
+
+		free(ph->idle);
+		free(ph->host);
+	}
+
+	free(pool->hosts);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+
+	return;
+}
+
+/**
+ * http_pool_get - take a connection to the host of a link
+ * @pool: the connection pool
+ * @link: the URL we are about to request
+ *
+ * Reuse an idle connection to the host if there is one,
+ * otherwise create and connect a new HTTP object.
+ */
+struct http_t *
+http_pool_get(http_pool_t *pool, char *link)
+{
+	assert(pool);
+	assert(link);
+
+	char host[HTTP_HOST_MAX+1];
+	struct http_pool_host *ph;
+	struct http_t *http = NULL;
+	uint32_t id;
+
+	if (strlen(link) >= HTTP_URL_MAX)
+		return NULL;
+
+	Default_Version_Methods->URL_parse_host(link, host);
+
+	pthread_mutex_lock(&pool->lock);
+
+	ph = __http_pool_host(pool, host, 0);
+
+	if (ph && ph->nr_idle)
+		http = ph->idle[--(ph->nr_idle)];
+
+	id = pool->next_id++;
+
+	pthread_mutex_unlock(&pool->lock);
+
+	if (http)
+		return http;
+
+/*
+ * Connect outside of the lock so that other workers
+ * are not held up by our DNS lookup and handshake.
+ */
+	if (!(http = HTTP_new(id)))
+		return NULL;
+
+	http->usingSecure = pool->usingSecure;
+	http->followRedirects = pool->followRedirects;
+	http->version = pool->version;
+	http->verb = GET;
+
+	strcpy(http->host, host);
+
+	if (http_connect(http) < 0)
+	{
+		fprintf(stderr, "http_pool_get: failed to connect to %s\n", host);
+		HTTP_delete(http);
+		return NULL;
+	}
+
+	return http;
+}
+
+/**
+ * http_pool_put - give a connection back to the pool
+ * @pool: the connection pool
+ * @http: the HTTP object taken with http_pool_get()
+ *
+ * The object is kept under whichever host it is connected
+ * to now; it is freed if it is no longer connected or the
+ * host already has enough idle connections.
+ */
+void
+http_pool_put(http_pool_t *pool, struct http_t *http)
+{
+	assert(pool);
+	assert(http);
+
+	struct http_pool_host *ph;
+
+	if (http_socket(http) < 0)
+		goto drop;
+
+	pthread_mutex_lock(&pool->lock);
+
+	ph = __http_pool_host(pool, http->host, 1);
+
+	if (!ph || ph->nr_idle >= ph->nr_alloc)
+	{
+		pthread_mutex_unlock(&pool->lock);
+		http_disconnect(http);
+		goto drop;
+	}
+
+	ph->idle[ph->nr_idle++] = http;
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return;
+
+drop:
+	HTTP_delete(http);
+	return;
+}
+
+static void *
+__http_pool_worker(void *arg)
+{
+	struct http_pool_ctx *ctx = (struct http_pool_ctx *)arg;
+	struct http_t *http;
+	char *link;
+	int idx;
+
+	while (1)
+	{
+		idx = __sync_fetch_and_add(&ctx->next_link, 1);
+
+		if (idx >= ctx->nr_links)
+			break;
+
+		link = ctx->links[idx];
+
+		if (!(http = http_pool_get(ctx->pool, link)))
+		{
+			__sync_fetch_and_add(&ctx->nr_failed, 1);
+			continue;
+		}
+
+		if (ctx->job(http, link, ctx->arg) < 0)
+			__sync_fetch_and_add(&ctx->nr_failed, 1);
+		else
+			__sync_fetch_and_add(&ctx->nr_ok, 1);
+
+		http_pool_put(ctx->pool, http);
+	}
+
+	return NULL;
+}
+
+/**
+ * http_pool_run - process a list of links with a number of concurrent workers
+ * @pool: the connection pool
+ * @links: the links to process
+ * @nr_links: number of links
+ * @nr_jobs: number of worker threads
+ * @job: called by the workers for each link
+ * @arg: passed through to JOB
+ * @nr_failed: if not NULL, the number of failed links is returned here
+ *
+ * Returns the number of links JOB succeeded for, or -1 on error.
+ */
+int
+http_pool_run(http_pool_t *pool,
+		char **links,
+		int nr_links,
+		int nr_jobs,
+		http_pool_job_t job,
+		void *arg,
+		int *nr_failed)
+{
+	assert(pool);
+	assert(links);
+	assert(job);
+
+	struct http_pool_ctx ctx;
+	pthread_t *workers;
+	int nr_started = 0;
+	int i;
+
+	if (nr_jobs < 1)
+		nr_jobs = 1;
+
+	if (nr_jobs > HTTP_POOL_MAX_JOBS)
+		nr_jobs = HTTP_POOL_MAX_JOBS;
+
+	if (nr_jobs > nr_links)
+		nr_jobs = nr_links;
+
+	clear_struct(&ctx);
+	ctx.pool = pool;
+	ctx.links = links;
+	ctx.nr_links = nr_links;
+	ctx.job = job;
+	ctx.arg = arg;
+
+	if (!(workers = calloc(nr_jobs ? nr_jobs : 1, sizeof(pthread_t))))
+		goto fail;
+
+	for (i = 0; i < nr_jobs; ++i)
+	{
+		if (pthread_create(&workers[i], NULL, __http_pool_worker, (void *)&ctx) != 0)
+		{
+			fprintf(stderr, "http_pool_run: pthread_create error (%s)\n", strerror(errno));
+			break;
+		}
+
+		++nr_started;
+	}
+
+/*
+ * If we could not start any threads at all,
+ * do the work ourselves.
+ */
+	if (!nr_started)
+		__http_pool_worker((void *)&ctx);
+
+	for (i = 0; i < nr_started; ++i)
+		pthread_join(workers[i], NULL);
+
+	free(workers);
+
+	if (nr_failed)
+		*nr_failed = ctx.nr_failed;
+
+	return ctx.nr_ok;
+
+fail:
+	return -1;
+}
@@ -0,0 +1,46 @@
+#ifndef POOL_H
+#define POOL_H 1
+
+#include <pthread.h>
+#include <stdint.h>
+#include "http.h"
+
+#define HTTP_POOL_MAX_JOBS 64
+
+/*
+ * Idle, connected HTTP objects for one remote host.
+ */
+struct http_pool_host
+{
+	char *host;
+	struct http_t **idle;
+	int nr_idle;
+	int nr_alloc;
+};
+
+typedef struct http_pool_t
+{
+	pthread_mutex_t lock;
+	struct http_pool_host *hosts;
+	int nr_hosts;
+	int max_idle; /* Idle connections kept per host */
+	int usingSecure; /* Settings copied into each new HTTP object */
+	int followRedirects;
+	uint32_t version;
+	uint32_t next_id;
+} http_pool_t;
+
+/*
+ * Called by the workers for each link; the HTTP object is
+ * connected to the host of LINK and returned to the pool
+ * afterwards (or dropped if it has been disconnected).
+ */
+typedef int (*http_pool_job_t)(struct http_t *, char *, void *);
+
+http_pool_t *http_pool_create(int) __wur;
+void http_pool_destroy(http_pool_t *) __nonnull((1));
+struct http_t *http_pool_get(http_pool_t *, char *) __nonnull((1,2)) __wur;
+void http_pool_put(http_pool_t *, struct http_t *) __nonnull((1,2));
+int http_pool_run(http_pool_t *, char **, int, int, http_pool_job_t, void *, int *) __nonnull((1,2,5)) __wur;
+
+#endif /* !defined POOL_H */
@@ -0,0 +1,608 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "redirect.h"
+#include "wikigrab.h"
+
+#define REDIRECT_MAX_URL 0xffff
+
+/*
+ * A redirect map file mapped into memory, with the offset
+ * of each record so that we can binary search it.
+ */
+struct redirect_file
+{
+	char *map;
+	size_t size;
+	uint32_t *offsets;
+	uint32_t nr_entries;
+};
+
+/*
+ * A redirect learned during this run.
+ */
+struct redirect_entry
+{
+	char *from;
+	char *to;
+	size_t from_len;
+	size_t to_len;
+	int persist;
+};
+
+static pthread_mutex_t redirect_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct redirect_file loaded;
+static struct redirect_entry *added = NULL;
+static int nr_added = 0;
+static int nr_alloc = 0;
+static int nr_persist = 0;
+static char *map_path = NULL;
+
+static int
+__keycmp(char *a, size_t alen, char *b, size_t blen)
+{
+	int rv = memcmp(a, b, (alen < blen ? alen : blen));
+
+	if (rv)
+		return rv;
+
+	return (alen < blen ? -1 : (alen > blen ? 1 : 0));
+}
+
+static void
+__record(struct redirect_file *rf, uint32_t idx, char **from, size_t *from_len, char **to, size_t *to_len)
+{
+	struct redirect_map_record *rec = (struct redirect_map_record *)(rf->map + rf->offsets[idx]);
+
+	*from = ((char *)rec + sizeof(*rec));
+	*from_len = rec->from_len;
+	*to = (*from + rec->from_len);
+	*to_len = rec->to_len;
+
+	return;
+}
+
+static void
+__unmap_file(struct redirect_file *rf)
+{
+	if (rf->map)
+		munmap(rf->map, rf->size);
+
+	free(rf->offsets);
+	clear_struct(rf);
+
+	return;
+}
+
+/**
+ * __map_file - map a redirect map file and index its records
+ * @path: the file
+ * @rf: filled in on success
+ *
+ * A missing file is an empty map. A file that is truncated,
+ * of another version or not sorted is ignored (and will be
+ * replaced at the next save) rather than trusted.
+ */
+static int
+__map_file(char *path, struct redirect_file *rf)
+{
+	struct redirect_map_header *hdr;
+	struct redirect_map_record *rec;
+	struct stat statb;
+	char *prev = NULL;
+	size_t prev_len = 0;
+	size_t off;
+	uint32_t i;
+	int fd = -1;
+
+	clear_struct(rf);
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+	{
+		if (errno == ENOENT)
+			return 0;
+
+		goto fail;
+	}
+
+	if (fstat(fd, &statb) < 0)
+		goto fail;
+
+	if ((size_t)statb.st_size < sizeof(*hdr))
+		goto out_empty;
+
+	rf->size = (size_t)statb.st_size;
+	rf->map = mmap(NULL, rf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (MAP_FAILED == rf->map)
+	{
+		rf->map = NULL;
+		goto fail;
+	}
+
+	close(fd);
+	fd = -1;
+
+	hdr = (struct redirect_map_header *)rf->map;
+
+	if (memcmp(hdr->magic, REDIRECT_MAP_MAGIC, 4) || hdr->version != REDIRECT_MAP_VERSION)
+		goto out_invalid;
+
+	if (hdr->nr_entries > ((rf->size - sizeof(*hdr)) / sizeof(*rec)))
+		goto out_invalid;
+
+	if (hdr->nr_entries && !(rf->offsets = calloc(hdr->nr_entries, sizeof(uint32_t))))
+		goto fail;
+
+	off = sizeof(*hdr);
+
+	for (i = 0; i < hdr->nr_entries; ++i)
+	{
+		if ((off + sizeof(*rec)) > rf->size)
+			goto out_invalid;
+
+		rec = (struct redirect_map_record *)(rf->map + off);
+
+		if ((off + sizeof(*rec) + rec->from_len + rec->to_len) > rf->size || !rec->from_len)
+			goto out_invalid;
+
+		if (prev && __keycmp(prev, prev_len, (char *)rec + sizeof(*rec), rec->from_len) >= 0)
+			goto out_invalid;
+
+		prev = ((char *)rec + sizeof(*rec));
+		prev_len = rec->from_len;
+
+		rf->offsets[i] = (uint32_t)off;
+		off += (sizeof(*rec) + rec->from_len + rec->to_len);
+	}
+
+	rf->nr_entries = hdr->nr_entries;
+
+	return 0;
+
+out_invalid:
+	fprintf(stderr, "Ignoring invalid redirect map \"%s\"\n", path);
+	__unmap_file(rf);
+	return 0;
+
+out_empty:
+	close(fd);
+	return 0;
+
+fail:
+	if (fd != -1)
+		close(fd);
+
+	__unmap_file(rf);
+	return -1;
+}
+
+static int
+__file_find(struct redirect_file *rf, char *key, size_t key_len)
+{
+	char *from;
+	char *to;
+	size_t from_len;
+	size_t to_len;
+	int lo = 0;
+	int hi = (int)rf->nr_entries - 1;
+	int mid;
+	int rv;
+
+	while (lo <= hi)
+	{
+		mid = ((lo + hi) >> 1);
+		__record(rf, mid, &from, &from_len, &to, &to_len);
+
+		rv = __keycmp(key, key_len, from, from_len);
+
+		if (!rv)
+			return mid;
+
+		if (rv < 0)
+			hi = (mid - 1);
+		else
+			lo = (mid + 1);
+	}
+
+	return -1;
+}
+
+/*
+ * Returns the index of KEY in the entries added during this
+ * run, or -1 with *POS set to where it would be inserted.
+ */
+static int
+__added_find(char *key, size_t key_len, int *pos)
+{
+	int lo = 0;
+	int hi = (nr_added - 1);
+	int mid;
+	int rv;
+
+	while (lo <= hi)
+	{
+		mid = ((lo + hi) >> 1);
+		rv = __keycmp(key, key_len, added[mid].from, added[mid].from_len);
+
+		if (!rv)
+			return mid;
+
+		if (rv < 0)
+			hi = (mid - 1);
+		else
+			lo = (mid + 1);
+	}
+
+	if (pos)
+		*pos = lo;
+
+	return -1;
+}
+
+/**
+ * redirect_map_load - map the redirects saved by previous runs
+ * @path: the redirect map file (it is created at the first save)
+ */
+int
+redirect_map_load(char *path)
+{
+	assert(path);
+
+	int rv;
+
+	pthread_mutex_lock(&redirect_lock);
+
+	__unmap_file(&loaded);
+	free(map_path);
+
+	if (!(map_path = strdup(path)))
+	{
+		pthread_mutex_unlock(&redirect_lock);
+		return -1;
+	}
+
+	rv = __map_file(map_path, &loaded);
+
+	pthread_mutex_unlock(&redirect_lock);
+
+	return rv;
+}
+
+/**
+ * redirect_map_lookup - find where a URL redirects to
+ * @from: the URL we are about to request
+ * @to: the new location is copied here
+ * @size: size of TO
+ *
+ * Returns 1 if FROM is known to redirect (TO is the empty string
+ * if it redirects to itself), 0 otherwise.
+ */
+int
+redirect_map_lookup(char *from, char *to, size_t size)
+{
+	assert(from);
+	assert(to);
+
+	size_t from_len = strlen(from);
+	char *k;
+	char *v = NULL;
+	size_t k_len;
+	size_t v_len = 0;
+	int idx;
+	int found = 0;
+
+	pthread_mutex_lock(&redirect_lock);
+
+	if ((idx = __added_find(from, from_len, NULL)) != -1)
+	{
+		v = added[idx].to;
+		v_len = added[idx].to_len;
+		found = 1;
+	}
+	else
+	if ((idx = __file_find(&loaded, from, from_len)) != -1)
+	{
+		__record(&loaded, idx, &k, &k_len, &v, &v_len);
+
+	/*
+	 * Older maps saved pages that redirected to themselves;
+	 * that need not hold for ever, so ask the server again.
+	 */
+		found = (v_len != 0);
+	}
+
+	if (found)
+	{
+		if (v_len >= size)
+			found = 0;
+		else
+		{
+			memcpy(to, v, v_len);
+			to[v_len] = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&redirect_lock);
+
+	return found;
+}
+
+/**
+ * redirect_map_add - remember that a URL redirects elsewhere
+ * @from: the URL that elicited the redirect
+ * @to: the URL in the Location header ("" if the same as FROM)
+ * @persist: save it at exit (for permanent redirects; never for "")
+ */
+int
+redirect_map_add(char *from, char *to, int persist)
+{
+	assert(from);
+	assert(to);
+
+	struct redirect_entry *e;
+	size_t from_len = strlen(from);
+	size_t to_len = strlen(to);
+	char *nfrom = NULL;
+	char *nto = NULL;
+	int idx;
+	int pos = 0;
+
+	if (!from_len || from_len > REDIRECT_MAX_URL || to_len > REDIRECT_MAX_URL)
+		return -1;
+
+	if (!to_len)
+		persist = 0;
+
+	if (!(nto = strdup(to)))
+		goto fail;
+
+	pthread_mutex_lock(&redirect_lock);
+
+	if ((idx = __added_find(from, from_len, &pos)) != -1)
+	{
+		e = &added[idx];
+
+		free(e->to);
+		e->to = nto;
+		e->to_len = to_len;
+
+		if (persist && !e->persist)
+			++nr_persist;
+		else
+		if (!persist && e->persist && !to_len)
+			--nr_persist;
+
+		e->persist = (to_len ? (e->persist | persist) : 0);
+
+		pthread_mutex_unlock(&redirect_lock);
+		return 0;
+	}
+
+	if (nr_added >= nr_alloc)
+	{
+		int new_alloc = (nr_alloc ? (nr_alloc * 2) : 64);
+
+		if (!(e = realloc(added, new_alloc * sizeof(struct redirect_entry))))
+			goto fail_unlock;
+
+		added = e;
+		nr_alloc = new_alloc;
+	}
+
+	if (!(nfrom = strdup(from)))
+		goto fail_unlock;
+
+	memmove(&added[pos + 1], &added[pos], ((nr_added - pos) * sizeof(struct redirect_entry)));
+
+	e = &added[pos];
+	e->from = nfrom;
+	e->from_len = from_len;
+	e->to = nto;
+	e->to_len = to_len;
+	e->persist = persist;
+
+	++nr_added;
+
+	if (persist)
+		++nr_persist;
+
+	pthread_mutex_unlock(&redirect_lock);
+
+	return 0;
+
+fail_unlock:
+	pthread_mutex_unlock(&redirect_lock);
+
+fail:
+	free(nto);
+	return -1;
+}
+
+static int
+__write_record(FILE *fp, char *from, size_t from_len, char *to, size_t to_len)
+{
+	struct redirect_map_record rec;
+
+	rec.from_len = (uint16_t)from_len;
+	rec.to_len = (uint16_t)to_len;
+
+	if (fwrite(&rec, sizeof(rec), 1, fp) != 1
+	|| fwrite(from, 1, from_len, fp) != from_len
+	|| (to_len && fwrite(to, 1, to_len, fp) != to_len))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * redirect_map_save - merge the permanent redirects learned during this run into the file
+ *
+ * The file is mapped afresh so that redirects saved by another
+ * run since we started are kept; ours win for the same URL. The
+ * merged map is written next to the file and renamed over it.
+ */
+int
+redirect_map_save(void)
+{
+	struct redirect_file current;
+	struct redirect_map_header hdr;
+	struct redirect_entry *e;
+	char *tmp_path = NULL;
+	char *from;
+	char *to;
+	size_t from_len;
+	size_t to_len;
+	uint32_t i = 0;
+	uint32_t nr = 0;
+	int j = 0;
+	int rv;
+	FILE *fp = NULL;
+
+	pthread_mutex_lock(&redirect_lock);
+
+	if (!map_path || !nr_persist)
+	{
+		pthread_mutex_unlock(&redirect_lock);
+		return 0;
+	}
+
+	if (__map_file(map_path, &current) < 0)
+		goto fail;
+
+	if (!(tmp_path = malloc(strlen(map_path) + 32)))
+		goto fail;
+
+	sprintf(tmp_path, "%s.tmp.%d", map_path, (int)getpid());
+
+	if (!(fp = fopen(tmp_path, "w")))
+		goto fail;
+
+	clear_struct(&hdr);
+	memcpy(hdr.magic, REDIRECT_MAP_MAGIC, 4);
+	hdr.version = REDIRECT_MAP_VERSION;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto fail;
+
+	while (i < current.nr_entries || j < nr_added)
+	{
+		if (j < nr_added && !added[j].persist)
+		{
+			++j;
+			continue;
+		}
+
+		if (i < current.nr_entries)
+		{
+			__record(&current, i, &from, &from_len, &to, &to_len);
+
+			if (!to_len) /* Dropped; see redirect_map_lookup() */
+			{
+				++i;
+				continue;
+			}
+		}
+
+		if (j < nr_added)
+		{
+			e = &added[j];
+
+			rv = (i < current.nr_entries) ? __keycmp(e->from, e->from_len, from, from_len) : -1;
+
+			if (rv <= 0)
+			{
+				if (__write_record(fp, e->from, e->from_len, e->to, e->to_len) < 0)
+					goto fail;
+
+				++j;
+
+				if (!rv)
+					++i;
+
+				++nr;
+				continue;
+			}
+		}
+
+		if (__write_record(fp, from, from_len, to, to_len) < 0)
+			goto fail;
+
+		++i;
+		++nr;
+	}
+
+	hdr.nr_entries = nr;
+
+	if (fseek(fp, 0, SEEK_SET) < 0 || fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto fail;
+
+	if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+		goto fail;
+
+	fclose(fp);
+	fp = NULL;
+
+	if (rename(tmp_path, map_path) < 0)
+		goto fail;
+
+	__unmap_file(&current);
+	free(tmp_path);
+
+	pthread_mutex_unlock(&redirect_lock);
+
+	return 0;
+
+fail:
+	fprintf(stderr, "redirect_map_save: failed to save \"%s\" (%s)\n", map_path, strerror(errno));
+
+	if (fp)
+	{
+		fclose(fp);
+		unlink(tmp_path);
+	}
+
+	__unmap_file(&current);
+	free(tmp_path);
+
+	pthread_mutex_unlock(&redirect_lock);
+
+	return -1;
+}
+
+/**
+ * redirect_map_unload - unmap the file and forget everything learned during this run
+ */
+void
+redirect_map_unload(void)
+{
+	int i;
+
+	pthread_mutex_lock(&redirect_lock);
+
+	__unmap_file(&loaded);
+
+	for (i = 0; i < nr_added; ++i)
+	{
+		free(added[i].from);
+		free(added[i].to);
+	}
+
+	free(added);
+	added = NULL;
+	nr_added = nr_alloc = nr_persist = 0;
+
+	free(map_path);
+	map_path = NULL;
+
+	pthread_mutex_unlock(&redirect_lock);
+
+	return;
+}
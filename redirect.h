@@ -0,0 +1,47 @@
+#ifndef REDIRECT_H
+#define REDIRECT_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Permanent redirects (301) saved between runs so that
+ * we can rewrite a URL before sending the request rather
+ * than paying a round trip to be told where to go again.
+ *
+ * The file is a sorted list of records after a small
+ * header; it is mapped read-only at startup and the
+ * redirects learned during the run are merged into it
+ * at exit. Temporary redirects (302/303), and pages
+ * that redirect to themselves, are kept in the same
+ * table for the rest of the run but are not saved.
+ */
+#define REDIRECT_MAP_MAGIC "WGRM"
+#define REDIRECT_MAP_VERSION 1
+#define REDIRECT_MAP_FILE ".redirects"
+
+struct redirect_map_header
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t nr_entries;
+	uint32_t reserved;
+} __attribute__((packed));
+
+/*
+ * Followed by FROM_LEN bytes of the URL that elicits
+ * the redirect and TO_LEN bytes of its new location.
+ */
+struct redirect_map_record
+{
+	uint16_t from_len;
+	uint16_t to_len;
+} __attribute__((packed));
+
+int redirect_map_load(char *) __nonnull((1)) __wur;
+int redirect_map_save(void) __wur;
+void redirect_map_unload(void);
+int redirect_map_lookup(char *, char *, size_t) __nonnull((1,2)) __wur;
+int redirect_map_add(char *, char *, int) __nonnull((1,2));
+
+#endif /* !defined REDIRECT_H */
@@ -0,0 +1,379 @@
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include "resolve.h"
+
+enum resolve_state
+{
+	RESOLVE_EMPTY = 0,
+	RESOLVE_PENDING, /* First lookup not finished; callers wait */
+	RESOLVE_READY,
+	RESOLVE_FAILED
+};
+
+struct resolve_entry
+{
+	char host[RESOLVE_HOST_MAX];
+	enum resolve_state state;
+	int queued; /* For the worker to look up (first time or refresh) */
+	int error; /* errno of a failed lookup */
+	time_t expires;
+	unsigned long last_used;
+	struct resolve_result result;
+};
+
+static struct resolve_entry resolve_cache[RESOLVE_MAX_HOSTS];
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t resolve_done = PTHREAD_COND_INITIALIZER;
+static int resolve_worker_running = 0;
+static unsigned long resolve_clock = 0;
+
+static struct resolve_stats resolve_counters;
+
+/**
+ * __resolve_lookup - ask getaddrinfo() for a host's addresses
+ * @host: the host name (or an address literal)
+ * @result: filled in with the TCP addresses
+ */
+static int
+__resolve_lookup(char *host, struct resolve_result *result)
+{
+	struct addrinfo hints;
+	struct addrinfo *ainf = NULL;
+	struct addrinfo *aip;
+	int err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	__sync_fetch_and_add(&resolve_counters.lookups, 1);
+
+	if ((err = getaddrinfo(host, NULL, &hints, &ainf)) != 0)
+	{
+		errno = (err == EAI_SYSTEM ? errno : EHOSTUNREACH);
+		return -1;
+	}
+
+	result->nr_addrs = 0;
+
+	for (aip = ainf; aip && result->nr_addrs < RESOLVE_MAX_ADDRS; aip = aip->ai_next)
+	{
+		struct resolve_addr *ra = &result->addrs[result->nr_addrs];
+
+		if (aip->ai_family != AF_INET && aip->ai_family != AF_INET6)
+			continue;
+
+		if (aip->ai_addrlen > sizeof(ra->addr))
+			continue;
+
+		ra->family = aip->ai_family;
+		ra->len = aip->ai_addrlen;
+		memcpy(&ra->addr, aip->ai_addr, aip->ai_addrlen);
+
+		++result->nr_addrs;
+	}
+
+	freeaddrinfo(ainf);
+
+	if (!result->nr_addrs)
+	{
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * __resolve_find - find a host's entry (lock held)
+ * @host: the host name
+ */
+static struct resolve_entry *
+__resolve_find(char *host)
+{
+	int i;
+
+	for (i = 0; i < RESOLVE_MAX_HOSTS; ++i)
+	{
+		if (resolve_cache[i].state != RESOLVE_EMPTY
+		&& !strcmp(resolve_cache[i].host, host))
+			return &resolve_cache[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * __resolve_new - take an entry for a host and queue its lookup (lock held)
+ * @host: the host name
+ *
+ * Reuses the least recently used entry that the worker
+ * is not busy with; returns NULL if there is none.
+ */
+static struct resolve_entry *
+__resolve_new(char *host)
+{
+	struct resolve_entry *lru = NULL;
+	int i;
+
+	if (strlen(host) >= RESOLVE_HOST_MAX)
+		return NULL;
+
+	for (i = 0; i < RESOLVE_MAX_HOSTS; ++i)
+	{
+		if (resolve_cache[i].queued)
+			continue;
+
+		if (!lru || resolve_cache[i].last_used < lru->last_used)
+			lru = &resolve_cache[i];
+	}
+
+	if (!lru)
+		return NULL;
+
+	strcpy(lru->host, host);
+	lru->state = RESOLVE_PENDING;
+	lru->queued = 1;
+	lru->last_used = ++resolve_clock;
+
+	pthread_cond_signal(&resolve_work);
+
+	return lru;
+}
+
+static void *
+__resolve_worker(void *arg)
+{
+	struct resolve_entry *e;
+	struct resolve_result result;
+	char host[RESOLVE_HOST_MAX];
+	int i;
+	int ret;
+
+	(void)arg;
+
+	pthread_mutex_lock(&resolve_lock);
+
+	while (1)
+	{
+		for (e = NULL, i = 0; i < RESOLVE_MAX_HOSTS; ++i)
+		{
+			if (resolve_cache[i].queued)
+			{
+				e = &resolve_cache[i];
+				break;
+			}
+		}
+
+		if (!e)
+		{
+			pthread_cond_wait(&resolve_work, &resolve_lock);
+			continue;
+		}
+
+	/*
+	 * The entry is not reused while it is queued,
+	 * so it is still ours when we take the lock back.
+	 */
+		strcpy(host, e->host);
+		pthread_mutex_unlock(&resolve_lock);
+
+		ret = __resolve_lookup(host, &result);
+
+		pthread_mutex_lock(&resolve_lock);
+
+		if (ret == 0)
+		{
+			e->result = result;
+			e->state = RESOLVE_READY;
+			e->expires = time(NULL) + RESOLVE_TTL;
+		}
+		else
+		if (e->state != RESOLVE_READY)
+		{
+		/*
+		 * A failed refresh leaves the old answer in place
+		 * until the next attempt; a failed first lookup
+		 * is remembered for a little while.
+		 */
+			e->error = errno;
+			e->state = RESOLVE_FAILED;
+			e->expires = time(NULL) + RESOLVE_NEGATIVE_TTL;
+		}
+		else
+		{
+			e->expires = time(NULL) + RESOLVE_NEGATIVE_TTL;
+		}
+
+		e->queued = 0;
+		pthread_cond_broadcast(&resolve_done);
+	}
+
+	return NULL;
+}
+
+/**
+ * __resolve_start_worker - start the lookup thread the first time (lock held)
+ */
+static int
+__resolve_start_worker(void)
+{
+	pthread_t worker;
+
+	if (resolve_worker_running)
+		return 0;
+
+	if (pthread_create(&worker, NULL, __resolve_worker, NULL) != 0)
+		return -1;
+
+	pthread_detach(worker);
+	resolve_worker_running = 1;
+
+	return 0;
+}
+
+/**
+ * resolve_host - get the addresses of a host
+ * @host: the host name
+ * @result: filled in with its addresses
+ *
+ * Returns 0, or -1 with errno set if the host has no addresses.
+ */
+int
+resolve_host(char *host, struct resolve_result *result)
+{
+	assert(host);
+	assert(result);
+
+	struct resolve_entry *e;
+	int started = 0; /* We asked for the lookup, so it is not a hit */
+
+	pthread_mutex_lock(&resolve_lock);
+
+	if (__resolve_start_worker() < 0)
+		goto lookup_here;
+
+	while (1)
+	{
+		if (!(e = __resolve_find(host)))
+		{
+			if (!(e = __resolve_new(host)))
+				goto lookup_here;
+
+			started = 1;
+		}
+
+		if (e->state == RESOLVE_PENDING)
+		{
+			pthread_cond_wait(&resolve_done, &resolve_lock);
+
+		/*
+		 * Look again: once the lookup is done the
+		 * entry may have been given to another host.
+		 */
+			continue;
+		}
+
+		e->last_used = ++resolve_clock;
+
+		if (time(NULL) >= e->expires && !e->queued)
+		{
+			if (e->state == RESOLVE_FAILED)
+			{
+				e->state = RESOLVE_PENDING;
+				e->queued = 1;
+				pthread_cond_signal(&resolve_work);
+				started = 1;
+				continue;
+			}
+
+		/*
+		 * Stale but usable: hand it out and let
+		 * the worker refresh it in the background.
+		 */
+			e->queued = 1;
+			pthread_cond_signal(&resolve_work);
+		}
+
+		break;
+	}
+
+	if (!started)
+		__sync_fetch_and_add(&resolve_counters.hits, 1);
+
+	if (e->state == RESOLVE_FAILED)
+	{
+		errno = e->error;
+		pthread_mutex_unlock(&resolve_lock);
+		return -1;
+	}
+
+	*result = e->result;
+	pthread_mutex_unlock(&resolve_lock);
+
+	return 0;
+
+lookup_here:
+	pthread_mutex_unlock(&resolve_lock);
+
+	return __resolve_lookup(host, result);
+}
+
+/**
+ * resolve_prefetch - start looking up a host we will want soon
+ * @host: the host name
+ */
+void
+resolve_prefetch(char *host)
+{
+	assert(host);
+
+	struct resolve_entry *e;
+
+	pthread_mutex_lock(&resolve_lock);
+
+	if (__resolve_start_worker() == 0)
+	{
+		if (!(e = __resolve_find(host)))
+		{
+			__resolve_new(host);
+		}
+		else
+		if (e->state != RESOLVE_PENDING && time(NULL) >= e->expires && !e->queued)
+		{
+			if (e->state == RESOLVE_FAILED)
+				e->state = RESOLVE_PENDING;
+
+			e->queued = 1;
+			pthread_cond_signal(&resolve_work);
+		}
+	}
+
+	pthread_mutex_unlock(&resolve_lock);
+
+	return;
+}
+
+/**
+ * resolve_get_stats - get the number of lookups and cache hits
+ * @stats: filled in with the counters
+ */
+void
+resolve_get_stats(struct resolve_stats *stats)
+{
+	assert(stats);
+
+	stats->lookups = __sync_fetch_and_add(&resolve_counters.lookups, 0);
+	stats->hits = __sync_fetch_and_add(&resolve_counters.hits, 0);
+
+	return;
+}
@@ -0,0 +1,50 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H 1
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/*
+ * Cache of host name lookups shared by everything that
+ * connects (or, like the article header, just wants to
+ * print an address).
+ *
+ * The lookups themselves are done by a worker thread. A
+ * caller that needs an address we do not have waits for
+ * it, and callers asking for the same host meanwhile wait
+ * for that one lookup rather than starting their own.
+ * Once an entry is older than RESOLVE_TTL it is still
+ * handed out while the worker refreshes it in the
+ * background; getaddrinfo() does not tell us the record's
+ * real TTL, so this is a fixed bound.
+ */
+#define RESOLVE_TTL 300 /* Seconds an answer is considered fresh */
+#define RESOLVE_NEGATIVE_TTL 10 /* Seconds a failed lookup is remembered */
+#define RESOLVE_MAX_HOSTS 64
+#define RESOLVE_MAX_ADDRS 16
+#define RESOLVE_HOST_MAX 256
+
+struct resolve_addr
+{
+	int family;
+	socklen_t len;
+	struct sockaddr_storage addr;
+};
+
+struct resolve_result
+{
+	int nr_addrs;
+	struct resolve_addr addrs[RESOLVE_MAX_ADDRS]; /* In the order getaddrinfo() gave them */
+};
+
+struct resolve_stats
+{
+	unsigned long lookups; /* Calls to getaddrinfo() */
+	unsigned long hits; /* Answered from the cache */
+};
+
+int resolve_host(char *, struct resolve_result *) __nonnull((1,2)) __wur;
+void resolve_prefetch(char *) __nonnull((1));
+void resolve_get_stats(struct resolve_stats *) __nonnull((1));
+
+#endif /* !defined RESOLVE_H */
@@ -0,0 +1,269 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define SCAN_X86 1
+#endif
+#include "scan.h"
+
+/*
+ * scan_block() returns a mask with bit N set if byte N of the
+ * SCAN_BLOCK bytes at P is in the set; scan_find() goes through
+ * a range a block at a time and finishes off the last few bytes
+ * one at a time.
+ */
+
+typedef uint64_t (*scan_block_fn)(const char *, const struct scan_set *);
+
+static uint64_t __scan_block_scalar(const char *, const struct scan_set *);
+
+static scan_block_fn __scan_block = __scan_block_scalar;
+static enum scan_impl __scan_impl = SCAN_SCALAR;
+static pthread_once_t __scan_once = PTHREAD_ONCE_INIT;
+
+static const char *const scan_impl_names[] =
+{
+	"scalar",
+	"sse2",
+	"avx2"
+};
+
+static inline int
+__scan_is_member(unsigned char c, const struct scan_set *set)
+{
+	int i;
+
+	for (i = 0; i < set->nr_bytes; ++i)
+	{
+		if (set->bytes[i] == c)
+			return 1;
+	}
+
+	return 0;
+}
+
+static uint64_t
+__scan_block_scalar(const char *p, const struct scan_set *set)
+{
+	uint64_t mask = 0;
+	int i;
+
+	for (i = 0; i < SCAN_BLOCK; ++i)
+	{
+		if (__scan_is_member((unsigned char)p[i], set))
+			mask |= ((uint64_t)1 << i);
+	}
+
+	return mask;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static uint64_t
+__scan_block_sse2(const char *p, const struct scan_set *set)
+{
+	__m128i v0 = _mm_loadu_si128((const __m128i *)p);
+	__m128i v1 = _mm_loadu_si128((const __m128i *)(p + 16));
+	__m128i v2 = _mm_loadu_si128((const __m128i *)(p + 32));
+	__m128i v3 = _mm_loadu_si128((const __m128i *)(p + 48));
+	__m128i m0 = _mm_setzero_si128();
+	__m128i m1 = _mm_setzero_si128();
+	__m128i m2 = _mm_setzero_si128();
+	__m128i m3 = _mm_setzero_si128();
+	__m128i b;
+	int i;
+
+	for (i = 0; i < set->nr_bytes; ++i)
+	{
+		b = _mm_set1_epi8((char)set->bytes[i]);
+		m0 = _mm_or_si128(m0, _mm_cmpeq_epi8(v0, b));
+		m1 = _mm_or_si128(m1, _mm_cmpeq_epi8(v1, b));
+		m2 = _mm_or_si128(m2, _mm_cmpeq_epi8(v2, b));
+		m3 = _mm_or_si128(m3, _mm_cmpeq_epi8(v3, b));
+	}
+
+	return ((uint64_t)(uint16_t)_mm_movemask_epi8(m0)
+		| ((uint64_t)(uint16_t)_mm_movemask_epi8(m1) << 16)
+		| ((uint64_t)(uint16_t)_mm_movemask_epi8(m2) << 32)
+		| ((uint64_t)(uint16_t)_mm_movemask_epi8(m3) << 48));
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+__scan_block_avx2(const char *p, const struct scan_set *set)
+{
+	__m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+	__m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+	__m256i m0 = _mm256_setzero_si256();
+	__m256i m1 = _mm256_setzero_si256();
+	__m256i b;
+	int i;
+
+	for (i = 0; i < set->nr_bytes; ++i)
+	{
+		b = _mm256_set1_epi8((char)set->bytes[i]);
+		m0 = _mm256_or_si256(m0, _mm256_cmpeq_epi8(v0, b));
+		m1 = _mm256_or_si256(m1, _mm256_cmpeq_epi8(v1, b));
+	}
+
+	return ((uint64_t)(uint32_t)_mm256_movemask_epi8(m0)
+		| ((uint64_t)(uint32_t)_mm256_movemask_epi8(m1) << 32));
+}
+#endif
+
+static void
+__scan_init(void)
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		__scan_block = __scan_block_avx2;
+		__scan_impl = SCAN_AVX2;
+	}
+	else
+	if (__builtin_cpu_supports("sse2"))
+	{
+		__scan_block = __scan_block_sse2;
+		__scan_impl = SCAN_SSE2;
+	}
+#endif
+
+	return;
+}
+
+/**
+ * scan_set_init - set up the bytes to look for
+ * @set: the set
+ * @bytes: the bytes, as a string (at most SCAN_SET_MAX of them)
+ */
+void
+scan_set_init(struct scan_set *set, const char *bytes)
+{
+	assert(set);
+	assert(bytes);
+	assert(strlen(bytes) <= SCAN_SET_MAX);
+
+	memset(set, 0, sizeof(*set));
+
+	while (*bytes && set->nr_bytes < SCAN_SET_MAX)
+		set->bytes[set->nr_bytes++] = (unsigned char)*bytes++;
+
+	return;
+}
+
+/**
+ * scan_block - which of SCAN_BLOCK bytes are in a set
+ * @p: the bytes (all SCAN_BLOCK of them must be readable)
+ * @set: the set
+ */
+uint64_t
+scan_block(const char *p, const struct scan_set *set)
+{
+	pthread_once(&__scan_once, __scan_init);
+
+	return __scan_block(p, set);
+}
+
+/**
+ * scan_find - find the first byte in a range that is in a set
+ * @p: start of the range
+ * @end: end of the range
+ * @set: the set
+ *
+ * Returns NULL if there is none.
+ */
+char *
+scan_find(const char *p, const char *end, const struct scan_set *set)
+{
+	uint64_t mask;
+
+	pthread_once(&__scan_once, __scan_init);
+
+	while ((end - p) >= SCAN_BLOCK)
+	{
+		if ((mask = __scan_block(p, set)))
+			return (char *)(p + __builtin_ctzll(mask));
+
+		p += SCAN_BLOCK;
+	}
+
+	while (p < end)
+	{
+		if (__scan_is_member((unsigned char)*p, set))
+			return (char *)p;
+
+		++p;
+	}
+
+	return NULL;
+}
+
+/**
+ * scan_find_byte - find the first C in a range
+ * @p: start of the range
+ * @end: end of the range
+ * @c: the byte
+ */
+char *
+scan_find_byte(const char *p, const char *end, int c)
+{
+	struct scan_set set;
+
+	set.bytes[0] = (unsigned char)c;
+	set.nr_bytes = 1;
+
+	return scan_find(p, end, &set);
+}
+
+/**
+ * scan_use - use a particular version of the scanning code
+ * @impl: which one
+ *
+ * Returns -1 if this CPU cannot run it.
+ */
+int
+scan_use(enum scan_impl impl)
+{
+	pthread_once(&__scan_once, __scan_init);
+
+	switch(impl)
+	{
+		case SCAN_SCALAR:
+			__scan_block = __scan_block_scalar;
+			break;
+#ifdef SCAN_X86
+		case SCAN_SSE2:
+			if (!__builtin_cpu_supports("sse2"))
+				return -1;
+			__scan_block = __scan_block_sse2;
+			break;
+		case SCAN_AVX2:
+			if (!__builtin_cpu_supports("avx2"))
+				return -1;
+			__scan_block = __scan_block_avx2;
+			break;
+#endif
+		default:
+			return -1;
+	}
+
+	__scan_impl = impl;
+
+	return 0;
+}
+
+/**
+ * scan_impl_name - the name of the version of the scanning code in use
+ */
+const char *
+scan_impl_name(void)
+{
+	pthread_once(&__scan_once, __scan_init);
+
+	return scan_impl_names[__scan_impl];
+}
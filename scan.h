@@ -0,0 +1,37 @@
+#ifndef SCAN_H
+#define SCAN_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Finding any of a few delimiter bytes, a block at a time.
+ * There are SSE2 and AVX2 versions and a plain C one; the
+ * best one the CPU has is picked the first time we scan.
+ */
+
+#define SCAN_SET_MAX 8
+#define SCAN_BLOCK 64
+
+struct scan_set
+{
+	unsigned char bytes[SCAN_SET_MAX];
+	int nr_bytes;
+};
+
+enum scan_impl
+{
+	SCAN_SCALAR = 0,
+	SCAN_SSE2,
+	SCAN_AVX2
+};
+
+void scan_set_init(struct scan_set *, const char *) __nonnull((1,2));
+uint64_t scan_block(const char *, const struct scan_set *) __nonnull((1,2)) __wur;
+char *scan_find(const char *, const char *, const struct scan_set *) __nonnull((1,2,3)) __wur;
+char *scan_find_byte(const char *, const char *, int) __nonnull((1,2)) __wur;
+
+int scan_use(enum scan_impl) __wur;
+const char *scan_impl_name(void) __wur;
+
+#endif /* !defined SCAN_H */
@@ -0,0 +1,275 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "store.h"
+#include "wikigrab.h"
+
+#define STORE_KEY_MAX 200
+
+/**
+ * __store_key - escape part of a link for use as a file name
+ * @key: the name is written here (STORE_KEY_MAX + 16 bytes)
+ * @p: start of the part
+ * @e: end of the part
+ *
+ * Anything other than [A-Za-z0-9._-] is escaped. Overly long
+ * names are cut short and a hash of the whole part appended
+ * so that they stay distinct.
+ */
+static size_t
+__store_key(char *key, char *p, char *e)
+{
+	uint32_t hash = 2166136261u;
+	size_t k = 0;
+	int truncated = 0;
+
+	for (; p < e; ++p)
+	{
+		hash = ((hash ^ (unsigned char)*p) * 16777619u);
+
+		if (truncated)
+			continue;
+
+		if (k >= (STORE_KEY_MAX - 3))
+		{
+			truncated = 1;
+			continue;
+		}
+
+		if ((*p >= 'a' && *p <= 'z')
+		|| (*p >= 'A' && *p <= 'Z')
+		|| (*p >= '0' && *p <= '9')
+		|| *p == '_' || *p == '-' || (*p == '.' && k))
+		{
+			key[k++] = *p;
+		}
+		else
+		{
+			sprintf(&key[k], "%%%02X", (unsigned char)*p);
+			k += 3;
+		}
+	}
+
+	if (truncated)
+		k += sprintf(&key[k], "~%08x", hash);
+
+	key[k] = 0;
+
+	return k;
+}
+
+/**
+ * __store_path - get the metadata file for a wiki link
+ * @link: the article link
+ * @path: the path is written here (PATH_MAX bytes)
+ *
+ * The file is named after the page title (everything after
+ * "/wiki/") in a directory named after the host, as the same
+ * title on two wikis is two different articles. The output
+ * format goes on the end, as the text and XML files of an
+ * article are revalidated separately.
+ */
+static int
+__store_path(char *link, char *path)
+{
+	char host[STORE_KEY_MAX + 16];
+	char key[STORE_KEY_MAX + 32];
+	char *home;
+	char *title;
+	char *p;
+	size_t k;
+
+	if (!(home = getenv("HOME")))
+		return -1;
+
+	if (!(title = strstr(link, "/wiki/")))
+		return -1;
+
+	if ((p = strstr(link, "://")) && p < title)
+		p += strlen("://");
+	else
+		p = link;
+
+	while (*p == '/')
+		++p;
+
+	if (p >= title)
+		return -1;
+
+	title += strlen("/wiki/");
+
+	if (!*title)
+		return -1;
+
+	__store_key(host, p, (title - strlen("/wiki/")));
+
+/*
+ * Host names are not case sensitive.
+ */
+	for (p = host; *p; ++p)
+	{
+		if (*p >= 'A' && *p <= 'Z')
+			*p += ('a' - 'A');
+	}
+
+	k = __store_key(key, title, (title + strlen(title)));
+	strcpy(&key[k], option_set(OPT_FORMAT_XML) ? ".xml" : ".txt");
+
+	if (snprintf(path, PATH_MAX, "%s%s/%s/%s/%s", home, WIKIGRAB_DIR, STORE_DIR, host, key) >= PATH_MAX)
+		return -1;
+
+	return 0;
+}
+
+static void
+__store_value(char *dest, char *value)
+{
+	size_t len = strlen(value);
+
+	while (len && (value[len - 1] == '\n' || value[len - 1] == '\r'))
+		--len;
+
+	if (len >= STORE_VALUE_MAX)
+		len = (STORE_VALUE_MAX - 1);
+
+	memcpy(dest, value, len);
+	dest[len] = 0;
+
+	return;
+}
+
+/**
+ * store_load - get the metadata saved for an article
+ * @link: the article link
+ * @meta: filled in from the store
+ *
+ * Returns -1 if we have nothing for this article.
+ */
+int
+store_load(char *link, struct article_meta *meta)
+{
+	assert(link);
+	assert(meta);
+
+	char path[PATH_MAX];
+	char line[PATH_MAX + 32];
+	FILE *fp;
+	size_t len;
+
+	clear_struct(meta);
+
+	if (__store_path(link, path) < 0)
+		return -1;
+
+	if (!(fp = fopen(path, "r")))
+		return -1;
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (!strncmp("etag ", line, 5))
+			__store_value(meta->etag, (line + 5));
+		else
+		if (!strncmp("last-modified ", line, 14))
+			__store_value(meta->lastmod, (line + 14));
+		else
+		if (!strncmp("file ", line, 5))
+		{
+			len = strlen(line + 5);
+
+			while (len && line[4 + len] == '\n')
+				--len;
+
+			memcpy(meta->path, (line + 5), len);
+			meta->path[len] = 0;
+		}
+	}
+
+	fclose(fp);
+
+	if (!meta->path[0] || (!meta->etag[0] && !meta->lastmod[0]))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * store_save - save the metadata for an article we just extracted
+ * @link: the article link
+ * @meta: the validators from the response and the file we wrote
+ *
+ * Written to a temporary file and renamed into place so that
+ * concurrent workers never see half a record.
+ */
+int
+store_save(char *link, struct article_meta *meta)
+{
+	assert(link);
+	assert(meta);
+
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + 32];
+	char *p;
+	char *q;
+	FILE *fp;
+
+	if (__store_path(link, path) < 0)
+		return -1;
+
+/*
+ * Nothing to revalidate with.
+ */
+	if (!meta->etag[0] && !meta->lastmod[0])
+	{
+		unlink(path);
+		return 0;
+	}
+
+/*
+ * Make STORE_DIR and the host's directory in it.
+ */
+	p = strrchr(path, '/');
+	*p = 0;
+	q = strrchr(path, '/');
+	*q = 0;
+
+	if (mkdir(path, S_IRWXU) < 0 && errno != EEXIST)
+		return -1;
+
+	*q = '/';
+
+	if (mkdir(path, S_IRWXU) < 0 && errno != EEXIST)
+		return -1;
+
+	*p = '/';
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d.%lx", path, (int)getpid(), (unsigned long)pthread_self());
+
+	if (!(fp = fopen(tmp_path, "w")))
+		return -1;
+
+	fprintf(fp, "file %s\n", meta->path);
+
+	if (meta->etag[0])
+		fprintf(fp, "etag %s\n", meta->etag);
+
+	if (meta->lastmod[0])
+		fprintf(fp, "last-modified %s\n", meta->lastmod);
+
+	if (fclose(fp) != 0)
+		goto fail;
+
+	if (rename(tmp_path, path) < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	unlink(tmp_path);
+	return -1;
+}
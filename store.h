@@ -0,0 +1,24 @@
+#ifndef STORE_H
+#define STORE_H 1
+
+#include <limits.h>
+
+/*
+ * Per-article metadata kept in ~/WIKIGRAB_DIR/STORE_DIR/<host> so that
+ * we can revalidate an article we already have with a conditional
+ * GET and skip it entirely if the server says it has not changed.
+ */
+#define STORE_DIR ".meta"
+#define STORE_VALUE_MAX 256
+
+struct article_meta
+{
+	char etag[STORE_VALUE_MAX]; /* ETag of the page we extracted */
+	char lastmod[STORE_VALUE_MAX]; /* Last-Modified of that page */
+	char path[PATH_MAX]; /* The article file we wrote */
+};
+
+int store_load(char *, struct article_meta *) __nonnull((1,2)) __wur;
+int store_save(char *, struct article_meta *) __nonnull((1,2)) __wur;
+
+#endif /* !defined STORE_H */
@@ -0,0 +1,145 @@
+/*
+ * Extract an article from a saved page, for the golden-file
+ * test (make golden). The article is written where wikigrab
+ * would write it, under $HOME.
+ *
+ *	./tests/extract <page.html> <txt|xml> [--dom] [--stream <chunk>]
+ *
+ * With --stream the page is fed to article_stream_feed() CHUNK
+ * bytes at a time, as if the body were arriving over the wire.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../buffer.h"
+#include "../http.h"
+#include "../parse.h"
+#include "../wikigrab.h"
+
+uint32_t runtime_options;
+
+/*
+ * The only header the extraction asks for; fixed so
+ * that the output can be compared byte for byte.
+ */
+static char *
+golden_fetch_header(struct http_t *http, char *name)
+{
+	if (!strcmp("last-modified", name))
+		return "Tue, 01 Jan 2019 00:00:00 GMT";
+
+	return NULL;
+}
+
+static struct HTTP_methods golden_ops =
+{
+	.fetch_header = golden_fetch_header
+};
+
+/*
+ * Feed the page to a stream CHUNK bytes at a time.
+ */
+static int
+golden_stream(struct http_t *http, char *page, size_t len, size_t chunk, char *path)
+{
+	struct article_stream *stream;
+	size_t off;
+	size_t n;
+	int ret = -1;
+
+	if (!(stream = article_stream_new(http)))
+		return -1;
+
+	for (off = 0; off < len; off += n)
+	{
+		n = ((len - off) < chunk ? (len - off) : chunk);
+
+		if (article_stream_feed(stream, page + off, n) < 0)
+			goto out;
+	}
+
+	ret = article_stream_finish(stream, path);
+
+	out:
+	article_stream_destroy(stream);
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static struct http_t http;
+	char path[PATH_MAX];
+	FILE *fp;
+	char *page;
+	long len;
+	size_t chunk = 0;
+	int i;
+
+	if (argc < 3)
+	{
+		fprintf(stderr, "usage: %s <page.html> <txt|xml> [--dom] [--stream <chunk>]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	set_option(strcmp("xml", argv[2]) ? OPT_FORMAT_TXT : OPT_FORMAT_XML);
+
+	for (i = 3; i < argc; ++i)
+	{
+		if (!strcmp("--dom", argv[i]))
+		{
+			set_option(OPT_DOM);
+		}
+		else
+		if (!strcmp("--stream", argv[i]) && (i + 1) < argc)
+		{
+			set_option(OPT_STREAM);
+			chunk = strtoul(argv[++i], NULL, 10);
+		}
+	}
+
+	http.host = "127.0.0.1";
+	http.ops = &golden_ops;
+
+	if (!(fp = fopen(argv[1], "r")))
+	{
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+
+	if (!(page = malloc(len)) || fread(page, 1, len, fp) != (size_t)len)
+	{
+		fprintf(stderr, "%s: failed to read page\n", argv[1]);
+		exit(EXIT_FAILURE);
+	}
+
+	fclose(fp);
+
+	if (chunk)
+	{
+		if (golden_stream(&http, page, (size_t)len, chunk, path) < 0)
+			exit(EXIT_FAILURE);
+
+		free(page);
+		return EXIT_SUCCESS;
+	}
+
+	if (buf_init(&http_rbuf(&http), len + 16) < 0)
+		exit(EXIT_FAILURE);
+
+	buf_append_ex(&http_rbuf(&http), page, len);
+	free(page);
+
+	if (extract_wiki_article(&http, path) < 0)
+		exit(EXIT_FAILURE);
+
+	buf_destroy(&http_rbuf(&http));
+
+	return EXIT_SUCCESS;
+}
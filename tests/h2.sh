@@ -0,0 +1,96 @@
+#!/bin/sh
+#
+# Fetch the pages in tests/golden over HTTP/2 from a local nghttpd,
+# as one batch on one connection (all the requests are sent before
+# the first response is read), and compare each article's text with
+# the one in the corpus. The server listens on 127.0.0.1:$H2_PORT
+# (18443 by default) with a certificate made for the run.
+#
+#	tests/h2.sh <wikigrab>  (make h2)
+
+wikigrab=$1
+dir=$(dirname "$0")/golden
+port=${H2_PORT:-18443}
+failed=0
+pid=
+
+if ! command -v nghttpd >/dev/null 2>&1; then
+	echo "h2: nghttpd not found, skipped"
+	exit 0
+fi
+
+tmp=$(mktemp -d) || exit 1
+
+trap '[ -n "$pid" ] && kill $pid 2>/dev/null; rm -rf "$tmp"' EXIT
+mkdir -p "$tmp/root/wiki" "$tmp/home/Wiki_Articles"
+
+if ! openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=127.0.0.1 \
+    -keyout "$tmp/key.pem" -out "$tmp/cert.pem" >/dev/null 2>&1; then
+	echo "h2: failed to make a certificate"
+	exit 1
+fi
+
+nr_links=0
+
+for page in "$dir"/*.html; do
+	name=$(basename "$page" .html)
+	cp "$page" "$tmp/root/wiki/$name"
+	echo "https://127.0.0.1:$port/wiki/$name" >>"$tmp/links"
+	nr_links=$((nr_links + 1))
+done
+
+nghttpd -v -a 127.0.0.1 -d "$tmp/root" "$port" "$tmp/key.pem" "$tmp/cert.pem" >>"$tmp/server.log" 2>&1 &
+pid=$!
+sleep 1
+
+if ! kill -0 $pid 2>/dev/null; then
+	echo "h2: nghttpd did not start"
+	cat "$tmp/server.log"
+	exit 1
+fi
+
+# The text starts after the JSON block (txt) or the metadata (XML);
+# what is before it depends on the server.
+for format in txt xml; do
+	if ! HOME=$tmp/home $wikigrab --http2 --$format --batch "$tmp/links" >"$tmp/out" 2>&1; then
+		echo "FAIL $format (wikigrab failed)"
+		cat "$tmp/out"
+		failed=1
+		continue
+	fi
+
+	if ! grep -q "^TLS: 1 handshake" "$tmp/out"; then
+		echo "FAIL $format (not one connection)"
+		failed=1
+	fi
+
+	if [ $format = txt ]; then
+		strip='1,/^  }$/d'
+	else
+		strip='1,/<\/metadata>/d'
+	fi
+
+	for page in "$dir"/*.html; do
+		name=$(basename "$page" .html)
+
+		sed "$strip" "$dir/$name.$format" >"$tmp/expected"
+		sed "$strip" "$tmp/home/Wiki_Articles/$name.$format" >"$tmp/got" 2>/dev/null
+
+		if ! cmp -s "$tmp/expected" "$tmp/got"; then
+			echo "FAIL $name.$format"
+			failed=1
+		fi
+	done
+done
+
+# Each run's requests are streams 1, 3, 5, ... of a single connection.
+streams=$(grep -c "recv HEADERS frame.*stream_id=" "$tmp/server.log")
+conns=$(grep "recv HEADERS frame" "$tmp/server.log" | sed 's/ .*//' | sort -u | wc -l)
+
+if [ "$streams" -ne $((nr_links * 2)) ] || [ "$conns" -ne 2 ]; then
+	echo "FAIL $streams streams on $conns connections (expected $((nr_links * 2)) on 2)"
+	failed=1
+fi
+
+[ $failed = 0 ] && echo "h2: $nr_links articles in each format over one connection, all identical"
+exit $failed
@@ -0,0 +1,319 @@
+/*
+ * Check the HPACK decoder against the examples in RFC 7541
+ * appendix C.4 (requests) and C.6 (responses, with a 256-byte
+ * table so that entries are evicted), both Huffman coded: the
+ * fields of each header block and the dynamic table after it.
+ * The encoder is checked against C.2.2, C.2.4 and the start of
+ * C.3.1, which are the forms we send requests in.
+ *
+ *	./tests/hpack  (make hpack)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../buffer.h"
+#include "../hpack.h"
+
+#define HPACK_TEST_MAX_FIELDS 8
+
+struct hpack_field
+{
+	const char *name;
+	const char *value;
+};
+
+struct hpack_vector
+{
+	const char *section;
+	const char *block; /* In hex, as printed in the RFC */
+	struct hpack_field fields[HPACK_TEST_MAX_FIELDS];
+	struct hpack_field table[HPACK_TEST_MAX_FIELDS]; /* Newest entry first */
+	size_t table_size;
+};
+
+static const struct hpack_vector request_vectors[] =
+{
+	{
+		"C.4.1",
+		"8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+		{
+			{ ":method", "GET" },
+			{ ":scheme", "http" },
+			{ ":path", "/" },
+			{ ":authority", "www.example.com" }
+		},
+		{
+			{ ":authority", "www.example.com" }
+		},
+		57
+	},
+	{
+		"C.4.2",
+		"8286 84be 5886 a8eb 1064 9cbf",
+		{
+			{ ":method", "GET" },
+			{ ":scheme", "http" },
+			{ ":path", "/" },
+			{ ":authority", "www.example.com" },
+			{ "cache-control", "no-cache" }
+		},
+		{
+			{ "cache-control", "no-cache" },
+			{ ":authority", "www.example.com" }
+		},
+		110
+	},
+	{
+		"C.4.3",
+		"8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+		{
+			{ ":method", "GET" },
+			{ ":scheme", "https" },
+			{ ":path", "/index.html" },
+			{ ":authority", "www.example.com" },
+			{ "custom-key", "custom-value" }
+		},
+		{
+			{ "custom-key", "custom-value" },
+			{ "cache-control", "no-cache" },
+			{ ":authority", "www.example.com" }
+		},
+		164
+	}
+};
+
+static const struct hpack_vector response_vectors[] =
+{
+	{
+		"C.6.1",
+		"4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6"
+		"2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3",
+		{
+			{ ":status", "302" },
+			{ "cache-control", "private" },
+			{ "date", "Mon, 21 Oct 2013 20:13:21 GMT" },
+			{ "location", "https://www.example.com" }
+		},
+		{
+			{ "location", "https://www.example.com" },
+			{ "date", "Mon, 21 Oct 2013 20:13:21 GMT" },
+			{ "cache-control", "private" },
+			{ ":status", "302" }
+		},
+		222
+	},
+	{
+		"C.6.2",
+		"4883 640e ffc1 c0bf",
+		{
+			{ ":status", "307" },
+			{ "cache-control", "private" },
+			{ "date", "Mon, 21 Oct 2013 20:13:21 GMT" },
+			{ "location", "https://www.example.com" }
+		},
+		{
+			{ ":status", "307" },
+			{ "location", "https://www.example.com" },
+			{ "date", "Mon, 21 Oct 2013 20:13:21 GMT" },
+			{ "cache-control", "private" }
+		},
+		222
+	},
+	{
+		"C.6.3",
+		"88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab"
+		"77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f"
+		"9587 3160 65c0 03ed 4ee5 b106 3d50 07",
+		{
+			{ ":status", "200" },
+			{ "cache-control", "private" },
+			{ "date", "Mon, 21 Oct 2013 20:13:22 GMT" },
+			{ "location", "https://www.example.com" },
+			{ "content-encoding", "gzip" },
+			{ "set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1" }
+		},
+		{
+			{ "set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1" },
+			{ "content-encoding", "gzip" },
+			{ "date", "Mon, 21 Oct 2013 20:13:22 GMT" }
+		},
+		215
+	}
+};
+
+/*
+ * Field being checked by the decoder's callback.
+ */
+struct hpack_check
+{
+	const struct hpack_vector *vector;
+	int nr_fields;
+	int failed;
+};
+
+static size_t
+hpack_unhex(const char *hex, unsigned char *out)
+{
+	size_t n = 0;
+	unsigned int octet;
+
+	while (*hex)
+	{
+		if (*hex == ' ')
+		{
+			++hex;
+			continue;
+		}
+
+		sscanf(hex, "%2x", &octet);
+		out[n++] = (unsigned char)octet;
+		hex += 2;
+	}
+
+	return n;
+}
+
+static int
+hpack_same(const char *expected, char *str, size_t len)
+{
+	return (expected && strlen(expected) == len && !memcmp(expected, str, len));
+}
+
+static int
+hpack_check_field(void *arg, char *name, size_t name_len, char *value, size_t value_len)
+{
+	struct hpack_check *check = (struct hpack_check *)arg;
+	const struct hpack_field *f;
+
+	if (check->nr_fields >= HPACK_TEST_MAX_FIELDS)
+	{
+		check->failed = 1;
+		return 0;
+	}
+
+	f = &check->vector->fields[check->nr_fields++];
+
+	if (!hpack_same(f->name, name, name_len) || !hpack_same(f->value, value, value_len))
+	{
+		fprintf(stderr, "%s: field %d is \"%.*s: %.*s\"\n",
+			check->vector->section, check->nr_fields,
+			(int)name_len, name, (int)value_len, value);
+
+		check->failed = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Decode each block of a series on one table, as a connection would.
+ */
+static int
+hpack_check_series(const struct hpack_vector *vectors, int nr_vectors, size_t table_size)
+{
+	struct hpack_table table;
+	struct hpack_check check;
+	struct hpack_entry *e;
+	unsigned char block[256];
+	size_t len;
+	int failed = 0;
+	int nr_table;
+	int i;
+	int j;
+
+	if (hpack_table_init(&table, table_size) < 0)
+		return -1;
+
+	for (i = 0; i < nr_vectors; ++i)
+	{
+		memset(&check, 0, sizeof(check));
+		check.vector = &vectors[i];
+
+		len = hpack_unhex(vectors[i].block, block);
+
+		if (hpack_decode(&table, block, len, hpack_check_field, (void *)&check) < 0)
+		{
+			fprintf(stderr, "%s: decoding error\n", vectors[i].section);
+			check.failed = 1;
+		}
+
+		if (check.vector->fields[check.nr_fields].name)
+		{
+			fprintf(stderr, "%s: only %d fields decoded\n", vectors[i].section, check.nr_fields);
+			check.failed = 1;
+		}
+
+		for (nr_table = 0; vectors[i].table[nr_table].name; ++nr_table)
+			;
+
+		if (table.nr_entries != nr_table || table.size != vectors[i].table_size)
+		{
+			fprintf(stderr, "%s: table has %d entries, %lu bytes\n",
+				vectors[i].section, table.nr_entries, table.size);
+			check.failed = 1;
+		}
+
+		for (j = 0; j < nr_table && j < table.nr_entries; ++j)
+		{
+			e = &table.entries[(table.head + j) % table.nr_alloc];
+
+			if (!hpack_same(vectors[i].table[j].name, e->name, e->name_len)
+			|| !hpack_same(vectors[i].table[j].value, e->value, e->value_len))
+			{
+				fprintf(stderr, "%s: table entry %d is \"%.*s: %.*s\"\n",
+					vectors[i].section, (j + 1),
+					(int)e->name_len, e->name, (int)e->value_len, e->value);
+				check.failed = 1;
+			}
+		}
+
+		fprintf(stdout, "%s %s\n", check.failed ? "FAIL" : "ok  ", vectors[i].section);
+		failed |= check.failed;
+	}
+
+	hpack_table_destroy(&table);
+
+	return failed ? -1 : 0;
+}
+
+static int
+hpack_check_encode(const char *section, const struct hpack_field *fields, int nr_fields, const char *hex)
+{
+	unsigned char expected[64];
+	size_t len = hpack_unhex(hex, expected);
+	buf_t buf;
+	int failed;
+	int i;
+
+	if (buf_init(&buf, 64) < 0)
+		return -1;
+
+	for (i = 0; i < nr_fields; ++i)
+		hpack_encode_header(&buf, (char *)fields[i].name, (char *)fields[i].value);
+
+	failed = (buf.data_len != len || memcmp(buf.buf_head, expected, len));
+
+	fprintf(stdout, "%s %s (encoded)\n", failed ? "FAIL" : "ok  ", section);
+
+	buf_destroy(&buf);
+
+	return failed ? -1 : 0;
+}
+
+int
+main(void)
+{
+	static const struct hpack_field c22[] = { { ":path", "/sample/path" } };
+	static const struct hpack_field c24[] = { { ":method", "GET" } };
+	static const struct hpack_field c31[] = { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" } };
+	int failed = 0;
+
+	failed |= hpack_check_series(request_vectors, 3, HPACK_DEFAULT_TABLE_SIZE);
+	failed |= hpack_check_series(response_vectors, 3, 256);
+
+	failed |= hpack_check_encode("C.2.2", c22, 1, "040c 2f73 616d 706c 652f 7061 7468");
+	failed |= hpack_check_encode("C.2.4", c24, 1, "82");
+	failed |= hpack_check_encode("C.3.1", c31, 3, "8286 84");
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
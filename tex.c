@@ -67,11 +67,13 @@ tex_replace_matrices(buf_t *buf)
 	char *p;
 	char *savep;
 	char *end;
-	buf_t tmp;
 
-	buf_init(&tmp, 1024);
 	savep = buf->buf_head;
 #if 0
+	buf_t tmp;
+
+	if (buf_init(&tmp, 1024) < 0)
+		return -1;
 
 	while (1)
 	{
@@ -103,6 +105,8 @@ tex_replace_matrices(buf_t *buf)
 		buf_replace(&tmp, "\\vdots", ".\n.\n.\n");
 		buf_replace(&tmp, "\\ddots", "");
 	}
+
+	buf_destroy(&tmp);
 #endif
 
 	return 0;
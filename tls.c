@@ -0,0 +1,276 @@
+#include <assert.h>
+#include <openssl/conf.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tls.h"
+
+#define TLS_HOST_MAX 256
+
+struct tls_session_entry
+{
+	char host[TLS_HOST_MAX];
+	SSL_SESSION *session;
+	unsigned long last_used;
+};
+
+static SSL_CTX *tls_ctx = NULL;
+static pthread_once_t tls_init_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t tls_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tls_session_entry tls_sessions[TLS_SESSION_CACHE_MAX];
+static unsigned long tls_clock = 0;
+
+static struct tls_stats tls_counters;
+
+/**
+ * __tls_session_entry - find the cache entry for a host (lock held)
+ * @host: the remote host name
+ * @create: take the least recently used entry if there is none
+ */
+static struct tls_session_entry *
+__tls_session_entry(const char *host, int create)
+{
+	struct tls_session_entry *lru = &tls_sessions[0];
+	int i;
+
+	for (i = 0; i < TLS_SESSION_CACHE_MAX; ++i)
+	{
+		if (tls_sessions[i].session && !strcmp(tls_sessions[i].host, host))
+			return &tls_sessions[i];
+
+		if (tls_sessions[i].last_used < lru->last_used)
+			lru = &tls_sessions[i];
+	}
+
+	if (!create)
+		return NULL;
+
+	if (lru->session)
+	{
+		SSL_SESSION_free(lru->session);
+		lru->session = NULL;
+	}
+
+	strncpy(lru->host, host, TLS_HOST_MAX - 1);
+	lru->host[TLS_HOST_MAX - 1] = 0;
+
+	return lru;
+}
+
+/**
+ * __tls_new_session - keep a session the server gave us
+ * @ssl: the connection it came on
+ * @session: the new session
+ *
+ * With TLS 1.3 the tickets arrive after the handshake,
+ * whenever we next read; with 1.2 this is called at the end
+ * of the handshake. Returning 1 means we keep the reference.
+ */
+static int
+__tls_new_session(SSL *ssl, SSL_SESSION *session)
+{
+	struct tls_session_entry *e;
+	const char *host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+
+	if (!host || !SSL_SESSION_is_resumable(session))
+		return 0;
+
+	pthread_mutex_lock(&tls_cache_lock);
+
+	e = __tls_session_entry(host, 1);
+
+	if (e->session)
+		SSL_SESSION_free(e->session);
+
+	e->session = session;
+	e->last_used = ++tls_clock;
+
+	pthread_mutex_unlock(&tls_cache_lock);
+
+	return 1;
+}
+
+static void
+__tls_init(void)
+{
+	SSL_library_init();
+	SSL_load_error_strings();
+	OpenSSL_add_all_algorithms();
+	ERR_load_crypto_strings();
+
+	if (!(tls_ctx = SSL_CTX_new(TLS_client_method())))
+	{
+		fprintf(stderr, "tls_context: SSL_CTX_new error\n");
+		return;
+	}
+
+	SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+
+/*
+ * We look sessions up by host ourselves, so there is
+ * no point in OpenSSL keeping them by session ID too.
+ */
+	SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_CLIENT|SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(tls_ctx, __tls_new_session);
+
+	return;
+}
+
+/**
+ * tls_context - get the process-wide SSL_CTX, creating it the first time
+ */
+SSL_CTX *
+tls_context(void)
+{
+	pthread_once(&tls_init_once, __tls_init);
+
+	return tls_ctx;
+}
+
+/**
+ * tls_new - create a client SSL object for a connected socket
+ * @sock: the socket
+ * @host: the remote host name, sent with SNI and used to find a session to resume
+ *
+ * The caller may set other options (ALPN) before tls_handshake().
+ */
+SSL *
+tls_new(int sock, char *host)
+{
+	assert(host);
+
+	struct tls_session_entry *e;
+	SSL_CTX *ctx;
+	SSL *ssl;
+
+	if (!(ctx = tls_context()))
+		return NULL;
+
+	if (!(ssl = SSL_new(ctx)))
+		return NULL;
+
+	SSL_set_fd(ssl, sock); /* Set the socket for reading/writing */
+	SSL_set_connect_state(ssl); /* Set as client */
+	SSL_set_tlsext_host_name(ssl, host);
+
+	pthread_mutex_lock(&tls_cache_lock);
+
+	if ((e = __tls_session_entry(host, 0)))
+	{
+		SSL_set_session(ssl, e->session);
+		e->last_used = ++tls_clock;
+	}
+
+	pthread_mutex_unlock(&tls_cache_lock);
+
+	return ssl;
+}
+
+/**
+ * tls_handshake - do, or carry on with, the TLS handshake
+ * @ssl: the object from tls_new()
+ *
+ * On a non-blocking socket, returns TLS_WANT_READ or TLS_WANT_WRITE
+ * if the handshake cannot go on until the socket is readable or
+ * writable; call it again when it is. Returns 0 once it is done.
+ */
+int
+tls_handshake(SSL *ssl)
+{
+	assert(ssl);
+
+	int ret;
+
+	if ((ret = SSL_connect(ssl)) != 1)
+	{
+		switch(SSL_get_error(ssl, ret))
+		{
+			case SSL_ERROR_WANT_READ:
+				return TLS_WANT_READ;
+			case SSL_ERROR_WANT_WRITE:
+				return TLS_WANT_WRITE;
+			default:
+				return -1;
+		}
+	}
+
+	__sync_fetch_and_add(&tls_counters.handshakes, 1);
+
+	if (SSL_session_reused(ssl))
+		__sync_fetch_and_add(&tls_counters.resumed, 1);
+
+	return 0;
+}
+
+/**
+ * tls_close - shut down and free a client SSL object
+ * @ssl: the object from tls_new() (may be NULL)
+ *
+ * Call this before closing the socket. We send our close_notify
+ * but do not wait for the server's: a server that sees the
+ * connection drop without one may throw the session away, and
+ * freeing an SSL object that was not shut down marks its session
+ * as not resumable on our side too.
+ */
+void
+tls_close(SSL *ssl)
+{
+	if (!ssl)
+		return;
+
+	if (SSL_is_init_finished(ssl))
+		SSL_shutdown(ssl);
+
+	SSL_free(ssl);
+
+	return;
+}
+
+/**
+ * tls_get_stats - get the number of handshakes and how many resumed a session
+ * @stats: filled in with the counters
+ */
+void
+tls_get_stats(struct tls_stats *stats)
+{
+	assert(stats);
+
+	stats->handshakes = __sync_fetch_and_add(&tls_counters.handshakes, 0);
+	stats->resumed = __sync_fetch_and_add(&tls_counters.resumed, 0);
+
+	return;
+}
+
+/**
+ * tls_fini - free the cached sessions and the shared SSL_CTX
+ */
+void
+tls_fini(void)
+{
+	int i;
+
+	pthread_mutex_lock(&tls_cache_lock);
+
+	for (i = 0; i < TLS_SESSION_CACHE_MAX; ++i)
+	{
+		if (tls_sessions[i].session)
+		{
+			SSL_SESSION_free(tls_sessions[i].session);
+			tls_sessions[i].session = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&tls_cache_lock);
+
+	if (tls_ctx)
+	{
+		SSL_CTX_free(tls_ctx);
+		tls_ctx = NULL;
+	}
+
+	return;
+}
@@ -0,0 +1,30 @@
+#ifndef TLS_H
+#define TLS_H 1
+
+#include <openssl/ssl.h>
+
+/*
+ * One SSL_CTX for the whole process, with a client session
+ * cache keyed by host so that reconnecting to a host we have
+ * already spoken to resumes the session (a TLS 1.3 ticket or
+ * a 1.2 session ID) instead of doing a full handshake.
+ */
+#define TLS_SESSION_CACHE_MAX 64 /* Hosts we keep a session for */
+
+#define TLS_WANT_READ 1 /* The handshake is waiting for the socket to be readable */
+#define TLS_WANT_WRITE 2 /* ... or writable */
+
+struct tls_stats
+{
+	unsigned long handshakes;
+	unsigned long resumed;
+};
+
+SSL_CTX *tls_context(void) __wur;
+SSL *tls_new(int, char *) __nonnull((2)) __wur;
+int tls_handshake(SSL *) __nonnull((1)) __wur;
+void tls_close(SSL *);
+void tls_get_stats(struct tls_stats *) __nonnull((1));
+void tls_fini(void);
+
+#endif /* !defined TLS_H */
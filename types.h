@@ -12,12 +12,15 @@ struct value_t
 	size_t vlen;
 };
 
+/*
+ * A piece of the article, as a view of the buffer it
+ * was found in rather than a copy of it.
+ */
 struct content_t
 {
-	char *data;
-	size_t data_len;
-	size_t alloc_len;
-	off_t off;
+	off_t off; /* Where it starts in the buffer */
+	size_t len; /* Its length there */
+	int el; /* Its element if it came from an html_doc, or -1 */
 };
 
 struct offset_idx
@@ -2,6 +2,7 @@
 #include <ctype.h>
 #include <string.h>
 #include "buffer.h"
+#include "scan.h"
 #include "utils.h"
 
 /**
@@ -87,82 +88,102 @@ nested_closing_char(char *whence, char *limit, char o, char c)
 	return final;
 }
 
+/**
+ * remove_excess_sp - remove whitespace that follows a space
+ * @buf: the buffer
+ *
+ * The text is moved down in one pass rather than
+ * cutting out each run of whitespace as we find it.
+ */
 void
 remove_excess_sp(buf_t *buf)
 {
 	assert(buf);
 
-	char *p;
-	char *savep;
+	char *head = buf->buf_head;
 	char *tail = buf->buf_tail;
-	size_t range;
-
-	savep = buf->buf_head;
+	char *r = head;
+	char *w = head;
+	char *p;
+	size_t len;
 
-	while (1)
+	while (r < tail)
 	{
-		p = memchr(savep, ' ', (tail - savep));
-
-		if (!p || p >= tail)
+		if (!(p = scan_find_byte(r, tail, ' ')))
 			break;
 
 		++p;
+		len = (p - r);
 
-		savep = p;
-		while (isspace(*p))
-			++p;
+		if (w != r)
+			memmove(w, r, len);
 
-		range = (p - savep);
+		w += len;
+		r = p;
 
-		if (range)
-		{
-			buf_collapse(buf, (off_t)(savep - buf->buf_head), range);
-			p = savep;
-			tail = buf->buf_tail;
-		}
+		while (r < tail && isspace(*r))
+			++r;
+	}
+
+	len = (tail - r);
+
+	if (w != r)
+	{
+		memmove(w, r, len);
+		buf_snip(buf, (size_t)(r - w));
 	}
 
 	return;
 }
 
+/**
+ * remove_excess_nl - cut runs of new lines down to two
+ * @buf: the buffer
+ */
 void
 remove_excess_nl(buf_t *buf)
 {
 	assert(buf);
 
-	char *p;
-	char *savep;
+	char *head = buf->buf_head;
 	char *tail = buf->buf_tail;
-	size_t range;
-
-	savep = buf->buf_head;
+	char *r = head;
+	char *w = head;
+	char *p;
+	char *run;
+	size_t len;
 
-	while (1)
+	while (r < tail)
 	{
-		p = memchr(savep, 0x0a, (tail - savep));
-
-		if (!p)
+		if (!(run = scan_find_byte(r, tail, 0x0a)))
 			break;
 
-		savep = p;
+		p = run;
 
-		while (*p == 0x0a && p < tail)
+		while (p < tail && *p == 0x0a)
 			++p;
 
-		range = (p - savep);
+	/*
+	 * Keep the first two.
+	 */
+		if ((p - run) > 2)
+			len = ((run + 2) - r);
+		else
+			len = (p - r);
 
-		if (range > 2)
-		{
-			savep += 2;
+		if (w != r)
+			memmove(w, r, len);
 
-			range = (p - savep);
+		w += len;
+		r = p;
+	}
 
-			buf_collapse(buf, (off_t)(savep - buf->buf_head), range);
-			p = savep;
-			tail = buf->buf_tail;
-		}
+	len = (tail - r);
 
-		savep = p;
+	if (w != r)
+	{
+		memmove(w, r, len);
+		buf_snip(buf, (size_t)(r - w));
 	}
 
 	return;
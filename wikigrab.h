@@ -13,10 +13,7 @@
 #define DEFAULT_TMP_BUF_SIZE 16384
 #define DEFAULT_MAX_LINE_SIZE 1024
 
-int SOCK_SET_FLAG_ONCE;
-int SOCK_SSL_SET_FLAG_ONCE;
-
-uint32_t runtime_options;
+extern uint32_t runtime_options; /* Defined in main.c */
 
 #define option_set(o) ((o) & runtime_options)
 #define set_option(o) (runtime_options |= (o))
@@ -28,6 +25,8 @@ uint32_t runtime_options;
 #define OPT_OPEN_FINISH 0x10 /* Open the article when done */
 #define OPT_FORMAT_TXT 0x20 /* format in plain text file */
 #define OPT_FORMAT_XML 0x40 /* format in XML file */
+#define OPT_STREAM 0x80 /* Extract articles while they are being received */
+#define OPT_DOM 0x100 /* Remove unwanted elements from a DOM rather than the text */
 
 #define COL_GREEN "\x1b[38;5;40m"
 #define COL_ORANGE "\x1b[38;5;208m"